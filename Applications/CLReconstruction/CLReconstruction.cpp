@@ -35,8 +35,27 @@ POSSIBILITY OF SUCH DAMAGES.
 #include <vtkCLVolumeReconstruction.h>
 
 // STL includes
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // PLUS includes
 #include <vtkPlusAccurateTimer.h>
@@ -57,10 +76,52 @@ POSSIBILITY OF SUCH DAMAGES.
 /* Sets output extent and origin from a vtkTrackedFrameList */
 bool get_extent_from_trackedList(vtkPlusTrackedFrameList*, vtkPlusTransformRepository*, double spacing, int*, double*);
 
+/* Sets output extent and origin from the calibrated poses of a recorded sequence */
+void get_extent_from_poses(const std::vector<float>& poses, const float* cal_mat, int w, int h, double sx, double sy, double spacing, int*, double*);
+
+/* Writes the flipped frames and Probe to Tracker poses of a vtkTrackedFrameList as a raw file and a pose table */
+bool export_sequence(vtkPlusTrackedFrameList*, const std::string& prefix);
+
+/* Offline reconstruction of a raw file and a pose table in batches of frames */
+int reconstruct_batches(const std::string& framesFileName, const std::string& posesFileName, int batchSize);
+
+/* Read-only memory map of a whole file */
+struct mapped_file
+{
+  const unsigned char* data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#else
+  int file;
+#endif
+};
+bool map_file(const std::string& fileName, mapped_file& map);
+void unmap_file(mapped_file& map);
+
+namespace
+{
+  /* NOTE: This is the US calibration without scaling. Scaling is specified separately */
+  const float us_cal_mat[12] = { 0.9947f,    0.0994f, -0.0262f, -12.6030f,
+                                 -0.0413f,    0.1535f, -0.9873f, -7.8930f,
+                                 -0.0941f,    0.9831f,    0.1568f,    1.0670f
+                               };
+  const int bscan_width = 820;
+  const int bscan_height = 616;
+  const double bscan_spacing_x = 0.077;
+  const double bscan_spacing_y = 0.073;
+  const double output_spacing = 0.5;
+}
+
 int main(int argc, char** argv)
 {
   std::string inputConfigFileName;
   std::string reconCompareFileName;
+  std::string exportPrefix;
+  std::string batchFramesFileName;
+  std::string batchPosesFileName;
+  int batchSize = 64;
 
   int verboseLevel = vtkPlusLogger::LOG_LEVEL_INFO;
 
@@ -69,6 +130,10 @@ int main(int argc, char** argv)
 
   args.AddArgument("--config-file", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &inputConfigFileName, "Name of the input configuration file.");
   args.AddArgument("--recon-compare-seq-file", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &reconCompareFileName, "Filename of the video sequence to use for reconstruction comparison");
+  args.AddArgument("--export-batch", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &exportPrefix, "Write the sequence as <prefix>.raw and <prefix>.txt for --batch-frames and --batch-poses, then exit");
+  args.AddArgument("--batch-frames", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &batchFramesFileName, "Raw 820x616 8-bit frames to reconstruct offline (memory mapped)");
+  args.AddArgument("--batch-poses", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &batchPosesFileName, "Pose table of the raw frames: timestamp and the 12 first Probe to Tracker elements per line");
+  args.AddArgument("--batch-size", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &batchSize, "Frames per batch of the offline reconstruction (default 64)");
   args.AddArgument("--verbose", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &verboseLevel, "Verbose level (1=error only, 2=warning, 3=info, 4=debug, 5=trace)");
 
   // Input arguments error checking
@@ -90,6 +155,17 @@ int main(int argc, char** argv)
 
   vtkPlusLogger::Instance()->SetLogLevel(verboseLevel);
 
+  // Offline reconstruction of a recorded sequence, no PLUS configuration needed
+  if (!batchFramesFileName.empty() || !batchPosesFileName.empty())
+  {
+    if (batchFramesFileName.empty() || batchPosesFileName.empty() || batchSize < 1)
+    {
+      LOG_ERROR("--batch-frames and --batch-poses are both needed, with a positive --batch-size");
+      exit(EXIT_FAILURE);
+    }
+    return reconstruct_batches(batchFramesFileName, batchPosesFileName, batchSize);
+  }
+
   // Read Sequence Meta file in the tracked frame list
   vtkSmartPointer<vtkPlusTrackedFrameList> trackedFrameList = vtkSmartPointer<vtkPlusTrackedFrameList>::New();
   if (vtkPlusSequenceIO::Read(reconCompareFileName, trackedFrameList) != PLUS_SUCCESS)
@@ -97,6 +173,11 @@ int main(int argc, char** argv)
     LOG_ERROR("Unable to read " << reconCompareFileName);
     exit(EXIT_FAILURE);
   }
+  if (!exportPrefix.empty())
+  {
+    return export_sequence(trackedFrameList, exportPrefix) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   PlusTransformName transformName = PlusTransformName("Probe", "Tracker");
   vtkSmartPointer<vtkMatrix4x4> tFrame2Tracker = vtkSmartPointer<vtkMatrix4x4>::New();
 
@@ -144,19 +225,12 @@ int main(int argc, char** argv)
                            -0.0069f, 0.0753f, 0.1568f, 1.0670f
                          }; */
 
-  /* NOTE: This is the US calibration without scaling. Scaling is specified separately */
-  float us_cal_mat[12] = { 0.9947f,    0.0994f, -0.0262f, -12.6030f,
-                           -0.0413f,    0.1535f, -0.9873f, -7.8930f,
-                           -0.0941f,    0.9831f,    0.1568f,    1.0670f
-                         };
-
   recon->SetProgramSourcePath(KERNEL_CL_LOCATION);
-  recon->SetBScanSize(820, 616);
-  recon->SetBScanSpacing(0.077, 0.073);
+  recon->SetBScanSize(bscan_width, bscan_height);
+  recon->SetBScanSpacing(bscan_spacing_x, bscan_spacing_y);
 
   int extent[6] = { 0, 0, 0, 0, 0, 0 };
   double origin[3] = { 0, 0, 0 };
-  double output_spacing = 0.5;
 
   if (!get_extent_from_trackedList(trackedFrameList, repository, output_spacing, extent, origin))
   {
@@ -166,7 +240,7 @@ int main(int argc, char** argv)
   recon->SetOutputExtent(extent[0], extent[1], extent[2], extent[3], extent[4], extent[5]);
   recon->SetOutputSpacing(output_spacing);
   recon->SetOutputOrigin(origin[0], origin[1], origin[2]);
-  recon->SetCalMatrix(us_cal_mat);
+  recon->SetCalMatrix(const_cast<float*>(us_cal_mat));
   try
   {
     recon->Initialize();
@@ -207,6 +281,7 @@ int main(int argc, char** argv)
   //---------------- Now reconstruct --------------------------------------------------------------------------
 
   // For timing
+  double reconStartTime = vtkPlusAccurateTimer::GetSystemTime();
   for (unsigned int i = 0; i < trackedFrameList->GetNumberOfTrackedFrames(); i++)
   {
     // Set Image Dada
@@ -232,6 +307,9 @@ int main(int argc, char** argv)
   }
 
   recon->GetOutputVolume(outputVolume);
+  double reconTime = vtkPlusAccurateTimer::GetSystemTime() - reconStartTime;
+  LOG_INFO(trackedFrameList->GetNumberOfTrackedFrames() << " frames reconstructed in " << reconTime << " seconds ("
+           << trackedFrameList->GetNumberOfTrackedFrames() / reconTime << " frames/second)");
   writer->SetInputData(outputVolume);
   writer->Write();
 
@@ -240,6 +318,281 @@ int main(int argc, char** argv)
   return 0;
 }
 
+bool export_sequence(vtkPlusTrackedFrameList* frameList, const std::string& prefix)
+{
+  std::ofstream frames((prefix + ".raw").c_str(), std::ios::binary);
+  std::ofstream poses((prefix + ".txt").c_str());
+  if (!frames || !poses)
+  {
+    LOG_ERROR("Unable to write " << prefix << ".raw and " << prefix << ".txt");
+    return false;
+  }
+
+  PlusTransformName transformName = PlusTransformName("Probe", "Tracker");
+  vtkSmartPointer<vtkMatrix4x4> tFrame2Tracker = vtkSmartPointer<vtkMatrix4x4>::New();
+  vtkSmartPointer<vtkImageFlip> imgFlip = vtkSmartPointer<vtkImageFlip>::New();
+  imgFlip->SetFilteredAxis(1);
+
+  poses << "# timestamp, then the 3 first rows of the Probe to Tracker matrix" << std::endl;
+  poses.precision(9);
+  for (unsigned int i = 0; i < frameList->GetNumberOfTrackedFrames(); i++)
+  {
+    // Frames are stored the way the reconstruction gets them
+    PlusTrackedFrame* trackedFrame = frameList->GetTrackedFrame(i);
+    imgFlip->SetInputData(trackedFrame->GetImageData()->GetImage());
+    imgFlip->Modified();
+    imgFlip->Update();
+    int* dims = imgFlip->GetOutput()->GetDimensions();
+    if (dims[0] != bscan_width || dims[1] != bscan_height || imgFlip->GetOutput()->GetScalarType() != VTK_UNSIGNED_CHAR)
+    {
+      LOG_ERROR("Frame " << i << " is not " << bscan_width << "x" << bscan_height << " 8-bit");
+      return false;
+    }
+    frames.write((const char*)imgFlip->GetOutput()->GetScalarPointer(), bscan_width * bscan_height);
+
+    trackedFrame->GetCustomFrameTransform(transformName, tFrame2Tracker);
+    poses << trackedFrame->GetTimestamp();
+    for (int r = 0; r < 3; r++)
+    {
+      for (int c = 0; c < 4; c++)
+      {
+        poses << " " << tFrame2Tracker->GetElement(r, c);
+      }
+    }
+    poses << std::endl;
+  }
+
+  LOG_INFO(frameList->GetNumberOfTrackedFrames() << " frames written to " << prefix << ".raw and " << prefix << ".txt");
+  return frames.good() && poses.good();
+}
+
+int reconstruct_batches(const std::string& framesFileName, const std::string& posesFileName, int batchSize)
+{
+  double startTime = vtkPlusAccurateTimer::GetSystemTime();
+
+  // Pose table, one frame per line
+  std::ifstream posesFile(posesFileName.c_str());
+  if (!posesFile)
+  {
+    LOG_ERROR("Unable to read " << posesFileName);
+    return EXIT_FAILURE;
+  }
+  std::vector<double> timestamps;
+  std::vector<float> poses;
+  std::string line;
+  while (std::getline(posesFile, line))
+  {
+    if (line.empty() || line[0] == '#')
+    {
+      continue;
+    }
+    std::istringstream ss(line);
+    double timestamp;
+    float pose[12];
+    ss >> timestamp;
+    for (int i = 0; i < 12; i++)
+    {
+      ss >> pose[i];
+    }
+    if (ss.fail())
+    {
+      LOG_ERROR("Malformed pose " << timestamps.size() << " in " << posesFileName);
+      return EXIT_FAILURE;
+    }
+    timestamps.push_back(timestamp);
+    poses.insert(poses.end(), pose, pose + 12);
+  }
+  int numFrames = (int)timestamps.size();
+
+  // The frames are only paged in as the batches are uploaded
+  mapped_file frames;
+  if (!map_file(framesFileName, frames))
+  {
+    LOG_ERROR("Unable to map " << framesFileName);
+    return EXIT_FAILURE;
+  }
+  size_t frameSize = (size_t)bscan_width * bscan_height;
+  if (numFrames == 0 || frames.size < numFrames * frameSize)
+  {
+    LOG_ERROR(framesFileName << " does not hold the " << numFrames << " frames of " << posesFileName);
+    unmap_file(frames);
+    return EXIT_FAILURE;
+  }
+
+  int extent[6] = { 0, 0, 0, 0, 0, 0 };
+  double origin[3] = { 0, 0, 0 };
+  get_extent_from_poses(poses, us_cal_mat, bscan_width, bscan_height, bscan_spacing_x, bscan_spacing_y, output_spacing, extent, origin);
+
+  vtkSmartPointer<vtkCLVolumeReconstruction> recon = vtkSmartPointer<vtkCLVolumeReconstruction>::New();
+  recon->SetDevice(0);
+  recon->SetProgramSourcePath(KERNEL_CL_LOCATION);
+  recon->SetBScanSize(bscan_width, bscan_height);
+  recon->SetBScanSpacing(bscan_spacing_x, bscan_spacing_y);
+  recon->SetOutputExtent(extent[0], extent[1], extent[2], extent[3], extent[4], extent[5]);
+  recon->SetOutputSpacing(output_spacing);
+  recon->SetOutputOrigin(origin[0], origin[1], origin[2]);
+  recon->SetCalMatrix(const_cast<float*>(us_cal_mat));
+  try
+  {
+    recon->Initialize();
+  }
+  catch (const std::exception& e)
+  {
+    LOG_ERROR("Unable to initialize OpenCL volume reconstruction. Aborting. Error: " << e.what());
+    unmap_file(frames);
+    return EXIT_FAILURE;
+  }
+  recon->StartReconstruction();
+
+  //---------------- Now reconstruct --------------------------------------------------------------------------
+
+  double reconStartTime = vtkPlusAccurateTimer::GetSystemTime();
+  for (int i = 0; i < numFrames; i += batchSize)
+  {
+    int n = std::min(batchSize, numFrames - i);
+    if (recon->ReconstructBatch(n, &timestamps[i], frames.data + i * frameSize, &poses[12 * i]) != n)
+    {
+      LOG_ERROR("Frames " << i << " to " << i + n - 1 << " could not be reconstructed. Aborting.");
+      unmap_file(frames);
+      return EXIT_FAILURE;
+    }
+    LOG_DEBUG("Frames " << i << " to " << i + n - 1 << " reconstructed");
+  }
+  vtkSmartPointer<vtkImageData> outputVolume = vtkSmartPointer<vtkImageData>::New();
+  recon->GetOutputVolume(outputVolume);
+  double reconTime = vtkPlusAccurateTimer::GetSystemTime() - reconStartTime;
+  unmap_file(frames);
+
+  vtkSmartPointer<vtkMetaImageWriter> writer = vtkSmartPointer<vtkMetaImageWriter>::New();
+  writer->SetFileName("3DUS-output.mhd");
+  writer->SetInputData(outputVolume);
+  writer->Write();
+
+  double totalTime = vtkPlusAccurateTimer::GetSystemTime() - startTime;
+  LOG_INFO(numFrames << " frames reconstructed in batches of " << batchSize << " in " << reconTime << " seconds ("
+           << numFrames / reconTime << " frames/second), " << totalTime << " seconds end to end");
+  LOG_INFO(recon->GetNumberOfAllocatedBricks() << " of " << recon->GetNumberOfBricks() << " bricks allocated");
+
+  return EXIT_SUCCESS;
+}
+
+bool map_file(const std::string& fileName, mapped_file& map)
+{
+  map.data = NULL;
+  map.size = 0;
+#ifdef _WIN32
+  map.file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (map.file == INVALID_HANDLE_VALUE)
+  {
+    return false;
+  }
+  LARGE_INTEGER size;
+  GetFileSizeEx(map.file, &size);
+  map.size = (size_t)size.QuadPart;
+  map.mapping = CreateFileMappingA(map.file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (map.mapping != NULL)
+  {
+    map.data = (const unsigned char*)MapViewOfFile(map.mapping, FILE_MAP_READ, 0, 0, 0);
+  }
+  if (map.data == NULL)
+  {
+    if (map.mapping != NULL)
+    {
+      CloseHandle(map.mapping);
+    }
+    CloseHandle(map.file);
+    return false;
+  }
+#else
+  map.file = open(fileName.c_str(), O_RDONLY);
+  if (map.file < 0)
+  {
+    return false;
+  }
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(map.file, &st) == 0 && st.st_size > 0)
+  {
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, map.file, 0);
+  }
+  if (data == MAP_FAILED)
+  {
+    close(map.file);
+    return false;
+  }
+  // Frames are read once, in order
+  madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+  map.data = (const unsigned char*)data;
+  map.size = (size_t)st.st_size;
+#endif
+  return true;
+}
+
+void unmap_file(mapped_file& map)
+{
+  if (map.data == NULL)
+  {
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(map.data);
+  CloseHandle(map.mapping);
+  CloseHandle(map.file);
+#else
+  munmap((void*)map.data, map.size);
+  close(map.file);
+#endif
+  map.data = NULL;
+}
+
+void get_extent_from_poses(const std::vector<float>& poses, const float* cal_mat, int w, int h, double sx, double sy, double spacing, int* outputExtent, double* origin)
+{
+  double extent_Ref[6] =
+  {
+    VTK_DOUBLE_MAX, VTK_DOUBLE_MIN,
+    VTK_DOUBLE_MAX, VTK_DOUBLE_MIN,
+    VTK_DOUBLE_MAX, VTK_DOUBLE_MIN
+  };
+
+  // Corners of the bscan in mm, mapped the way vtkCLVolumeReconstruction maps them: pose * calibration
+  double corners[4][3] = { { 0, 0, 0 }, { w * sx, 0, 0 }, { 0, h * sy, 0 }, { w * sx, h * sy, 0 } };
+  for (size_t f = 0; f < poses.size() / 12; f++)
+  {
+    const float* pose = &poses[12 * f];
+    for (int corner = 0; corner < 4; corner++)
+    {
+      double corner_Probe[3];
+      for (int r = 0; r < 3; r++)
+      {
+        corner_Probe[r] = cal_mat[r * 4 + 3];
+        for (int k = 0; k < 3; k++)
+        {
+          corner_Probe[r] += cal_mat[r * 4 + k] * corners[corner][k];
+        }
+      }
+      for (int axis = 0; axis < 3; axis++)
+      {
+        double corner_Ref = pose[axis * 4 + 3];
+        for (int k = 0; k < 3; k++)
+        {
+          corner_Ref += pose[axis * 4 + k] * corner_Probe[k];
+        }
+        extent_Ref[axis * 2] = std::min(extent_Ref[axis * 2], corner_Ref);
+        extent_Ref[axis * 2 + 1] = std::max(extent_Ref[axis * 2 + 1], corner_Ref);
+      }
+    }
+  }
+
+  outputExtent[0] = outputExtent[2] = outputExtent[4] = 0;
+  outputExtent[1] = int((extent_Ref[1] - extent_Ref[0]) / spacing);
+  outputExtent[3] = int((extent_Ref[3] - extent_Ref[2]) / spacing);
+  outputExtent[5] = int((extent_Ref[5] - extent_Ref[4]) / spacing);
+
+  origin[0] = extent_Ref[0];
+  origin[1] = extent_Ref[2];
+  origin[2] = extent_Ref[4];
+}
+
 bool get_extent_from_trackedList(vtkPlusTrackedFrameList* frameList, vtkPlusTransformRepository* repository, double spacing, int* outputExtent, double* origin)
 {
   PlusTransformName imageToReferenceTransformName;
@@ -0,0 +1,216 @@
+/*------------------------------------------------------------------------------//
+CLReconstruction_Parity.exe
+
+Description:
+This file checks the CPU backend of vtkCLVolumeReconstruction against itself and against
+the OpenCL backend. It builds a synthetic sweep (a slightly tilted bscan translated along
+z), reconstructs it with the CPU backend single-threaded and with the requested number of
+threads, checks that both volumes are identical, then reconstructs it with the OpenCL
+backend and reports the voxels filled by only one backend and the mean and largest grey
+level difference of the voxels filled by both. The OpenCL kernels compound neighbouring
+rays concurrently, so small differences are expected; the check fails past the given
+tolerances. Without an OpenCL device, only the CPU runs are compared.
+
+Usage:\t [--frames=N] [--batch=N] [--threads=N] [--spacing=mm] [--tolerance=GreyLevels] [--coverage=Fraction]
+
+//------------------------------------------------------------------------------*/
+
+// RobartsVTK includes
+#include <vtkCLVolumeReconstruction.h>
+
+// VTK includes
+#include <vtkImageData.h>
+#include <vtkSmartPointer.h>
+#include <vtkTimerLog.h>
+#include <vtksys/CommandLineArguments.hxx>
+
+// STL includes
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+  const int BScanWidth = 128;
+  const int BScanHeight = 128;
+  const double BScanSpacing = 0.3;
+  const double SweepStep = 0.25;
+  const double TiltDegrees = 3.0;
+
+  // A bscan tilted about y and translated along z by SweepStep per frame, with a smooth
+  // pattern that changes from frame to frame
+  void BuildSweep(int numFrames, std::vector<double>& timestamps, std::vector<unsigned char>& bscans, std::vector<float>& poses)
+  {
+    double tilt = TiltDegrees * 3.14159265358979 / 180.0;
+    timestamps.resize(numFrames);
+    bscans.resize((size_t)numFrames * BScanWidth * BScanHeight);
+    poses.assign(12 * numFrames, 0.0f);
+    for (int f = 0; f < numFrames; f++)
+    {
+      timestamps[f] = 0.05 * f;
+      float* pose = &poses[12 * f];
+      pose[0] = (float)cos(tilt);
+      pose[2] = (float)sin(tilt);
+      pose[3] = 1.0f;
+      pose[5] = 1.0f;
+      pose[7] = 1.0f;
+      pose[8] = (float)-sin(tilt);
+      pose[10] = (float)cos(tilt);
+      pose[11] = (float)(4.0 + SweepStep * f);
+
+      unsigned char* bscan = &bscans[(size_t)f * BScanWidth * BScanHeight];
+      for (int y = 0; y < BScanHeight; y++)
+      {
+        for (int x = 0; x < BScanWidth; x++)
+        {
+          double value = 128.0 + 60.0 * sin(0.11 * x + 0.03 * f) + 60.0 * cos(0.07 * y - 0.02 * f);
+          bscan[x + y * BScanWidth] = (unsigned char)std::min(255.0, std::max(1.0, value));
+        }
+      }
+    }
+  }
+
+  // Reconstructs the sweep with the given backend, returns the backend that was used
+  int Reconstruct(int backend, int numThreads, int batchSize, double spacing, const int extent[6],
+                  const std::vector<double>& timestamps, const std::vector<unsigned char>& bscans,
+                  const std::vector<float>& poses, std::vector<unsigned char>& volume, double& elapsed)
+  {
+    vtkSmartPointer<vtkCLVolumeReconstruction> recon = vtkSmartPointer<vtkCLVolumeReconstruction>::New();
+    recon->SetBackend(backend);
+    recon->SetNumberOfCPUThreads(numThreads);
+    recon->SetDevice(0);
+    recon->SetProgramSourcePath(KERNEL_CL_LOCATION);
+    recon->SetBScanSize(BScanWidth, BScanHeight);
+    recon->SetBScanSpacing(BScanSpacing, BScanSpacing);
+    recon->SetOutputExtent(extent[0], extent[1], extent[2], extent[3], extent[4], extent[5]);
+    recon->SetOutputSpacing(spacing);
+    recon->SetOutputOrigin(0.0, 0.0, 0.0);
+    recon->Initialize();
+    recon->StartReconstruction();
+
+    vtkSmartPointer<vtkTimerLog> timer = vtkSmartPointer<vtkTimerLog>::New();
+    timer->StartTimer();
+    int numFrames = (int)timestamps.size();
+    size_t bscanSize = (size_t)BScanWidth * BScanHeight;
+    for (int i = 0; i < numFrames; i += batchSize)
+    {
+      int n = std::min(batchSize, numFrames - i);
+      recon->ReconstructBatch(n, &timestamps[i], &bscans[i * bscanSize], &poses[12 * i]);
+    }
+    vtkSmartPointer<vtkImageData> output = vtkSmartPointer<vtkImageData>::New();
+    recon->GetOutputVolume(output);
+    timer->StopTimer();
+    elapsed = timer->GetElapsedTime();
+
+    unsigned char* ptr = (unsigned char*)output->GetScalarPointer();
+    volume.assign(ptr, ptr + output->GetNumberOfPoints());
+    return recon->GetBackend();
+  }
+}
+
+int main(int argc, char** argv)
+{
+  bool printHelp(false);
+  int numFrames = 200;
+  int batchSize = 1;
+  int numThreads = 8;
+  double spacing = 0.5;
+  double tolerance = 1.0;
+  double coverage = 0.01;
+
+  vtksys::CommandLineArguments args;
+  args.Initialize(argc, argv);
+  args.AddArgument("--help", vtksys::CommandLineArguments::NO_ARGUMENT, &printHelp, "Print this help.");
+  args.AddArgument("--frames", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &numFrames, "Number of frames of the sweep.");
+  args.AddArgument("--batch", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &batchSize, "Number of frames per ReconstructBatch call.");
+  args.AddArgument("--threads", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &numThreads, "Number of threads for the multi-threaded CPU run.");
+  args.AddArgument("--spacing", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &spacing, "Output spacing (mm).");
+  args.AddArgument("--tolerance", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &tolerance, "Largest mean grey level difference between the backends.");
+  args.AddArgument("--coverage", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &coverage, "Largest fraction of the filled voxels filled by only one backend.");
+
+  if (!args.Parse())
+  {
+    std::cerr << "Problem parsing arguments." << std::endl;
+    std::cout << "Help: " << args.GetHelp() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (printHelp)
+  {
+    std::cout << args.GetHelp() << std::endl;
+    exit(EXIT_SUCCESS);
+  }
+  if (numFrames < 8 || batchSize < 1 || numThreads < 1 || spacing <= 0.0)
+  {
+    std::cerr << "Invalid parity check parameters." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  std::vector<double> timestamps;
+  std::vector<unsigned char> bscans;
+  std::vector<float> poses;
+  BuildSweep(numFrames, timestamps, bscans, poses);
+
+  // The tilted bscans stay within 2 mm of their centre in z
+  int extent[6] = { 0, 0, 0, 0, 0, 0 };
+  extent[1] = (int)ceil((1.0 + BScanWidth * BScanSpacing) / spacing) + 1;
+  extent[3] = (int)ceil((1.0 + BScanHeight * BScanSpacing) / spacing) + 1;
+  extent[5] = (int)ceil((4.0 + SweepStep * numFrames + 4.0) / spacing);
+
+  // CPU backend, single-threaded and multi-threaded
+  std::vector<unsigned char> reference, threaded, device;
+  double serialTime, threadedTime, deviceTime;
+  Reconstruct(vtkCLVolumeReconstruction::CPU_BACKEND, 1, batchSize, spacing, extent, timestamps, bscans, poses, reference, serialTime);
+  Reconstruct(vtkCLVolumeReconstruction::CPU_BACKEND, numThreads, batchSize, spacing, extent, timestamps, bscans, poses, threaded, threadedTime);
+  bool identical = (reference.size() == threaded.size()) && (memcmp(&reference[0], &threaded[0], reference.size()) == 0);
+
+  size_t filled = 0;
+  for (size_t v = 0; v < reference.size(); v++)
+  {
+    filled += (reference[v] != 0);
+  }
+  std::cout << "Volume: " << extent[1] + 1 << "x" << extent[3] + 1 << "x" << extent[5] + 1 << ", " << filled << " voxels filled by "
+            << numFrames << " frames in batches of " << batchSize << std::endl;
+  std::cout << "CPU 1 thread:   " << serialTime << " s" << std::endl;
+  std::cout << "CPU " << numThreads << " threads: " << threadedTime << " s, volumes identical: " << (identical ? "yes" : "no") << std::endl;
+
+  // OpenCL backend
+  int backend = Reconstruct(vtkCLVolumeReconstruction::OPENCL_BACKEND, numThreads, batchSize, spacing, extent, timestamps, bscans, poses, device, deviceTime);
+  if (backend != vtkCLVolumeReconstruction::OPENCL_BACKEND)
+  {
+    std::cout << "OpenCL: no usable device, not compared" << std::endl;
+    return identical ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  size_t onlyOne = 0;
+  size_t both = 0;
+  double sumDifference = 0.0;
+  int maxDifference = 0;
+  for (size_t v = 0; v < reference.size(); v++)
+  {
+    if ((reference[v] != 0) != (device[v] != 0))
+    {
+      onlyOne++;
+      continue;
+    }
+    if (reference[v] == 0)
+    {
+      continue;
+    }
+    int difference = abs((int)reference[v] - (int)device[v]);
+    sumDifference += difference;
+    maxDifference = std::max(maxDifference, difference);
+    both++;
+  }
+  double meanDifference = (both > 0) ? sumDifference / both : 0.0;
+  double onlyOneFraction = (filled > 0) ? (double)onlyOne / filled : 0.0;
+  bool parity = (meanDifference <= tolerance) && (onlyOneFraction <= coverage);
+
+  std::cout << "OpenCL:         " << deviceTime << " s" << std::endl;
+  std::cout << "Filled by one backend only: " << onlyOne << " (" << 100.0 * onlyOneFraction << "% of the CPU voxels)" << std::endl;
+  std::cout << "Grey level difference: mean " << meanDifference << ", max " << maxDifference << std::endl;
+  std::cout << "CPU and OpenCL within tolerance: " << (parity ? "yes" : "no") << std::endl;
+
+  return (identical && parity) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -257,6 +257,7 @@ int main(int argc, char** argv)
     exit(EXIT_FAILURE);
   }
   recon->StartReconstruction();
+  recon->StartAsyncReconstruction();
   vtkTransform* pose = vtkTransform::New();
   recon->SetImagePoseTransform(pose);
 
@@ -363,6 +364,12 @@ int main(int argc, char** argv)
   std::cout << "Reconstruction done. " << std::endl;
   std::cout << "Writing output to file. " << std::endl;
 
+  // Compound the frames still queued before writing
+  recon->StopAsyncReconstruction();
+  recon->GetOutputVolume(outputVolume);
+  std::cout << "Compounded " << recon->GetNumberOfCompoundedFrames() << " frames, dropped "
+            << recon->GetNumberOfDroppedFrames() << ", mean latency " << recon->GetMeanLatency() << " s" << std::endl;
+
   writer->SetInputData(outputVolume);
   writer->Write();
 
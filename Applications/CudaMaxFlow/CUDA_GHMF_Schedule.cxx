@@ -0,0 +1,192 @@
+/*------------------------------------------------------------------------------//
+CUDA_GHMF_Schedule.exe
+
+Description:
+This file is a simulator for the GPU max-flow task scheduler. It builds the task graphs of
+vtkCudaHierarchicalMaxFlowSegmentation2 and vtkCudaDirectedAcyclicGraphMaxFlowSegmentation
+for a hierarchy (read from a VTK tree file or a synthetic one of the given branching and
+depth) and runs the scheduler against simulated devices of the given capacity, bandwidth and
+kernel rate, modelling a volume of the given size. It reports the memory transfers, kernel
+launches, simulated running time and device idle time of each decomposition. No GPU is needed.
+All units are decimal: 1 MB is 10^6 bytes, 1 GB/s is 10^9 bytes per second and 1 GVoxels/s
+is 10^9 voxels per second.
+
+Usage:\t [--tree=TreeFilename] [--branching=N] [--depth=N] [--size=N] [--iterations=N]
+         [--devices=N] [--memory=MB] [--bandwidth=GB/s] [--kernel-rate=GVoxels/s] [--trace=Prefix]
+
+//------------------------------------------------------------------------------*/
+
+#include "vtkCudaDirectedAcyclicGraphMaxFlowSegmentation.h"
+#include "vtkCudaHierarchicalMaxFlowSegmentation2.h"
+#include "vtkImageData.h"
+#include "vtkMutableDirectedGraph.h"
+#include "vtkRootedDirectedAcyclicGraph.h"
+#include "vtkSmartPointer.h"
+#include "vtkTree.h"
+#include "vtkTreeReader.h"
+#include "vtksys/CommandLineArguments.hxx"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  // Edge length of the stand-in volume, the simulated devices model the requested size
+  const int InputSize = 4;
+
+  void AddChildren(vtkMutableDirectedGraph* graph, vtkIdType parent, int branching, int depth)
+  {
+    if (depth == 0)
+    {
+      return;
+    }
+    for (int i = 0; i < branching; i++)
+    {
+      vtkIdType child = graph->AddChild(parent);
+      AddChildren(graph, child, branching, depth - 1);
+    }
+  }
+
+  template<class Segmenter>
+  void SetUpSegmenter(Segmenter* segmenter, vtkTree* tree, vtkImageData* dataTerm, int numIterations, int numDevices,
+                      int numBuffers, double bandwidth, double kernelRate, vtkIdType volumeSize, const std::string& trace)
+  {
+    segmenter->SetNumberOfIterations(numIterations);
+    segmenter->ClearDevices();
+    for (int i = 0; i < numDevices; i++)
+    {
+      segmenter->AddSimulatedDevice(numBuffers, bandwidth, kernelRate);
+    }
+    segmenter->SetSimulatedVolumeSize(volumeSize);
+    if (!trace.empty())
+    {
+      segmenter->SetSchedulingTraceFileName(trace.c_str());
+    }
+    for (vtkIdType node = 0; node < tree->GetNumberOfVertices(); node++)
+    {
+      if (tree->IsLeaf(node))
+      {
+        segmenter->SetDataInputDataObject(node, dataTerm);
+      }
+    }
+  }
+
+  template<class Segmenter>
+  void Report(const char* name, Segmenter* segmenter)
+  {
+    std::cout << name << ": " << segmenter->GetNumberOfMemoryTransfers() << " transfers, "
+              << segmenter->GetNumberOfKernelRuns() << " kernel launches, "
+              << segmenter->GetSimulatedTime() << " s simulated, "
+              << segmenter->GetSimulatedIdleTime() << " s device idle time" << std::endl;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  bool printHelp(false);
+  std::string treeFilename;
+  int branching = 3;
+  int depth = 2;
+  int size = 256;
+  int numIterations = 100;
+  int numDevices = 1;
+  double memory = 4096.0;
+  double bandwidth = 12.0;
+  double kernelRate = 10.0;
+  std::string tracePrefix;
+
+  vtksys::CommandLineArguments args;
+  args.Initialize(argc, argv);
+  args.AddArgument("--help", vtksys::CommandLineArguments::NO_ARGUMENT, &printHelp, "Print this help.");
+  args.AddArgument("--tree", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &treeFilename, "VTK tree file with the hierarchy (synthetic if not given).");
+  args.AddArgument("--branching", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &branching, "Children per node of the synthetic hierarchy.");
+  args.AddArgument("--depth", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &depth, "Depth of the synthetic hierarchy.");
+  args.AddArgument("--size", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &size, "Edge length of the modelled cubic volume.");
+  args.AddArgument("--iterations", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &numIterations, "Number of solver iterations.");
+  args.AddArgument("--devices", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &numDevices, "Number of simulated devices.");
+  args.AddArgument("--memory", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &memory, "Buffer memory of each device in MB (10^6 bytes).");
+  args.AddArgument("--bandwidth", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &bandwidth, "Host-device bandwidth in GB/s (10^9 bytes per second).");
+  args.AddArgument("--kernel-rate", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &kernelRate, "Voxels processed per kernel in GVoxels/s (10^9 voxels per second).");
+  args.AddArgument("--trace", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &tracePrefix, "Prefix of the scheduling trace files to write.");
+
+  if (!args.Parse())
+  {
+    std::cerr << "Problem parsing arguments." << std::endl;
+    std::cout << "Help: " << args.GetHelp() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (printHelp)
+  {
+    std::cout << args.GetHelp() << std::endl;
+    exit(EXIT_SUCCESS);
+  }
+  if (branching < 2 || depth < 1 || size < 2 || numIterations < 1 || numDevices < 1 ||
+      memory <= 0.0 || bandwidth <= 0.0 || kernelRate <= 0.0)
+  {
+    std::cerr << "Invalid simulation parameters." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  //load or build the hierarchy
+  vtkSmartPointer<vtkTree> tree = vtkSmartPointer<vtkTree>::New();
+  if (!treeFilename.empty())
+  {
+    vtkSmartPointer<vtkTreeReader> reader = vtkSmartPointer<vtkTreeReader>::New();
+    reader->SetFileName(treeFilename.c_str());
+    reader->Update();
+    tree->DeepCopy(reader->GetOutput());
+  }
+  else
+  {
+    vtkSmartPointer<vtkMutableDirectedGraph> graph = vtkSmartPointer<vtkMutableDirectedGraph>::New();
+    AddChildren(graph, graph->AddVertex(), branching, depth);
+    if (!tree->CheckedShallowCopy(graph))
+    {
+      std::cerr << "Could not build hierarchy." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (tree->GetNumberOfVertices() < 2)
+  {
+    std::cerr << "Could not read hierarchy." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  vtkSmartPointer<vtkRootedDirectedAcyclicGraph> dag = vtkSmartPointer<vtkRootedDirectedAcyclicGraph>::New();
+  if (!dag->CheckedShallowCopy(tree))
+  {
+    std::cerr << "Hierarchy is not a rooted directed acyclic graph." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  //a small stand-in data term, only the number of buffers matters to the scheduler
+  vtkSmartPointer<vtkImageData> dataTerm = vtkSmartPointer<vtkImageData>::New();
+  dataTerm->SetExtent(0, InputSize - 1, 0, InputSize - 1, 0, InputSize - 1);
+  dataTerm->AllocateScalars(VTK_FLOAT, 1);
+  float* ptr = (float*) dataTerm->GetScalarPointer();
+  for (vtkIdType x = 0; x < dataTerm->GetNumberOfPoints(); x++)
+  {
+    ptr[x] = 1.0f;
+  }
+
+  vtkIdType volumeSize = (vtkIdType) size * size * size;
+  int numBuffers = (int)(memory * 1.0e6 / (sizeof(float) * (double) volumeSize));
+  std::cout << "Volume: " << size << "^3, vertices: " << tree->GetNumberOfVertices() << ", iterations: " << numIterations
+            << ", devices: " << numDevices << " of " << numBuffers << " buffers" << std::endl;
+
+  vtkSmartPointer<vtkCudaHierarchicalMaxFlowSegmentation2> hierarchical = vtkSmartPointer<vtkCudaHierarchicalMaxFlowSegmentation2>::New();
+  hierarchical->SetStructure(tree);
+  SetUpSegmenter(hierarchical.GetPointer(), tree, dataTerm, numIterations, numDevices, numBuffers, bandwidth * 1.0e9,
+                 kernelRate * 1.0e9, volumeSize, tracePrefix.empty() ? tracePrefix : tracePrefix + "_hmf2.txt");
+  hierarchical->Update();
+  Report("HierarchicalMaxFlowSegmentation2", hierarchical.GetPointer());
+
+  vtkSmartPointer<vtkCudaDirectedAcyclicGraphMaxFlowSegmentation> directed = vtkSmartPointer<vtkCudaDirectedAcyclicGraphMaxFlowSegmentation>::New();
+  directed->SetStructure(dag);
+  SetUpSegmenter(directed.GetPointer(), tree, dataTerm, numIterations, numDevices, numBuffers, bandwidth * 1.0e9,
+                 kernelRate * 1.0e9, volumeSize, tracePrefix.empty() ? tracePrefix : tracePrefix + "_dag.txt");
+  directed->Update();
+  Report("DirectedAcyclicGraphMaxFlowSegmentation", directed.GetPointer());
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,252 @@
+/*------------------------------------------------------------------------------//
+GHMF_Benchmark.exe
+
+Description:
+This file is a benchmark for the CPU GHMF solver. It builds a synthetic hierarchy with
+random data terms, runs vtkHierarchicalMaxFlowSegmentation single-threaded and with the
+requested number of threads, checks that both produce identical labels and reports the
+throughput in voxels per second per iteration. It then solves with the flows stored as
+half floats and as bfloat16 and reports the memory held and the Dice coefficient of each
+label (voxels where it has the largest probability) against the float result. With
+--out-of-core, it also solves with the buffers in a memory-mapped scratch file, checks the
+labels against the in-memory result and reports the bytes read and written per iteration.
+
+Usage:\t [--size=N] [--iterations=N] [--threads=N] [--leaves=N] [--out-of-core] [--scratch=Directory]
+
+//------------------------------------------------------------------------------*/
+
+#include "vtkHierarchicalMaxFlowSegmentation.h"
+#include "vtkImageData.h"
+#include "vtkMinimalStandardRandomSequence.h"
+#include "vtkMultiThreader.h"
+#include "vtkMutableDirectedGraph.h"
+#include "vtkSmartPointer.h"
+#include "vtkTimerLog.h"
+#include "vtkTree.h"
+#include "vtksys/CommandLineArguments.hxx"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  double RunSegmentation(vtkHierarchicalMaxFlowSegmentation* segmenter, int numThreads)
+  {
+    segmenter->SetNumberOfThreads(numThreads);
+    segmenter->Modified();
+    vtkSmartPointer<vtkTimerLog> timer = vtkSmartPointer<vtkTimerLog>::New();
+    timer->StartTimer();
+    segmenter->Update();
+    timer->StopTimer();
+    return timer->GetElapsedTime();
+  }
+
+  // Hard segmentation, each voxel gets the index of the leaf with the largest probability
+  std::vector<int> ArgMaxLabels(vtkHierarchicalMaxFlowSegmentation* segmenter, const std::vector<vtkIdType>& leaves)
+  {
+    std::vector<int> labels;
+    std::vector<float> best;
+    for (size_t i = 0; i < leaves.size(); i++)
+    {
+      vtkImageData* output = vtkImageData::SafeDownCast(segmenter->GetOutputDataObject(leaves[i]));
+      float* ptr = (float*) output->GetScalarPointer();
+      vtkIdType numVoxels = output->GetNumberOfPoints();
+      if (i == 0)
+      {
+        labels.assign(numVoxels, 0);
+        best.assign(ptr, ptr + numVoxels);
+        continue;
+      }
+      for (vtkIdType x = 0; x < numVoxels; x++)
+      {
+        if (ptr[x] > best[x])
+        {
+          best[x] = ptr[x];
+          labels[x] = (int) i;
+        }
+      }
+    }
+    return labels;
+  }
+
+  // Dice coefficient of one label between two hard segmentations (1 if both are empty)
+  double Dice(const std::vector<int>& a, const std::vector<int>& b, int label)
+  {
+    double both = 0.0, sizeA = 0.0, sizeB = 0.0;
+    for (size_t x = 0; x < a.size(); x++)
+    {
+      sizeA += (a[x] == label) ? 1.0 : 0.0;
+      sizeB += (b[x] == label) ? 1.0 : 0.0;
+      both += (a[x] == label && b[x] == label) ? 1.0 : 0.0;
+    }
+    return (sizeA + sizeB > 0.0) ? 2.0 * both / (sizeA + sizeB) : 1.0;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  bool printHelp(false);
+  int size = 128;
+  int numIterations = 20;
+  int numThreads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  int numLeaves = 4;
+  bool outOfCore(false);
+  std::string scratchDirectory;
+
+  vtksys::CommandLineArguments args;
+  args.Initialize(argc, argv);
+  args.AddArgument("--help", vtksys::CommandLineArguments::NO_ARGUMENT, &printHelp, "Print this help.");
+  args.AddArgument("--size", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &size, "Edge length of the cubic test volume.");
+  args.AddArgument("--iterations", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &numIterations, "Number of solver iterations.");
+  args.AddArgument("--threads", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &numThreads, "Number of threads for the multi-threaded run.");
+  args.AddArgument("--leaves", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &numLeaves, "Number of leaf labels (split evenly under two branches).");
+  args.AddArgument("--out-of-core", vtksys::CommandLineArguments::NO_ARGUMENT, &outOfCore, "Also solve with the buffers in a memory-mapped scratch file.");
+  args.AddArgument("--scratch", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &scratchDirectory, "Directory for the out-of-core scratch file.");
+
+  if (!args.Parse())
+  {
+    std::cerr << "Problem parsing arguments." << std::endl;
+    std::cout << "Help: " << args.GetHelp() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (printHelp)
+  {
+    std::cout << args.GetHelp() << std::endl;
+    exit(EXIT_SUCCESS);
+  }
+  if (size < 2 || numIterations < 1 || numThreads < 1 || numLeaves < 2)
+  {
+    std::cerr << "Invalid benchmark parameters." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  //build a two level hierarchy: root -> 2 branches -> leaves
+  vtkSmartPointer<vtkMutableDirectedGraph> graph = vtkSmartPointer<vtkMutableDirectedGraph>::New();
+  vtkIdType root = graph->AddVertex();
+  vtkIdType branches[2];
+  branches[0] = graph->AddVertex();
+  branches[1] = graph->AddVertex();
+  graph->AddEdge(root, branches[0]);
+  graph->AddEdge(root, branches[1]);
+  std::vector<vtkIdType> leaves;
+  for (int i = 0; i < numLeaves; i++)
+  {
+    leaves.push_back(graph->AddVertex());
+    graph->AddEdge(branches[i % 2], leaves.back());
+  }
+  vtkSmartPointer<vtkTree> tree = vtkSmartPointer<vtkTree>::New();
+  if (!tree->CheckedShallowCopy(graph))
+  {
+    std::cerr << "Could not build hierarchy." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  vtkSmartPointer<vtkHierarchicalMaxFlowSegmentation> segmenter = vtkSmartPointer<vtkHierarchicalMaxFlowSegmentation>::New();
+  segmenter->SetStructure(tree);
+  segmenter->SetNumberOfIterations(numIterations);
+
+  //random, non-negative data terms
+  vtkSmartPointer<vtkMinimalStandardRandomSequence> random = vtkSmartPointer<vtkMinimalStandardRandomSequence>::New();
+  random->SetSeed(1);
+  std::vector< vtkSmartPointer<vtkImageData> > dataTerms;
+  for (int i = 0; i < numLeaves; i++)
+  {
+    vtkSmartPointer<vtkImageData> dataTerm = vtkSmartPointer<vtkImageData>::New();
+    dataTerm->SetExtent(0, size - 1, 0, size - 1, 0, size - 1);
+    dataTerm->AllocateScalars(VTK_FLOAT, 1);
+    float* ptr = (float*) dataTerm->GetScalarPointer();
+    for (vtkIdType x = 0; x < dataTerm->GetNumberOfPoints(); x++)
+    {
+      ptr[x] = (float) random->GetValue();
+      random->Next();
+    }
+    segmenter->SetDataInputDataObject(leaves[i], dataTerm);
+    dataTerms.push_back(dataTerm);
+  }
+  for (int i = 0; i < 2; i++)
+  {
+    segmenter->AddSmoothnessScalar(branches[i], 0.05);
+  }
+  for (int i = 0; i < numLeaves; i++)
+  {
+    segmenter->AddSmoothnessScalar(leaves[i], 0.01);
+  }
+
+  //single-threaded reference run
+  double serialTime = RunSegmentation(segmenter, 1);
+  std::vector< std::vector<float> > reference(numLeaves);
+  for (int i = 0; i < numLeaves; i++)
+  {
+    vtkImageData* output = vtkImageData::SafeDownCast(segmenter->GetOutputDataObject(leaves[i]));
+    float* ptr = (float*) output->GetScalarPointer();
+    reference[i].assign(ptr, ptr + output->GetNumberOfPoints());
+  }
+
+  //multi-threaded run
+  double threadedTime = RunSegmentation(segmenter, numThreads);
+  bool identical = true;
+  for (int i = 0; i < numLeaves; i++)
+  {
+    vtkImageData* output = vtkImageData::SafeDownCast(segmenter->GetOutputDataObject(leaves[i]));
+    float* ptr = (float*) output->GetScalarPointer();
+    identical = identical && (memcmp(ptr, &(reference[i][0]), reference[i].size() * sizeof(float)) == 0);
+  }
+
+  double voxels = (double) size * size * size;
+  std::cout << "Volume: " << size << "^3, leaves: " << numLeaves << ", iterations: " << numIterations << std::endl;
+  std::cout << "1 thread:   " << serialTime << " s, "
+            << voxels * numIterations / serialTime << " voxels/second/iteration" << std::endl;
+  std::cout << numThreads << " threads: " << threadedTime << " s, "
+            << voxels * numIterations / threadedTime << " voxels/second/iteration" << std::endl;
+  std::cout << "Speed-up: " << serialTime / threadedTime << std::endl;
+  std::cout << "Labels identical: " << (identical ? "yes" : "no") << std::endl;
+
+  //16-bit flow storage against the float result
+  std::vector<int> referenceLabels = ArgMaxLabels(segmenter, leaves);
+  vtkIdType floatBytes = segmenter->GetNumberOfBytesHeld();
+  const int storageModes[2] = { VTK_MAXFLOW_STORAGE_HALF, VTK_MAXFLOW_STORAGE_BFLOAT16 };
+  const char* storageNames[2] = { "half", "bfloat16" };
+  std::cout << "float storage: " << floatBytes << " bytes held" << std::endl;
+  for (int m = 0; m < 2; m++)
+  {
+    segmenter->SetFlowStorage(storageModes[m]);
+    double compactTime = RunSegmentation(segmenter, numThreads);
+    std::vector<int> compactLabels = ArgMaxLabels(segmenter, leaves);
+    std::cout << storageNames[m] << " storage: " << compactTime << " s, "
+              << segmenter->GetNumberOfBytesHeld() << " bytes held, Dice:";
+    for (int i = 0; i < numLeaves; i++)
+    {
+      std::cout << " " << Dice(referenceLabels, compactLabels, i);
+    }
+    std::cout << std::endl;
+  }
+  segmenter->SetFlowStorageToFloat();
+
+  //out-of-core run, which has to give the same labels as the in-memory one
+  if (outOfCore)
+  {
+    segmenter->SetOutOfCore(1);
+    if (!scratchDirectory.empty())
+    {
+      segmenter->SetScratchDirectory(scratchDirectory.c_str());
+    }
+    double outOfCoreTime = RunSegmentation(segmenter, 1);
+    bool outOfCoreIdentical = true;
+    for (int i = 0; i < numLeaves; i++)
+    {
+      vtkImageData* output = vtkImageData::SafeDownCast(segmenter->GetOutputDataObject(leaves[i]));
+      float* ptr = (float*) output->GetScalarPointer();
+      outOfCoreIdentical = outOfCoreIdentical && (memcmp(ptr, &(reference[i][0]), reference[i].size() * sizeof(float)) == 0);
+    }
+    std::cout << "out-of-core: " << outOfCoreTime << " s, "
+              << segmenter->GetBytesReadPerIteration() << " bytes read and "
+              << segmenter->GetBytesWrittenPerIteration() << " bytes written per iteration, labels identical: "
+              << (outOfCoreIdentical ? "yes" : "no") << std::endl;
+    segmenter->SetOutOfCore(0);
+    identical = identical && outOfCoreIdentical;
+  }
+
+  return identical ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -41,7 +41,7 @@ The tree is saved in a VTK file with the following attributes:
 void showHelpMessage()
 {
   std::cerr << "Usage:\t TreeFilename NumberOfIterations " <<
-            "[-output OutputFilename] [-step StepSize] [-cc VanishingRatio]" << std::endl;
+            "[-output OutputFilename] [-step StepSize] [-cc VanishingRatio] [-tol Tolerance] [-check Interval] [-levels NumberOfLevels] [-levelits IterationsPerLevel]" << std::endl;
 }
 
 void showLongHelpMessage()
@@ -53,14 +53,18 @@ void showLongHelpMessage()
             "identifiers and output values" << std::endl <<
             std::endl <<
             "Usage:\t TreeFilename NumberOfIterations " <<
-            "[-output OutputFilename] [-step StepSize] [-cc VanishingRatio]" << std::endl <<
+            "[-output OutputFilename] [-step StepSize] [-cc VanishingRatio] [-tol Tolerance] [-check Interval] [-levels NumberOfLevels] [-levelits IterationsPerLevel]" << std::endl <<
             "The tree is saved in a VTK file with the following attributes:" << std::endl <<
             "\"DataTerm\": (mandatory) filename for the data term" << std::endl <<
             "\"SmoothnessTerm\": (optional) filename for the smoothness term" << std::endl <<
             "\"OutputLocation\": (optional) filename to save probabilistic label to" << std::endl <<
             "\"Alpha\": (optional) filename for the smoothness term" << std::endl <<
             "\"Identifier\": (mandatory iff OutputFilename is specified) unique label integer to associate" <<
-            " in merged file (discrete segmentation)" << std::endl;
+            " in merged file (discrete segmentation)" << std::endl <<
+            "If a tolerance is given, the solver stops once the mean label change (checked every" <<
+            " Interval iterations) drops below it." << std::endl <<
+            "With more than one level, coarser versions of the problem are solved first (with" <<
+            " IterationsPerLevel iterations each) to start the full resolution solve." << std::endl;
 }
 
 int main(int argc, char** argv)
@@ -94,6 +98,10 @@ int main(int argc, char** argv)
   int NumFlags = (argc - 3) / 2;
   double Tau = 0.1;
   double CC = 0.25;
+  double Tolerance = 0.0;
+  int CheckInterval = 10;
+  int NumLevels = 1;
+  int NumLevelIts = 50;
   bool hasOutput = false;
   std::string OutFileBase = "";
 
@@ -114,6 +122,22 @@ int main(int argc, char** argv)
     {
       CC = std::atof(argv[4+2*i]);
     }
+    else if( !command.compare("-tol") )
+    {
+      Tolerance = std::atof(argv[4+2*i]);
+    }
+    else if( !command.compare("-check") )
+    {
+      CheckInterval = std::atoi(argv[4+2*i]);
+    }
+    else if( !command.compare("-levels") )
+    {
+      NumLevels = std::atoi(argv[4+2*i]);
+    }
+    else if( !command.compare("-levelits") )
+    {
+      NumLevelIts = std::atoi(argv[4+2*i]);
+    }
     else
     {
       showHelpMessage();
@@ -146,6 +170,10 @@ int main(int argc, char** argv)
   Segmenter->SetNumberOfIterations(NumIts);
   Segmenter->SetStepSize(Tau);
   Segmenter->SetCC(CC);
+  Segmenter->SetConvergenceTolerance(Tolerance);
+  Segmenter->SetConvergenceCheckInterval(CheckInterval);
+  Segmenter->SetNumberOfLevels(NumLevels);
+  Segmenter->SetNumberOfIterationsPerLevel(NumLevelIts);
 
   //get information arrays
   vtkStringArray* DataTerms = (vtkStringArray*) Tree->GetVertexData()->GetAbstractArray("DataTerm");
@@ -201,6 +229,8 @@ int main(int argc, char** argv)
 
   //run segmentation
   Segmenter->Update();
+  std::cout << "Iterations used: " << Segmenter->GetNumberOfIterationsUsed() <<
+            ", final mean label change: " << Segmenter->GetFinalResidual() << std::endl;
 
   //output files
   Iterator = vtkRootedDirectedAcyclicGraphForwardIterator::New();
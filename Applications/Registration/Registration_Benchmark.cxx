@@ -0,0 +1,433 @@
+/*------------------------------------------------------------------------------//
+Registration_Benchmark.exe
+
+Description:
+This file is a benchmark for the histogram based similarity metrics used by the
+registration. It builds a pair of synthetic 12 bit volumes, offset from one another, and
+evaluates every vtkImage*Manipulator over the same sequence of sub-voxel translations (as
+an optimizer would) single-threaded and with the requested number of threads, reporting
+the evaluations per second of each. The single-threaded loop the manipulators used to
+run (a divide per voxel) is kept here as a baseline for the mutual information, which is
+checked against vtkImageMIManipulator. It then evaluates the mutual information over
+small rigid transformations, by reslicing image 1 with vtkImageReslice first and by
+handing the transformations to vtkImageMIManipulator, which samples image 1 itself.
+It evaluates it from 5% and 1% of the voxels, as in the early stages of an
+optimization, against the translations and the results of all of them. Finally, it
+registers the volumes with vtkImagePyramidRegistration at full resolution only and
+coarse-to-fine, reporting the evaluations and time of every level.
+
+Usage:\t [--size=N] [--evaluations=N] [--threads=N] [--bins=N]
+
+//------------------------------------------------------------------------------*/
+
+#include "vtkImageData.h"
+#include "vtkImageECRManipulator.h"
+#include "vtkImageMIManipulator.h"
+#include "vtkImageNMIManipulator.h"
+#include "vtkImagePyramidRegistration.h"
+#include "vtkImageRMIManipulator.h"
+#include "vtkImageReslice.h"
+#include "vtkImageSMIManipulator.h"
+#include "vtkImageSMIManipulator2.h"
+#include "vtkImageSMIPVIManipulator.h"
+#include "vtkImageTMIManipulator.h"
+#include "vtkMinimalStandardRandomSequence.h"
+#include "vtkMultiThreader.h"
+#include "vtkSmartPointer.h"
+#include "vtkTimerLog.h"
+#include "vtkTransform.h"
+#include "vtksys/CommandLineArguments.hxx"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  const int MaxIntensity = 4095;
+
+  // Smooth structures plus noise, image 2 is image 1 shifted by (shift, 0, 0)
+  vtkSmartPointer<vtkImageData> MakeVolume(int size, double shift, vtkMinimalStandardRandomSequence* random)
+  {
+    vtkSmartPointer<vtkImageData> volume = vtkSmartPointer<vtkImageData>::New();
+    volume->SetExtent(0, size - 1, 0, size - 1, 0, size - 1);
+    volume->AllocateScalars(VTK_UNSIGNED_SHORT, 1);
+    unsigned short* ptr = (unsigned short*) volume->GetScalarPointer();
+    for (int z = 0; z < size; z++)
+    {
+      for (int y = 0; y < size; y++)
+      {
+        for (int x = 0; x < size; x++)
+        {
+          double value = 2000.0 + 1200.0 * sin((x + shift) * 0.15) * cos(y * 0.1) * cos(z * 0.05) +
+                         400.0 * random->GetValue();
+          random->Next();
+          *ptr++ = (unsigned short)(value < 0.0 ? 0.0 : (value > MaxIntensity ? MaxIntensity : value));
+        }
+      }
+    }
+    return volume;
+  }
+
+  template<class Manipulator>
+  void SetInputs(Manipulator* manipulator, vtkImageData* source, vtkImageData* target)
+  {
+    manipulator->SetInput1(source);
+    manipulator->SetInput2(target);
+  }
+
+  void SetInputs(vtkImageECRManipulator* manipulator, vtkImageData* source, vtkImageData* target)
+  {
+    manipulator->SetInput1Data(source);
+    manipulator->SetInput2Data(target);
+  }
+
+  // Evaluations per second over the translations, the results are kept for comparison
+  template<class Manipulator>
+  double Evaluate(Manipulator* manipulator, const std::vector<double>& translations, int numEvaluations,
+                  std::vector<double>& results)
+  {
+    results.resize(numEvaluations);
+    vtkSmartPointer<vtkTimerLog> timer = vtkSmartPointer<vtkTimerLog>::New();
+    timer->StartTimer();
+    for (int i = 0; i < numEvaluations; i++)
+    {
+      double translation[3] = { translations[3 * i], translations[3 * i + 1], translations[3 * i + 2] };
+      manipulator->SetTranslation(translation);
+      results[i] = manipulator->GetResult();
+    }
+    timer->StopTimer();
+    return numEvaluations / timer->GetElapsedTime();
+  }
+
+  template<class Manipulator>
+  void Run(const char* name, Manipulator* manipulator, int extent[6], const std::vector<double>& translations,
+           int numEvaluations, int numThreads, std::vector<double>& results)
+  {
+    manipulator->SetExtent(extent);
+    manipulator->SetNumberOfThreads(1);
+    double serialRate = Evaluate(manipulator, translations, numEvaluations, results);
+    manipulator->SetNumberOfThreads(numThreads);
+    double threadedRate = Evaluate(manipulator, translations, numEvaluations, results);
+    std::cout << name << ": " << serialRate << " evaluations/second with 1 thread, "
+              << threadedRate << " with " << numThreads << " threads" << std::endl;
+  }
+
+  // The loop vtkImageMIManipulator used to run: single-threaded, trilinear
+  // interpolation, and a divide by the bin width for every voxel.
+  double LegacyMutualInformation(vtkImageData* source, vtkImageData* target, int extent[6], const double tran[3],
+                                 int binWidth, int numBins, double entropyT, std::vector<long>& histS,
+                                 std::vector<long>& histST)
+  {
+    int loc000[3], loc111[3];
+    double f[3];
+    for (int i = 0; i < 3; i++)
+    {
+      loc000[i] = (int) floor(tran[i]);
+      f[i] = tran[i] - loc000[i];
+      loc111[i] = (tran[i] == 0.0) ? loc000[i] : loc000[i] + 1;
+    }
+    double F000 = (1.0 - f[0]) * (1.0 - f[1]) * (1.0 - f[2]);
+    double F100 =        f[0]  * (1.0 - f[1]) * (1.0 - f[2]);
+    double F010 = (1.0 - f[0]) *        f[1]  * (1.0 - f[2]);
+    double F110 =        f[0]  *        f[1]  * (1.0 - f[2]);
+    double F001 = (1.0 - f[0]) * (1.0 - f[1]) *        f[2];
+    double F101 =        f[0]  * (1.0 - f[1]) *        f[2];
+    double F011 = (1.0 - f[0]) *        f[1]  *        f[2];
+    double F111 =        f[0]  *        f[1]  *        f[2];
+
+    int* inExt = source->GetExtent();
+    if ( (extent[0] + loc000[0] < inExt[0]) || (extent[2] + loc000[1] < inExt[2]) ||
+         (extent[4] + loc000[2] < inExt[4]) || (extent[1] + loc111[0] > inExt[1]) ||
+         (extent[3] + loc111[1] > inExt[3]) || (extent[5] + loc111[2] > inExt[5]) )
+    {
+      return 0.0;
+    }
+
+    histS.assign(numBins, 0);
+    histST.assign(numBins * numBins, 0);
+    vtkIdType* inc = source->GetIncrements();
+    int start[3] = { extent[0] + loc000[0], extent[2] + loc000[1], extent[4] + loc000[2] };
+    unsigned short* in1Ptr = (unsigned short*) source->GetScalarPointer(start);
+    unsigned short* in2Ptr = (unsigned short*) target->GetScalarPointer(extent[0], extent[2], extent[4]);
+    double count = 0.0;
+    for (int idZ = extent[4]; idZ <= extent[5]; idZ++)
+    {
+      for (int idY = extent[2]; idY <= extent[3]; idY++)
+      {
+        unsigned short* p1 = in1Ptr + (idZ - extent[4]) * inc[2] + (idY - extent[2]) * inc[1];
+        unsigned short* p2 = in2Ptr + (idZ - extent[4]) * inc[2] + (idY - extent[2]) * inc[1];
+        for (int idX = extent[0]; idX <= extent[1]; idX++, p1++, p2++)
+        {
+          double Vxyz = (p1[0] * F000 + p1[1] * F100 +
+                         p1[inc[1]] * F010 + p1[inc[1] + 1] * F110 +
+                         p1[inc[2]] * F001 + p1[inc[2] + 1] * F101 +
+                         p1[inc[1] + inc[2]] * F011 + p1[inc[1] + inc[2] + 1] * F111);
+          int a = (int) floor(Vxyz / double(binWidth));
+          int b = (int) floor(*p2 / double(binWidth));
+          histS[a]++;
+          histST[b * numBins + a]++;
+          count++;
+        }
+      }
+    }
+
+    double entropyS = 0.0, entropyST = 0.0;
+    for (int i = 0; i < numBins; i++)
+    {
+      double temp = (double) histS[i];
+      if (temp > 0.0)
+      {
+        entropyS += temp * log(temp);
+      }
+      for (int j = 0; j < numBins; j++)
+      {
+        temp = (double) histST[j * numBins + i];
+        if (temp > 0.0)
+        {
+          entropyST += temp * log(temp);
+        }
+      }
+    }
+    entropyS  = -entropyS / count + log(count);
+    entropyST = -entropyST / count + log(count);
+    return entropyS + entropyT - entropyST;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  bool printHelp(false);
+  int size = 128;
+  int numEvaluations = 100;
+  int numThreads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  int numBins = 64;
+
+  vtksys::CommandLineArguments args;
+  args.Initialize(argc, argv);
+  args.AddArgument("--help", vtksys::CommandLineArguments::NO_ARGUMENT, &printHelp, "Print this help.");
+  args.AddArgument("--size", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &size, "Edge length of the cubic test volumes.");
+  args.AddArgument("--evaluations", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &numEvaluations, "Number of metric evaluations per run.");
+  args.AddArgument("--threads", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &numThreads, "Number of threads for the multi-threaded runs.");
+  args.AddArgument("--bins", vtksys::CommandLineArguments::EQUAL_ARGUMENT, &numBins, "Number of histogram bins of each image.");
+
+  if (!args.Parse())
+  {
+    std::cerr << "Problem parsing arguments." << std::endl;
+    std::cout << "Help: " << args.GetHelp() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (printHelp)
+  {
+    std::cout << args.GetHelp() << std::endl;
+    exit(EXIT_SUCCESS);
+  }
+  if (size < 16 || numEvaluations < 1 || numThreads < 1 || numBins < 2 || numBins > MaxIntensity + 1)
+  {
+    std::cerr << "Invalid benchmark parameters." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  vtkSmartPointer<vtkMinimalStandardRandomSequence> random = vtkSmartPointer<vtkMinimalStandardRandomSequence>::New();
+  random->SetSeed(1);
+  vtkSmartPointer<vtkImageData> source = MakeVolume(size, 0.0, random);
+  vtkSmartPointer<vtkImageData> target = MakeVolume(size, 2.5, random);
+  vtkSmartPointer<vtkImageData> mask = vtkSmartPointer<vtkImageData>::New();
+  mask->SetExtent(0, size - 1, 0, size - 1, 0, size - 1);
+  mask->AllocateScalars(VTK_UNSIGNED_SHORT, 1);
+  unsigned short* maskPtr = (unsigned short*) mask->GetScalarPointer();
+  for (vtkIdType x = 0; x < mask->GetNumberOfPoints(); x++)
+  {
+    maskPtr[x] = (x % size < size / 2) ? 1 : 0;
+  }
+
+  //sub-voxel translations within 3 voxels, the margin keeps them all inside image 1
+  std::vector<double> translations(3 * numEvaluations);
+  for (size_t i = 0; i < translations.size(); i++)
+  {
+    translations[i] = 6.0 * random->GetValue() - 3.0;
+    random->Next();
+  }
+  const int margin = 4;
+  int extent[6] = { margin, size - 1 - margin, margin, size - 1 - margin, margin, size - 1 - margin };
+  int binWidth = (MaxIntensity + 1 + numBins - 1) / numBins;
+
+  std::cout << "Volume: " << size << "^3, bins: " << numBins << ", evaluations: " << numEvaluations << std::endl;
+  std::vector<double> results;
+
+  vtkSmartPointer<vtkImageMIManipulator> mi = vtkSmartPointer<vtkImageMIManipulator>::New();
+  SetInputs(mi.GetPointer(), source, target);
+  mi->SetBinWidth(binWidth, binWidth);
+  mi->SetBinNumber(numBins, numBins);
+  Run("MI", mi.GetPointer(), extent, translations, numEvaluations, numThreads, results);
+  std::vector<double> miResults(results);
+
+  //the legacy loop, against the last MI results
+  std::vector<long> histS, histST;
+  std::vector<double> legacyResults(numEvaluations);
+  vtkSmartPointer<vtkTimerLog> timer = vtkSmartPointer<vtkTimerLog>::New();
+  timer->StartTimer();
+  for (int i = 0; i < numEvaluations; i++)
+  {
+    legacyResults[i] = LegacyMutualInformation(source, target, extent, &translations[3 * i], binWidth, numBins,
+                                               mi->entropyT, histS, histST);
+  }
+  timer->StopTimer();
+  double largestDifference = 0.0;
+  for (int i = 0; i < numEvaluations; i++)
+  {
+    largestDifference = std::max(largestDifference, fabs(legacyResults[i] - results[i]));
+  }
+  std::cout << "Legacy MI loop: " << numEvaluations / timer->GetElapsedTime() << " evaluations/second, "
+            << "largest difference to MI: " << largestDifference << std::endl;
+
+  vtkSmartPointer<vtkImageNMIManipulator> nmi = vtkSmartPointer<vtkImageNMIManipulator>::New();
+  SetInputs(nmi.GetPointer(), source, target);
+  nmi->SetBinWidth(binWidth, binWidth);
+  nmi->SetBinNumber(numBins, numBins);
+  Run("NMI", nmi.GetPointer(), extent, translations, numEvaluations, numThreads, results);
+
+  vtkSmartPointer<vtkImageECRManipulator> ecr = vtkSmartPointer<vtkImageECRManipulator>::New();
+  SetInputs(ecr.GetPointer(), source, target);
+  ecr->SetBinWidth(binWidth, binWidth);
+  ecr->SetBinNumber(numBins, numBins);
+  Run("ECR", ecr.GetPointer(), extent, translations, numEvaluations, numThreads, results);
+
+  vtkSmartPointer<vtkImageRMIManipulator> rmi = vtkSmartPointer<vtkImageRMIManipulator>::New();
+  SetInputs(rmi.GetPointer(), source, target);
+  rmi->SetBinNumber(numBins, numBins);
+  Run("RMI", rmi.GetPointer(), extent, translations, numEvaluations, numThreads, results);
+
+  vtkSmartPointer<vtkImageTMIManipulator> tmi = vtkSmartPointer<vtkImageTMIManipulator>::New();
+  SetInputs(tmi.GetPointer(), source, target);
+  tmi->SetBinNumber(numBins, numBins);
+  Run("TMI", tmi.GetPointer(), extent, translations, numEvaluations, numThreads, results);
+
+  vtkSmartPointer<vtkImageSMIManipulator> smi = vtkSmartPointer<vtkImageSMIManipulator>::New();
+  SetInputs(smi.GetPointer(), source, target);
+  smi->SetBinNumber(numBins, numBins);
+  Run("SMI", smi.GetPointer(), extent, translations, numEvaluations, numThreads, results);
+
+  vtkSmartPointer<vtkImageSMIManipulator2> smi2 = vtkSmartPointer<vtkImageSMIManipulator2>::New();
+  SetInputs(smi2.GetPointer(), source, target);
+  smi2->SetMask(mask);
+  smi2->SetBinNumber(numBins, numBins);
+  Run("SMI2 (masked)", smi2.GetPointer(), extent, translations, numEvaluations, numThreads, results);
+
+  vtkSmartPointer<vtkImageSMIPVIManipulator> smipvi = vtkSmartPointer<vtkImageSMIPVIManipulator>::New();
+  SetInputs(smipvi.GetPointer(), source, target);
+  smipvi->SetBinNumber(numBins, numBins);
+  Run("SMIPVI", smipvi.GetPointer(), extent, translations, numEvaluations, numThreads, results);
+
+  //rigid transformations within 1.5 degrees and 1 voxel about the centre
+  std::vector< vtkSmartPointer<vtkTransform> > transforms(numEvaluations);
+  double center = 0.5 * (size - 1);
+  for (int i = 0; i < numEvaluations; i++)
+  {
+    double angles[3];
+    for (int j = 0; j < 3; j++)
+    {
+      angles[j] = 3.0 * random->GetValue() - 1.5;
+      random->Next();
+    }
+    transforms[i] = vtkSmartPointer<vtkTransform>::New();
+    transforms[i]->PostMultiply();
+    transforms[i]->Translate(-center, -center, -center);
+    transforms[i]->RotateX(angles[0]);
+    transforms[i]->RotateY(angles[1]);
+    transforms[i]->RotateZ(angles[2]);
+    transforms[i]->Translate(center + translations[3 * i] / 3.0, center + translations[3 * i + 1] / 3.0,
+                             center + translations[3 * i + 2] / 3.0);
+  }
+
+  //resliced into a temporary volume, then compared without translation
+  vtkSmartPointer<vtkImageReslice> reslice = vtkSmartPointer<vtkImageReslice>::New();
+  reslice->SetInputData(source);
+  reslice->SetInterpolationModeToLinear();
+  vtkSmartPointer<vtkImageMIManipulator> reslicedMI = vtkSmartPointer<vtkImageMIManipulator>::New();
+  reslicedMI->SetInput2(target);
+  reslicedMI->SetBinWidth(binWidth, binWidth);
+  reslicedMI->SetBinNumber(numBins, numBins);
+  double noTranslation[3] = { 0.0, 0.0, 0.0 };
+  std::vector<double> reslicedResults(numEvaluations);
+  timer->StartTimer();
+  for (int i = 0; i < numEvaluations; i++)
+  {
+    reslice->SetResliceTransform(transforms[i]);
+    reslice->Update();
+    reslicedMI->SetInput1(reslice->GetOutput());
+    if (i == 0)
+    {
+      reslicedMI->SetExtent(extent);
+    }
+    reslicedMI->SetTranslation(noTranslation);
+    reslicedResults[i] = reslicedMI->GetResult();
+  }
+  timer->StopTimer();
+  double reslicedRate = numEvaluations / timer->GetElapsedTime();
+
+  //sampled within the histogram loop
+  timer->StartTimer();
+  for (int i = 0; i < numEvaluations; i++)
+  {
+    mi->SetTransform(transforms[i]);
+    results[i] = mi->GetResult();
+  }
+  timer->StopTimer();
+  double transformedRate = numEvaluations / timer->GetElapsedTime();
+  double rigidDifference = 0.0;
+  for (int i = 0; i < numEvaluations; i++)
+  {
+    rigidDifference = std::max(rigidDifference, fabs(reslicedResults[i] - results[i]));
+  }
+  std::cout << "Rigid MI: " << reslicedRate << " evaluations/second resliced first, " << transformedRate
+            << " sampled in the histogram loop, largest difference: " << rigidDifference
+            << " (the resliced volume is rounded to integers)" << std::endl;
+
+  //from a random subset of the voxels
+  const double fractions[2] = { 0.05, 0.01 };
+  for (int f = 0; f < 2; f++)
+  {
+    mi->SetSamplingFraction(fractions[f]);
+    timer->StartTimer();
+    for (int i = 0; i < numEvaluations; i++)
+    {
+      mi->SetTranslation(&translations[3 * i]);
+      results[i] = mi->GetResult();
+    }
+    timer->StopTimer();
+    double sampledDifference = 0.0;
+    for (int i = 0; i < numEvaluations; i++)
+    {
+      sampledDifference = std::max(sampledDifference, fabs(miResults[i] - results[i]));
+    }
+    std::cout << "MI from " << 100.0 * fractions[f] << "% of the voxels: " << numEvaluations / timer->GetElapsedTime()
+              << " evaluations/second, largest difference to all of them: " << sampledDifference << std::endl;
+  }
+  mi->SetSamplingFraction(1.0);
+
+  //registered at full resolution only, then from 3 levels, towards a translation of (2.5, 0, 0)
+  vtkSmartPointer<vtkImagePyramidRegistration> registration = vtkSmartPointer<vtkImagePyramidRegistration>::New();
+  registration->SetSourceImage(source);
+  registration->SetTargetImage(target);
+  registration->SetBinNumber(numBins);
+  registration->SetNumberOfThreads(numThreads);
+  for (int numLevels = 1; numLevels <= 3; numLevels += 2)
+  {
+    registration->SetNumberOfLevels(numLevels);
+    registration->Update();
+    double* parameters = registration->GetParameters();
+    std::cout << "Registration from " << numLevels << " level(s): translation ( " << parameters[0] << ", "
+              << parameters[1] << ", " << parameters[2] << " ), rotation ( " << parameters[3] << ", "
+              << parameters[4] << ", " << parameters[5] << " )" << std::endl;
+    for (int level = numLevels - 1; level >= 0; level--)
+    {
+      std::cout << "  level " << level << ": " << registration->GetNumberOfEvaluations(level) << " evaluations, "
+                << registration->GetElapsedTime(level) << " s" << std::endl;
+    }
+  }
+
+  return (largestDifference < 1e-9) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
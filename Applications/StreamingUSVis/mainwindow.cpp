@@ -244,6 +244,8 @@ int MainWindow::InitPLUSBypassPipeline()
   acceleratedVolumeReconstructor->SetCalMatrix(us_cal_mat);
   acceleratedVolumeReconstructor->Initialize();
   acceleratedVolumeReconstructor->StartReconstruction();
+  acceleratedVolumeReconstructor->SetPublishInterval(1.0 / frame_rate);
+  acceleratedVolumeReconstructor->StartAsyncReconstruction();
 
   return 0;
 }
@@ -331,6 +333,7 @@ int MainWindow::InitVTKPipeline()
   us_callback->Viewer = usViewer;
   us_callback->imgFlip = usImageFlip;
   us_callback->index = 0;
+  us_callback->volumeVersion = 0;
   us_callback->Info = this->ui->trackingInfo_Label;
   us_callback->Iren = this->ui->US_View->GetInteractor();
   us_callback->ImageData = usImageData;
@@ -1163,19 +1166,23 @@ void vtkUSEventCallback::Execute(vtkObject* caller, unsigned long, void*)
   imgFlip->SetInputData(PlusTrackedFrame->GetImageData()->GetImage());
   imgFlip->Update();
 
-  accRecon->SetInputImageData(PlusTrackedFrame->GetTimestamp(), imgFlip->GetOutput());
-
+  // Compounding runs on the reconstructor's own thread, frames are dropped if it falls behind
   PlusTrackedFrame->GetCustomFrameTransform(TransformName, tFrame2Tracker);
-  accRecon->SetInputPoseData(PlusTrackedFrame->GetTimestamp(), tFrame2Tracker);
+  accRecon->PushFrame(PlusTrackedFrame->GetTimestamp(), imgFlip->GetOutput(), tFrame2Tracker);
 
-  accRecon->UpdateReconstruction();
-  accRecon->GetOutputVolume(usVolume);
+  // The compounding thread publishes the volume at the frame rate, pick it up only when there is a new one
+  unsigned long version = accRecon->GetPublishedVolume(usVolume, volumeVersion);
+  bool volumeUpdated = (version != volumeVersion);
+  volumeVersion = version;
 
   if (!std::strcmp(current_mapper.c_str(), "1D_MAPPER"))
   {
-    usVolume->Modified();
-    cudaMapper->SetInputData(usVolume);
-    cudaMapper->Modified();
+    if (volumeUpdated)
+    {
+      usVolume->Modified();
+      cudaMapper->SetInputData(usVolume);
+      cudaMapper->Modified();
+    }
 
 #ifdef ALIGNMENT_DEBUG
     _boxTransform->Identity();
@@ -1183,13 +1190,13 @@ void vtkUSEventCallback::Execute(vtkObject* caller, unsigned long, void*)
     _boxTransform->Update();
 #endif
   }
-  else if (!std::strcmp(current_mapper.c_str(), "2D_MAPPER"))
+  else if (!std::strcmp(current_mapper.c_str(), "2D_MAPPER") && volumeUpdated)
   {
     usVolume->Modified();
     cudaMapper2->SetInputData(usVolume);
     cudaMapper2->Modified();
   }
-  else if (!std::strcmp(current_mapper.c_str(), "INEX_MAPPER"))
+  else if (!std::strcmp(current_mapper.c_str(), "INEX_MAPPER") && volumeUpdated)
   {
     _inExMapper->SetInputData(usVolume);
     _inExMapper->Modified();
@@ -247,6 +247,7 @@ public:
   std::string current_mapper;
   bool sc_capture_on;
   unsigned int index;
+  unsigned long volumeVersion;
 };
 
 namespace Ui
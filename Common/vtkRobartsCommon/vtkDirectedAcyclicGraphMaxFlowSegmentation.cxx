@@ -73,6 +73,35 @@ vtkDirectedAcyclicGraphMaxFlowSegmentation::vtkDirectedAcyclicGraphMaxFlowSegmen
   this->StepSize = 0.1;
   this->CC = 0.25;
 
+  //convergence is not checked by default
+  this->ConvergenceTolerance = 0.0;
+  this->ConvergenceCheckInterval = 10;
+  this->NumberOfIterationsUsed = 0;
+  this->FinalResidual = 0.0;
+  this->MeasureResidual = false;
+  this->Residual = 0.0;
+
+  //working buffers are allocated on the first update and kept afterwards
+  this->CPUArena = 0;
+  this->CPUArenaStride = 0;
+  this->CPUArenaNumberOfBuffers = 0;
+  this->MemoryBudget = 0;
+
+  //the previous solution is only used when asked for
+  this->WarmStart = 0;
+  this->WarmStarted = 0;
+  this->PreviousSolutionValid = 0;
+  this->PreviousDimensions[0] = this->PreviousDimensions[1] = this->PreviousDimensions[2] = 0;
+  this->PreviousStructureTime = 0;
+  this->ContinueSolution = 0;
+  this->KeepFullSolution = 0;
+
+  //solve at full resolution only by default
+  this->NumberOfLevels = 1;
+  this->NumberOfIterationsPerLevel = 50;
+  this->PyramidArena = 0;
+  this->PyramidArenaSize = 0;
+
   //set up the input mapping structure
   this->FirstUnusedDataPort = 0;
   this->InputSmoothnessPortMapping.clear();
@@ -102,6 +131,67 @@ vtkDirectedAcyclicGraphMaxFlowSegmentation::~vtkDirectedAcyclicGraphMaxFlowSegme
   this->InputSmoothnessPortMapping.clear();
   this->BackwardsInputSmoothnessPortMapping.clear();
   this->BranchMap.clear();
+  this->ReleaseBuffers();
+}
+
+//----------------------------------------------------------------------------
+vtkIdType vtkDirectedAcyclicGraphMaxFlowSegmentation::GetNumberOfBytesHeld()
+{
+  size_t numberOfFloats = this->PyramidArena ? this->PyramidArenaSize : 0;
+  if (this->CPUArena)
+  {
+    numberOfFloats += this->CPUArenaStride * this->CPUArenaNumberOfBuffers;
+  }
+  return (vtkIdType)(numberOfFloats * sizeof(float));
+}
+
+//----------------------------------------------------------------------------
+void vtkDirectedAcyclicGraphMaxFlowSegmentation::ReleaseBuffers()
+{
+  freeAlignedBuffer(this->CPUArena);
+  this->CPUArena = 0;
+  this->CPUArenaStride = 0;
+  this->CPUArenaNumberOfBuffers = 0;
+  this->PreviousSolutionValid = 0;
+  freeAlignedBuffer(this->PyramidArena);
+  this->PyramidArena = 0;
+  this->PyramidArenaSize = 0;
+}
+
+//----------------------------------------------------------------------------
+void vtkDirectedAcyclicGraphMaxFlowSegmentation::ResetWarmStart()
+{
+  this->PreviousSolutionValid = 0;
+}
+
+//----------------------------------------------------------------------------
+int vtkDirectedAcyclicGraphMaxFlowSegmentation::AcquireBuffers(int NumberOfBuffers)
+{
+  //reuse the buffers from the last update if the layout has not changed
+  size_t stride = alignedBufferStride(VolumeSize);
+  if (this->CPUArena && stride == this->CPUArenaStride && NumberOfBuffers == this->CPUArenaNumberOfBuffers)
+  {
+    return 0;
+  }
+  this->ReleaseBuffers();
+
+  double bytesNeeded = (double) stride * (double) NumberOfBuffers * sizeof(float);
+  if (this->MemoryBudget > 0 && bytesNeeded > (double) this->MemoryBudget)
+  {
+    vtkErrorMacro("CPU buffers require " << bytesNeeded << " bytes, exceeding the memory budget of "
+                  << this->MemoryBudget << " bytes. Cannot run algorithm.");
+    return -1;
+  }
+
+  this->CPUArena = allocateAlignedBuffer(stride * NumberOfBuffers);
+  if (!this->CPUArena)
+  {
+    vtkErrorMacro("Not enough CPU memory. Cannot run algorithm.");
+    return -1;
+  }
+  this->CPUArenaStride = stride;
+  this->CPUArenaNumberOfBuffers = NumberOfBuffers;
+  return 0;
 }
 
 //----------------------------------------------------------------------------
@@ -756,56 +846,32 @@ int vtkDirectedAcyclicGraphMaxFlowSegmentation::RequestData(vtkInformation* requ
     BufferPointerLocs.push_front(&(LeafSourceBuffers[i]));
   }
 
-  //try to obtain required CPU buffers
-  while (numberOfAdditionalCPUBuffersNeeded > 0)
+  //obtain the required CPU buffers, reusing those from the last update if possible
+  //(when warm starting, space to keep the leaf labels is added at the end)
+  if (this->AcquireBuffers(numberOfAdditionalCPUBuffersNeeded + (this->WarmStart ? NumLeaves : 0)))
   {
-    int numBuffersAcquired = (numberOfAdditionalCPUBuffersNeeded < INT_MAX / VolumeSize) ?
-                             numberOfAdditionalCPUBuffersNeeded : INT_MAX / VolumeSize;
-    for (; numBuffersAcquired > 0; numBuffersAcquired--)
-    {
-      try
-      {
-        float* newCPUBuffer = new float[VolumeSize * numBuffersAcquired];
-        if (!newCPUBuffer)
-        {
-          continue;
-        }
-        CPUBuffersAcquired.push_front(newCPUBuffer);
-        CPUBuffersSize.push_front(numBuffersAcquired);
-        numberOfAdditionalCPUBuffersNeeded -= numBuffersAcquired;
-        break;
-      }
-      catch (...) { };
-    }
-    if (numBuffersAcquired == 0)
-    {
-      break;
-    }
-  }
-
-  //if we cannot obtain all required buffers, return an error and exit
-  if (numberOfAdditionalCPUBuffersNeeded > 0)
-  {
-    while (CPUBuffersAcquired.size() > 0)
-    {
-      float* tempBuffer = CPUBuffersAcquired.front();
-      delete[] tempBuffer;
-      CPUBuffersAcquired.pop_front();
-    }
-    vtkErrorMacro("Not enough CPU memory. Cannot run algorithm.");
+    delete[] bufferPointers;
     return -1;
   }
 
   //put buffer pointers into given structures
   std::list<float**>::iterator bufferNameIt = BufferPointerLocs.begin();
-  std::list<float*>::iterator bufferAllocIt = CPUBuffersAcquired.begin();
-  std::list<int>::iterator bufferSizeIt = CPUBuffersSize.begin();
-  for (; bufferAllocIt != CPUBuffersAcquired.end(); bufferAllocIt++, bufferSizeIt++)
+  for (int i = 0; bufferNameIt != BufferPointerLocs.end(); bufferNameIt++, i++)
   {
-    for (int i = 0; i < *bufferSizeIt; i++)
+    *(*bufferNameIt) = this->CPUArena + this->CPUArenaStride * i;
+  }
+
+  //continue from the previous solution if it was found on the same extent and structure
+  float* previousLabels = this->CPUArena + this->CPUArenaStride * numberOfAdditionalCPUBuffersNeeded;
+  this->WarmStarted = this->WarmStart && this->PreviousSolutionValid &&
+                      this->PreviousDimensions[0] == VX && this->PreviousDimensions[1] == VY &&
+                      this->PreviousDimensions[2] == VZ &&
+                      this->PreviousStructureTime == this->Structure->GetMTime();
+  if (this->WarmStarted)
+  {
+    for (int i = 0; i < NumLeaves; i++)
     {
-      *(*bufferNameIt) = (*bufferAllocIt) + VolumeSize * i;
-      bufferNameIt++;
+      copyBuffer(LeafLabelBuffers[i], previousLabels + this->CPUArenaStride * i, VolumeSize);
     }
   }
 
@@ -908,6 +974,14 @@ int vtkDirectedAcyclicGraphMaxFlowSegmentation::RequestData(vtkInformation* requ
   }
   back_iterator->Delete();
 
+  //solve the coarser levels first to get a starting point, unless warm starting already
+  this->ContinueSolution = this->WarmStarted;
+  if (!this->WarmStarted && this->NumberOfLevels > 1)
+  {
+    this->ContinueSolution = this->RunCoarseLevels(BufferPointerLocs, numberOfAdditionalCPUBuffersNeeded);
+  }
+  this->KeepFullSolution = this->WarmStart;
+
   //run algorithm proper
   if (this->Debug)
   {
@@ -920,15 +994,19 @@ int vtkDirectedAcyclicGraphMaxFlowSegmentation::RequestData(vtkInformation* requ
   }
   this->RunAlgorithm();
 
-  //deallocate CPU buffers
-  while (CPUBuffersAcquired.size() > 0)
+  //keep the leaf labels so that the next update can continue from this solution
+  this->PreviousSolutionValid = this->WarmStart;
+  if (this->WarmStart)
   {
-    float* tempBuffer = CPUBuffersAcquired.front();
-    delete[] tempBuffer;
-    CPUBuffersAcquired.pop_front();
+    for (int i = 0; i < NumLeaves; i++)
+    {
+      copyBuffer(previousLabels + this->CPUArenaStride * i, LeafLabelBuffers[i], VolumeSize);
+    }
+    this->PreviousDimensions[0] = VX;
+    this->PreviousDimensions[1] = VY;
+    this->PreviousDimensions[2] = VZ;
+    this->PreviousStructureTime = this->Structure->GetMTime();
   }
-  CPUBuffersAcquired.clear();
-  CPUBuffersSize.clear();
 
   //deallocate structure that holds the pointers to the buffers
   delete[] bufferPointers;
@@ -943,6 +1021,185 @@ int vtkDirectedAcyclicGraphMaxFlowSegmentation::RequestData(vtkInformation* requ
   return 1;
 }
 
+//----------------------------------------------------------------------------
+int vtkDirectedAcyclicGraphMaxFlowSegmentation::RunCoarseLevels(std::list<float**>& BufferPointerLocs, int numberOfBuffers)
+{
+  //find the size of each level, stopping before a dimension gets too small to be useful
+  std::vector<int> levelVX(1, VX), levelVY(1, VY), levelVZ(1, VZ);
+  while ((int) levelVX.size() < this->NumberOfLevels)
+  {
+    int l = (int) levelVX.size() - 1;
+    int cx = downsampledDimension(levelVX[l]);
+    int cy = downsampledDimension(levelVY[l]);
+    int cz = downsampledDimension(levelVZ[l]);
+    if ((levelVX[l] > 1 && cx < 4) || (levelVY[l] > 1 && cy < 4) || (levelVZ[l] > 1 && cz < 4))
+    {
+      break;
+    }
+    levelVX.push_back(cx);
+    levelVY.push_back(cy);
+    levelVZ.push_back(cz);
+  }
+  int numLevels = (int) levelVX.size();
+  if (numLevels < 2)
+  {
+    return 0;
+  }
+
+  //each coarse level holds the solver buffers, data terms, labels and smoothness terms
+  int numSmoothness = 0;
+  for (int i = 0; i < NumLeaves; i++)
+  {
+    numSmoothness += LeafSmoothnessTermBuffers[i] ? 1 : 0;
+  }
+  for (int i = 0; i < NumBranches; i++)
+  {
+    numSmoothness += BranchSmoothnessTermBuffers[i] ? 1 : 0;
+  }
+  int buffersPerLevel = numberOfBuffers + 2 * NumLeaves + numSmoothness;
+  std::vector<size_t> levelStride(numLevels, 0);
+  size_t pyramidSize = 0;
+  for (int l = 1; l < numLevels; l++)
+  {
+    levelStride[l] = alignedBufferStride(levelVX[l] * levelVY[l] * levelVZ[l]);
+    pyramidSize += levelStride[l] * buffersPerLevel;
+  }
+
+  //get the block for the coarse levels, keeping the one from the last update if it fits
+  if (!this->PyramidArena || pyramidSize != this->PyramidArenaSize)
+  {
+    freeAlignedBuffer(this->PyramidArena);
+    this->PyramidArena = 0;
+    this->PyramidArenaSize = 0;
+    double bytesNeeded = (double)(pyramidSize + this->CPUArenaStride * this->CPUArenaNumberOfBuffers) * sizeof(float);
+    if (this->MemoryBudget > 0 && bytesNeeded > (double) this->MemoryBudget)
+    {
+      vtkWarningMacro("Coarse levels do not fit in the memory budget, solving at full resolution only.");
+      return 0;
+    }
+    this->PyramidArena = allocateAlignedBuffer(pyramidSize);
+    if (!this->PyramidArena)
+    {
+      vtkWarningMacro("Not enough CPU memory for the coarse levels, solving at full resolution only.");
+      return 0;
+    }
+    this->PyramidArenaSize = pyramidSize;
+  }
+  std::vector<float*> levelBase(numLevels, (float*) 0);
+  levelBase[1] = this->PyramidArena;
+  for (int l = 2; l < numLevels; l++)
+  {
+    levelBase[l] = levelBase[l - 1] + levelStride[l - 1] * buffersPerLevel;
+  }
+
+  //keep the full resolution problem
+  std::vector<float*> fullDataTerms(LeafDataTermBuffers, LeafDataTermBuffers + NumLeaves);
+  std::vector<float*> fullLabels(LeafLabelBuffers, LeafLabelBuffers + NumLeaves);
+  std::vector<float*> fullLeafSmoothness(LeafSmoothnessTermBuffers, LeafSmoothnessTermBuffers + NumLeaves);
+  std::vector<float*> fullBranchSmoothness(BranchSmoothnessTermBuffers, BranchSmoothnessTermBuffers + NumBranches);
+  int fullNumberOfIterations = this->NumberOfIterations;
+
+  //downsample the data and smoothness terms level by level
+  for (int l = 1; l < numLevels; l++)
+  {
+    float* fine = levelBase[l - 1];
+    float* coarse = levelBase[l];
+    int smoothness = numberOfBuffers + 2 * NumLeaves;
+    for (int i = 0; i < NumLeaves; i++)
+    {
+      downsampleBuffer(coarse + levelStride[l] * (numberOfBuffers + i),
+                       (l == 1) ? fullDataTerms[i] : fine + levelStride[l - 1] * (numberOfBuffers + i),
+                       levelVX[l - 1], levelVY[l - 1], levelVZ[l - 1]);
+    }
+    for (int i = 0; i < NumLeaves + NumBranches; i++)
+    {
+      float* fullSmoothness = (i < NumLeaves) ? fullLeafSmoothness[i] : fullBranchSmoothness[i - NumLeaves];
+      if (fullSmoothness)
+      {
+        downsampleBuffer(coarse + levelStride[l] * smoothness,
+                         (l == 1) ? fullSmoothness : fine + levelStride[l - 1] * smoothness,
+                         levelVX[l - 1], levelVY[l - 1], levelVZ[l - 1]);
+        smoothness++;
+      }
+    }
+  }
+
+  //solve from the coarsest level up, starting each level from the one below it
+  this->KeepFullSolution = 1;
+  this->NumberOfIterations = this->NumberOfIterationsPerLevel;
+  for (int l = numLevels - 1; l >= 0; l--)
+  {
+    VX = levelVX[l];
+    VY = levelVY[l];
+    VZ = levelVZ[l];
+    VolumeSize = VX * VY * VZ;
+    float* base = (l == 0) ? this->CPUArena : levelBase[l];
+    size_t stride = (l == 0) ? this->CPUArenaStride : levelStride[l];
+    std::list<float**>::iterator bufferNameIt = BufferPointerLocs.begin();
+    for (int i = 0; bufferNameIt != BufferPointerLocs.end(); bufferNameIt++, i++)
+    {
+      *(*bufferNameIt) = base + stride * i;
+    }
+    int smoothness = numberOfBuffers + 2 * NumLeaves;
+    for (int i = 0; i < NumLeaves; i++)
+    {
+      LeafDataTermBuffers[i] = (l == 0) ? fullDataTerms[i] : base + stride * (numberOfBuffers + i);
+      LeafLabelBuffers[i] = (l == 0) ? fullLabels[i] : base + stride * (numberOfBuffers + NumLeaves + i);
+      LeafSmoothnessTermBuffers[i] = (l == 0 || !fullLeafSmoothness[i]) ? fullLeafSmoothness[i] : base + stride * (smoothness++);
+    }
+    for (int i = 0; i < NumBranches; i++)
+    {
+      BranchSmoothnessTermBuffers[i] = (l == 0 || !fullBranchSmoothness[i]) ? fullBranchSmoothness[i] : base + stride * (smoothness++);
+    }
+
+    //prolong the solution of the level below, the full resolution level is run by the caller
+    if (l < numLevels - 1)
+    {
+      this->ProlongSolution(BufferPointerLocs, levelBase[l + 1], levelStride[l + 1], numberOfBuffers);
+    }
+    if (l == 0)
+    {
+      break;
+    }
+    if (this->Debug)
+    {
+      vtkDebugMacro("Solving level " << l << " (" << VX << "x" << VY << "x" << VZ << ").");
+    }
+    this->ContinueSolution = (l < numLevels - 1);
+    this->InitializeAlgorithm();
+    this->RunAlgorithm();
+  }
+  this->NumberOfIterations = fullNumberOfIterations;
+
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+void vtkDirectedAcyclicGraphMaxFlowSegmentation::ProlongSolution(std::list<float**>& BufferPointerLocs, float* coarseBase, size_t coarseStride, int numberOfBuffers)
+{
+  std::list<float**>::iterator bufferNameIt = BufferPointerLocs.begin();
+  for (int i = 0; bufferNameIt != BufferPointerLocs.end(); bufferNameIt++, i++)
+  {
+    prolongBuffer(*(*bufferNameIt), coarseBase + coarseStride * i, VX, VY, VZ);
+  }
+  for (int i = 0; i < NumLeaves; i++)
+  {
+    prolongBuffer(LeafLabelBuffers[i], coarseBase + coarseStride * (numberOfBuffers + NumLeaves + i), VX, VY, VZ);
+  }
+
+  //the divergences have to match the prolonged flows
+  for (int i = 0; i < NumBranches; i++)
+  {
+    dagmf_computeDivergence(BranchDivBuffers[i], BranchFlowXBuffers[i], BranchFlowYBuffers[i], BranchFlowZBuffers[i],
+                            VX, VY, VZ, VolumeSize);
+  }
+  for (int i = 0; i < NumLeaves; i++)
+  {
+    dagmf_computeDivergence(LeafDivBuffers[i], LeafFlowXBuffers[i], LeafFlowYBuffers[i], LeafFlowZBuffers[i],
+                            VX, VY, VZ, VolumeSize);
+  }
+}
+
 //----------------------------------------------------------------------------
 int vtkDirectedAcyclicGraphMaxFlowSegmentation::RequestDataObject(vtkInformation* vtkNotUsed(request), vtkInformationVector** inputVector, vtkInformationVector* outputVector)
 {
@@ -970,6 +1227,12 @@ int vtkDirectedAcyclicGraphMaxFlowSegmentation::RequestDataObject(vtkInformation
 //----------------------------------------------------------------------------
 int vtkDirectedAcyclicGraphMaxFlowSegmentation::InitializeAlgorithm()
 {
+  //a warm start or a coarser level has already filled in the flows and labels
+  if (this->ContinueSolution)
+  {
+    return 1;
+  }
+
   //initialize all spatial flows and divergences to zero
   for (int i = 0; i < NumBranches; i++)
   {
@@ -1036,15 +1299,37 @@ int vtkDirectedAcyclicGraphMaxFlowSegmentation::InitializeAlgorithm()
 //----------------------------------------------------------------------------
 int vtkDirectedAcyclicGraphMaxFlowSegmentation::RunAlgorithm()
 {
+  this->NumberOfIterationsUsed = 0;
+  this->FinalResidual = 0.0;
+
   //Solve maximum flow problem in an iterative bottom-up manner
   for (int iteration = 0; iteration < this->NumberOfIterations; iteration++)
   {
+    //measure the label change on check iterations and on the last one
+    this->MeasureResidual = (iteration + 1 == this->NumberOfIterations) ||
+                            (this->ConvergenceTolerance > 0.0 && (iteration + 1) % this->ConvergenceCheckInterval == 0);
+    this->Residual = 0.0;
     SolveMaxFlow();
+    this->NumberOfIterationsUsed = iteration + 1;
     if (this->Debug)
     {
       vtkDebugMacro("Finished iteration " << (iteration + 1) << ".");
     }
+
+    if (this->MeasureResidual)
+    {
+      this->FinalResidual = this->Residual / ((double) this->VolumeSize * (this->NumLeaves + this->NumBranches));
+      if (this->Debug)
+      {
+        vtkDebugMacro("Mean label change " << this->FinalResidual << ".");
+      }
+      if (this->FinalResidual < this->ConvergenceTolerance)
+      {
+        break;
+      }
+    }
   }
+  this->MeasureResidual = false;
   return 1;
 }
 
@@ -1267,8 +1552,16 @@ void vtkDirectedAcyclicGraphMaxFlowSegmentation::SolveMaxFlow()
         }
       }
 
-      updateLabel(LeafSinkBuffers[LeafMap[currNode]], LeafSourceBuffers[LeafMap[currNode]],
-                  LeafDivBuffers[LeafMap[currNode]], LeafLabelBuffers[LeafMap[currNode]], CC, VolumeSize);
+      if (this->MeasureResidual)
+      {
+        this->Residual += updateLabelWithResidual(LeafSinkBuffers[LeafMap[currNode]], LeafSourceBuffers[LeafMap[currNode]],
+                                                  LeafDivBuffers[LeafMap[currNode]], LeafLabelBuffers[LeafMap[currNode]], CC, VolumeSize);
+      }
+      else
+      {
+        updateLabel(LeafSinkBuffers[LeafMap[currNode]], LeafSourceBuffers[LeafMap[currNode]],
+                    LeafDivBuffers[LeafMap[currNode]], LeafLabelBuffers[LeafMap[currNode]], CC, VolumeSize);
+      }
 
     }
     else if (currNode != this->Structure->GetRoot())
@@ -1298,8 +1591,16 @@ void vtkDirectedAcyclicGraphMaxFlowSegmentation::SolveMaxFlow()
         }
       }
 
-      updateLabel(BranchSinkBuffers[BranchMap[currNode]], BranchSourceBuffers[BranchMap[currNode]],
-                  BranchDivBuffers[BranchMap[currNode]], BranchLabelBuffers[BranchMap[currNode]], CC, VolumeSize);
+      if (this->MeasureResidual)
+      {
+        this->Residual += updateLabelWithResidual(BranchSinkBuffers[BranchMap[currNode]], BranchSourceBuffers[BranchMap[currNode]],
+                                                  BranchDivBuffers[BranchMap[currNode]], BranchLabelBuffers[BranchMap[currNode]], CC, VolumeSize);
+      }
+      else
+      {
+        updateLabel(BranchSinkBuffers[BranchMap[currNode]], BranchSourceBuffers[BranchMap[currNode]],
+                    BranchDivBuffers[BranchMap[currNode]], BranchLabelBuffers[BranchMap[currNode]], CC, VolumeSize);
+      }
 
     }
     else
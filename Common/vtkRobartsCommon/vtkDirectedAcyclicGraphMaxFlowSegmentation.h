@@ -72,6 +72,21 @@ public:
   vtkSetClampMacro(NumberOfIterations, int, 0, INT_MAX);
   vtkGetMacro(NumberOfIterations, int);
 
+  // Description:
+  // Get and Set the convergence tolerance. If positive, the mean absolute change in the
+  // labels is measured every ConvergenceCheckInterval iterations and the solver stops as
+  // soon as it falls below this value. The default of 0 always runs NumberOfIterations.
+  vtkSetClampMacro(ConvergenceTolerance, double, 0.0, DBL_MAX);
+  vtkGetMacro(ConvergenceTolerance, double);
+  vtkSetClampMacro(ConvergenceCheckInterval, int, 1, INT_MAX);
+  vtkGetMacro(ConvergenceCheckInterval, int);
+
+  // Description:
+  // Get the number of iterations run by the last update of the CPU solver and the mean
+  // absolute label change measured in its final iteration.
+  vtkGetMacro(NumberOfIterationsUsed, int);
+  vtkGetMacro(FinalResidual, double);
+
   // Description:
   // Get and Set the labeling constant, CC, of the algorithm. The default value is 0.25
   // and is unlikely to require modification.
@@ -84,6 +99,44 @@ public:
   vtkSetClampMacro(StepSize, float, 0.0f, 1.0f);
   vtkGetMacro(StepSize, float);
 
+  // Description:
+  // Get and Set the maximum number of bytes the CPU solver may hold for its working
+  // buffers. A value of 0 (the default) places no limit. The buffers are kept between
+  // updates and reused as long as the extent and the structure do not change.
+  vtkSetClampMacro(MemoryBudget, vtkIdType, 0, VTK_ID_MAX);
+  vtkGetMacro(MemoryBudget, vtkIdType);
+
+  // Description:
+  // Get the number of bytes currently held for the CPU working buffers, or release them.
+  vtkIdType GetNumberOfBytesHeld();
+  void ReleaseBuffers();
+
+  // Description:
+  // Get and Set whether the solver is warm-started. If on, the flows, divergences and labels
+  // of the last solve are kept and used as the starting point of the next one, as long as the
+  // extent and the structure are unchanged. This is meant for re-solving after edits to the
+  // data terms or smoothness, which then converge in far fewer iterations.
+  vtkSetClampMacro(WarmStart, int, 0, 1);
+  vtkGetMacro(WarmStart, int);
+  vtkBooleanMacro(WarmStart, int);
+
+  // Description:
+  // Get whether the last update started from the previous solution, or discard that
+  // solution so that the next update starts from scratch.
+  vtkGetMacro(WarmStarted, int);
+  void ResetWarmStart();
+
+  // Description:
+  // Get and Set the number of resolution levels. With more than one level, the data and
+  // smoothness terms are downsampled by two per level, the coarsest level is solved first
+  // and its flows and labels are prolonged to start the next finer one. Coarse levels run
+  // NumberOfIterationsPerLevel iterations, the full resolution NumberOfIterations. The
+  // default of 1 solves at full resolution only.
+  vtkSetClampMacro(NumberOfLevels, int, 1, 16);
+  vtkGetMacro(NumberOfLevels, int);
+  vtkSetClampMacro(NumberOfIterationsPerLevel, int, 0, INT_MAX);
+  vtkGetMacro(NumberOfIterationsPerLevel, int);
+
   // Description:
   // Get and Set the data cost for the objects. The algorithm only uses those which
   // correspond to leaf nodes due to the data term pushdown theorem. These must be
@@ -147,6 +200,12 @@ protected:
   int                             NumEdges;
 
   int                             NumberOfIterations;
+  double                          ConvergenceTolerance;
+  int                             ConvergenceCheckInterval;
+  int                             NumberOfIterationsUsed;
+  double                          FinalResidual;
+  bool                            MeasureResidual;
+  double                          Residual;
   float                           CC;
   float                           StepSize;
   int                             VolumeSize;
@@ -157,9 +216,34 @@ protected:
   std::map<int, vtkIdType>        BackwardsInputSmoothnessPortMapping;
   int                             FirstUnusedSmoothnessPort;
 
+  //persistent, cache-line aligned block holding all CPU working buffers
+  int                             AcquireBuffers(int NumberOfBuffers);
+  float*                          CPUArena;
+  size_t                          CPUArenaStride;
+  int                             CPUArenaNumberOfBuffers;
+  vtkIdType                       MemoryBudget;
+
+  //previous solution kept for warm starting, leaf labels are stored at the end of the arena
+  int                             WarmStart;
+  int                             WarmStarted;
+  int                             PreviousSolutionValid;
+  int                             PreviousDimensions[3];
+  vtkMTimeType                    PreviousStructureTime;
+
+  //set if InitializeAlgorithm should keep the solution already in the buffers, and if
+  //RunAlgorithm has to leave the complete solution (not only the leaf labels) in CPU memory
+  int                             ContinueSolution;
+  int                             KeepFullSolution;
+
+  //coarse-to-fine solver, the coarse levels are kept in a second persistent block
+  int                             RunCoarseLevels(std::list<float**>& BufferPointerLocs, int numberOfBuffers);
+  void                            ProlongSolution(std::list<float**>& BufferPointerLocs, float* coarseBase, size_t coarseStride, int numberOfBuffers);
+  int                             NumberOfLevels;
+  int                             NumberOfIterationsPerLevel;
+  float*                          PyramidArena;
+  size_t                          PyramidArenaSize;
+
   //pointers to variable structures, easier to keep as part of the class definition
-  std::list<float*>               CPUBuffersAcquired;
-  std::list<int>                  CPUBuffersSize;
   int                             TotalNumberOfBuffers;
   float**                         BranchFlowXBuffers;
   float**                         BranchFlowYBuffers;
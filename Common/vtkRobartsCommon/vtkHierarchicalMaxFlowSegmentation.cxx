@@ -29,6 +29,9 @@
 #include "vtkInformation.h"
 #include "vtkInformationVector.h"
 #include "vtkMaxFlowSegmentationUtilities.h"
+#include "vtkMultiThreader.h"
+#include "vtkMutexLock.h"
+#include "vtkConditionVariable.h"
 #include "vtkObjectFactory.h"
 #include "vtkSmartPointer.h"
 #include "vtkStreamingDemandDrivenPipeline.h"
@@ -43,6 +46,8 @@
 #include <limits.h>
 #include <set>
 #include <list>
+#include <utility>
+#include <vector>
 
 #define SQR(X) X*X
 
@@ -59,6 +64,51 @@ vtkHierarchicalMaxFlowSegmentation::vtkHierarchicalMaxFlowSegmentation()
   this->StepSize = 0.1;
   this->CC = 0.25;
 
+  //convergence is not checked by default
+  this->ConvergenceTolerance = 0.0;
+  this->ConvergenceCheckInterval = 10;
+  this->NumberOfIterationsUsed = 0;
+  this->FinalResidual = 0.0;
+  this->MeasureResidual = false;
+  this->Residual = 0.0;
+
+  //set up the threader for the CPU solver
+  this->Threader = vtkMultiThreader::New();
+  this->NumberOfThreads = this->Threader->GetNumberOfThreads();
+
+  //working buffers are allocated on the first update and kept afterwards
+  this->CPUArena = 0;
+  this->CPUArenaStride = 0;
+  this->CPUArenaNumberOfBuffers = 0;
+  this->MemoryBudget = 0;
+
+  //the previous solution is only used when asked for
+  this->WarmStart = 0;
+  this->WarmStarted = 0;
+  this->PreviousSolutionValid = 0;
+  this->PreviousDimensions[0] = this->PreviousDimensions[1] = this->PreviousDimensions[2] = 0;
+  this->PreviousStructureTime = 0;
+  this->ContinueSolution = 0;
+  this->KeepFullSolution = 0;
+
+  //solve at full resolution only by default
+  this->NumberOfLevels = 1;
+  this->NumberOfIterationsPerLevel = 50;
+  this->PyramidArena = 0;
+  this->PyramidArenaSize = 0;
+
+  //flows are stored as floats by default
+  this->FlowStorage = VTK_MAXFLOW_STORAGE_FLOAT;
+  this->CompactBuffers = 0;
+
+  //buffers are kept in memory by default
+  this->OutOfCore = 0;
+  this->CPUArenaMapped = 0;
+  this->ScratchDirectory = 0;
+  this->SlabThickness = 8;
+  this->BytesReadPerIteration = 0.0;
+  this->BytesWrittenPerIteration = 0.0;
+
   //set up the input mapping structure
   this->FirstUnusedDataPort = 0;
   this->InputSmoothnessPortMapping.clear();
@@ -83,6 +133,144 @@ vtkHierarchicalMaxFlowSegmentation::~vtkHierarchicalMaxFlowSegmentation()
   this->InputSmoothnessPortMapping.clear();
   this->BackwardsInputSmoothnessPortMapping.clear();
   this->BranchMap.clear();
+  this->Threader->Delete();
+  this->ReleaseBuffers();
+  this->SetScratchDirectory(0);
+}
+
+//----------------------------------------------------------------------------
+vtkIdType vtkHierarchicalMaxFlowSegmentation::GetNumberOfBytesHeld()
+{
+  size_t NumberOfFloats = this->PyramidArena ? this->PyramidArenaSize : 0;
+  if( this->CPUArena )
+  {
+    NumberOfFloats += this->CPUArenaStride * this->CPUArenaNumberOfBuffers;
+  }
+  return (vtkIdType) (NumberOfFloats * sizeof(float));
+}
+
+//----------------------------------------------------------------------------
+void vtkHierarchicalMaxFlowSegmentation::ReleaseBuffers()
+{
+  if( this->CPUArenaMapped )
+  {
+    freeMappedBuffer(this->CPUArena);
+  }
+  else
+  {
+    freeAlignedBuffer(this->CPUArena);
+  }
+  this->CPUArena = 0;
+  this->CPUArenaMapped = 0;
+  this->CompactBuffers = 0;
+  this->CPUArenaStride = 0;
+  this->CPUArenaNumberOfBuffers = 0;
+  this->PreviousSolutionValid = 0;
+  freeAlignedBuffer(this->PyramidArena);
+  this->PyramidArena = 0;
+  this->PyramidArenaSize = 0;
+}
+
+//----------------------------------------------------------------------------
+void vtkHierarchicalMaxFlowSegmentation::ResetWarmStart()
+{
+  this->PreviousSolutionValid = 0;
+}
+
+//----------------------------------------------------------------------------
+int vtkHierarchicalMaxFlowSegmentation::SupportsCompactFlowStorage()
+{
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+unsigned short* vtkHierarchicalMaxFlowSegmentation::GetCompactBuffer( bool leaf, int index, int component )
+{
+  //each 16-bit buffer takes half of an arena buffer
+  size_t position = 4 * (size_t) ((leaf ? NumBranches : 0) + index) + component;
+  return this->CompactBuffers + this->CPUArenaStride * position;
+}
+
+//----------------------------------------------------------------------------
+void vtkHierarchicalMaxFlowSegmentation::RelateParentSinkBuffers()
+{
+  vtkTreeDFSIterator* iterator = vtkTreeDFSIterator::New();
+  iterator->SetTree(this->Structure);
+  iterator->Next();
+  while( iterator->HasNext() )
+  {
+    vtkIdType node = iterator->Next();
+    vtkIdType parent = this->Structure->GetParent(node);
+    if( this->Structure->IsLeaf(node) )
+    {
+      if( parent == this->Structure->GetRoot() )
+      {
+        leafIncBuffers[this->LeafMap[node]] = sourceFlowBuffer;
+      }
+      else
+      {
+        leafIncBuffers[this->LeafMap[node]] = branchSinkBuffers[this->BranchMap[parent]];
+      }
+    }
+    else
+    {
+      if( parent == this->Structure->GetRoot() )
+      {
+        branchIncBuffers[this->BranchMap[node]] = sourceFlowBuffer;
+      }
+      else
+      {
+        branchIncBuffers[this->BranchMap[node]] = branchSinkBuffers[this->BranchMap[parent]];
+      }
+    }
+  }
+  iterator->Delete();
+}
+
+//----------------------------------------------------------------------------
+int vtkHierarchicalMaxFlowSegmentation::AcquireBuffers( int NumberOfBuffers )
+{
+  //reuse the buffers from the last update if the layout has not changed
+  size_t Stride = alignedBufferStride(VolumeSize);
+  if( this->CPUArena && Stride == this->CPUArenaStride && NumberOfBuffers == this->CPUArenaNumberOfBuffers &&
+      this->CPUArenaMapped == this->OutOfCore )
+  {
+    return 0;
+  }
+  this->ReleaseBuffers();
+
+  //out-of-core buffers live in a scratch file rather than memory
+  if( this->OutOfCore )
+  {
+    this->CPUArena = allocateMappedBuffer(Stride * NumberOfBuffers, this->ScratchDirectory);
+    if( !this->CPUArena )
+    {
+      vtkErrorMacro("Could not map a scratch file for the CPU buffers. Cannot run algorithm.");
+      return -1;
+    }
+    this->CPUArenaMapped = 1;
+    this->CPUArenaStride = Stride;
+    this->CPUArenaNumberOfBuffers = NumberOfBuffers;
+    return 0;
+  }
+
+  double BytesNeeded = (double) Stride * (double) NumberOfBuffers * sizeof(float);
+  if( this->MemoryBudget > 0 && BytesNeeded > (double) this->MemoryBudget )
+  {
+    vtkErrorMacro("CPU buffers require " << BytesNeeded << " bytes, exceeding the memory budget of "
+                  << this->MemoryBudget << " bytes. Cannot run algorithm.");
+    return -1;
+  }
+
+  this->CPUArena = allocateAlignedBuffer(Stride * NumberOfBuffers);
+  if( !this->CPUArena )
+  {
+    vtkErrorMacro("Not enough CPU memory. Cannot run algorithm.");
+    return -1;
+  }
+  this->CPUArenaStride = Stride;
+  this->CPUArenaNumberOfBuffers = NumberOfBuffers;
+  return 0;
 }
 
 //----------------------------------------------------------------------------
@@ -631,13 +819,21 @@ int vtkHierarchicalMaxFlowSegmentation::RequestData(vtkInformation *request,
   //        1 divergence buffer
   //        1 sink flow buffer
   //        1 working temp buffer (ie: guk)
-  NumberOfAdditionalCPUBuffersNeeded += 7 * NumBranches;
+  //(with 16-bit storage the spatial flow and divergence buffers are packed separately, two
+  //to an arena buffer, after the float ones)
+  int Compact = (this->FlowStorage != VTK_MAXFLOW_STORAGE_FLOAT && this->SupportsCompactFlowStorage());
+  int NumberOfCompactCPUBuffersNeeded = Compact ? 2 * (NumBranches + NumLeaves) : 0;
+  NumberOfAdditionalCPUBuffersNeeded += (Compact ? 3 : 7) * NumBranches;
   TotalNumberOfBuffers += 7*NumBranches;
-  NumberOfAdditionalCPUBuffersNeeded += 5 * NumLeaves;
+  NumberOfAdditionalCPUBuffersNeeded += (Compact ? 1 : 5) * NumLeaves;
   TotalNumberOfBuffers += 5 * NumLeaves;
 
   //allocate those buffer pointers and put on list
   float** bufferPointers = new float* [7 * NumBranches + 5 * NumLeaves];
+  for(int i = 0; i < 7 * NumBranches + 5 * NumLeaves; i++ )
+  {
+    bufferPointers[i] = 0;
+  }
   float** tempPtr = bufferPointers;
   this->branchFlowXBuffers =    tempPtr;
   tempPtr += NumBranches;
@@ -653,20 +849,11 @@ int vtkHierarchicalMaxFlowSegmentation::RequestData(vtkInformation *request,
   tempPtr += NumBranches;
   this->branchWorkingBuffers =  tempPtr;
   tempPtr += NumBranches;
-  for(int i = 0; i < NumBranches; i++ )
+  for(int i = 0; i < NumBranches && !Compact; i++ )
   {
     BufferPointerLocs.push_front(&(branchFlowXBuffers[i]));
-  }
-  for(int i = 0; i < NumBranches; i++ )
-  {
     BufferPointerLocs.push_front(&(branchFlowYBuffers[i]));
-  }
-  for(int i = 0; i < NumBranches; i++ )
-  {
     BufferPointerLocs.push_front(&(branchFlowZBuffers[i]));
-  }
-  for(int i = 0; i < NumBranches; i++ )
-  {
     BufferPointerLocs.push_front(&(branchDivBuffers[i]));
   }
   for(int i = 0; i < NumBranches; i++ )
@@ -691,20 +878,11 @@ int vtkHierarchicalMaxFlowSegmentation::RequestData(vtkInformation *request,
   tempPtr += NumLeaves;
   this->leafSinkBuffers =      tempPtr;
   tempPtr += NumLeaves;
-  for(int i = 0; i < NumLeaves; i++ )
+  for(int i = 0; i < NumLeaves && !Compact; i++ )
   {
     BufferPointerLocs.push_front(&(leafFlowXBuffers[i]));
-  }
-  for(int i = 0; i < NumLeaves; i++ )
-  {
     BufferPointerLocs.push_front(&(leafFlowYBuffers[i]));
-  }
-  for(int i = 0; i < NumLeaves; i++ )
-  {
     BufferPointerLocs.push_front(&(leafFlowZBuffers[i]));
-  }
-  for(int i = 0; i < NumLeaves; i++ )
-  {
     BufferPointerLocs.push_front(&(leafDivBuffers[i]));
   }
   for(int i = 0; i < NumLeaves; i++ )
@@ -712,56 +890,34 @@ int vtkHierarchicalMaxFlowSegmentation::RequestData(vtkInformation *request,
     BufferPointerLocs.push_front(&(leafSinkBuffers[i]));
   }
 
-  //try to obtain required CPU buffers
-  while( NumberOfAdditionalCPUBuffersNeeded > 0 )
+  //obtain the required CPU buffers, reusing those from the last update if possible
+  //(when warm starting, space to keep the leaf labels is added at the end)
+  if( this->AcquireBuffers(NumberOfAdditionalCPUBuffersNeeded + NumberOfCompactCPUBuffersNeeded + (this->WarmStart ? NumLeaves : 0)) )
   {
-    int NumBuffersAcquired = (NumberOfAdditionalCPUBuffersNeeded < INT_MAX / VolumeSize) ?
-                             NumberOfAdditionalCPUBuffersNeeded : INT_MAX / VolumeSize;
-    for( ; NumBuffersAcquired > 0; NumBuffersAcquired--)
-    {
-      try
-      {
-        float* NewCPUBuffer = new float[VolumeSize*NumBuffersAcquired];
-        if( !NewCPUBuffer )
-        {
-          continue;
-        }
-        CPUBuffersAcquired.push_front( NewCPUBuffer );
-        CPUBuffersSize.push_front( NumBuffersAcquired );
-        NumberOfAdditionalCPUBuffersNeeded -= NumBuffersAcquired;
-        break;
-      }
-      catch( ... ) { };
-    }
-    if( NumBuffersAcquired == 0 )
-    {
-      break;
-    }
-  }
-
-  //if we cannot obtain all required buffers, return an error and exit
-  if( NumberOfAdditionalCPUBuffersNeeded > 0 )
-  {
-    while( CPUBuffersAcquired.size() > 0 )
-    {
-      float* tempBuffer = CPUBuffersAcquired.front();
-      delete[] tempBuffer;
-      CPUBuffersAcquired.pop_front();
-    }
-    vtkErrorMacro("Not enough CPU memory. Cannot run algorithm.");
+    delete[] bufferPointers;
     return -1;
   }
 
   //put buffer pointers into given structures
   std::list<float**>::iterator bufferNameIt = BufferPointerLocs.begin();
-  std::list<float*>::iterator bufferAllocIt = CPUBuffersAcquired.begin();
-  std::list<int>::iterator bufferSizeIt = CPUBuffersSize.begin();
-  for( ; bufferAllocIt != CPUBuffersAcquired.end(); bufferAllocIt++, bufferSizeIt++ )
+  for( int i = 0; bufferNameIt != BufferPointerLocs.end(); bufferNameIt++, i++ )
+  {
+    *(*bufferNameIt) = this->CPUArena + this->CPUArenaStride*i;
+  }
+
+  this->CompactBuffers = Compact ? (unsigned short*) (this->CPUArena + this->CPUArenaStride*NumberOfAdditionalCPUBuffersNeeded) : 0;
+
+  //continue from the previous solution if it was found on the same extent and hierarchy
+  float* PreviousLabels = this->CPUArena + this->CPUArenaStride*(NumberOfAdditionalCPUBuffersNeeded + NumberOfCompactCPUBuffersNeeded);
+  this->WarmStarted = this->WarmStart && this->PreviousSolutionValid &&
+                      this->PreviousDimensions[0] == VX && this->PreviousDimensions[1] == VY &&
+                      this->PreviousDimensions[2] == VZ &&
+                      this->PreviousStructureTime == this->Structure->GetMTime();
+  if( this->WarmStarted )
   {
-    for( int i = 0; i < *bufferSizeIt; i++ )
+    for(int i = 0; i < NumLeaves; i++ )
     {
-      *(*bufferNameIt) = (*bufferAllocIt) + VolumeSize*i;
-      bufferNameIt++;
+      copyBuffer(leafLabelBuffers[i], PreviousLabels + this->CPUArenaStride*i, VolumeSize);
     }
   }
 
@@ -774,59 +930,47 @@ int vtkHierarchicalMaxFlowSegmentation::RequestData(vtkInformation *request,
   //create pointers to parent outflow
   leafIncBuffers = new float* [NumLeaves];
   branchIncBuffers = new float* [NumBranches];
-  iterator = vtkTreeDFSIterator::New();
-  iterator->SetTree(this->Structure);
-  iterator->Next();
-  while( iterator->HasNext() )
+  this->RelateParentSinkBuffers();
+
+  //solve the coarser levels first to get a starting point, unless warm starting already
+  this->ContinueSolution = this->WarmStarted;
+  if( !this->WarmStarted && this->NumberOfLevels > 1 && !this->CompactBuffers )
   {
-    vtkIdType node = iterator->Next();
-    vtkIdType parent = this->Structure->GetParent(node);
-    if( this->Structure->IsLeaf(node) )
-    {
-      if( parent == this->Structure->GetRoot() )
-      {
-        leafIncBuffers[this->LeafMap[node]] = sourceFlowBuffer;
-      }
-      else
-      {
-        leafIncBuffers[this->LeafMap[node]] = branchSinkBuffers[this->BranchMap[parent]];
-      }
-    }
-    else
-    {
-      if( parent == this->Structure->GetRoot() )
-      {
-        branchIncBuffers[this->BranchMap[node]] = sourceFlowBuffer;
-      }
-      else
-      {
-        branchIncBuffers[this->BranchMap[node]] = branchSinkBuffers[this->BranchMap[parent]];
-      }
-    }
+    this->ContinueSolution = this->RunCoarseLevels(BufferPointerLocs, NumberOfAdditionalCPUBuffersNeeded);
   }
-  iterator->Delete();
+  this->KeepFullSolution = this->WarmStart;
 
   //run algorithm proper
   if( this->Debug )
   {
     vtkDebugMacro("Starting initialization");
   }
-  this->InitializeAlgorithm();
+  if( this->InitializeAlgorithm() < 0 )
+  {
+    vtkErrorMacro("Could not initialize the max-flow algorithm.");
+    this->PreviousSolutionValid = false;
+    delete[] bufferPointers;
+    return -1;
+  }
   if( this->Debug )
   {
     vtkDebugMacro("Starting max-flow algorithm.");
   }
   this->RunAlgorithm();
 
-  //deallocate CPU buffers
-  while( CPUBuffersAcquired.size() > 0 )
+  //keep the leaf labels so that the next update can continue from this solution
+  this->PreviousSolutionValid = this->WarmStart;
+  if( this->WarmStart )
   {
-    float* tempBuffer = CPUBuffersAcquired.front();
-    delete[] tempBuffer;
-    CPUBuffersAcquired.pop_front();
+    for(int i = 0; i < NumLeaves; i++ )
+    {
+      copyBuffer(PreviousLabels + this->CPUArenaStride*i, leafLabelBuffers[i], VolumeSize);
+    }
+    this->PreviousDimensions[0] = VX;
+    this->PreviousDimensions[1] = VY;
+    this->PreviousDimensions[2] = VZ;
+    this->PreviousStructureTime = this->Structure->GetMTime();
   }
-  CPUBuffersAcquired.clear();
-  CPUBuffersSize.clear();
 
   //deallocate structure that holds the pointers to the buffers
   delete[] bufferPointers;
@@ -834,6 +978,186 @@ int vtkHierarchicalMaxFlowSegmentation::RequestData(vtkInformation *request,
   return 1;
 }
 
+//----------------------------------------------------------------------------
+int vtkHierarchicalMaxFlowSegmentation::RunCoarseLevels( std::list<float**>& BufferPointerLocs, int NumberOfBuffers )
+{
+  //find the size of each level, stopping before a dimension gets too small to be useful
+  std::vector<int> LevelVX(1,VX), LevelVY(1,VY), LevelVZ(1,VZ);
+  while( (int) LevelVX.size() < this->NumberOfLevels )
+  {
+    int l = (int) LevelVX.size() - 1;
+    int CX = downsampledDimension(LevelVX[l]);
+    int CY = downsampledDimension(LevelVY[l]);
+    int CZ = downsampledDimension(LevelVZ[l]);
+    if( (LevelVX[l] > 1 && CX < 4) || (LevelVY[l] > 1 && CY < 4) || (LevelVZ[l] > 1 && CZ < 4) )
+    {
+      break;
+    }
+    LevelVX.push_back(CX);
+    LevelVY.push_back(CY);
+    LevelVZ.push_back(CZ);
+  }
+  int NumLevels = (int) LevelVX.size();
+  if( NumLevels < 2 )
+  {
+    return 0;
+  }
+
+  //each coarse level holds the solver buffers, data terms, labels and smoothness terms
+  int NumSmoothness = 0;
+  for(int i = 0; i < NumLeaves; i++ )
+  {
+    NumSmoothness += leafSmoothnessTermBuffers[i] ? 1 : 0;
+  }
+  for(int i = 0; i < NumBranches; i++ )
+  {
+    NumSmoothness += branchSmoothnessTermBuffers[i] ? 1 : 0;
+  }
+  int BuffersPerLevel = NumberOfBuffers + 2*NumLeaves + NumSmoothness;
+  std::vector<size_t> LevelStride(NumLevels,0);
+  size_t PyramidSize = 0;
+  for(int l = 1; l < NumLevels; l++ )
+  {
+    LevelStride[l] = alignedBufferStride(LevelVX[l]*LevelVY[l]*LevelVZ[l]);
+    PyramidSize += LevelStride[l] * BuffersPerLevel;
+  }
+
+  //get the block for the coarse levels, keeping the one from the last update if it fits
+  if( !this->PyramidArena || PyramidSize != this->PyramidArenaSize )
+  {
+    freeAlignedBuffer(this->PyramidArena);
+    this->PyramidArena = 0;
+    this->PyramidArenaSize = 0;
+    double BytesNeeded = (double) (PyramidSize + this->CPUArenaStride*this->CPUArenaNumberOfBuffers) * sizeof(float);
+    if( this->MemoryBudget > 0 && BytesNeeded > (double) this->MemoryBudget )
+    {
+      vtkWarningMacro("Coarse levels do not fit in the memory budget, solving at full resolution only.");
+      return 0;
+    }
+    this->PyramidArena = allocateAlignedBuffer(PyramidSize);
+    if( !this->PyramidArena )
+    {
+      vtkWarningMacro("Not enough CPU memory for the coarse levels, solving at full resolution only.");
+      return 0;
+    }
+    this->PyramidArenaSize = PyramidSize;
+  }
+  std::vector<float*> LevelBase(NumLevels,(float*)0);
+  LevelBase[1] = this->PyramidArena;
+  for(int l = 2; l < NumLevels; l++ )
+  {
+    LevelBase[l] = LevelBase[l-1] + LevelStride[l-1] * BuffersPerLevel;
+  }
+
+  //keep the full resolution problem
+  std::vector<float*> FullDataTerms(leafDataTermBuffers, leafDataTermBuffers + NumLeaves);
+  std::vector<float*> FullLabels(leafLabelBuffers, leafLabelBuffers + NumLeaves);
+  std::vector<float*> FullLeafSmoothness(leafSmoothnessTermBuffers, leafSmoothnessTermBuffers + NumLeaves);
+  std::vector<float*> FullBranchSmoothness(branchSmoothnessTermBuffers, branchSmoothnessTermBuffers + NumBranches);
+  int FullNumberOfIterations = this->NumberOfIterations;
+
+  //downsample the data and smoothness terms level by level
+  for(int l = 1; l < NumLevels; l++ )
+  {
+    float* Fine = LevelBase[l-1];
+    float* Coarse = LevelBase[l];
+    int Smoothness = NumberOfBuffers + 2*NumLeaves;
+    for(int i = 0; i < NumLeaves; i++ )
+    {
+      downsampleBuffer(Coarse + LevelStride[l]*(NumberOfBuffers+i),
+                       (l == 1) ? FullDataTerms[i] : Fine + LevelStride[l-1]*(NumberOfBuffers+i),
+                       LevelVX[l-1], LevelVY[l-1], LevelVZ[l-1]);
+    }
+    for(int i = 0; i < NumLeaves + NumBranches; i++ )
+    {
+      float* FullSmoothness = (i < NumLeaves) ? FullLeafSmoothness[i] : FullBranchSmoothness[i-NumLeaves];
+      if( FullSmoothness )
+      {
+        downsampleBuffer(Coarse + LevelStride[l]*Smoothness,
+                         (l == 1) ? FullSmoothness : Fine + LevelStride[l-1]*Smoothness,
+                         LevelVX[l-1], LevelVY[l-1], LevelVZ[l-1]);
+        Smoothness++;
+      }
+    }
+  }
+
+  //solve from the coarsest level up, starting each level from the one below it
+  this->KeepFullSolution = 1;
+  this->NumberOfIterations = this->NumberOfIterationsPerLevel;
+  for(int l = NumLevels-1; l >= 0; l-- )
+  {
+    VX = LevelVX[l];
+    VY = LevelVY[l];
+    VZ = LevelVZ[l];
+    VolumeSize = VX * VY * VZ;
+    float* Base = (l == 0) ? this->CPUArena : LevelBase[l];
+    size_t Stride = (l == 0) ? this->CPUArenaStride : LevelStride[l];
+    std::list<float**>::iterator bufferNameIt = BufferPointerLocs.begin();
+    for( int i = 0; bufferNameIt != BufferPointerLocs.end(); bufferNameIt++, i++ )
+    {
+      *(*bufferNameIt) = Base + Stride*i;
+    }
+    int Smoothness = NumberOfBuffers + 2*NumLeaves;
+    for(int i = 0; i < NumLeaves; i++ )
+    {
+      leafDataTermBuffers[i] = (l == 0) ? FullDataTerms[i] : Base + Stride*(NumberOfBuffers+i);
+      leafLabelBuffers[i] = (l == 0) ? FullLabels[i] : Base + Stride*(NumberOfBuffers+NumLeaves+i);
+      leafSmoothnessTermBuffers[i] = (l == 0 || !FullLeafSmoothness[i]) ? FullLeafSmoothness[i] : Base + Stride*(Smoothness++);
+    }
+    for(int i = 0; i < NumBranches; i++ )
+    {
+      branchSmoothnessTermBuffers[i] = (l == 0 || !FullBranchSmoothness[i]) ? FullBranchSmoothness[i] : Base + Stride*(Smoothness++);
+    }
+    this->RelateParentSinkBuffers();
+
+    //prolong the solution of the level below, the full resolution level is run by the caller
+    if( l < NumLevels-1 )
+    {
+      this->ProlongSolution(BufferPointerLocs, LevelBase[l+1], LevelStride[l+1], NumberOfBuffers);
+    }
+    if( l == 0 )
+    {
+      break;
+    }
+    if( this->Debug )
+    {
+      vtkDebugMacro("Solving level " << l << " (" << VX << "x" << VY << "x" << VZ << ").");
+    }
+    this->ContinueSolution = (l < NumLevels-1);
+    this->InitializeAlgorithm();
+    this->RunAlgorithm();
+  }
+  this->NumberOfIterations = FullNumberOfIterations;
+
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+void vtkHierarchicalMaxFlowSegmentation::ProlongSolution( std::list<float**>& BufferPointerLocs, float* CoarseBase, size_t CoarseStride, int NumberOfBuffers )
+{
+  std::list<float**>::iterator bufferNameIt = BufferPointerLocs.begin();
+  for( int i = 0; bufferNameIt != BufferPointerLocs.end(); bufferNameIt++, i++ )
+  {
+    prolongBuffer(*(*bufferNameIt), CoarseBase + CoarseStride*i, VX, VY, VZ);
+  }
+  for(int i = 0; i < NumLeaves; i++ )
+  {
+    prolongBuffer(leafLabelBuffers[i], CoarseBase + CoarseStride*(NumberOfBuffers+NumLeaves+i), VX, VY, VZ);
+  }
+
+  //the divergences have to match the prolonged flows
+  for(int i = 0; i < NumBranches; i++ )
+  {
+    ghmf_slabComputeDivergence(branchDivBuffers[i], branchFlowXBuffers[i], branchFlowYBuffers[i], branchFlowZBuffers[i],
+                               VX, VY, VZ, VolumeSize, 0, VolumeSize);
+  }
+  for(int i = 0; i < NumLeaves; i++ )
+  {
+    ghmf_slabComputeDivergence(leafDivBuffers[i], leafFlowXBuffers[i], leafFlowYBuffers[i], leafFlowZBuffers[i],
+                               VX, VY, VZ, VolumeSize, 0, VolumeSize);
+  }
+}
+
 int vtkHierarchicalMaxFlowSegmentation::RequestDataObject(
   vtkInformation* vtkNotUsed(request),
   vtkInformationVector** inputVector ,
@@ -874,15 +1198,35 @@ int vtkHierarchicalMaxFlowSegmentation::RequestDataObject(
 
 int vtkHierarchicalMaxFlowSegmentation::InitializeAlgorithm()
 {
+  //a warm start or a coarser level has already filled in the flows and labels
+  if( this->ContinueSolution )
+  {
+    return 1;
+  }
+
   //initalize all spatial flows and divergences to zero
-  for(int i = 0; i < NumBranches; i++ )
+  for(int i = 0; i < NumBranches && this->CompactBuffers; i++ )
+  {
+    for(int c = 0; c < 4; c++ )
+    {
+      zeroOutCompactBuffer(this->GetCompactBuffer(false,i,c), VolumeSize);
+    }
+  }
+  for(int i = 0; i < NumLeaves && this->CompactBuffers; i++ )
+  {
+    for(int c = 0; c < 4; c++ )
+    {
+      zeroOutCompactBuffer(this->GetCompactBuffer(true,i,c), VolumeSize);
+    }
+  }
+  for(int i = 0; i < NumBranches && !this->CompactBuffers; i++ )
   {
     zeroOutBuffer(branchFlowXBuffers[i], VolumeSize);
     zeroOutBuffer(branchFlowYBuffers[i], VolumeSize);
     zeroOutBuffer(branchFlowZBuffers[i], VolumeSize);
     zeroOutBuffer(branchDivBuffers[i], VolumeSize);
   }
-  for(int i = 0; i < NumLeaves; i++ )
+  for(int i = 0; i < NumLeaves && !this->CompactBuffers; i++ )
   {
     zeroOutBuffer(leafFlowXBuffers[i], VolumeSize);
     zeroOutBuffer(leafFlowYBuffers[i], VolumeSize);
@@ -934,15 +1278,44 @@ int vtkHierarchicalMaxFlowSegmentation::InitializeAlgorithm()
 
 int vtkHierarchicalMaxFlowSegmentation::RunAlgorithm()
 {
+  //use the slab-parallel solver if more than one thread is available, it is also the only
+  //one handling 16-bit flow storage and out-of-core buffers
+  if( (this->NumberOfThreads > 1 && this->VZ > 1) || this->CompactBuffers || this->CPUArenaMapped )
+  {
+    return this->RunAlgorithmSlabs();
+  }
+
+  this->NumberOfIterationsUsed = 0;
+  this->FinalResidual = 0.0;
+
   //Solve maximum flow problem in an iterative bottom-up manner
   for( int iteration = 0; iteration < this->NumberOfIterations; iteration++ )
   {
+    //measure the label change on check iterations and on the last one
+    this->MeasureResidual = (iteration+1 == this->NumberOfIterations) ||
+                            (this->ConvergenceTolerance > 0.0 && (iteration+1) % this->ConvergenceCheckInterval == 0);
+    this->Residual = 0.0;
     SolveMaxFlow( this->Structure->GetRoot() );
+    this->NumberOfIterationsUsed = iteration+1;
     if( this->Debug )
     {
       vtkDebugMacro( "Finished iteration " << (iteration+1) << ".");
     }
+
+    if( this->MeasureResidual )
+    {
+      this->FinalResidual = this->Residual / ((double) this->VolumeSize * (this->NumNodes-1));
+      if( this->Debug )
+      {
+        vtkDebugMacro( "Mean label change " << this->FinalResidual << "." );
+      }
+      if( this->FinalResidual < this->ConvergenceTolerance )
+      {
+        break;
+      }
+    }
   }
+  this->MeasureResidual = false;
   return 1;
 }
 
@@ -1150,6 +1523,19 @@ void vtkHierarchicalMaxFlowSegmentation::UpdateLabel( vtkIdType node )
   }
 
   //std::cout << node << "\t Update labels" << std::endl;
+  if( this->MeasureResidual )
+  {
+    if( NumKids == 0 )
+      this->Residual += updateLabelWithResidual(leafSinkBuffers[LeafMap[node]], leafIncBuffers[LeafMap[node]],
+                                                leafDivBuffers[LeafMap[node]], leafLabelBuffers[LeafMap[node]],
+                                                CC, VolumeSize);
+    else
+      this->Residual += updateLabelWithResidual(branchSinkBuffers[BranchMap[node]], branchIncBuffers[BranchMap[node]],
+                                                branchDivBuffers[BranchMap[node]], branchLabelBuffers[BranchMap[node]],
+                                                CC, VolumeSize);
+    return;
+  }
+
   if( NumKids == 0 )
     updateLabel(leafSinkBuffers[LeafMap[node]], leafIncBuffers[LeafMap[node]],
                 leafDivBuffers[LeafMap[node]], leafLabelBuffers[LeafMap[node]],
@@ -1159,3 +1545,696 @@ void vtkHierarchicalMaxFlowSegmentation::UpdateLabel( vtkIdType node )
                 branchDivBuffers[BranchMap[node]], branchLabelBuffers[BranchMap[node]],
                 CC, VolumeSize);
 }
+
+//----------------------------------------------------------------------------
+// MULTI-THREADED CPU VERSION OF THE ALGORITHM
+//----------------------------------------------------------------------------
+
+namespace
+{
+  // Reusable barrier which releases the threads once all of them have entered.
+  class vtkHierarchicalMaxFlowSegmentationBarrier
+  {
+  public:
+    vtkHierarchicalMaxFlowSegmentationBarrier(int numThreads)
+    {
+      this->NumThreads = numThreads;
+      this->NumEntered = 0;
+      this->Generation = 0;
+      this->Lock = vtkMutexLock::New();
+      this->Condition = vtkConditionVariable::New();
+    }
+    ~vtkHierarchicalMaxFlowSegmentationBarrier()
+    {
+      this->Condition->Delete();
+      this->Lock->Delete();
+    }
+    void Enter()
+    {
+      this->Lock->Lock();
+      int generation = this->Generation;
+      this->NumEntered++;
+      if( this->NumEntered == this->NumThreads )
+      {
+        this->NumEntered = 0;
+        this->Generation++;
+        this->Condition->Broadcast();
+      }
+      else
+      {
+        while( generation == this->Generation )
+        {
+          this->Condition->Wait(this->Lock);
+        }
+      }
+      this->Lock->Unlock();
+    }
+
+  private:
+    vtkMutexLock* Lock;
+    vtkConditionVariable* Condition;
+    int NumThreads;
+    int NumEntered;
+    int Generation;
+  };
+
+  // Flattened copy of a node in the hierarchy so the threads never touch the tree or the maps
+  struct vtkHierarchicalMaxFlowSegmentationNode
+  {
+    bool IsRoot;
+    bool IsLeaf;
+    std::vector<int> Children;
+    float* Sink;
+    float* Inc;
+    float* Div;
+    float* Label;
+    float* FlowX;
+    float* FlowY;
+    float* FlowZ;
+    float* Smoothness;
+    float  Alpha;
+    float* DataTerm;
+    float* Working;
+    float* ParentWorking;
+    compactFloat* CompactFlowX;
+    compactFloat* CompactFlowY;
+    compactFloat* CompactFlowZ;
+    compactFloat* CompactDiv;
+  };
+
+  // One iteration of vtkHierarchicalMaxFlowSegmentation::SolveMaxFlow is split into stages, each
+  // applied to a range of voxels at a time. The spatial flow stages read from the neighbouring
+  // z-slices, so every range must have finished the previous stage before one of them starts.
+  // The other stages are pointwise.
+  enum vtkHierarchicalMaxFlowSegmentationStageType
+  {
+    ClearWorkingBuffer,
+    StepAndApply,
+    ComputeFlowMag,
+    ProjectFlows,
+    ComputeDivergence,
+    UpdateSinksAndLabels
+  };
+
+  struct vtkHierarchicalMaxFlowSegmentationStage
+  {
+    vtkHierarchicalMaxFlowSegmentationStageType Type;
+    int Node;
+  };
+
+  // Stages of one node in a row (at most a clear, the four spatial stages and the update of a
+  // leaf) that the out-of-core solver runs as one wavefront over the volume, and the ranges of
+  // the mapped arena they touch with the size of their elements
+  struct vtkHierarchicalMaxFlowSegmentationPass
+  {
+    int FirstStage;
+    int NumberOfStages;
+    std::vector<std::pair<char*,size_t> > Buffers;
+  };
+
+  struct vtkHierarchicalMaxFlowSegmentationThreadStruct
+  {
+    std::vector<vtkHierarchicalMaxFlowSegmentationNode> Nodes;
+    std::vector<vtkHierarchicalMaxFlowSegmentationStage> Stages;
+    std::vector<vtkHierarchicalMaxFlowSegmentationPass> Passes;
+    float* MappedArena;
+    int BlockSlices;
+    int NumberOfBlocks;
+    vtkHierarchicalMaxFlowSegmentationBarrier* Barrier;
+    int NumberOfIterations;
+    double ConvergenceTolerance;
+    int ConvergenceCheckInterval;
+    std::vector<double> Residuals;
+    int NumberOfIterationsUsed;
+    double FinalResidual;
+    float StepSize;
+    float CC;
+    int VX, VY, VZ;
+    int VolumeSize;
+    bool Compact;
+    int BFloat16;
+  };
+
+  // Number of voxels of a slab updated at a time by the pointwise part of the solver, small
+  // enough for a decoded 16-bit divergence to stay in cache
+  const int vtkHierarchicalMaxFlowSegmentationChunkSize = 2048;
+
+  // Divergence of a node over [start,start+count), decoded into the scratch space if it is
+  // stored in 16 bits
+  inline float* vtkHierarchicalMaxFlowSegmentationGetDiv( vtkHierarchicalMaxFlowSegmentationThreadStruct* str,
+                                                          vtkHierarchicalMaxFlowSegmentationNode& node,
+                                                          int start, int count, float* scratch )
+  {
+    if( !str->Compact )
+    {
+      return node.Div + start;
+    }
+    decodeCompactBuffer(scratch, node.CompactDiv + start, count, str->BFloat16);
+    return scratch;
+  }
+
+  // Stages in the order SolveMaxFlow goes through them
+  void vtkHierarchicalMaxFlowSegmentationAddStages( vtkHierarchicalMaxFlowSegmentationThreadStruct* str, int nodeIndex )
+  {
+    vtkHierarchicalMaxFlowSegmentationNode& node = str->Nodes[nodeIndex];
+    vtkHierarchicalMaxFlowSegmentationStage stage;
+    stage.Node = nodeIndex;
+    if( !node.IsLeaf )
+    {
+      stage.Type = ClearWorkingBuffer;
+      str->Stages.push_back(stage);
+    }
+    if( !node.IsRoot )
+    {
+      stage.Type = StepAndApply;
+      str->Stages.push_back(stage);
+      stage.Type = ComputeFlowMag;
+      str->Stages.push_back(stage);
+      stage.Type = ProjectFlows;
+      str->Stages.push_back(stage);
+      stage.Type = ComputeDivergence;
+      str->Stages.push_back(stage);
+    }
+    for( size_t kid = 0; kid < node.Children.size(); kid++ )
+    {
+      vtkHierarchicalMaxFlowSegmentationAddStages( str, node.Children[kid] );
+    }
+    stage.Type = UpdateSinksAndLabels;
+    str->Stages.push_back(stage);
+  }
+
+  inline bool vtkHierarchicalMaxFlowSegmentationIsSpatial( const vtkHierarchicalMaxFlowSegmentationStage& stage )
+  {
+    return stage.Type != ClearWorkingBuffer && stage.Type != UpdateSinksAndLabels;
+  }
+
+  // Buffers of a node that lie in the mapped arena [begin,end)
+  void vtkHierarchicalMaxFlowSegmentationAddMapped( vtkHierarchicalMaxFlowSegmentationPass& pass, void* buffer, size_t size,
+                                                    char* begin, char* end )
+  {
+    char* address = (char*) buffer;
+    if( address < begin || address >= end )
+    {
+      return;
+    }
+    for( size_t i = 0; i < pass.Buffers.size(); i++ )
+    {
+      if( pass.Buffers[i].first == address )
+      {
+        return;
+      }
+    }
+    pass.Buffers.push_back( std::make_pair(address, size) );
+  }
+
+  void vtkHierarchicalMaxFlowSegmentationAddMappedNode( vtkHierarchicalMaxFlowSegmentationPass& pass,
+                                                        vtkHierarchicalMaxFlowSegmentationNode& node, char* begin, char* end )
+  {
+    float* floats[] = { node.Sink, node.Inc, node.Div, node.Label, node.FlowX, node.FlowY, node.FlowZ,
+                        node.Working, node.ParentWorking };
+    for( size_t i = 0; i < sizeof(floats) / sizeof(floats[0]); i++ )
+    {
+      vtkHierarchicalMaxFlowSegmentationAddMapped( pass, floats[i], sizeof(float), begin, end );
+    }
+    compactFloat* compacts[] = { node.CompactFlowX, node.CompactFlowY, node.CompactFlowZ, node.CompactDiv };
+    for( size_t i = 0; i < sizeof(compacts) / sizeof(compacts[0]); i++ )
+    {
+      vtkHierarchicalMaxFlowSegmentationAddMapped( pass, compacts[i], sizeof(compactFloat), begin, end );
+    }
+  }
+
+  // Group the stages into passes, a new one starting wherever the node changes
+  void vtkHierarchicalMaxFlowSegmentationAddPasses( vtkHierarchicalMaxFlowSegmentationThreadStruct* str, char* begin, char* end )
+  {
+    for( int stage = 0; stage < (int) str->Stages.size(); stage++ )
+    {
+      vtkHierarchicalMaxFlowSegmentationNode& node = str->Nodes[str->Stages[stage].Node];
+      if( stage == 0 || str->Stages[stage].Node != str->Stages[stage-1].Node )
+      {
+        vtkHierarchicalMaxFlowSegmentationPass pass;
+        pass.FirstStage = stage;
+        pass.NumberOfStages = 0;
+        str->Passes.push_back(pass);
+        vtkHierarchicalMaxFlowSegmentationAddMappedNode( str->Passes.back(), node, begin, end );
+      }
+      vtkHierarchicalMaxFlowSegmentationPass& pass = str->Passes.back();
+      pass.NumberOfStages++;
+
+      //the update also goes through the children of the node
+      if( str->Stages[stage].Type == UpdateSinksAndLabels )
+      {
+        for( size_t kid = 0; kid < node.Children.size(); kid++ )
+        {
+          vtkHierarchicalMaxFlowSegmentationAddMappedNode( pass, str->Nodes[node.Children[kid]], begin, end );
+        }
+      }
+    }
+  }
+
+  // Write a block of the buffers of a pass back to the scratch file and drop it from memory
+  void vtkHierarchicalMaxFlowSegmentationReleaseBlock( vtkHierarchicalMaxFlowSegmentationThreadStruct* str,
+                                                       const vtkHierarchicalMaxFlowSegmentationPass& pass, int block )
+  {
+    int sliceSize = str->VX * str->VY;
+    int start = sliceSize * block * str->BlockSlices;
+    int end = sliceSize * ((block+1) * str->BlockSlices < str->VZ ? (block+1) * str->BlockSlices : str->VZ);
+    for( size_t i = 0; i < pass.Buffers.size(); i++ )
+    {
+      releaseMappedRange( str->MappedArena, pass.Buffers[i].first + start * pass.Buffers[i].second,
+                          (end - start) * pass.Buffers[i].second );
+    }
+  }
+
+  // Apply one stage to the voxels in [start,end)
+  void vtkHierarchicalMaxFlowSegmentationRunStage( vtkHierarchicalMaxFlowSegmentationThreadStruct* str,
+                                                   const vtkHierarchicalMaxFlowSegmentationStage& stage,
+                                                   int start, int end, double* residual )
+  {
+    vtkHierarchicalMaxFlowSegmentationNode& node = str->Nodes[stage.Node];
+    int NumKids = (int) node.Children.size();
+    int count = end - start;
+    float CC = str->CC;
+    int VX = str->VX;
+    int VY = str->VY;
+    int VZ = str->VZ;
+    int VolumeSize = str->VolumeSize;
+    int bfloat16 = str->BFloat16;
+
+    switch( stage.Type )
+    {
+    //RB : clear working buffer
+    case ClearWorkingBuffer:
+      if( node.IsRoot )
+      {
+        setBufferToValue(node.Working + start, 1.0f/CC, count);
+      }
+      else
+      {
+        zeroOutBuffer(node.Working + start, count);
+      }
+      break;
+
+    // BL: Update spatial flow
+    case StepAndApply:
+      if( str->Compact )
+      {
+        ghmf_compactStepAndApply(node.Sink, node.Inc, node.CompactDiv, node.Label, node.CompactFlowX, node.CompactFlowY, node.CompactFlowZ,
+                                 str->StepSize, CC, VX, VY, VZ, VolumeSize, start, end, bfloat16);
+      }
+      else
+      {
+        ghmf_slabStepAndApply(node.Sink, node.Inc, node.Div, node.Label, node.FlowX, node.FlowY, node.FlowZ,
+                              str->StepSize, CC, VX, VY, VZ, VolumeSize, start, end);
+      }
+      break;
+    case ComputeFlowMag:
+      if( str->Compact )
+      {
+        ghmf_compactComputeFlowMag(node.CompactDiv, node.CompactFlowX, node.CompactFlowY, node.CompactFlowZ, node.Smoothness, node.Alpha,
+                                   VX, VY, VZ, VolumeSize, start, end, bfloat16);
+      }
+      else
+      {
+        ghmf_slabComputeFlowMag(node.Div, node.FlowX, node.FlowY, node.FlowZ, node.Smoothness, node.Alpha,
+                                VX, VY, VZ, VolumeSize, start, end);
+      }
+      break;
+    case ProjectFlows:
+      if( str->Compact )
+      {
+        ghmf_compactProjectFlows(node.CompactDiv, node.CompactFlowX, node.CompactFlowY, node.CompactFlowZ, VX, VY, VZ, VolumeSize, start, end, bfloat16);
+      }
+      else
+      {
+        ghmf_slabProjectFlows(node.Div, node.FlowX, node.FlowY, node.FlowZ, VX, VY, VZ, VolumeSize, start, end);
+      }
+      break;
+    case ComputeDivergence:
+      if( str->Compact )
+      {
+        ghmf_compactComputeDivergence(node.CompactDiv, node.CompactFlowX, node.CompactFlowY, node.CompactFlowZ, VX, VY, VZ, VolumeSize, start, end, bfloat16);
+      }
+      else
+      {
+        ghmf_slabComputeDivergence(node.Div, node.FlowX, node.FlowY, node.FlowZ, VX, VY, VZ, VolumeSize, start, end);
+      }
+      break;
+
+    //the rest is pointwise, so it is done a chunk at a time to keep the slab in cache
+    case UpdateSinksAndLabels:
+      {
+        float divScratch[vtkHierarchicalMaxFlowSegmentationChunkSize];
+        float childDivScratch[vtkHierarchicalMaxFlowSegmentationChunkSize];
+        for( int chunk = start; chunk < end; chunk += vtkHierarchicalMaxFlowSegmentationChunkSize )
+        {
+          int chunkCount = (end - chunk < vtkHierarchicalMaxFlowSegmentationChunkSize) ? end - chunk : vtkHierarchicalMaxFlowSegmentationChunkSize;
+          float* div = node.IsRoot ? 0 : vtkHierarchicalMaxFlowSegmentationGetDiv( str, node, chunk, chunkCount, divScratch );
+
+          // B : Add sink potential to working buffer and divide it by N+1 into the sink buffer
+          if( !node.IsRoot && !node.IsLeaf )
+          {
+            storeSinkFlowInBuffer(node.Working + chunk, node.Inc + chunk, div, node.Label + chunk, CC, chunkCount);
+            divAndStoreBuffer(node.Working + chunk, node.Sink + chunk, (float)(NumKids+1), chunkCount);
+          }
+
+          //R  : Divide working buffer by N and store in sink buffer
+          if( node.IsRoot )
+          {
+            divAndStoreBuffer(node.Working + chunk, node.Sink + chunk, (float)NumKids, chunkCount);
+          }
+
+          //  L: Find sink potential and store, constrained, in sink
+          if( node.IsLeaf )
+          {
+            ghmf_updateLeafSinkFlowAndConstrain(node.Sink + chunk, node.Inc + chunk, div, node.Label + chunk,
+                                                node.DataTerm + chunk, CC, chunkCount);
+          }
+
+          //RB : Update children's labels
+          for(int kid = NumKids-1; kid >= 0; kid--)
+          {
+            vtkHierarchicalMaxFlowSegmentationNode& child = str->Nodes[node.Children[kid]];
+            float* childDiv = vtkHierarchicalMaxFlowSegmentationGetDiv( str, child, chunk, chunkCount, childDivScratch );
+            if( residual )
+            {
+              *residual += updateLabelWithResidual(child.Sink + chunk, child.Inc + chunk, childDiv, child.Label + chunk, CC, chunkCount);
+            }
+            else
+            {
+              updateLabel(child.Sink + chunk, child.Inc + chunk, childDiv, child.Label + chunk, CC, chunkCount);
+            }
+          }
+
+          // BL: Find source potential and store in parent's working buffer
+          if( !node.IsRoot )
+          {
+            storeSourceFlowInBuffer(node.ParentWorking + chunk, node.Sink + chunk, div, node.Label + chunk, CC, chunkCount);
+          }
+        }
+      }
+      break;
+    }
+  }
+}
+
+VTK_THREAD_RETURN_TYPE vtkHierarchicalMaxFlowSegmentationThreadedSolve( void *arg )
+{
+  int threadId = static_cast<vtkMultiThreader::ThreadInfo *>(arg)->ThreadID;
+  int threadCount = static_cast<vtkMultiThreader::ThreadInfo *>(arg)->NumberOfThreads;
+  vtkHierarchicalMaxFlowSegmentationThreadStruct* str = static_cast<vtkHierarchicalMaxFlowSegmentationThreadStruct *>
+      (static_cast<vtkMultiThreader::ThreadInfo *>(arg)->UserData);
+
+  //find the z-slab this thread is responsible for
+  int sliceSize = str->VX * str->VY;
+  int start = sliceSize * (str->VZ * threadId / threadCount);
+  int end = sliceSize * (str->VZ * (threadId+1) / threadCount);
+
+  for( int iteration = 0; iteration < str->NumberOfIterations; iteration++ )
+  {
+    bool measure = (iteration+1 == str->NumberOfIterations) ||
+                   (str->ConvergenceTolerance > 0.0 && (iteration+1) % str->ConvergenceCheckInterval == 0);
+    double residual = 0.0;
+    for( size_t stage = 0; stage < str->Stages.size(); stage++ )
+    {
+      if( vtkHierarchicalMaxFlowSegmentationIsSpatial(str->Stages[stage]) )
+      {
+        str->Barrier->Enter();
+      }
+      vtkHierarchicalMaxFlowSegmentationRunStage( str, str->Stages[stage], start, end, measure ? &residual : 0 );
+    }
+    if( threadId == 0 )
+    {
+      str->NumberOfIterationsUsed = iteration+1;
+    }
+    if( !measure )
+    {
+      continue;
+    }
+
+    //every thread sums the partial residuals in the same order so they all agree on stopping
+    str->Residuals[threadId] = residual;
+    str->Barrier->Enter();
+    double total = 0.0;
+    for( int i = 0; i < threadCount; i++ )
+    {
+      total += str->Residuals[i];
+    }
+    total /= (double) str->VolumeSize * (str->Nodes.size() - 1);
+    if( threadId == 0 )
+    {
+      str->FinalResidual = total;
+    }
+    if( total < str->ConvergenceTolerance )
+    {
+      break;
+    }
+  }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+// Out-of-core solve. Each pass is run as a wavefront over blocks of z-slices: stage s of the
+// pass runs on block b at step 2s+b, so by then block b+1 has finished stage s-1 and no later
+// stage has yet overwritten what stage s reads from the blocks next to it. The stencils reach
+// at most one block, so the blocks of a step are independent and each is split among the
+// threads. A block two behind the front is no longer read by the pass and is released, which
+// keeps 2*(NumberOfStages-1)+3 blocks of the buffers of the pass resident at most.
+VTK_THREAD_RETURN_TYPE vtkHierarchicalMaxFlowSegmentationThreadedWavefront( void *arg )
+{
+  int threadId = static_cast<vtkMultiThreader::ThreadInfo *>(arg)->ThreadID;
+  int threadCount = static_cast<vtkMultiThreader::ThreadInfo *>(arg)->NumberOfThreads;
+  vtkHierarchicalMaxFlowSegmentationThreadStruct* str = static_cast<vtkHierarchicalMaxFlowSegmentationThreadStruct *>
+      (static_cast<vtkMultiThreader::ThreadInfo *>(arg)->UserData);
+  int sliceSize = str->VX * str->VY;
+
+  for( int iteration = 0; iteration < str->NumberOfIterations; iteration++ )
+  {
+    bool measure = (iteration+1 == str->NumberOfIterations) ||
+                   (str->ConvergenceTolerance > 0.0 && (iteration+1) % str->ConvergenceCheckInterval == 0);
+    double residual = 0.0;
+    for( size_t p = 0; p < str->Passes.size(); p++ )
+    {
+      const vtkHierarchicalMaxFlowSegmentationPass& pass = str->Passes[p];
+      int lag = 2 * (pass.NumberOfStages - 1);
+      for( int step = 0; step < str->NumberOfBlocks + lag; step++ )
+      {
+        if( threadId == 0 && step - lag - 2 >= 0 )
+        {
+          vtkHierarchicalMaxFlowSegmentationReleaseBlock( str, pass, step - lag - 2 );
+        }
+        for( int stage = 0; stage < pass.NumberOfStages && step - 2*stage >= 0; stage++ )
+        {
+          int block = step - 2*stage;
+          if( block >= str->NumberOfBlocks )
+          {
+            continue;
+          }
+          int start = sliceSize * block * str->BlockSlices;
+          int end = sliceSize * ((block+1) * str->BlockSlices < str->VZ ? (block+1) * str->BlockSlices : str->VZ);
+          int first = start + (int) ((long long) (end - start) * threadId / threadCount);
+          int last = start + (int) ((long long) (end - start) * (threadId+1) / threadCount);
+          vtkHierarchicalMaxFlowSegmentationRunStage( str, str->Stages[pass.FirstStage + stage], first, last, measure ? &residual : 0 );
+        }
+        str->Barrier->Enter();
+      }
+
+      //the last two blocks are done once the pass is
+      if( threadId == 0 )
+      {
+        for( int block = (str->NumberOfBlocks > 2) ? str->NumberOfBlocks - 2 : 0; block < str->NumberOfBlocks; block++ )
+        {
+          vtkHierarchicalMaxFlowSegmentationReleaseBlock( str, pass, block );
+        }
+      }
+      str->Barrier->Enter();
+    }
+    if( threadId == 0 )
+    {
+      str->NumberOfIterationsUsed = iteration+1;
+    }
+    if( !measure )
+    {
+      continue;
+    }
+
+    //every thread sums the partial residuals in the same order so they all agree on stopping
+    str->Residuals[threadId] = residual;
+    str->Barrier->Enter();
+    double total = 0.0;
+    for( int i = 0; i < threadCount; i++ )
+    {
+      total += str->Residuals[i];
+    }
+    total /= (double) str->VolumeSize * (str->Nodes.size() - 1);
+    if( threadId == 0 )
+    {
+      str->FinalResidual = total;
+    }
+    if( total < str->ConvergenceTolerance )
+    {
+      break;
+    }
+  }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+int vtkHierarchicalMaxFlowSegmentation::RunAlgorithmSlabs()
+{
+  vtkHierarchicalMaxFlowSegmentationThreadStruct str;
+  str.NumberOfIterations = this->NumberOfIterations;
+  str.ConvergenceTolerance = this->ConvergenceTolerance;
+  str.ConvergenceCheckInterval = this->ConvergenceCheckInterval;
+  str.NumberOfIterationsUsed = 0;
+  str.FinalResidual = 0.0;
+  str.StepSize = this->StepSize;
+  str.CC = this->CC;
+  str.VX = this->VX;
+  str.VY = this->VY;
+  str.VZ = this->VZ;
+  str.VolumeSize = this->VolumeSize;
+  str.Compact = (this->CompactBuffers != 0);
+  str.BFloat16 = (this->FlowStorage == VTK_MAXFLOW_STORAGE_BFLOAT16);
+  str.MappedArena = 0;
+  str.BlockSlices = 0;
+  str.NumberOfBlocks = 0;
+
+  //flatten the hierarchy, keeping the root at index 0
+  std::map<vtkIdType,int> NodeIndex;
+  vtkTreeDFSIterator* iterator = vtkTreeDFSIterator::New();
+  iterator->SetTree(this->Structure);
+  iterator->SetStartVertex(this->Structure->GetRoot());
+  while( iterator->HasNext() )
+  {
+    vtkIdType node = iterator->Next();
+    NodeIndex[node] = (int) str.Nodes.size();
+
+    vtkHierarchicalMaxFlowSegmentationNode entry;
+    entry.IsRoot = (node == this->Structure->GetRoot());
+    entry.IsLeaf = this->Structure->IsLeaf(node);
+    entry.Sink = entry.Inc = entry.Div = entry.Label = 0;
+    entry.FlowX = entry.FlowY = entry.FlowZ = 0;
+    entry.Smoothness = entry.DataTerm = entry.Working = entry.ParentWorking = 0;
+    entry.Alpha = 1.0f;
+    entry.CompactFlowX = entry.CompactFlowY = entry.CompactFlowZ = entry.CompactDiv = 0;
+    if( entry.IsRoot )
+    {
+      entry.Sink = sourceFlowBuffer;
+      entry.Working = sourceWorkingBuffer;
+    }
+    else if( entry.IsLeaf )
+    {
+      int l = this->LeafMap[node];
+      entry.Sink = leafSinkBuffers[l];
+      entry.Inc = leafIncBuffers[l];
+      entry.Div = leafDivBuffers[l];
+      entry.Label = leafLabelBuffers[l];
+      entry.FlowX = leafFlowXBuffers[l];
+      entry.FlowY = leafFlowYBuffers[l];
+      entry.FlowZ = leafFlowZBuffers[l];
+      entry.Smoothness = leafSmoothnessTermBuffers[l];
+      entry.Alpha = leafSmoothnessConstants[l];
+      entry.DataTerm = leafDataTermBuffers[l];
+      if( this->CompactBuffers )
+      {
+        entry.CompactFlowX = this->GetCompactBuffer(true,l,0);
+        entry.CompactFlowY = this->GetCompactBuffer(true,l,1);
+        entry.CompactFlowZ = this->GetCompactBuffer(true,l,2);
+        entry.CompactDiv = this->GetCompactBuffer(true,l,3);
+      }
+    }
+    else
+    {
+      int b = this->BranchMap[node];
+      entry.Sink = branchSinkBuffers[b];
+      entry.Inc = branchIncBuffers[b];
+      entry.Div = branchDivBuffers[b];
+      entry.Label = branchLabelBuffers[b];
+      entry.FlowX = branchFlowXBuffers[b];
+      entry.FlowY = branchFlowYBuffers[b];
+      entry.FlowZ = branchFlowZBuffers[b];
+      entry.Smoothness = branchSmoothnessTermBuffers[b];
+      entry.Alpha = branchSmoothnessConstants[b];
+      entry.Working = branchWorkingBuffers[b];
+      if( this->CompactBuffers )
+      {
+        entry.CompactFlowX = this->GetCompactBuffer(false,b,0);
+        entry.CompactFlowY = this->GetCompactBuffer(false,b,1);
+        entry.CompactFlowZ = this->GetCompactBuffer(false,b,2);
+        entry.CompactDiv = this->GetCompactBuffer(false,b,3);
+      }
+    }
+    if( !entry.IsRoot )
+    {
+      vtkIdType parent = this->Structure->GetParent(node);
+      entry.ParentWorking = (parent == this->Structure->GetRoot()) ?
+                            sourceWorkingBuffer : branchWorkingBuffers[this->BranchMap[parent]];
+    }
+    str.Nodes.push_back(entry);
+  }
+  iterator->Delete();
+  for( std::map<vtkIdType,int>::iterator it = NodeIndex.begin(); it != NodeIndex.end(); it++ )
+  {
+    int NumKids = this->Structure->GetNumberOfChildren(it->first);
+    for(int kid = 0; kid < NumKids; kid++)
+    {
+      str.Nodes[it->second].Children.push_back( NodeIndex[this->Structure->GetChild(it->first,kid)] );
+    }
+  }
+  vtkHierarchicalMaxFlowSegmentationAddStages( &str, 0 );
+
+  //one z-slab (or share of a block) per thread, no more than SingleMethodExecute will start or
+  //the barrier never opens
+  int numThreads = (this->NumberOfThreads < this->VZ) ? this->NumberOfThreads : this->VZ;
+  int maxThreads = vtkMultiThreader::GetGlobalMaximumNumberOfThreads();
+  if( maxThreads > 0 && numThreads > maxThreads )
+  {
+    numThreads = maxThreads;
+  }
+  this->Threader->SetNumberOfThreads(numThreads);
+  vtkHierarchicalMaxFlowSegmentationBarrier barrier(numThreads);
+  str.Barrier = &barrier;
+  str.Residuals.assign(numThreads, 0.0);
+
+  //buffers mapped to a scratch file are updated a pass at a time, each as a wavefront
+  bool wavefront = this->CPUArenaMapped && this->sourceFlowBuffer >= this->CPUArena &&
+                   this->sourceFlowBuffer < this->CPUArena + this->CPUArenaStride*this->CPUArenaNumberOfBuffers;
+  double readBefore = 0.0;
+  double writtenBefore = 0.0;
+  if( wavefront )
+  {
+    //blocks of z-slices have to be thick enough to hold the neighbours read by the spatial
+    //stages, which reach back VX*VZ voxels for the divergence
+    str.BlockSlices = (VZ + VY - 1) / VY;
+    str.BlockSlices = (this->SlabThickness > str.BlockSlices) ? this->SlabThickness : str.BlockSlices;
+    str.NumberOfBlocks = (VZ + str.BlockSlices - 1) / str.BlockSlices;
+    str.MappedArena = this->CPUArena;
+    vtkHierarchicalMaxFlowSegmentationAddPasses( &str, (char*) this->CPUArena,
+                                                 (char*) (this->CPUArena + this->CPUArenaStride*this->CPUArenaNumberOfBuffers) );
+    this->Threader->SetSingleMethod(vtkHierarchicalMaxFlowSegmentationThreadedWavefront, &str);
+    processIOBytes(&readBefore, &writtenBefore);
+  }
+  else
+  {
+    this->Threader->SetSingleMethod(vtkHierarchicalMaxFlowSegmentationThreadedSolve, &str);
+  }
+
+  // always shut off debugging to avoid threading problems with GetMacros
+  bool debug = this->Debug;
+  this->Debug = false;
+  this->Threader->SingleMethodExecute();
+  this->Debug = debug;
+
+  this->NumberOfIterationsUsed = str.NumberOfIterationsUsed;
+  this->FinalResidual = str.FinalResidual;
+  if( wavefront )
+  {
+    double readAfter, writtenAfter;
+    processIOBytes(&readAfter, &writtenAfter);
+    this->BytesReadPerIteration = (this->NumberOfIterationsUsed > 0) ? (readAfter - readBefore) / this->NumberOfIterationsUsed : 0.0;
+    this->BytesWrittenPerIteration = (this->NumberOfIterationsUsed > 0) ? (writtenAfter - writtenBefore) / this->NumberOfIterationsUsed : 0.0;
+    vtkDebugMacro( "Read " << this->BytesReadPerIteration << " bytes and wrote " << this->BytesWrittenPerIteration
+                   << " bytes per iteration." );
+  }
+  return 1;
+}
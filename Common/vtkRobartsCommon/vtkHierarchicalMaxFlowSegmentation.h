@@ -34,12 +34,17 @@
 
 class vtkInformation;
 class vtkInformationVector;
+class vtkMultiThreader;
 
 #include <map>
 #include <list>
 #include <limits.h>
 #include <float.h>
 
+#define VTK_MAXFLOW_STORAGE_FLOAT    0
+#define VTK_MAXFLOW_STORAGE_HALF     1
+#define VTK_MAXFLOW_STORAGE_BFLOAT16 2
+
 class vtkRobartsCommonExport vtkHierarchicalMaxFlowSegmentation : public vtkImageAlgorithm
 {
 public:
@@ -63,6 +68,21 @@ public:
   // is too slow).
   vtkSetClampMacro(NumberOfIterations,int,0,INT_MAX);
   vtkGetMacro(NumberOfIterations,int);
+
+  // Description:
+  // Get and Set the convergence tolerance. If positive, the mean absolute change in the
+  // labels is measured every ConvergenceCheckInterval iterations and the solver stops as
+  // soon as it falls below this value. The default of 0 always runs NumberOfIterations.
+  vtkSetClampMacro(ConvergenceTolerance,double,0.0,DBL_MAX);
+  vtkGetMacro(ConvergenceTolerance,double);
+  vtkSetClampMacro(ConvergenceCheckInterval,int,1,INT_MAX);
+  vtkGetMacro(ConvergenceCheckInterval,int);
+
+  // Description:
+  // Get the number of iterations run by the last update of the CPU solver and the mean
+  // absolute label change measured in its final iteration.
+  vtkGetMacro(NumberOfIterationsUsed,int);
+  vtkGetMacro(FinalResidual,double);
   
   // Description:
   // Get and Set the labeling constant, CC, of the algorithm. The default value is 0.25
@@ -75,6 +95,98 @@ public:
   // value is 0.1 and is unlikely to require modification.
   vtkSetClampMacro(StepSize,float,0.0f,1.0f);
   vtkGetMacro(StepSize,float);
+
+  // Description:
+  // Get and Set the number of threads used by the CPU solver. The volume is split into
+  // z-slabs which are updated in parallel, giving the same labels as the single-threaded
+  // solver. Setting this to 1 runs the original single-threaded code path.
+  vtkSetClampMacro(NumberOfThreads,int,1,VTK_MAX_THREADS);
+  vtkGetMacro(NumberOfThreads,int);
+
+  // Description:
+  // Get and Set the maximum number of bytes the CPU solver may hold for its working
+  // buffers. A value of 0 (the default) places no limit. The buffers are kept between
+  // updates and reused as long as the extent and the hierarchy do not change.
+  vtkSetClampMacro(MemoryBudget,vtkIdType,0,VTK_ID_MAX);
+  vtkGetMacro(MemoryBudget,vtkIdType);
+
+  // Description:
+  // Get the number of bytes currently held for the CPU working buffers, or release them.
+  vtkIdType GetNumberOfBytesHeld();
+  void ReleaseBuffers();
+
+  // Description:
+  // Get and Set whether the solver is warm-started. If on, the flows, divergences and labels
+  // of the last solve are kept and used as the starting point of the next one, as long as the
+  // extent and the hierarchy are unchanged. This is meant for re-solving after edits to the
+  // data terms or smoothness, which then converge in far fewer iterations.
+  vtkSetClampMacro(WarmStart,int,0,1);
+  vtkGetMacro(WarmStart,int);
+  vtkBooleanMacro(WarmStart,int);
+
+  // Description:
+  // Get whether the last update started from the previous solution, or discard that
+  // solution so that the next update starts from scratch.
+  vtkGetMacro(WarmStarted,int);
+  void ResetWarmStart();
+
+  // Description:
+  // Get and Set the number of resolution levels. With more than one level, the data and
+  // smoothness terms are downsampled by two per level, the coarsest level is solved first
+  // and its flows and labels are prolonged to start the next finer one. Coarse levels run
+  // NumberOfIterationsPerLevel iterations, the full resolution NumberOfIterations. The
+  // default of 1 solves at full resolution only.
+  vtkSetClampMacro(NumberOfLevels,int,1,16);
+  vtkGetMacro(NumberOfLevels,int);
+  vtkSetClampMacro(NumberOfIterationsPerLevel,int,0,INT_MAX);
+  vtkGetMacro(NumberOfIterationsPerLevel,int);
+
+  // Description:
+  // Get and Set how the spatial flows and divergences are stored by the CPU solver.
+  // VTK_MAXFLOW_STORAGE_FLOAT: 32-bit floats (default)
+  // VTK_MAXFLOW_STORAGE_HALF: IEEE 16-bit floats
+  // VTK_MAXFLOW_STORAGE_BFLOAT16: bfloat16, less precise than half floats but with the range of a float
+  // The 16-bit formats roughly halve the memory held for the solver, at some cost in accuracy
+  // of the labels. All arithmetic is still done in float. They always use the slab solver
+  // (with NumberOfThreads threads) and solve at full resolution only. The GPU subclasses
+  // ignore this setting.
+  vtkSetClampMacro(FlowStorage,int,VTK_MAXFLOW_STORAGE_FLOAT,VTK_MAXFLOW_STORAGE_BFLOAT16);
+  vtkGetMacro(FlowStorage,int);
+  void SetFlowStorageToFloat()
+  {
+    this->SetFlowStorage(VTK_MAXFLOW_STORAGE_FLOAT);
+  }
+  void SetFlowStorageToHalf()
+  {
+    this->SetFlowStorage(VTK_MAXFLOW_STORAGE_HALF);
+  }
+  void SetFlowStorageToBFloat16()
+  {
+    this->SetFlowStorage(VTK_MAXFLOW_STORAGE_BFLOAT16);
+  }
+
+  // Description:
+  // Get and Set whether the CPU working buffers are kept in a memory-mapped scratch file in
+  // ScratchDirectory (the system temporary directory if not set) instead of memory. Each
+  // iteration then goes through the nodes one at a time, each as a wavefront over blocks of
+  // SlabThickness (or more) z-slices, and writes the blocks behind the front back to the file.
+  // At most 11 blocks of the buffers of a node, its parent and its children are resident,
+  // however large the hierarchy. This is slower, but lets hierarchies run whose buffers do not
+  // fit in memory. MemoryBudget does not apply to these buffers, and the data terms,
+  // smoothness terms and labels stay in memory.
+  vtkSetClampMacro(OutOfCore,int,0,1);
+  vtkGetMacro(OutOfCore,int);
+  vtkBooleanMacro(OutOfCore,int);
+  vtkSetStringMacro(ScratchDirectory);
+  vtkGetStringMacro(ScratchDirectory);
+  vtkSetClampMacro(SlabThickness,int,1,INT_MAX);
+  vtkGetMacro(SlabThickness,int);
+
+  // Description:
+  // Get the average number of bytes read from and written to storage per iteration by the
+  // last out-of-core update (always 0 on platforms that do not report process I/O).
+  vtkGetMacro(BytesReadPerIteration,double);
+  vtkGetMacro(BytesWrittenPerIteration,double);
   
   // Description:
   // Get and Set the data cost for the objects. The algorithm only uses those which
@@ -127,6 +239,7 @@ protected:
   
   virtual int InitializeAlgorithm();
   virtual int RunAlgorithm();
+  int RunAlgorithmSlabs();
 
   void PropogateLabels( vtkIdType currNode );
   void SolveMaxFlow( vtkIdType currNode );
@@ -143,9 +256,17 @@ protected:
   int    NumEdges;
 
   int NumberOfIterations;
+  double ConvergenceTolerance;
+  int ConvergenceCheckInterval;
+  int NumberOfIterationsUsed;
+  double FinalResidual;
+  bool MeasureResidual;
+  double Residual;
   float CC;
   float StepSize;
   int VolumeSize;
+  int NumberOfThreads;
+  vtkMultiThreader* Threader;
   int VX, VY, VZ;
   
   int FirstUnusedDataPort;
@@ -153,9 +274,50 @@ protected:
   std::map<int,vtkIdType> BackwardsInputSmoothnessPortMapping;
   int FirstUnusedSmoothnessPort;
 
+  //persistent, cache-line aligned block holding all CPU working buffers
+  int AcquireBuffers( int NumberOfBuffers );
+  float* CPUArena;
+  size_t CPUArenaStride;
+  int CPUArenaNumberOfBuffers;
+  vtkIdType MemoryBudget;
+
+  //previous solution kept for warm starting, leaf labels are stored at the end of the arena
+  int WarmStart;
+  int WarmStarted;
+  int PreviousSolutionValid;
+  int PreviousDimensions[3];
+  vtkMTimeType PreviousStructureTime;
+
+  //set if InitializeAlgorithm should keep the solution already in the buffers, and if
+  //RunAlgorithm has to leave the complete solution (not only the leaf labels) in CPU memory
+  int ContinueSolution;
+  int KeepFullSolution;
+
+  //coarse-to-fine solver, the coarse levels are kept in a second persistent block
+  int RunCoarseLevels( std::list<float**>& BufferPointerLocs, int NumberOfBuffers );
+  void ProlongSolution( std::list<float**>& BufferPointerLocs, float* CoarseBase, size_t CoarseStride, int NumberOfBuffers );
+  void RelateParentSinkBuffers();
+  int NumberOfLevels;
+  int NumberOfIterationsPerLevel;
+  float* PyramidArena;
+  size_t PyramidArenaSize;
+
+  //16-bit flow and divergence storage, four buffers per non-root node (x, y and z flows, then
+  //divergence) packed two to an arena buffer, branches before leaves
+  virtual int SupportsCompactFlowStorage();
+  unsigned short* GetCompactBuffer( bool leaf, int index, int component );
+  int FlowStorage;
+  unsigned short* CompactBuffers;
+
+  //out-of-core solver, with the arena mapped to a scratch file
+  int OutOfCore;
+  int CPUArenaMapped;
+  char* ScratchDirectory;
+  int SlabThickness;
+  double BytesReadPerIteration;
+  double BytesWrittenPerIteration;
+
   //pointers to variable structures, easier to keep as part of the class definition
-  std::list<float*> CPUBuffersAcquired;
-  std::list<int> CPUBuffersSize;
   int TotalNumberOfBuffers;
   float**  branchFlowXBuffers;
   float**  branchFlowYBuffers;
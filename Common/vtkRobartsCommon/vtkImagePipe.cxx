@@ -21,7 +21,37 @@
 
 #include "vtkPointData.h"
 
+#include <algorithm>
 #include <iostream>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#define vtkImagePipePoll WSAPoll
+#define vtkImagePipeCloseDescriptor( socket ) closesocket( (SOCKET) (socket) )
+#define vtkImagePipeWouldBlock() ( WSAGetLastError() == WSAEWOULDBLOCK )
+#define VTK_IMAGE_PIPE_SEND_FLAGS 0
+#else
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define vtkImagePipePoll poll
+#define vtkImagePipeCloseDescriptor( socket ) close( socket )
+#define vtkImagePipeWouldBlock() ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+#ifdef MSG_NOSIGNAL
+#define VTK_IMAGE_PIPE_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define VTK_IMAGE_PIPE_SEND_FLAGS 0
+#endif
+#endif
+
+#include <deque>
 
 vtkStandardNewMacro(vtkImagePipe);
 
@@ -37,6 +67,542 @@ struct vtkImagePipeInitData
   int imageSize; //can also be used to weakly confirm data integrity
 };
 
+//header of the frames pushed to subscribers or pulled after negotiating
+//an encoding, followed by the encoded scalars
+extern "C"
+struct vtkImagePipeFrameHeader
+{
+  unsigned int sequence;
+  vtkImagePipeInitData info;
+  int encoding;
+  int keyframe; //delta against an empty image
+  int payloadSize;
+  double encodeTime;
+};
+
+//requests sent by the client
+enum
+{
+  VTK_IMAGE_PIPE_DISCONNECT = -1,
+  VTK_IMAGE_PIPE_PULL = 1,
+  VTK_IMAGE_PIPE_SUBSCRIBE = 2,
+  VTK_IMAGE_PIPE_NEGOTIATE = 3 //followed by the encoding, answered with the accepted one
+};
+
+//copy of the input, shared by the snapshot and the raw messages sent from it
+struct vtkImagePipeImage
+{
+  int references;
+  std::vector<unsigned char> data;
+};
+
+//serialized message, shared by the snapshot and the clients it is queued on.
+//The header and the payload are sent with one gathered write, raw payloads
+//straight from the image of the snapshot and encoded ones from the message.
+struct vtkImagePipeMessage
+{
+  int references;
+  bool frame;
+  std::vector<unsigned char> header;
+  vtkImagePipeImage* image; //raw payload, 0 if encoded
+  std::vector<unsigned char> encoded;
+};
+
+//the serializations of the input built so far, each built at most once
+enum
+{
+  VTK_IMAGE_PIPE_MESSAGE_PULL, //unframed raw answer to a pull
+  VTK_IMAGE_PIPE_MESSAGE_RAW,
+  VTK_IMAGE_PIPE_MESSAGE_LZ,
+  VTK_IMAGE_PIPE_MESSAGE_DELTA, //against the previous snapshot, built per client for other bases
+  VTK_IMAGE_PIPE_MESSAGE_KEYFRAME, //delta against an empty image
+  VTK_IMAGE_PIPE_MESSAGE_UNCHANGED, //empty delta
+  VTK_IMAGE_PIPE_NUMBER_OF_MESSAGES
+};
+
+//copy of the input taken by the reactor
+struct vtkImagePipeSnapshot
+{
+  unsigned long id; //0 until the first copy
+  vtkMTimeType mtime;
+  unsigned int sequence;
+  vtkImagePipeInitData info;
+  vtkImagePipeImage* image;
+  vtkImagePipeImage* previous; //image of the snapshot before, base of the shared delta
+  vtkImagePipeMessage* messages[VTK_IMAGE_PIPE_NUMBER_OF_MESSAGES];
+};
+
+//message queued on a client and how much of it was sent
+struct vtkImagePipePending
+{
+  vtkImagePipeMessage* message;
+  size_t offset;
+};
+
+//server side state of a client
+struct vtkImagePipeConnection
+{
+  vtkClientSocket* socket;
+  int encoding;
+  bool framed;
+  bool subscribed;
+  int request[2];
+  int requestBytes;
+  std::deque<vtkImagePipePending> pending;
+  vtkImagePipeImage* base; //image of the last delta encoded frame queued, the base of its next delta
+  vtkImagePipeInitData baseInfo;
+  unsigned int lastSequence;
+
+  //throughput counters
+  double connectTime;
+  double bytesSent;
+  int framesSent;
+  int framesSkipped;
+};
+
+//----------------------------------------------------------------------------
+static void vtkImagePipeFillInitData( vtkImageData* image, vtkImagePipeInitData& initData )
+{
+  image->GetExtent( initData.extent );
+  image->GetSpacing( initData.spacing );
+  image->GetOrigin( initData.origin );
+  initData.scalarType = image->GetScalarType();
+  initData.numComponents = image->GetNumberOfScalarComponents();
+  initData.scalarSize = image->GetScalarSize();
+  initData.imageSize = (initData.extent[1] - initData.extent[0] + 1) *
+                       (initData.extent[3] - initData.extent[2] + 1) *
+                       (initData.extent[5] - initData.extent[4] + 1) *
+                       initData.numComponents * initData.scalarSize;
+}
+
+//----------------------------------------------------------------------------
+// whether an image description received from the server is consistent: a
+// known scalar type of the given size, and an image size that is the product
+// of the dimensions, the number of components and the scalar size
+static bool vtkImagePipeCheckInitData( const vtkImagePipeInitData& initData )
+{
+  int scalarSize = 0;
+  switch( initData.scalarType )
+  {
+    vtkTemplateMacro( scalarSize = (int) sizeof(VTK_TT) );
+  }
+  if( scalarSize == 0 || initData.scalarSize != scalarSize || initData.numComponents < 1 || initData.imageSize < 0 )
+  {
+    return false;
+  }
+  //anything past the largest int is too large, which keeps the products in range
+  const vtkTypeInt64 tooLarge = (vtkTypeInt64) VTK_INT_MAX + 1;
+  vtkTypeInt64 size = std::min( (vtkTypeInt64) initData.numComponents * scalarSize, tooLarge );
+  for( int i = 0; i < 3; i++ )
+  {
+    vtkTypeInt64 dimension = (vtkTypeInt64) initData.extent[2*i+1] - initData.extent[2*i] + 1;
+    if( dimension < 0 )
+    {
+      return false;
+    }
+    size = std::min( size * std::min( dimension, tooLarge ), tooLarge );
+  }
+  return size == initData.imageSize;
+}
+
+//----------------------------------------------------------------------------
+// whether the payload of a frame has a size its encoding can produce, no
+// encoding more than doubles the image
+static bool vtkImagePipeCheckPayloadSize( int encoding, int payloadSize, int imageSize )
+{
+  if( encoding == VTK_IMAGE_PIPE_RAW )
+  {
+    return payloadSize == imageSize;
+  }
+  if( encoding == VTK_IMAGE_PIPE_DELTA_RLE || encoding == VTK_IMAGE_PIPE_LZ )
+  {
+    return payloadSize >= 0 && payloadSize <= 2 * (vtkTypeInt64) imageSize + 32;
+  }
+  return false;
+}
+
+//----------------------------------------------------------------------------
+// deltas need the image they are based on in the same format
+static bool vtkImagePipeSameFormat( const vtkImagePipeInitData& a, const vtkImagePipeInitData& b )
+{
+  return !memcmp( a.extent, b.extent, sizeof(a.extent) ) && a.scalarType == b.scalarType &&
+         a.numComponents == b.numComponents && a.imageSize == b.imageSize;
+}
+
+//----------------------------------------------------------------------------
+static void vtkImagePipeReleaseImage( vtkImagePipeImage* image )
+{
+  if( image && --image->references == 0 )
+  {
+    delete image;
+  }
+}
+
+//----------------------------------------------------------------------------
+// the payload is either the given image, referenced rather than copied, or
+// encoded into the message by the caller
+static vtkImagePipeMessage* vtkImagePipeNewMessage( bool frame, const void* header, int headerSize, vtkImagePipeImage* image )
+{
+  vtkImagePipeMessage* message = new vtkImagePipeMessage;
+  message->references = 1;
+  message->frame = frame;
+  message->header.assign( (const unsigned char*) header, (const unsigned char*) header + headerSize );
+  message->image = image;
+  if( image )
+  {
+    image->references++;
+  }
+  return message;
+}
+
+static void vtkImagePipeReleaseMessage( vtkImagePipeMessage* message )
+{
+  if( message && --message->references == 0 )
+  {
+    vtkImagePipeReleaseImage( message->image );
+    delete message;
+  }
+}
+
+//----------------------------------------------------------------------------
+// scatter-gather send of a header and a payload, without copying either,
+// returns the number of bytes sent or -1 like send()
+static int vtkImagePipeSendGather( int socket, const unsigned char* header, size_t headerSize, const unsigned char* data, size_t dataSize )
+{
+#ifdef _WIN32
+  WSABUF buffers[2];
+  buffers[0].buf = (char*) header;
+  buffers[0].len = (ULONG) headerSize;
+  buffers[1].buf = (char*) data;
+  buffers[1].len = (ULONG) dataSize;
+  DWORD sent = 0;
+  if( WSASend( (SOCKET) socket, buffers, 2, &sent, VTK_IMAGE_PIPE_SEND_FLAGS, NULL, NULL ) != 0 )
+  {
+    return -1;
+  }
+  return (int) sent;
+#else
+  struct iovec buffers[2];
+  buffers[0].iov_base = (void*) header;
+  buffers[0].iov_len = headerSize;
+  buffers[1].iov_base = (void*) data;
+  buffers[1].iov_len = dataSize;
+  struct msghdr message;
+  memset( &message, 0, sizeof(message) );
+  message.msg_iov = buffers;
+  message.msg_iovlen = 2;
+  return (int) sendmsg( socket, &message, VTK_IMAGE_PIPE_SEND_FLAGS );
+#endif
+}
+
+//----------------------------------------------------------------------------
+static int vtkImagePipeSetNonBlocking( int socket )
+{
+#ifdef _WIN32
+  u_long nonBlocking = 1;
+  return ioctlsocket( (SOCKET) socket, FIONBIO, &nonBlocking ) == 0;
+#else
+  int flags = fcntl( socket, F_GETFL, 0 );
+  return flags >= 0 && fcntl( socket, F_SETFL, flags | O_NONBLOCK ) == 0;
+#endif
+}
+
+//----------------------------------------------------------------------------
+// loopback datagram socket connected to itself, a byte sent on it wakes
+// the reactor (the same code works with poll and WSAPoll)
+static int vtkImagePipeCreateWakeSocket()
+{
+  int wake = (int) socket( AF_INET, SOCK_DGRAM, 0 );
+  if( wake < 0 )
+  {
+    return -1;
+  }
+  struct sockaddr_in address;
+  memset( &address, 0, sizeof(address) );
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  address.sin_port = 0;
+#ifdef _WIN32
+  int length = sizeof(address);
+#else
+  socklen_t length = sizeof(address);
+#endif
+  if( bind( wake, (struct sockaddr*) &address, sizeof(address) ) ||
+      getsockname( wake, (struct sockaddr*) &address, &length ) ||
+      connect( wake, (struct sockaddr*) &address, sizeof(address) ) ||
+      !vtkImagePipeSetNonBlocking( wake ) )
+  {
+    vtkImagePipeCloseDescriptor( wake );
+    return -1;
+  }
+  return wake;
+}
+
+//----------------------------------------------------------------------------
+// whether data can be read from the socket without blocking
+static bool vtkImagePipeHasData( int socket )
+{
+  fd_set readSet;
+  FD_ZERO( &readSet );
+  FD_SET( socket, &readSet );
+  struct timeval timeout;
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 0;
+  return select( socket + 1, &readSet, NULL, NULL, &timeout ) > 0;
+}
+
+//----------------------------------------------------------------------------
+static inline void vtkImagePipeAppend( std::vector<unsigned char>& out, unsigned int value )
+{
+  unsigned char bytes[4] = { (unsigned char) value, (unsigned char) (value >> 8), (unsigned char) (value >> 16), (unsigned char) (value >> 24) };
+  out.insert( out.end(), bytes, bytes + 4 );
+}
+
+static inline unsigned int vtkImagePipeRead( const unsigned char* in )
+{
+  return in[0] | (in[1] << 8) | (in[2] << 16) | ((unsigned int) in[3] << 24);
+}
+
+//----------------------------------------------------------------------------
+// Delta encoding: the offset of the first changed byte, then up to the last
+// changed byte, runs of (unchanged count, changed count, XOR of the changed
+// bytes). The reference is left untouched, raw frames may still be sent from it.
+static void vtkImagePipeEncodeDelta( const unsigned char* image, const unsigned char* reference, int size, std::vector<unsigned char>& out )
+{
+  //short unchanged runs are cheaper to send as part of the changed ones
+  const int minUnchanged = 8;
+  out.clear();
+
+  int first = 0;
+  while( first + 8 <= size && !memcmp( image + first, reference + first, 8 ) )
+  {
+    first += 8;
+  }
+  while( first < size && image[first] == reference[first] )
+  {
+    first++;
+  }
+  if( first == size )
+  {
+    return;
+  }
+  int last = size - 1;
+  while( image[last] == reference[last] )
+  {
+    last--;
+  }
+
+  vtkImagePipeAppend( out, first );
+  int i = first;
+  while( i <= last )
+  {
+    int unchanged = i;
+    while( i + 8 <= last && !memcmp( image + i, reference + i, 8 ) )
+    {
+      i += 8;
+    }
+    while( image[i] == reference[i] )
+    {
+      i++;
+    }
+    unchanged = i - unchanged;
+
+    //changed bytes, up to the next long enough unchanged run
+    int start = i;
+    int run = 0;
+    while( i <= last && run < minUnchanged )
+    {
+      run = (image[i] == reference[i]) ? run + 1 : 0;
+      i++;
+    }
+    int end = (run == minUnchanged) ? i - run : i;
+    i = end;
+
+    vtkImagePipeAppend( out, unchanged );
+    vtkImagePipeAppend( out, end - start );
+    size_t offset = out.size();
+    out.resize( offset + end - start );
+    for( int k = start; k < end; k++ )
+    {
+      out[offset++] = image[k] ^ reference[k];
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+static int vtkImagePipeDecodeDelta( const unsigned char* in, int inSize, unsigned char* image, int size )
+{
+  if( inSize == 0 )
+  {
+    return 1;
+  }
+  if( inSize < 4 )
+  {
+    return 0;
+  }
+  const unsigned char* end = in + inSize;
+  unsigned int position = vtkImagePipeRead( in );
+  in += 4;
+  while( in < end )
+  {
+    if( end - in < 8 )
+    {
+      return 0;
+    }
+    unsigned int unchanged = vtkImagePipeRead( in );
+    unsigned int changed = vtkImagePipeRead( in + 4 );
+    in += 8;
+    position += unchanged;
+    if( (unsigned int) (end - in) < changed || position + changed > (unsigned int) size )
+    {
+      return 0;
+    }
+    for( unsigned int k = 0; k < changed; k++ )
+    {
+      image[position++] ^= in[k];
+    }
+    in += changed;
+  }
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+// LZ encoding, the LZ4 block layout: a token with the literal count and the
+// match length - 4 (15 meaning more in the following bytes), the literals,
+// then the 16 bit offset of the match. The last sequence has no match.
+static void vtkImagePipeAppendLength( std::vector<unsigned char>& out, int length )
+{
+  for( ; length >= 255; length -= 255 )
+  {
+    out.push_back( 255 );
+  }
+  out.push_back( (unsigned char) length );
+}
+
+static void vtkImagePipeEncodeLZ( const unsigned char* in, int size, std::vector<unsigned char>& out )
+{
+  const int hashBits = 14;
+  const int minMatch = 4;
+  std::vector<int> table( 1 << hashBits, -1 );
+  out.clear();
+  out.reserve( size / 4 + 16 );
+
+  int anchor = 0;
+  int i = 0;
+  while( i + minMatch <= size )
+  {
+    unsigned int sequence;
+    memcpy( &sequence, in + i, 4 );
+    unsigned int hash = (sequence * 2654435761u) >> (32 - hashBits);
+    int candidate = table[hash];
+    table[hash] = i;
+    if( candidate < 0 || i - candidate > 65535 || memcmp( in + candidate, in + i, 4 ) )
+    {
+      i++;
+      continue;
+    }
+
+    int length = minMatch;
+    while( i + length < size && in[candidate + length] == in[i + length] )
+    {
+      length++;
+    }
+
+    int literals = i - anchor;
+    int extra = length - minMatch;
+    out.push_back( (unsigned char) ((std::min( literals, 15 ) << 4) | std::min( extra, 15 )) );
+    if( literals >= 15 )
+    {
+      vtkImagePipeAppendLength( out, literals - 15 );
+    }
+    out.insert( out.end(), in + anchor, in + i );
+    int offset = i - candidate;
+    out.push_back( (unsigned char) offset );
+    out.push_back( (unsigned char) (offset >> 8) );
+    if( extra >= 15 )
+    {
+      vtkImagePipeAppendLength( out, extra - 15 );
+    }
+
+    i += length;
+    anchor = i;
+  }
+
+  int literals = size - anchor;
+  out.push_back( (unsigned char) (std::min( literals, 15 ) << 4) );
+  if( literals >= 15 )
+  {
+    vtkImagePipeAppendLength( out, literals - 15 );
+  }
+  out.insert( out.end(), in + anchor, in + size );
+}
+
+//----------------------------------------------------------------------------
+static int vtkImagePipeReadLength( const unsigned char*& in, const unsigned char* end, int& length )
+{
+  unsigned char byte = 255;
+  while( byte == 255 )
+  {
+    if( in >= end )
+    {
+      return 0;
+    }
+    byte = *in++;
+    length += byte;
+  }
+  return 1;
+}
+
+static int vtkImagePipeDecodeLZ( const unsigned char* in, int inSize, unsigned char* image, int size )
+{
+  const unsigned char* end = in + inSize;
+  int position = 0;
+  while( in < end )
+  {
+    unsigned char token = *in++;
+    int literals = token >> 4;
+    if( literals == 15 && !vtkImagePipeReadLength( in, end, literals ) )
+    {
+      return 0;
+    }
+    if( end - in < literals || position + literals > size )
+    {
+      return 0;
+    }
+    memcpy( image + position, in, literals );
+    position += literals;
+    in += literals;
+    if( in == end )
+    {
+      break;
+    }
+
+    if( end - in < 2 )
+    {
+      return 0;
+    }
+    int offset = in[0] | (in[1] << 8);
+    in += 2;
+    int length = token & 15;
+    if( length == 15 && !vtkImagePipeReadLength( in, end, length ) )
+    {
+      return 0;
+    }
+    length += 4;
+    if( offset == 0 || offset > position || position + length > size )
+    {
+      return 0;
+    }
+
+    //the match may overlap what it copies
+    for( int k = 0; k < length; k++, position++ )
+    {
+      image[position] = image[position - offset];
+    }
+  }
+  return position == size;
+}
+
 
 //----------------------------------------------------------------------------
 vtkImagePipe::vtkImagePipe()
@@ -59,17 +625,54 @@ vtkImagePipe::vtkImagePipe()
   this->ImageSize = 0;
 
   //initialize the mutex locks
-  this->newThreadLock = vtkMutexLock::New();
   this->rwBufferLock = vtkReadWriteLock::New();
 
+  //no clients and no copy of the input yet
+  this->snapshot = new vtkImagePipeSnapshot;
+  this->snapshot->id = 0;
+  this->snapshot->image = 0;
+  this->snapshot->previous = 0;
+  for( int i = 0; i < VTK_IMAGE_PIPE_NUMBER_OF_MESSAGES; i++ )
+  {
+    this->snapshot->messages[i] = 0;
+  }
+  this->wakeSocket = -1;
+  this->stopping = false;
+
+  //no subscription and no frame yet
+  this->subscriptionMode = false;
+  this->frameSequence = 0;
+  this->lastFrameMTime = 0;
+  this->frameLock = vtkMutexLock::New();
+  this->backScalars = 0;
+  this->backSequence = 0;
+  this->backIsLatest = false;
+  this->skippedFrames = 0;
+
+  //raw frames until another encoding is asked for
+  this->encoding = VTK_IMAGE_PIPE_RAW;
+  this->lastFrameBytes = 0;
+  this->lastEncodeTime = 0.0;
+  this->lastDecodeTime = 0.0;
 }
 
 //----------------------------------------------------------------------------
 vtkImagePipe::~vtkImagePipe()
 {
   this->ReleaseSystemResources();
-  this->newThreadLock->Delete();
+  for( int i = 0; i < VTK_IMAGE_PIPE_NUMBER_OF_MESSAGES; i++ )
+  {
+    vtkImagePipeReleaseMessage( this->snapshot->messages[i] );
+  }
+  vtkImagePipeReleaseImage( this->snapshot->image );
+  vtkImagePipeReleaseImage( this->snapshot->previous );
+  delete this->snapshot;
   this->rwBufferLock->Delete();
+  this->frameLock->Delete();
+  if( this->backScalars )
+  {
+    this->backScalars->Delete();
+  }
   this->threader->Delete();
 }
 
@@ -83,13 +686,21 @@ void vtkImagePipe::ReleaseSystemResources()
 
   if( !this->isServer )
   {
-    int request = -1;
+    int request = VTK_IMAGE_PIPE_DISCONNECT;
     this->clientSocket->Send( (void*) &request, sizeof(request) );
     this->clientSocket->CloseSocket();
   }
   else
   {
+    //ask the reactor to flush and disconnect the clients, and wait for it
+    this->frameLock->Lock();
+    this->stopping = true;
+    this->frameLock->Unlock();
+    char wake = 0;
+    send( this->wakeSocket, &wake, 1, 0 );
     this->threader->TerminateThread( this->mainServerThread );
+    vtkImagePipeCloseDescriptor( this->wakeSocket );
+    this->wakeSocket = -1;
   }
 
   if( this->serverSocket )
@@ -216,37 +827,186 @@ void vtkImagePipe::SetSourceAddress( char* ipAddress, int portNumber )
 }
 
 //----------------------------------------------------------------------------
-void vtkImagePipe::PrintSelf(ostream& os, vtkIndent indent)
+void vtkImagePipe::SetSubscriptionMode( bool subscribe )
+{
+  if (this->Initialized)
+  {
+    vtkErrorMacro("Must uninitialize before changing parameters.");
+    return;
+  }
+  this->subscriptionMode = subscribe;
+}
+
+//----------------------------------------------------------------------------
+bool vtkImagePipe::GetSubscriptionMode()
+{
+  return this->subscriptionMode;
+}
+
+//----------------------------------------------------------------------------
+unsigned int vtkImagePipe::GetFrameSequence()
 {
+  return this->frameSequence;
+}
 
+//----------------------------------------------------------------------------
+int vtkImagePipe::GetNumberOfSkippedFrames()
+{
+  return this->skippedFrames;
 }
 
 //----------------------------------------------------------------------------
-void vtkImagePipe::Initialize()
+void vtkImagePipe::SetEncoding( int encoding )
 {
-  // if we are already initialized, do not initialize again
   if (this->Initialized)
   {
+    vtkErrorMacro("Must uninitialize before changing parameters.");
     return;
   }
-
-  //if we haven't set the client-server status,
-  if ( !this->serverSet || this->portNumber == -1 )
+  if( encoding != VTK_IMAGE_PIPE_RAW && encoding != VTK_IMAGE_PIPE_DELTA_RLE && encoding != VTK_IMAGE_PIPE_LZ )
   {
-    vtkErrorMacro("Set the client/server settings before initialization.");
+    vtkErrorMacro("Unknown encoding.");
     return;
   }
+  this->encoding = encoding;
+}
 
-  //if we are the server, make sure we have input set
-  if( this->isServer )
-  {
-    if( !this->buffer )
-    {
-      vtkErrorMacro("Need to set the input.");
-      return;
-    }
-    this->mainServerThread = this->threader->SpawnThread( (vtkThreadFunctionType) &FirstServerSideUpdate, (void*) this );
-  }
+//----------------------------------------------------------------------------
+int vtkImagePipe::GetEncoding()
+{
+  return this->encoding;
+}
+
+//----------------------------------------------------------------------------
+int vtkImagePipe::GetLastFrameBytes()
+{
+  return this->lastFrameBytes;
+}
+
+//----------------------------------------------------------------------------
+double vtkImagePipe::GetLastCompressionRatio()
+{
+  return this->lastFrameBytes > 0 ? (double) this->ImageSize / (double) this->lastFrameBytes : 0.0;
+}
+
+//----------------------------------------------------------------------------
+double vtkImagePipe::GetLastEncodeTime()
+{
+  return this->lastEncodeTime;
+}
+
+//----------------------------------------------------------------------------
+double vtkImagePipe::GetLastDecodeTime()
+{
+  return this->lastDecodeTime;
+}
+
+//----------------------------------------------------------------------------
+int vtkImagePipe::GetNumberOfClients()
+{
+  this->frameLock->Lock();
+  int numberOfClients = (int) this->connections.size();
+  this->frameLock->Unlock();
+  return numberOfClients;
+}
+
+//----------------------------------------------------------------------------
+double vtkImagePipe::GetClientBytesSent( int client )
+{
+  double bytesSent = 0.0;
+  this->frameLock->Lock();
+  if( client >= 0 && client < (int) this->connections.size() )
+  {
+    bytesSent = this->connections[client]->bytesSent;
+  }
+  this->frameLock->Unlock();
+  return bytesSent;
+}
+
+//----------------------------------------------------------------------------
+int vtkImagePipe::GetClientFramesSent( int client )
+{
+  int framesSent = 0;
+  this->frameLock->Lock();
+  if( client >= 0 && client < (int) this->connections.size() )
+  {
+    framesSent = this->connections[client]->framesSent;
+  }
+  this->frameLock->Unlock();
+  return framesSent;
+}
+
+//----------------------------------------------------------------------------
+int vtkImagePipe::GetClientFramesSkipped( int client )
+{
+  int framesSkipped = 0;
+  this->frameLock->Lock();
+  if( client >= 0 && client < (int) this->connections.size() )
+  {
+    framesSkipped = this->connections[client]->framesSkipped;
+  }
+  this->frameLock->Unlock();
+  return framesSkipped;
+}
+
+//----------------------------------------------------------------------------
+double vtkImagePipe::GetClientThroughput( int client )
+{
+  double throughput = 0.0;
+  this->frameLock->Lock();
+  if( client >= 0 && client < (int) this->connections.size() )
+  {
+    double elapsed = vtkTimerLog::GetUniversalTime() - this->connections[client]->connectTime;
+    throughput = elapsed > 0.0 ? this->connections[client]->bytesSent / elapsed : 0.0;
+  }
+  this->frameLock->Unlock();
+  return throughput;
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePipe::PrintSelf(ostream& os, vtkIndent indent)
+{
+
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePipe::Initialize()
+{
+  // if we are already initialized, do not initialize again
+  if (this->Initialized)
+  {
+    return;
+  }
+
+  //if we haven't set the client-server status,
+  if ( !this->serverSet || this->portNumber == -1 )
+  {
+    vtkErrorMacro("Set the client/server settings before initialization.");
+    return;
+  }
+
+  //if we are the server, make sure we have input set
+  if( this->isServer )
+  {
+    if( !this->buffer )
+    {
+      vtkErrorMacro("Need to set the input.");
+      return;
+    }
+    this->wakeSocket = vtkImagePipeCreateWakeSocket();
+    if( this->wakeSocket < 0 || !vtkImagePipeSetNonBlocking( this->serverSocket->GetSocketDescriptor() ) )
+    {
+      vtkErrorMacro("Could not set up the server sockets.");
+      if( this->wakeSocket >= 0 )
+      {
+        vtkImagePipeCloseDescriptor( this->wakeSocket );
+        this->wakeSocket = -1;
+      }
+      return;
+    }
+    this->stopping = false;
+    this->mainServerThread = this->threader->SpawnThread( (vtkThreadFunctionType) &ServerSideReactor, (void*) this );
+  }
 
   //create the connection if a client
   if( !this->isServer )
@@ -257,6 +1017,38 @@ void vtkImagePipe::Initialize()
       vtkErrorMacro("Could not connect to server side socket.");
       return;
     }
+
+    //agree on the encoding, the server falls back to raw frames if it does not know it
+    if( this->encoding != VTK_IMAGE_PIPE_RAW )
+    {
+      int request[2] = { VTK_IMAGE_PIPE_NEGOTIATE, this->encoding };
+      int accepted = VTK_IMAGE_PIPE_RAW;
+      if( !this->clientSocket->Send( request, sizeof(request) ) ||
+          !this->clientSocket->Receive( &accepted, sizeof(accepted), 1 ) )
+      {
+        vtkErrorMacro("Could not negotiate the encoding with the server.");
+        return;
+      }
+      if( accepted != this->encoding )
+      {
+        vtkWarningMacro("Server does not support the encoding, using raw frames.");
+      }
+      this->encoding = accepted;
+    }
+    this->backIsLatest = false;
+
+    //from now on the server pushes the frames
+    if( this->subscriptionMode )
+    {
+      int request = VTK_IMAGE_PIPE_SUBSCRIBE;
+      if( !this->clientSocket->Send( &request, sizeof(request) ) )
+      {
+        vtkErrorMacro("Could not subscribe to the server.");
+        return;
+      }
+      this->frameSequence = 0;
+      this->skippedFrames = 0;
+    }
   }
 
   //create output buffer if client
@@ -270,103 +1062,450 @@ void vtkImagePipe::Initialize()
 }
 
 //----------------------------------------------------------------------------
-// platform-independent sleep function
-static inline void vtkSleep(double duration)
+void* vtkImagePipe::ServerSideReactor(vtkMultiThreader::ThreadInfo *data)
 {
-  duration = duration; // avoid warnings
-  // sleep according to OS preference
-#ifdef _WIN32
-  Sleep((int)(1000*duration));
-#elif defined(__FreeBSD__) || defined(__linux__) || defined(sgi)
-  struct timespec sleep_time, dummy;
-  sleep_time.tv_sec = (int)duration;
-  sleep_time.tv_nsec = (int)(1000000000*(duration-sleep_time.tv_sec));
-  nanosleep(&sleep_time,&dummy);
-#endif
+  vtkImagePipe *self = (vtkImagePipe *)(data->UserData);
+  int listener = self->serverSocket->GetSocketDescriptor();
+  std::vector<struct pollfd> descriptors;
+
+  while(true)
+  {
+    //wait on the wake socket, the listening socket and every client,
+    //for writing too on the clients with something queued
+    descriptors.resize( 2 + self->connections.size() );
+    descriptors[0].fd = self->wakeSocket;
+    descriptors[1].fd = listener;
+    for( size_t i = 0; i < self->connections.size(); i++ )
+    {
+      vtkImagePipeConnection* connection = self->connections[i];
+      descriptors[2 + i].fd = connection->socket->GetSocketDescriptor();
+      descriptors[2 + i].events = connection->pending.empty() ? POLLIN : (POLLIN | POLLOUT);
+    }
+    descriptors[0].events = descriptors[1].events = POLLIN;
+    for( size_t i = 0; i < descriptors.size(); i++ )
+    {
+      descriptors[i].revents = 0;
+    }
+    if( vtkImagePipePoll( &(descriptors[0]), (unsigned long) descriptors.size(), -1 ) < 0 && !vtkImagePipeWouldBlock() )
+    {
+      break;
+    }
+
+    self->frameLock->Lock();
+    bool stopping = self->stopping;
+    unsigned int sequence = self->frameSequence;
+    self->frameLock->Unlock();
+    if( stopping )
+    {
+      break;
+    }
+
+    if( descriptors[0].revents )
+    {
+      char wake[64];
+      while( recv( self->wakeSocket, wake, sizeof(wake), 0 ) > 0 ) {}
+    }
+    if( descriptors[1].revents )
+    {
+      self->AcceptClient();
+    }
+
+    //serve the requests, then push the newest frame to the subscribers
+    //not busy with an older one, and send what they can take right now
+    std::vector<vtkImagePipeConnection*> closed;
+    for( size_t i = 0; i < descriptors.size() - 2; i++ )
+    {
+      vtkImagePipeConnection* connection = self->connections[i];
+      bool alive = (!descriptors[2 + i].revents || self->ReceiveRequests( connection )) && self->FlushConnection( connection );
+      if( alive && connection->subscribed && connection->pending.empty() && connection->lastSequence != sequence )
+      {
+        self->QueueFrame( connection );
+        alive = self->FlushConnection( connection );
+      }
+      if( !alive )
+      {
+        closed.push_back( connection );
+      }
+    }
+
+    //forget about the disconnected clients
+    for( size_t i = 0; i < closed.size(); i++ )
+    {
+      vtkImagePipeConnection* connection = closed[i];
+      self->frameLock->Lock();
+      self->connections.erase( std::find( self->connections.begin(), self->connections.end(), connection ) );
+      self->frameLock->Unlock();
+      for( size_t k = 0; k < connection->pending.size(); k++ )
+      {
+        vtkImagePipeReleaseMessage( connection->pending[k].message );
+      }
+      vtkImagePipeReleaseImage( connection->base );
+      connection->socket->CloseSocket();
+      connection->socket->Delete();
+      delete connection;
+    }
+  }
+
+  self->CloseConnections();
+  return 0;
 }
 
 //----------------------------------------------------------------------------
-void* vtkImagePipe::FirstServerSideUpdate(vtkMultiThreader::ThreadInfo *data)
+void vtkImagePipe::AcceptClient()
 {
+  //the listening socket is readable, so this does not wait
+  vtkClientSocket* client = this->serverSocket->WaitForConnection(1);
+  if( !client )
+  {
+    return;
+  }
+  if( !vtkImagePipeSetNonBlocking( client->GetSocketDescriptor() ) )
+  {
+    client->CloseSocket();
+    client->Delete();
+    return;
+  }
 
-  vtkImagePipe *self = (vtkImagePipe *)(data->UserData);
+  vtkImagePipeConnection* connection = new vtkImagePipeConnection;
+  connection->socket = client;
+  connection->encoding = VTK_IMAGE_PIPE_RAW;
+  connection->framed = false;
+  connection->subscribed = false;
+  connection->requestBytes = 0;
+  connection->base = 0;
+  connection->lastSequence = 0;
+  connection->connectTime = vtkTimerLog::GetUniversalTime();
+  connection->bytesSent = 0.0;
+  connection->framesSent = 0;
+  connection->framesSkipped = 0;
+
+  this->frameLock->Lock();
+  this->connections.push_back( connection );
+  this->frameLock->Unlock();
+}
 
-  //enter the infinite loop
+//----------------------------------------------------------------------------
+int vtkImagePipe::ReceiveRequests( vtkImagePipeConnection* connection )
+{
+  int socket = connection->socket->GetSocketDescriptor();
   while(true)
   {
-    //check for any new clients
-    vtkClientSocket* newClient = self->serverSocket->WaitForConnection(1);
-    if( newClient )
+    //a request is an int, a negotiation is followed by the encoding
+    int needed = sizeof(int);
+    if( connection->requestBytes >= (int) sizeof(int) && connection->request[0] == VTK_IMAGE_PIPE_NEGOTIATE )
+    {
+      needed = 2 * sizeof(int);
+    }
+    int amount = recv( socket, (char*) connection->request + connection->requestBytes, needed - connection->requestBytes, 0 );
+    if( amount == 0 )
+    {
+      return 0;
+    }
+    else if( amount < 0 )
+    {
+      return vtkImagePipeWouldBlock();
+    }
+    connection->requestBytes += amount;
+    if( connection->requestBytes < (int) sizeof(int) ||
+        (connection->request[0] == VTK_IMAGE_PIPE_NEGOTIATE && connection->requestBytes < (int) (2 * sizeof(int))) )
+    {
+      continue;
+    }
+    connection->requestBytes = 0;
+
+    int request = connection->request[0];
+    if( request == VTK_IMAGE_PIPE_NEGOTIATE )
+    {
+      //frames are sent with their header from now on
+      int encoding = connection->request[1];
+      if( encoding != VTK_IMAGE_PIPE_DELTA_RLE && encoding != VTK_IMAGE_PIPE_LZ )
+      {
+        encoding = VTK_IMAGE_PIPE_RAW;
+      }
+      connection->encoding = encoding;
+      connection->framed = true;
+      vtkImagePipePending answer = { vtkImagePipeNewMessage( false, &encoding, sizeof(encoding), 0 ), 0 };
+      connection->pending.push_back( answer );
+    }
+    else if( request == VTK_IMAGE_PIPE_SUBSCRIBE )
     {
-      self->newThreadLock->Lock();
-      self->clientSocket = newClient;
-      self->threader->SpawnThread( (vtkThreadFunctionType) &ServerSideUpdate, (void*) self );
+      //the client only listens to framed pushes from now on
+      connection->subscribed = true;
+      connection->framed = true;
+    }
+    else if( request == VTK_IMAGE_PIPE_PULL )
+    {
+      this->QueueFrame( connection );
     }
     else
     {
-      vtkSleep(100);
+      return 0;
     }
   }
-  return 0;
 }
 
 //----------------------------------------------------------------------------
-void* vtkImagePipe::ServerSideUpdate(vtkMultiThreader::ThreadInfo *data)
+int vtkImagePipe::FlushConnection( vtkImagePipeConnection* connection )
 {
-  //collect server and client information
-  vtkImagePipe *self = (vtkImagePipe *)(data->UserData);
-  vtkClientSocket* client = self->clientSocket;
-  self->newThreadLock->Unlock();
+  int socket = connection->socket->GetSocketDescriptor();
+  while( !connection->pending.empty() )
+  {
+    vtkImagePipePending& pending = connection->pending.front();
+    vtkImagePipeMessage* message = pending.message;
+    const std::vector<unsigned char>& payload = message->image ? message->image->data : message->encoded;
+    size_t headerSize = message->header.size();
+    size_t size = headerSize + payload.size();
 
-  //enter the infinite loop
-  while(true)
+    //the rest of the header and the payload, or the rest of the payload
+    int amount;
+    if( pending.offset < headerSize )
+    {
+      amount = vtkImagePipeSendGather( socket, &(message->header[pending.offset]), headerSize - pending.offset,
+                                       payload.empty() ? 0 : &(payload[0]), payload.size() );
+    }
+    else
+    {
+      amount = vtkImagePipeSendGather( socket, &(payload[pending.offset - headerSize]), size - pending.offset, 0, 0 );
+    }
+    if( amount < 0 )
+    {
+      return vtkImagePipeWouldBlock();
+    }
+    pending.offset += amount;
+
+    this->frameLock->Lock();
+    connection->bytesSent += amount;
+    if( pending.offset == size && message->frame )
+    {
+      connection->framesSent++;
+    }
+    this->frameLock->Unlock();
+
+    if( pending.offset < size )
+    {
+      return 1;
+    }
+    vtkImagePipeReleaseMessage( pending.message );
+    connection->pending.pop_front();
+  }
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePipe::QueueFrame( vtkImagePipeConnection* connection )
+{
+  this->UpdateSnapshot();
+  vtkImagePipeSnapshot* current = this->snapshot;
+
+  //pick the serialization, deltas depend on the last frame the client got
+  vtkImagePipeImage* base = connection->base;
+  int kind = VTK_IMAGE_PIPE_MESSAGE_PULL;
+  if( connection->framed && connection->encoding == VTK_IMAGE_PIPE_RAW )
   {
-    //if we have a request, push data onto the pipe
-    int request = 0;
-    int amount = client->Receive( &request, sizeof(request), 1 );
-    if( amount == 0 )
+    kind = VTK_IMAGE_PIPE_MESSAGE_RAW;
+  }
+  else if( connection->framed && connection->encoding == VTK_IMAGE_PIPE_LZ )
+  {
+    kind = VTK_IMAGE_PIPE_MESSAGE_LZ;
+  }
+  else if( connection->framed )
+  {
+    if( base == current->image )
     {
-      break;
+      kind = VTK_IMAGE_PIPE_MESSAGE_UNCHANGED;
     }
-    else if( amount < sizeof(request) )
+    else if( base && vtkImagePipeSameFormat( connection->baseInfo, current->info ) )
     {
-      continue;
+      kind = VTK_IMAGE_PIPE_MESSAGE_DELTA;
     }
-    else if( request != 1 )
+    else
     {
-      break;
+      kind = VTK_IMAGE_PIPE_MESSAGE_KEYFRAME;
+    }
+  }
+
+  //serialize the snapshot in that form if no client needed it yet. Only the
+  //delta against the previous snapshot is shared, the clients that skipped
+  //frames get one against the last image they have.
+  vtkImagePipeMessage* unshared = 0;
+  bool shared = (kind != VTK_IMAGE_PIPE_MESSAGE_DELTA || base == current->previous);
+  vtkImagePipeMessage*& message = shared ? current->messages[kind] : unshared;
+  if( !message )
+  {
+    int size = current->info.imageSize;
+    const unsigned char* image = size > 0 ? &(current->image->data[0]) : 0;
+    if( kind == VTK_IMAGE_PIPE_MESSAGE_PULL )
+    {
+      message = vtkImagePipeNewMessage( true, &(current->info), sizeof(current->info), current->image );
     }
+    else
+    {
+      vtkImagePipeFrameHeader header;
+      header.sequence = current->sequence;
+      header.info = current->info;
+      header.encoding = connection->encoding;
+      header.keyframe = (kind == VTK_IMAGE_PIPE_MESSAGE_KEYFRAME);
+      header.encodeTime = 0.0;
 
-    //read lock the buffer
-    self->rwBufferLock->ReaderLock();
+      //raw frames are sent from the snapshot, only encoded ones are copied
+      message = vtkImagePipeNewMessage( true, 0, 0, kind == VTK_IMAGE_PIPE_MESSAGE_RAW ? current->image : 0 );
+      double startTime = vtkTimerLog::GetUniversalTime();
+      if( kind == VTK_IMAGE_PIPE_MESSAGE_LZ )
+      {
+        vtkImagePipeEncodeLZ( image, size, message->encoded );
+      }
+      else if( kind == VTK_IMAGE_PIPE_MESSAGE_DELTA )
+      {
+        vtkImagePipeEncodeDelta( image, size > 0 ? &(base->data[0]) : 0, size, message->encoded );
+      }
+      else if( kind == VTK_IMAGE_PIPE_MESSAGE_KEYFRAME )
+      {
+        std::vector<unsigned char> empty( size, 0 );
+        vtkImagePipeEncodeDelta( image, size > 0 ? &(empty[0]) : 0, size, message->encoded );
+      }
+      header.encodeTime = vtkTimerLog::GetUniversalTime() - startTime;
 
-    //create the info structure
-    vtkImagePipeInitData initData;
-    self->buffer->GetExtent( initData.extent );
-    self->buffer->GetSpacing( initData.spacing );
-    self->buffer->GetOrigin( initData.origin );
-    initData.scalarType = self->buffer->GetScalarType();
-    initData.numComponents = self->buffer->GetNumberOfScalarComponents();
-    initData.scalarSize = self->buffer->GetScalarSize();
-    initData.imageSize = (initData.extent[1] - initData.extent[0] + 1) *
-                         (initData.extent[3] - initData.extent[2] + 1) *
-                         (initData.extent[5] - initData.extent[4] + 1) *
-                         initData.numComponents * initData.scalarSize;
-    self->ImageSize = initData.imageSize;
+      header.payloadSize = (kind == VTK_IMAGE_PIPE_MESSAGE_RAW) ? size : (int) message->encoded.size();
+      message->header.assign( (const unsigned char*) &header, (const unsigned char*) &header + sizeof(header) );
+    }
+  }
 
-    //send over the data
-    client->Send( (void*) &initData, sizeof(initData) );
-    client->Send( self->buffer->GetScalarPointer(), self->ImageSize );
+  if( shared )
+  {
+    message->references++;
+  }
+  vtkImagePipePending frame = { message, 0 };
+  connection->pending.push_back( frame );
 
-    //read unlock the buffer
-    self->rwBufferLock->ReaderUnlock();
+  //delta clients keep the image they will have once this frame is received
+  if( kind == VTK_IMAGE_PIPE_MESSAGE_DELTA || kind == VTK_IMAGE_PIPE_MESSAGE_KEYFRAME || kind == VTK_IMAGE_PIPE_MESSAGE_UNCHANGED )
+  {
+    current->image->references++;
+    vtkImagePipeReleaseImage( connection->base );
+    connection->base = current->image;
+    connection->baseInfo = current->info;
+  }
+  else
+  {
+    vtkImagePipeReleaseImage( connection->base );
+    connection->base = 0;
   }
 
-  client->CloseSocket();
-  return 0;
+  //subscribers skip the frames published while they were busy
+  if( connection->subscribed && connection->lastSequence != 0 && current->sequence > connection->lastSequence + 1 )
+  {
+    this->frameLock->Lock();
+    connection->framesSkipped += current->sequence - connection->lastSequence - 1;
+    this->frameLock->Unlock();
+  }
+  connection->lastSequence = current->sequence;
 }
 
-//----------------------------------------------------------------------------//----------------------------------------------------------------------------
+//----------------------------------------------------------------------------
+void vtkImagePipe::UpdateSnapshot()
+{
+  vtkImagePipeSnapshot* current = this->snapshot;
+  this->frameLock->Lock();
+  unsigned int sequence = this->frameSequence;
+  this->frameLock->Unlock();
+
+  //copy the input once if it changed, everything else works on the copy
+  this->rwBufferLock->ReaderLock();
+  vtkMTimeType mtime = this->buffer->GetMTime();
+  if( current->id && mtime == current->mtime && sequence == current->sequence )
+  {
+    this->rwBufferLock->ReaderUnlock();
+    return;
+  }
+  vtkImagePipeInitData info;
+  vtkImagePipeFillInitData( this->buffer, info );
+
+  //reuse the image before the previous one unless a queued raw frame or a client still uses it
+  vtkImagePipeImage* image = current->previous;
+  current->previous = current->image;
+  if( !image || image->references > 1 )
+  {
+    vtkImagePipeReleaseImage( image );
+    image = new vtkImagePipeImage;
+    image->references = 1;
+  }
+  image->data.resize( info.imageSize );
+  if( info.imageSize > 0 )
+  {
+    memcpy( &(image->data[0]), this->buffer->GetScalarPointer(), info.imageSize );
+  }
+  current->image = image;
+  this->rwBufferLock->ReaderUnlock();
+
+  for( int i = 0; i < VTK_IMAGE_PIPE_NUMBER_OF_MESSAGES; i++ )
+  {
+    vtkImagePipeReleaseMessage( current->messages[i] );
+    current->messages[i] = 0;
+  }
+  current->id++;
+  current->mtime = mtime;
+  current->sequence = sequence;
+  current->info = info;
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePipe::CloseConnections()
+{
+  //subscribers get the last frame even if they are still busy with one
+  this->frameLock->Lock();
+  unsigned int sequence = this->frameSequence;
+  this->frameLock->Unlock();
+  for( size_t i = 0; i < this->connections.size(); i++ )
+  {
+    if( this->connections[i]->subscribed && this->connections[i]->lastSequence != sequence )
+    {
+      this->QueueFrame( this->connections[i] );
+    }
+  }
+
+  //give the clients up to a second to take what is still queued
+  double deadline = vtkTimerLog::GetUniversalTime() + 1.0;
+  std::vector<struct pollfd> descriptors;
+  while( vtkTimerLog::GetUniversalTime() < deadline )
+  {
+    descriptors.clear();
+    for( size_t i = 0; i < this->connections.size(); i++ )
+    {
+      if( !this->connections[i]->pending.empty() && this->FlushConnection( this->connections[i] ) &&
+          !this->connections[i]->pending.empty() )
+      {
+        struct pollfd descriptor;
+        descriptor.fd = this->connections[i]->socket->GetSocketDescriptor();
+        descriptor.events = POLLOUT;
+        descriptor.revents = 0;
+        descriptors.push_back( descriptor );
+      }
+    }
+    if( descriptors.empty() )
+    {
+      break;
+    }
+    vtkImagePipePoll( &(descriptors[0]), (unsigned long) descriptors.size(), 10 );
+  }
+
+  this->frameLock->Lock();
+  std::vector<vtkImagePipeConnection*> closed;
+  closed.swap( this->connections );
+  this->frameLock->Unlock();
+  for( size_t i = 0; i < closed.size(); i++ )
+  {
+    for( size_t k = 0; k < closed[i]->pending.size(); k++ )
+    {
+      vtkImagePipeReleaseMessage( closed[i]->pending[k].message );
+    }
+    vtkImagePipeReleaseImage( closed[i]->base );
+    closed[i]->socket->CloseSocket();
+    closed[i]->socket->Delete();
+    delete closed[i];
+  }
+}
+
+//----------------------------------------------------------------------------
 void vtkImagePipe::Update()
 {
   if( !this->Initialized )
@@ -377,7 +1516,27 @@ void vtkImagePipe::Update()
   {
     //protect buffer updating with read/write lock
     this->rwBufferLock->WriterLock();
+    vtkMTimeType inputMTime = this->buffer->GetMTime();
     this->rwBufferLock->WriterUnlock();
+
+    //wake the reactor if the input was modified since the last frame
+    this->frameLock->Lock();
+    bool modified = (inputMTime != this->lastFrameMTime);
+    if( modified )
+    {
+      this->lastFrameMTime = inputMTime;
+      this->frameSequence++;
+    }
+    this->frameLock->Unlock();
+    if( modified )
+    {
+      char wake = 0;
+      send( this->wakeSocket, &wake, 1, 0 );
+    }
+  }
+  else if( this->subscriptionMode )
+  {
+    SubscribedClientSideUpdate();
   }
   else
   {
@@ -385,11 +1544,169 @@ void vtkImagePipe::Update()
   }
 }
 
+//----------------------------------------------------------------------------
+void vtkImagePipe::SubscribedClientSideUpdate()
+{
+  //wait for the first frame, then only take the frames already received
+  int received = 0;
+  unsigned int previousSequence = this->frameSequence;
+  if( this->frameSequence == 0 )
+  {
+    if( !this->ReceiveFrame() )
+    {
+      vtkErrorMacro("Server unavailable.");
+      return;
+    }
+    received++;
+  }
+  while( vtkImagePipeHasData( this->clientSocket->GetSocketDescriptor() ) )
+  {
+    if( !this->ReceiveFrame() )
+    {
+      vtkErrorMacro("Server unavailable.");
+      break;
+    }
+    received++;
+  }
+  //frames not newer than the output are stale
+  if( received == 0 || this->backSequence <= previousSequence )
+  {
+    this->skippedFrames += received;
+    return;
+  }
+
+  this->SwapFrame();
+  this->skippedFrames += received - 1;
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePipe::SwapFrame()
+{
+  //swap the newest frame into the output, the previous scalars receive the next one
+  vtkDataArray* front = this->buffer->GetPointData()->GetScalars();
+  if( front )
+  {
+    front->Register( this );
+  }
+  this->buffer->SetExtent( this->backExtent );
+  this->buffer->SetOrigin( this->backOrigin );
+  this->buffer->SetSpacing( this->backSpacing );
+  this->buffer->GetPointData()->SetScalars( this->backScalars );
+  this->buffer->Modified();
+  this->backScalars->Delete();
+  this->backScalars = front;
+  this->backIsLatest = false;
+
+  this->frameSequence = this->backSequence;
+}
+
+//----------------------------------------------------------------------------
+int vtkImagePipe::ReceiveFrame()
+{
+  vtkImagePipeFrameHeader header;
+  if( !this->clientSocket->Receive( (void*) &header, sizeof(header), 1 ) )
+  {
+    return 0;
+  }
+  //the stream cannot be trusted past a bad header, so the connection is dropped
+  vtkImagePipeInitData& initData = header.info;
+  if( !vtkImagePipeCheckInitData( initData ) )
+  {
+    vtkErrorMacro("Image information packet does not conform to the image size error check.");
+    this->clientSocket->CloseSocket();
+    return 0;
+  }
+  if( !vtkImagePipeCheckPayloadSize( header.encoding, header.payloadSize, initData.imageSize ) )
+  {
+    vtkErrorMacro("Frame payload does not match its encoding and image size.");
+    this->clientSocket->CloseSocket();
+    return 0;
+  }
+  this->ImageSize = initData.imageSize;
+
+  //the back buffer is only reallocated if the image format changes
+  vtkIdType numTuples = initData.imageSize / (initData.numComponents * initData.scalarSize);
+  if( !this->backScalars || this->backScalars->GetDataType() != initData.scalarType ||
+      this->backScalars->GetNumberOfComponents() != initData.numComponents )
+  {
+    if( this->backScalars )
+    {
+      this->backScalars->Delete();
+    }
+    this->backScalars = vtkDataArray::CreateDataArray( initData.scalarType );
+    this->backScalars->SetNumberOfComponents( initData.numComponents );
+  }
+  if( this->backScalars->GetNumberOfTuples() != numTuples )
+  {
+    this->backScalars->SetNumberOfTuples( numTuples );
+  }
+
+  unsigned char* back = (unsigned char*) this->backScalars->GetVoidPointer(0);
+  if( header.encoding == VTK_IMAGE_PIPE_RAW )
+  {
+    if( header.payloadSize != this->ImageSize || !this->clientSocket->Receive( back, this->ImageSize, 1 ) )
+    {
+      return 0;
+    }
+    this->lastDecodeTime = 0.0;
+  }
+  else
+  {
+    this->payload.resize( header.payloadSize );
+    if( header.payloadSize > 0 && !this->clientSocket->Receive( &(this->payload[0]), header.payloadSize, 1 ) )
+    {
+      return 0;
+    }
+
+    double startTime = vtkTimerLog::GetUniversalTime();
+    const unsigned char* in = header.payloadSize > 0 ? &(this->payload[0]) : NULL;
+    int decoded = 0;
+    if( header.encoding == VTK_IMAGE_PIPE_DELTA_RLE )
+    {
+      //the delta is against the last frame received, which may already be in the output
+      if( header.keyframe )
+      {
+        memset( back, 0, this->ImageSize );
+      }
+      else if( !this->backIsLatest )
+      {
+        vtkDataArray* front = this->buffer->GetPointData()->GetScalars();
+        if( !front || front->GetNumberOfTuples() * front->GetNumberOfComponents() * front->GetDataTypeSize() != this->ImageSize )
+        {
+          vtkErrorMacro("Delta frame without the frame it is based on.");
+          return 0;
+        }
+        memcpy( back, front->GetVoidPointer(0), this->ImageSize );
+      }
+      decoded = vtkImagePipeDecodeDelta( in, header.payloadSize, back, this->ImageSize );
+    }
+    else if( header.encoding == VTK_IMAGE_PIPE_LZ )
+    {
+      decoded = vtkImagePipeDecodeLZ( in, header.payloadSize, back, this->ImageSize );
+    }
+    this->lastDecodeTime = vtkTimerLog::GetUniversalTime() - startTime;
+    if( !decoded )
+    {
+      vtkErrorMacro("Could not decode the frame.");
+      return 0;
+    }
+  }
+  this->backIsLatest = true;
+  this->lastFrameBytes = (int) sizeof(header) + header.payloadSize;
+  this->lastEncodeTime = header.encodeTime;
+
+  this->backSequence = header.sequence;
+  memcpy( this->backExtent, initData.extent, sizeof(this->backExtent) );
+  memcpy( this->backOrigin, initData.origin, sizeof(this->backOrigin) );
+  memcpy( this->backSpacing, initData.spacing, sizeof(this->backSpacing) );
+  return 1;
+}
+
 //----------------------------------------------------------------------------
 void vtkImagePipe::ClientSideUpdate()
 {
   //send input request
-  int request = 1;
+  int request = VTK_IMAGE_PIPE_PULL;
   int serverThere = this->clientSocket->Send( &request, sizeof(request) );
   if( !serverThere )
   {
@@ -397,6 +1714,18 @@ void vtkImagePipe::ClientSideUpdate()
     return;
   }
 
+  //with a negotiated encoding the answer is an encoded frame
+  if( this->encoding != VTK_IMAGE_PIPE_RAW )
+  {
+    if( !this->ReceiveFrame() )
+    {
+      vtkErrorMacro("Server unavailable.");
+      return;
+    }
+    this->SwapFrame();
+    return;
+  }
+
   //collect input parameters and change the output buffer if needed
   vtkImagePipeInitData initData;
   serverThere = clientSocket->Receive( (void*) &initData, sizeof(initData), 1 );
@@ -405,19 +1734,16 @@ void vtkImagePipe::ClientSideUpdate()
     vtkErrorMacro("Server unavailable.");
     return;
   }
-  this->buffer->SetSpacing( initData.spacing );
-  this->buffer->SetOrigin( initData.origin );
-  this->buffer->SetExtent( initData.extent );
-  int calcImageSize = (initData.extent[1] - initData.extent[0] + 1) *
-                      (initData.extent[3] - initData.extent[2] + 1) *
-                      (initData.extent[5] - initData.extent[4] + 1) *
-                      initData.numComponents * initData.scalarSize;
-  this->ImageSize = initData.imageSize;
-  if( this->ImageSize != calcImageSize )
+  if( !vtkImagePipeCheckInitData( initData ) )
   {
     vtkErrorMacro("Image information packet does not conform to the image size error check.");
+    this->clientSocket->CloseSocket();
     return;
   }
+  this->buffer->SetSpacing( initData.spacing );
+  this->buffer->SetOrigin( initData.origin );
+  this->buffer->SetExtent( initData.extent );
+  this->ImageSize = initData.imageSize;
   this->buffer->AllocateScalars(initData.scalarType, initData.numComponents);
 
   //grab the data from the socket
@@ -427,4 +1753,5 @@ void vtkImagePipe::ClientSideUpdate()
     vtkErrorMacro("Server unavailable.");
     return;
   }
+  this->lastFrameBytes = (int) sizeof(initData) + this->ImageSize;
 }
\ No newline at end of file
@@ -33,6 +33,15 @@
 #include "vtkSocketController.h"
 #include "vtkMultiThreader.h"
 
+class vtkDataArray;
+struct vtkImagePipeConnection;
+struct vtkImagePipeSnapshot;
+
+// encodings of the transferred frames
+#define VTK_IMAGE_PIPE_RAW 0
+#define VTK_IMAGE_PIPE_DELTA_RLE 1
+#define VTK_IMAGE_PIPE_LZ 2
+
 #include <vector>
 
 class vtkRobartsCommonExport vtkImagePipe : public vtkAlgorithm
@@ -55,6 +64,52 @@ public:
   void SetAsServer( bool isServer );
   void SetSourceAddress( char* ipAddress, int portNumber );
 
+  // Description:
+  // Client side subscription mode, must be set before Initialize().
+  // Instead of a request per Update(), the server pushes a frame each
+  // time Update() is called on it after its input was modified. Update()
+  // on the client then takes the newest frame already received (waiting
+  // only for the first one), skipping the stale ones. Frames are received
+  // into a pre-sized back buffer which is swapped with the output scalars.
+  void SetSubscriptionMode( bool subscribe );
+  bool GetSubscriptionMode();
+
+  // Description:
+  // Sequence number of the frame held by the output, and the number of
+  // frames that were received but replaced by a newer one (client side).
+  unsigned int GetFrameSequence();
+  int GetNumberOfSkippedFrames();
+
+  // Description:
+  // Encoding requested by the client, must be set before Initialize().
+  // VTK_IMAGE_PIPE_DELTA_RLE sends the run-length encoded XOR of the
+  // range of bytes that changed since the previous frame sent to this
+  // client, VTK_IMAGE_PIPE_LZ compresses each frame on its own. Anything
+  // but VTK_IMAGE_PIPE_RAW (default) is negotiated with the server when
+  // connecting. In delta mode the output must not be modified.
+  void SetEncoding( int encoding );
+  int GetEncoding();
+
+  // Description:
+  // Statistics of the last frame received (client side): bytes on the
+  // wire, raw size over bytes on the wire, and the time in seconds the
+  // server took to encode it and the client to decode it.
+  int GetLastFrameBytes();
+  double GetLastCompressionRatio();
+  double GetLastEncodeTime();
+  double GetLastDecodeTime();
+
+  // Description:
+  // Per-client counters (server side), for the clients currently
+  // connected: bytes and frames sent, frames a subscriber did not get
+  // because it was still receiving an older one, and the bytes sent per
+  // second since the client connected.
+  int GetNumberOfClients();
+  double GetClientBytesSent( int client );
+  int GetClientFramesSent( int client );
+  int GetClientFramesSkipped( int client );
+  double GetClientThroughput( int client );
+
   // Description:
   // Initialize the driver (this is called automatically when the
   // first grab is done).
@@ -62,7 +117,8 @@ public:
 
   // Description:
   // Free the driver (this is called automatically inside the
-  // destructor).
+  // destructor). A server first sends what is still queued to its
+  // clients, for at most a second, then disconnects them.
   void ReleaseSystemResources();
 
 protected:
@@ -70,8 +126,19 @@ protected:
   ~vtkImagePipe();
 
   void ClientSideUpdate();
-  static void* ServerSideUpdate(vtkMultiThreader::ThreadInfo *data);
-  static void* FirstServerSideUpdate(vtkMultiThreader::ThreadInfo *data);
+  void SubscribedClientSideUpdate();
+  int ReceiveFrame();
+  void SwapFrame();
+
+  //the server runs a single thread polling the listening socket and all
+  //the clients, each frame is serialized once and queued on every client
+  static void* ServerSideReactor(vtkMultiThreader::ThreadInfo *data);
+  void AcceptClient();
+  int ReceiveRequests( vtkImagePipeConnection* connection );
+  int FlushConnection( vtkImagePipeConnection* connection );
+  void QueueFrame( vtkImagePipeConnection* connection );
+  void UpdateSnapshot();
+  void CloseConnections();
 
   bool Initialized;
   bool isServer;
@@ -88,9 +155,36 @@ protected:
 
   //structures for the read/write lock
   vtkImageData* buffer;
-  vtkMutexLock* newThreadLock;
   vtkReadWriteLock* rwBufferLock;
 
+  //server state owned by the reactor thread, the frame lock protects
+  //the sequence, the shutdown flag and the client list and counters
+  std::vector<vtkImagePipeConnection*> connections;
+  vtkImagePipeSnapshot* snapshot;
+  int wakeSocket;
+  bool stopping;
+
+  //subscription mode: the server counts the modified inputs and wakes
+  //the reactor, the client receives into the back buffer
+  bool subscriptionMode;
+  unsigned int frameSequence;
+  vtkMTimeType lastFrameMTime;
+  vtkMutexLock* frameLock;
+  vtkDataArray* backScalars;
+  unsigned int backSequence;
+  int backExtent[6];
+  double backOrigin[3];
+  double backSpacing[3];
+  bool backIsLatest;
+  int skippedFrames;
+
+  //negotiated encoding, the encoded frame and its statistics (client side)
+  int encoding;
+  std::vector<unsigned char> payload;
+  int lastFrameBytes;
+  double lastEncodeTime;
+  double lastDecodeTime;
+
 private:
   vtkImagePipe(const vtkImagePipe&);  // Not implemented.
   void operator=(const vtkImagePipe&);  // Not implemented.
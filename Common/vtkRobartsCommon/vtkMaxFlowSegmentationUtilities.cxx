@@ -21,6 +21,247 @@ DEALINGS IN THE SOFTWARE.
 
 #include "vtkMaxFlowSegmentationUtilities.h"
 #include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define MAXFLOW_BUFFER_ALIGNMENT 64
+#define MAXFLOW_MAPPED_HEADER 4096
+
+//----------------------------------------------------------------------------
+// ALIGNED BUFFER ALLOCATION
+//----------------------------------------------------------------------------
+
+size_t alignedBufferStride(int size)
+{
+  const size_t floatsPerLine = MAXFLOW_BUFFER_ALIGNMENT / sizeof(float);
+  return ((size_t) size + floatsPerLine - 1) / floatsPerLine * floatsPerLine;
+}
+
+float* allocateAlignedBuffer(size_t numFloats)
+{
+  //over-allocate and keep the original pointer just before the aligned block
+  size_t padding = MAXFLOW_BUFFER_ALIGNMENT + sizeof(void*);
+  if (numFloats > (((size_t) -1) - padding) / sizeof(float))
+  {
+    return 0;
+  }
+  void* raw = malloc(numFloats * sizeof(float) + padding);
+  if (!raw)
+  {
+    return 0;
+  }
+  size_t address = ((size_t) raw + padding) & ~((size_t) MAXFLOW_BUFFER_ALIGNMENT - 1);
+  ((void**) address)[-1] = raw;
+  return (float*) address;
+}
+
+void freeAlignedBuffer(float* buffer)
+{
+  if (buffer)
+  {
+    free(((void**) buffer)[-1]);
+  }
+}
+
+//----------------------------------------------------------------------------
+// MEMORY-MAPPED BUFFER ALLOCATION
+//----------------------------------------------------------------------------
+
+// kept in the first page of the mapping, just before the buffer
+struct mappedBufferHeader
+{
+  size_t bytes;
+  void* file;
+  void* mapping;
+};
+
+float* allocateMappedBuffer(size_t numFloats, const char* directory)
+{
+  if (numFloats > (((size_t) -1) - MAXFLOW_MAPPED_HEADER) / sizeof(float))
+  {
+    return 0;
+  }
+  size_t bytes = MAXFLOW_MAPPED_HEADER + numFloats * sizeof(float);
+  char* base = 0;
+  mappedBufferHeader header;
+  header.bytes = bytes;
+  header.file = 0;
+  header.mapping = 0;
+
+#ifdef _WIN32
+  char tempDirectory[MAX_PATH];
+  char path[MAX_PATH];
+  if (!directory || !*directory)
+  {
+    if (!GetTempPathA(MAX_PATH, tempDirectory))
+    {
+      return 0;
+    }
+    directory = tempDirectory;
+  }
+  if (!GetTempFileNameA(directory, "vmf", 0, path))
+  {
+    return 0;
+  }
+  HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, 0);
+  if (file == INVALID_HANDLE_VALUE)
+  {
+    DeleteFileA(path);
+    return 0;
+  }
+  unsigned long long size = (unsigned long long) bytes;
+  HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)(size & 0xFFFFFFFF), 0);
+  if (!mapping)
+  {
+    CloseHandle(file);
+    return 0;
+  }
+  base = (char*) MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+  if (!base)
+  {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return 0;
+  }
+  header.file = file;
+  header.mapping = mapping;
+#else
+  std::string path = (directory && *directory) ? directory : (getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+  path += "/vtkMaxFlowXXXXXX";
+  int file = mkstemp(&path[0]);
+  if (file < 0)
+  {
+    return 0;
+  }
+  //the file goes away as soon as it is unmapped
+  unlink(path.c_str());
+  if (ftruncate(file, (off_t) bytes) != 0)
+  {
+    close(file);
+    return 0;
+  }
+  void* mapped = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+  if (mapped == MAP_FAILED)
+  {
+    close(file);
+    return 0;
+  }
+  base = (char*) mapped;
+
+  //kept open to drop released ranges from the page cache
+  header.file = (void*) (size_t) file;
+#endif
+
+  memcpy(base, &header, sizeof(header));
+  return (float*)(base + MAXFLOW_MAPPED_HEADER);
+}
+
+void freeMappedBuffer(float* buffer)
+{
+  if (!buffer)
+  {
+    return;
+  }
+  char* base = ((char*) buffer) - MAXFLOW_MAPPED_HEADER;
+  mappedBufferHeader header;
+  memcpy(&header, base, sizeof(header));
+#ifdef _WIN32
+  UnmapViewOfFile(base);
+  CloseHandle((HANDLE) header.mapping);
+  CloseHandle((HANDLE) header.file);
+#else
+  munmap(base, header.bytes);
+  close((int) (size_t) header.file);
+#endif
+}
+
+void releaseMappedRange(float* buffer, void* start, size_t bytes)
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  size_t pageSize = (size_t) info.dwPageSize;
+#else
+  size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+#endif
+  size_t first = ((size_t) start + pageSize - 1) / pageSize * pageSize;
+  size_t last = ((size_t) start + bytes) / pageSize * pageSize;
+  if (last <= first)
+  {
+    return;
+  }
+  //write the pages back first, only clean pages can leave the file cache
+#ifdef _WIN32
+  //unlocking pages that are not locked takes them out of the working set
+  FlushViewOfFile((void*) first, last - first);
+  VirtualUnlock((void*) first, last - first);
+#else
+  char* base = ((char*) buffer) - MAXFLOW_MAPPED_HEADER;
+  mappedBufferHeader header;
+  memcpy(&header, base, sizeof(header));
+  msync((void*) first, last - first, MS_SYNC);
+  madvise((void*) first, last - first, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise((int) (size_t) header.file, (off_t) (first - (size_t) base), (off_t) (last - first), POSIX_FADV_DONTNEED);
+#endif
+#endif
+}
+
+int processIOBytes(double* bytesRead, double* bytesWritten)
+{
+  *bytesRead = 0.0;
+  *bytesWritten = 0.0;
+#ifdef _WIN32
+  IO_COUNTERS counters;
+  if (!GetProcessIoCounters(GetCurrentProcess(), &counters))
+  {
+    return 0;
+  }
+  *bytesRead = (double) counters.ReadTransferCount;
+  *bytesWritten = (double) counters.WriteTransferCount;
+  return 1;
+#elif defined(__linux__)
+  FILE* io = fopen("/proc/self/io", "r");
+  if (!io)
+  {
+    return 0;
+  }
+  char line[256];
+  int found = 0;
+  while (fgets(line, sizeof(line), io))
+  {
+    double value = 0.0;
+    if (sscanf(line, "read_bytes: %lf", &value) == 1)
+    {
+      *bytesRead = value;
+      found++;
+    }
+    else if (sscanf(line, "write_bytes: %lf", &value) == 1)
+    {
+      *bytesWritten = value;
+      found++;
+    }
+  }
+  fclose(io);
+  return (found == 2) ? 1 : 0;
+#else
+  return 0;
+#endif
+}
 
 //----------------------------------------------------------------------------
 // CPU VERSION OF THE ALGORITHM
@@ -130,6 +371,19 @@ void updateLabel(float* sink, float* inc, float* div, float* label, float CC, in
   }
 }
 
+double updateLabelWithResidual(float* sink, float* inc, float* div, float* label, float CC, int size)
+{
+  //same update as updateLabel, also returning the summed absolute change in the labels
+  double residual = 0.0;
+  for (int x = 0; x < size; x++)
+  {
+    float change = CC * (inc[x] - div[x] - sink[x]);
+    label[x] += change;
+    residual += fabs(change);
+  }
+  return residual;
+}
+
 void dagmf_storeSourceFlowInBuffer(float* working, float* sink, float* div, float* label, float* source, float* exclude, float CC, float multiplicity, int size)
 {
   for (int x = 0; x < size; x++)
@@ -280,11 +534,11 @@ void ghmf_computeFlowMag(float* div, float* flowX, float* flowY, float* flowZ, f
   }
   for (int x = 0; x < size; x++)
   {
-    div[x] += ((x + 1) % VX) ? 0.0f : flowX[x + 1] * flowX[x + 1];
+    div[x] += ((x + 1) % VX || x + 1 >= size) ? 0.0f : flowX[x + 1] * flowX[x + 1];
   }
   for (int x = 0; x < size; x++)
   {
-    div[x] += (((x + VX) / VX) % VY) ? 0.0f : flowX[x + VX] * flowX[x + VX];
+    div[x] += ((((x + VX) / VX) % VY) || x + VX >= size) ? 0.0f : flowX[x + VX] * flowX[x + VX];
   }
   for (int x = 0; x < size - VX * VY; x++)
   {
@@ -335,6 +589,431 @@ void ghmf_projectOntoSet(float* div, float* flowX, float* flowY, float* flowZ, i
   }
   for (int x = 0; x < size; x++)
   {
-    div[x] -= (x >= VX * VY) ? flowZ[x - VX * VZ] : 0.0f;
+    div[x] -= (x >= VX * VY && x >= VX * VZ) ? flowZ[x - VX * VZ] : 0.0f;
+  }
+}
+
+//----------------------------------------------------------------------------
+// SLAB-RESTRICTED VERSION OF THE GHMF SPATIAL FLOW UPDATE
+//----------------------------------------------------------------------------
+
+static inline float ghmf_gradientStepAt(float* sink, float* inc, float* div, float* label, float StepSize, float CC, int x)
+{
+  return StepSize * (sink[x] + div[x] - inc[x] - label[x] / CC);
+}
+
+void ghmf_slabStepAndApply(float* sink, float* inc, float* div, float* label, float* flowX, float* flowY, float* flowZ, float StepSize, float CC, int VX, int VY, int VZ, int size, int start, int end)
+{
+  //the gradient step is recomputed for the backwards neighbours rather than stored in the
+  //divergence buffer, so the buffer stays untouched until the flow magnitude is computed
+  for (int x = start; x < end; x++)
+  {
+    float currAllowed = ghmf_gradientStepAt(sink, inc, div, label, StepSize, CC, x);
+    float xAllowed = (x % VX) ? ghmf_gradientStepAt(sink, inc, div, label, StepSize, CC, x - 1) : 0.0f;
+    flowX[x] *= 0.5f * (currAllowed - xAllowed);
+    float yAllowed = (x / VX % VY) ? ghmf_gradientStepAt(sink, inc, div, label, StepSize, CC, x - VX) : 0.0f;
+    flowY[x] *= 0.5f * (currAllowed - yAllowed);
+    float zAllowed = (x >= VX * VY) ? ghmf_gradientStepAt(sink, inc, div, label, StepSize, CC, x - VX * VY) : 0.0f;
+    flowZ[x] *= 0.5f * (currAllowed - zAllowed);
+  }
+}
+
+void ghmf_slabComputeFlowMag(float* div, float* flowX, float* flowY, float* flowZ, float* smooth, float alpha, int VX, int VY, int VZ, int size, int start, int end)
+{
+  for (int x = start; x < end; x++)
+  {
+    float mag = flowX[x] * flowX[x] + flowY[x] * flowY[x] + flowZ[x] * flowZ[x];
+    mag += ((x + 1) % VX || x + 1 >= size) ? 0.0f : flowX[x + 1] * flowX[x + 1];
+    mag += ((((x + VX) / VX) % VY) || x + VX >= size) ? 0.0f : flowX[x + VX] * flowX[x + VX];
+    if (x < size - VX * VY)
+    {
+      mag += flowX[x + VX * VY] * flowX[x + VX * VY];
+    }
+    mag = sqrtf(mag);
+    if (smooth)
+    {
+      div[x] = (mag > alpha * smooth[x]) ? alpha * smooth[x] / mag : 1.0f;
+    }
+    else
+    {
+      div[x] = (mag > alpha) ? alpha / mag : 1.0f;
+    }
+  }
+}
+
+void ghmf_slabProjectFlows(float* div, float* flowX, float* flowY, float* flowZ, int VX, int VY, int VZ, int size, int start, int end)
+{
+  for (int x = start; x < end; x++)
+  {
+    float currAllowed = div[x];
+    float xAllowed = (x % VX) ? div[x - 1] : -currAllowed;
+    flowX[x] *= 0.5f * (currAllowed + xAllowed);
+    float yAllowed = (x / VX % VY) ? div[x - VX] : -currAllowed;
+    flowY[x] *= 0.5f * (currAllowed + yAllowed);
+    float zAllowed = (x >= VX * VY) ? div[x - VX * VY] : -currAllowed;
+    flowZ[x] *= 0.5f * (currAllowed + zAllowed);
+  }
+}
+
+void ghmf_slabComputeDivergence(float* div, float* flowX, float* flowY, float* flowZ, int VX, int VY, int VZ, int size, int start, int end)
+{
+  for (int x = start; x < end; x++)
+  {
+    float divergence = flowX[x] + flowY[x] + flowZ[x];
+    divergence -= (x % VX) ? flowX[x - 1] : 0.0f;
+    divergence -= (x / VX % VY) ? flowY[x - VX] : 0.0f;
+    divergence -= (x >= VX * VY && x >= VX * VZ) ? flowZ[x - VX * VZ] : 0.0f;
+    div[x] = divergence;
+  }
+}
+
+void ghmf_updateLeafSinkFlowAndConstrain(float* sink, float* inc, float* div, float* label, float* cap, float CC, int size)
+{
+  for (int x = 0; x < size; x++)
+  {
+    float potential = inc[x] - div[x] + label[x] / CC;
+    sink[x] = (potential > cap[x]) ? cap[x] : potential;
+  }
+}
+
+//----------------------------------------------------------------------------
+// RESAMPLING FOR THE COARSE-TO-FINE SOLVER
+//----------------------------------------------------------------------------
+
+int downsampledDimension(int dim)
+{
+  return (dim > 1) ? (dim + 1) / 2 : 1;
+}
+
+void downsampleBuffer(float* coarse, float* fine, int VX, int VY, int VZ)
+{
+  int CX = downsampledDimension(VX);
+  int CY = downsampledDimension(VY);
+  int CZ = downsampledDimension(VZ);
+  for (int z = 0; z < CZ; z++)
+  {
+    for (int y = 0; y < CY; y++)
+    {
+      for (int x = 0; x < CX; x++)
+      {
+        //average over the (up to 8) fine voxels inside the volume
+        float sum = 0.0f;
+        int count = 0;
+        for (int fz = 2 * z; fz < 2 * z + 2 && fz < VZ; fz++)
+        {
+          for (int fy = 2 * y; fy < 2 * y + 2 && fy < VY; fy++)
+          {
+            for (int fx = 2 * x; fx < 2 * x + 2 && fx < VX; fx++)
+            {
+              sum += fine[fx + VX * (fy + VY * fz)];
+              count++;
+            }
+          }
+        }
+        coarse[x + CX * (y + CY * z)] = sum / (float) count;
+      }
+    }
+  }
+}
+
+void prolongBuffer(float* fine, float* coarse, int VX, int VY, int VZ)
+{
+  int CX = downsampledDimension(VX);
+  int CY = downsampledDimension(VY);
+  for (int z = 0; z < VZ; z++)
+  {
+    for (int y = 0; y < VY; y++)
+    {
+      float* coarseRow = coarse + CX * (y / 2 + CY * (z / 2));
+      float* fineRow = fine + VX * (y + VY * z);
+      for (int x = 0; x < VX; x++)
+      {
+        fineRow[x] = coarseRow[x / 2];
+      }
+    }
+  }
+}
+
+void dagmf_computeDivergence(float* div, float* flowX, float* flowY, float* flowZ, int VX, int VY, int VZ, int size)
+{
+  //same divergence as computed at the end of dagmf_projectOntoSet
+  for (int x = 0; x < size; x++)
+  {
+    div[x] = flowX[x] + flowY[x] + flowZ[x];
+  }
+  for (int x = 0; x < size; x++)
+  {
+    div[x] -= ((x + 1) % VX) ? flowX[x + 1] : 0.0f;
   }
-}
\ No newline at end of file
+  for (int x = 0; x < size; x++)
+  {
+    div[x] -= ((x / VX + 1) % VY) ? flowY[x + VX] : 0.0f;
+  }
+  for (int x = 0; x < size; x++)
+  {
+    div[x] -= (x < size - VX * VY && x + VX * VZ < size) ? flowZ[x + VX * VZ] : 0.0f;
+  }
+}
+
+//----------------------------------------------------------------------------
+// 16-BIT FLOW AND DIVERGENCE STORAGE
+//----------------------------------------------------------------------------
+
+namespace
+{
+  inline unsigned int floatToBits(float value)
+  {
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+  }
+
+  inline float bitsToFloat(unsigned int bits)
+  {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+  // IEEE 754 half precision, rounding to nearest even
+  struct HalfCodec
+  {
+    static inline compactFloat Encode(float value)
+    {
+      unsigned int bits = floatToBits(value);
+      unsigned int sign = (bits >> 16) & 0x8000;
+      unsigned int absBits = bits & 0x7FFFFFFF;
+      if (absBits >= 0x7F800000)
+      {
+        //infinity or NaN
+        return (compactFloat)(sign | 0x7C00 | ((absBits > 0x7F800000) ? 0x0200 : 0));
+      }
+      if (absBits >= 0x477FF000)
+      {
+        //rounds past the largest half, 65504
+        return (compactFloat)(sign | 0x7C00);
+      }
+      if (absBits < 0x38800000)
+      {
+        //subnormal half, let the FPU round the value onto the 2^-24 grid
+        float shifted = bitsToFloat(absBits) + 0.5f;
+        return (compactFloat)(sign | (floatToBits(shifted) - 0x3F000000));
+      }
+      //rebias the exponent and round the mantissa
+      absBits += 0xC8000FFF + ((absBits >> 13) & 1);
+      return (compactFloat)(sign | (absBits >> 13));
+    }
+
+    static inline float Decode(compactFloat value)
+    {
+      unsigned int sign = ((unsigned int)(value & 0x8000)) << 16;
+      unsigned int exponent = (value >> 10) & 0x1F;
+      unsigned int mantissa = value & 0x03FF;
+      if (exponent == 0)
+      {
+        float subnormal = (float) mantissa * 5.9604644775390625e-8f;
+        return sign ? -subnormal : subnormal;
+      }
+      if (exponent == 31)
+      {
+        return bitsToFloat(sign | 0x7F800000 | (mantissa << 13));
+      }
+      return bitsToFloat(sign | ((exponent + 112) << 23) | (mantissa << 13));
+    }
+  };
+
+  // bfloat16, the upper 16 bits of a float rounded to nearest even
+  struct BFloat16Codec
+  {
+    static inline compactFloat Encode(float value)
+    {
+      unsigned int bits = floatToBits(value);
+      if ((bits & 0x7FFFFFFF) > 0x7F800000)
+      {
+        return (compactFloat)((bits >> 16) | 0x0040);
+      }
+      bits += 0x7FFF + ((bits >> 16) & 1);
+      return (compactFloat)(bits >> 16);
+    }
+
+    static inline float Decode(compactFloat value)
+    {
+      return bitsToFloat(((unsigned int) value) << 16);
+    }
+  };
+
+  template <class Codec>
+  void encodeCompactBufferImpl(compactFloat* bufferOut, float* bufferIn, int size)
+  {
+    for (int x = 0; x < size; x++)
+    {
+      bufferOut[x] = Codec::Encode(bufferIn[x]);
+    }
+  }
+
+  template <class Codec>
+  void decodeCompactBufferImpl(float* bufferOut, compactFloat* bufferIn, int size)
+  {
+    for (int x = 0; x < size; x++)
+    {
+      bufferOut[x] = Codec::Decode(bufferIn[x]);
+    }
+  }
+
+  template <class Codec>
+  inline float compactGradientStepAt(float* sink, float* inc, compactFloat* div, float* label, float StepSize, float CC, int x)
+  {
+    return StepSize * (sink[x] + Codec::Decode(div[x]) - inc[x] - label[x] / CC);
+  }
+
+  template <class Codec>
+  void ghmf_compactStepAndApplyImpl(float* sink, float* inc, compactFloat* div, float* label, compactFloat* flowX, compactFloat* flowY, compactFloat* flowZ, float StepSize, float CC, int VX, int VY, int VZ, int size, int start, int end)
+  {
+    for (int x = start; x < end; x++)
+    {
+      float currAllowed = compactGradientStepAt<Codec>(sink, inc, div, label, StepSize, CC, x);
+      float xAllowed = (x % VX) ? compactGradientStepAt<Codec>(sink, inc, div, label, StepSize, CC, x - 1) : 0.0f;
+      flowX[x] = Codec::Encode(Codec::Decode(flowX[x]) * 0.5f * (currAllowed - xAllowed));
+      float yAllowed = (x / VX % VY) ? compactGradientStepAt<Codec>(sink, inc, div, label, StepSize, CC, x - VX) : 0.0f;
+      flowY[x] = Codec::Encode(Codec::Decode(flowY[x]) * 0.5f * (currAllowed - yAllowed));
+      float zAllowed = (x >= VX * VY) ? compactGradientStepAt<Codec>(sink, inc, div, label, StepSize, CC, x - VX * VY) : 0.0f;
+      flowZ[x] = Codec::Encode(Codec::Decode(flowZ[x]) * 0.5f * (currAllowed - zAllowed));
+    }
+  }
+
+  template <class Codec>
+  void ghmf_compactComputeFlowMagImpl(compactFloat* div, compactFloat* flowX, compactFloat* flowY, compactFloat* flowZ, float* smooth, float alpha, int VX, int VY, int VZ, int size, int start, int end)
+  {
+    for (int x = start; x < end; x++)
+    {
+      float fx = Codec::Decode(flowX[x]);
+      float fy = Codec::Decode(flowY[x]);
+      float fz = Codec::Decode(flowZ[x]);
+      float mag = fx * fx + fy * fy + fz * fz;
+      if (!((x + 1) % VX || x + 1 >= size))
+      {
+        float neighbour = Codec::Decode(flowX[x + 1]);
+        mag += neighbour * neighbour;
+      }
+      if (!((((x + VX) / VX) % VY) || x + VX >= size))
+      {
+        float neighbour = Codec::Decode(flowX[x + VX]);
+        mag += neighbour * neighbour;
+      }
+      if (x < size - VX * VY)
+      {
+        float neighbour = Codec::Decode(flowX[x + VX * VY]);
+        mag += neighbour * neighbour;
+      }
+      mag = sqrtf(mag);
+      float limit = smooth ? alpha * smooth[x] : alpha;
+      div[x] = Codec::Encode((mag > limit) ? limit / mag : 1.0f);
+    }
+  }
+
+  template <class Codec>
+  void ghmf_compactProjectFlowsImpl(compactFloat* div, compactFloat* flowX, compactFloat* flowY, compactFloat* flowZ, int VX, int VY, int VZ, int size, int start, int end)
+  {
+    for (int x = start; x < end; x++)
+    {
+      float currAllowed = Codec::Decode(div[x]);
+      float xAllowed = (x % VX) ? Codec::Decode(div[x - 1]) : -currAllowed;
+      flowX[x] = Codec::Encode(Codec::Decode(flowX[x]) * 0.5f * (currAllowed + xAllowed));
+      float yAllowed = (x / VX % VY) ? Codec::Decode(div[x - VX]) : -currAllowed;
+      flowY[x] = Codec::Encode(Codec::Decode(flowY[x]) * 0.5f * (currAllowed + yAllowed));
+      float zAllowed = (x >= VX * VY) ? Codec::Decode(div[x - VX * VY]) : -currAllowed;
+      flowZ[x] = Codec::Encode(Codec::Decode(flowZ[x]) * 0.5f * (currAllowed + zAllowed));
+    }
+  }
+
+  template <class Codec>
+  void ghmf_compactComputeDivergenceImpl(compactFloat* div, compactFloat* flowX, compactFloat* flowY, compactFloat* flowZ, int VX, int VY, int VZ, int size, int start, int end)
+  {
+    for (int x = start; x < end; x++)
+    {
+      float divergence = Codec::Decode(flowX[x]) + Codec::Decode(flowY[x]) + Codec::Decode(flowZ[x]);
+      divergence -= (x % VX) ? Codec::Decode(flowX[x - 1]) : 0.0f;
+      divergence -= (x / VX % VY) ? Codec::Decode(flowY[x - VX]) : 0.0f;
+      divergence -= (x >= VX * VY && x >= VX * VZ) ? Codec::Decode(flowZ[x - VX * VZ]) : 0.0f;
+      div[x] = Codec::Encode(divergence);
+    }
+  }
+}
+
+void zeroOutCompactBuffer(compactFloat* buffer, int size)
+{
+  //zero has the same (all clear) representation in both formats
+  memset(buffer, 0, sizeof(compactFloat) * (size_t) size);
+}
+
+void encodeCompactBuffer(compactFloat* bufferOut, float* bufferIn, int size, int bfloat16)
+{
+  if (bfloat16)
+  {
+    encodeCompactBufferImpl<BFloat16Codec>(bufferOut, bufferIn, size);
+  }
+  else
+  {
+    encodeCompactBufferImpl<HalfCodec>(bufferOut, bufferIn, size);
+  }
+}
+
+void decodeCompactBuffer(float* bufferOut, compactFloat* bufferIn, int size, int bfloat16)
+{
+  if (bfloat16)
+  {
+    decodeCompactBufferImpl<BFloat16Codec>(bufferOut, bufferIn, size);
+  }
+  else
+  {
+    decodeCompactBufferImpl<HalfCodec>(bufferOut, bufferIn, size);
+  }
+}
+
+void ghmf_compactStepAndApply(float* sink, float* inc, compactFloat* div, float* label, compactFloat* flowX, compactFloat* flowY, compactFloat* flowZ, float StepSize, float CC, int VX, int VY, int VZ, int size, int start, int end, int bfloat16)
+{
+  if (bfloat16)
+  {
+    ghmf_compactStepAndApplyImpl<BFloat16Codec>(sink, inc, div, label, flowX, flowY, flowZ, StepSize, CC, VX, VY, VZ, size, start, end);
+  }
+  else
+  {
+    ghmf_compactStepAndApplyImpl<HalfCodec>(sink, inc, div, label, flowX, flowY, flowZ, StepSize, CC, VX, VY, VZ, size, start, end);
+  }
+}
+
+void ghmf_compactComputeFlowMag(compactFloat* div, compactFloat* flowX, compactFloat* flowY, compactFloat* flowZ, float* smooth, float alpha, int VX, int VY, int VZ, int size, int start, int end, int bfloat16)
+{
+  if (bfloat16)
+  {
+    ghmf_compactComputeFlowMagImpl<BFloat16Codec>(div, flowX, flowY, flowZ, smooth, alpha, VX, VY, VZ, size, start, end);
+  }
+  else
+  {
+    ghmf_compactComputeFlowMagImpl<HalfCodec>(div, flowX, flowY, flowZ, smooth, alpha, VX, VY, VZ, size, start, end);
+  }
+}
+
+void ghmf_compactProjectFlows(compactFloat* div, compactFloat* flowX, compactFloat* flowY, compactFloat* flowZ, int VX, int VY, int VZ, int size, int start, int end, int bfloat16)
+{
+  if (bfloat16)
+  {
+    ghmf_compactProjectFlowsImpl<BFloat16Codec>(div, flowX, flowY, flowZ, VX, VY, VZ, size, start, end);
+  }
+  else
+  {
+    ghmf_compactProjectFlowsImpl<HalfCodec>(div, flowX, flowY, flowZ, VX, VY, VZ, size, start, end);
+  }
+}
+
+void ghmf_compactComputeDivergence(compactFloat* div, compactFloat* flowX, compactFloat* flowY, compactFloat* flowZ, int VX, int VY, int VZ, int size, int start, int end, int bfloat16)
+{
+  if (bfloat16)
+  {
+    ghmf_compactComputeDivergenceImpl<BFloat16Codec>(div, flowX, flowY, flowZ, VX, VY, VZ, size, start, end);
+  }
+  else
+  {
+    ghmf_compactComputeDivergenceImpl<HalfCodec>(div, flowX, flowY, flowZ, VX, VY, VZ, size, start, end);
+  }
+}
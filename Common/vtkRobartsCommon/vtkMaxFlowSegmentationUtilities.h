@@ -23,6 +23,27 @@ DEALINGS IN THE SOFTWARE.
 #define VTKMAXFLOWSEGMENTATIONUTILITIES_H
 
 #include "vtkRobartsCommonExport.h"
+#include <stddef.h>
+
+// Cache-line aligned storage for the CPU solver buffers. alignedBufferStride pads a volume
+// size so that consecutive buffers carved out of one allocation each start on a 64-byte
+// boundary. allocateAlignedBuffer returns 0 if the memory is not available.
+size_t alignedBufferStride(int size);
+float* allocateAlignedBuffer(size_t numFloats);
+void freeAlignedBuffer(float* buffer);
+
+// Storage for the out-of-core solver. allocateMappedBuffer maps a scratch file created in the
+// given directory (the system temporary directory if 0 or empty) and removed once it is freed,
+// so the operating system can page the buffers out to it. It returns 0 if the file cannot be
+// created or mapped. releaseMappedRange writes the pages fully inside a range of the given
+// mapped buffer back to the file and drops them from memory, both from the process and from
+// the file cache where the platform allows it; their contents stay in the file, to be read
+// back on the next access. processIOBytes gives the number of bytes this process has read
+// from and written to storage so far, or returns 0 where the platform does not say.
+float* allocateMappedBuffer(size_t numFloats, const char* directory);
+void freeMappedBuffer(float* buffer);
+void releaseMappedRange(float* buffer, void* start, size_t bytes);
+int processIOBytes(double* bytesRead, double* bytesWritten);
 
 void zeroOutBuffer(float* buffer, int size);
 void setBufferToValue(float* buffer, float value, int size);
@@ -37,6 +58,7 @@ void lblBuffer(float* label, float* sink, float* cap, int size);
 void constrainBuffer(float* sink, float* cap, int size);
 void updateLeafSinkFlow(float* sink, float* inc, float* div, float* label, float CC, int size);
 void updateLabel(float* sink, float* inc, float* div, float* label, float CC, int size);
+double updateLabelWithResidual(float* sink, float* inc, float* div, float* label, float CC, int size);
 void storeSourceFlowInBuffer(float* working, float* sink, float* div, float* label, float CC, int size);
 void storeSinkFlowInBuffer(float* working, float* inc, float* div, float* label, float CC, int size);
 
@@ -52,4 +74,36 @@ void ghmf_applyStep(float* div, float* flowX, float* flowY, float* flowZ, int VX
 void ghmf_computeFlowMag(float* div, float* flowX, float* flowY, float* flowZ, float* smooth, float alpha, int VX, int VY, int VZ, int size);
 void ghmf_projectOntoSet(float* div, float* flowX, float* flowY, float* flowZ, int VX, int VY, int VZ, int size);
 
+// Slab-restricted versions of the ghmf spatial flow update used by the multi-threaded CPU solver.
+// Each kernel only writes voxels in [start,end) but indexes the full buffers, so neighbouring
+// slabs must have finished the previous kernel before the next one starts. Together they give
+// the same result as ghmf_flowGradientStep, ghmf_applyStep, ghmf_computeFlowMag and ghmf_projectOntoSet.
+void ghmf_slabStepAndApply(float* sink, float* inc, float* div, float* label, float* flowX, float* flowY, float* flowZ, float StepSize, float CC, int VX, int VY, int VZ, int size, int start, int end);
+void ghmf_slabComputeFlowMag(float* div, float* flowX, float* flowY, float* flowZ, float* smooth, float alpha, int VX, int VY, int VZ, int size, int start, int end);
+void ghmf_slabProjectFlows(float* div, float* flowX, float* flowY, float* flowZ, int VX, int VY, int VZ, int size, int start, int end);
+void ghmf_slabComputeDivergence(float* div, float* flowX, float* flowY, float* flowZ, int VX, int VY, int VZ, int size, int start, int end);
+void ghmf_updateLeafSinkFlowAndConstrain(float* sink, float* inc, float* div, float* label, float* cap, float CC, int size);
+
+// Resampling used by the coarse-to-fine (multigrid) mode. Each dimension larger than one is
+// halved, rounding up. downsampleBuffer averages the fine voxels covered by each coarse voxel
+// and prolongBuffer copies each coarse voxel to the fine voxels it covers. VX, VY and VZ are
+// always the dimensions of the fine buffer.
+int downsampledDimension(int dim);
+void downsampleBuffer(float* coarse, float* fine, int VX, int VY, int VZ);
+void prolongBuffer(float* fine, float* coarse, int VX, int VY, int VZ);
+void dagmf_computeDivergence(float* div, float* flowX, float* flowY, float* flowZ, int VX, int VY, int VZ, int size);
+
+// 16-bit storage for the spatial flows and divergences. Values are kept either as IEEE half
+// floats or, if bfloat16 is non-zero, as bfloat16 (the upper half of a float), and all the
+// arithmetic is still done in float. The compact kernels are the slab-restricted ghmf spatial
+// flow update above with the flows and divergence in 16-bit form.
+typedef unsigned short compactFloat;
+void zeroOutCompactBuffer(compactFloat* buffer, int size);
+void encodeCompactBuffer(compactFloat* bufferOut, float* bufferIn, int size, int bfloat16);
+void decodeCompactBuffer(float* bufferOut, compactFloat* bufferIn, int size, int bfloat16);
+void ghmf_compactStepAndApply(float* sink, float* inc, compactFloat* div, float* label, compactFloat* flowX, compactFloat* flowY, compactFloat* flowZ, float StepSize, float CC, int VX, int VY, int VZ, int size, int start, int end, int bfloat16);
+void ghmf_compactComputeFlowMag(compactFloat* div, compactFloat* flowX, compactFloat* flowY, compactFloat* flowZ, float* smooth, float alpha, int VX, int VY, int VZ, int size, int start, int end, int bfloat16);
+void ghmf_compactProjectFlows(compactFloat* div, compactFloat* flowX, compactFloat* flowY, compactFloat* flowZ, int VX, int VY, int VZ, int size, int start, int end, int bfloat16);
+void ghmf_compactComputeDivergence(compactFloat* div, compactFloat* flowX, compactFloat* flowY, compactFloat* flowZ, int VX, int VY, int VZ, int size, int start, int end, int bfloat16);
+
 #endif
\ No newline at end of file
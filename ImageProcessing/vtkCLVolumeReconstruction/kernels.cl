@@ -6,6 +6,9 @@
 #define PRINT_RES2 6000
 
 #define BSCAN_WINDOW 4 // must be >= 4 if PT
+#define BSCAN_RING (BSCAN_WINDOW + 1) // one spare slot, written while the previous frame is compounded
+#define BRICK_SIZE 32 // edge length of the bricks of the sparse output volume
+#define BRICK_VOXELS (BRICK_SIZE*BRICK_SIZE*BRICK_SIZE)
 #define PT_OR_DW 1 // 0=PT (Probe Trajectory), 1=DW (Distance Weighted)
 
 #define COMPOUND_AVG 0
@@ -276,6 +279,9 @@ __kernel void cast_rays(__global unsigned char * volume,
 #define NULL 0
 #define distance_pp(v, plane) (plane.x*v.x + plane.y*v.y + plane.z*v.z + plane.w)/sqrt(plane.x*plane.x + plane.y*plane.y + plane.z*plane.z)
 #define bscans_queue_a(n, x, y) bscans_queue[(n)*bscan_w*bscan_h + (y)*bscan_w + (x)]
+#define ring_idx(n) (((n) + queue_head) % BSCAN_RING) // slot of the n-th oldest bscan in the device ring buffers
+#define brick_idx(x,y,z) ((x)/BRICK_SIZE + ((y)/BRICK_SIZE)*bricks_w + ((z)/BRICK_SIZE)*bricks_w*bricks_h)
+#define brick_offset(x,y,z) ((x)%BRICK_SIZE + ((y)%BRICK_SIZE)*BRICK_SIZE + ((z)%BRICK_SIZE)*BRICK_SIZE*BRICK_SIZE)
 
 typedef struct {
   float4 corner0;
@@ -283,8 +289,92 @@ typedef struct {
   float4 cornery;
 } plane_pts;
 
+// Flag the bricks adv_fill_voxels can write to along a ray between two middle bscans
+void mark_ray_bricks(float4 intrs0,
+										 float4 intrs1,
+										 float volume_spacing,
+										 int volume_w,
+										 int volume_h,
+										 int volume_n,
+										 float4 corner0,
+										 float4 x_vector,
+										 float4 y_vector,
+										 float bscan_spacing_x,
+										 float bscan_spacing_y,
+										 int bscan_w,
+										 int bscan_h,
+										 __global unsigned char * touched_bricks) {
+
+	int bricks_w = (volume_w + BRICK_SIZE - 1)/BRICK_SIZE;
+	int bricks_h = (volume_h + BRICK_SIZE - 1)/BRICK_SIZE;
+
+	// Every voxel adv_fill_voxels visits for this ray is within margin of intrs0, which lies on the
+	// first middle bscan, and is only written if it projects onto that bscan
+	float margin = length(intrs1 - intrs0) + 2*volume_spacing;
+	float4 p0 = intrs0 - corner0;
+	float px0 = dot(p0, x_vector);
+	float py0 = dot(p0, y_vector);
+	if (px0 < -margin - bscan_spacing_x || px0 > bscan_w*bscan_spacing_x + margin ||
+			py0 < -margin - bscan_spacing_y || py0 > bscan_h*bscan_spacing_y + margin) return;
+
+	// Same box as adv_fill_voxels, clamped to the volume
+	intrs0 /= volume_spacing;
+	intrs1 /= volume_spacing;
+	int x0 = clamp(min(intrs0.x,intrs1.x), 0.0f, volume_w-1.0f);
+	int x1 = clamp(max(intrs0.x,intrs1.x) + 1.0f, 0.0f, volume_w-1.0f);
+	int y0 = clamp(min(intrs0.y,intrs1.y), 0.0f, volume_h-1.0f);
+	int y1 = clamp(max(intrs0.y,intrs1.y) + 1.0f, 0.0f, volume_h-1.0f);
+	int z0 = clamp(min(intrs0.z,intrs1.z), 0.0f, volume_n-1.0f);
+	int z1 = clamp(max(intrs0.z,intrs1.z) + 1.0f, 0.0f, volume_n-1.0f);
+
+	for (int z = z0/BRICK_SIZE; z <= z1/BRICK_SIZE; z++)
+		for (int y = y0/BRICK_SIZE; y <= y1/BRICK_SIZE; y++)
+			for (int x = x0/BRICK_SIZE; x <= x1/BRICK_SIZE; x++)
+				touched_bricks[x + y*bricks_w + z*bricks_w*bricks_h] = 1;
+}
+
+__kernel void mark_bricks(__global float4 * intersections,
+													float volume_spacing,
+													int volume_w,
+													int volume_h,
+													int volume_n,
+													__global float4 * x_vector_queue,
+													__global float4 * y_vector_queue,
+													__global plane_pts * plane_points_queue,
+													float bscan_spacing_x,
+													float bscan_spacing_y,
+													int bscan_w,
+													int bscan_h,
+													int intersection_counter,
+													__global unsigned char * touched_bricks,
+													int queue_head) {
+
+	int i = get_global_id(0);
+
+	if (i >= intersection_counter) return;
+
+	int q_idx = ring_idx(BSCAN_WINDOW/2-1);
+	mark_ray_bricks(intersections[i*2 + 0], intersections[i*2 + 1], volume_spacing, volume_w, volume_h, volume_n,
+									plane_points_queue[q_idx].corner0, x_vector_queue[q_idx], y_vector_queue[q_idx],
+									bscan_spacing_x, bscan_spacing_y, bscan_w, bscan_h, touched_bricks);
+}
+
+// Compound a contribution into a voxel
+void compound_voxel(__global unsigned char * voxel, float contribution) {
+	if (COMPOUND_METHOD == COMPOUND_AVG)
+		if (*voxel != 0) *voxel = (*voxel + contribution)/2;	else *voxel = contribution;
+	if (COMPOUND_METHOD == COMPOUND_MAX)
+		if (contribution > *voxel) *voxel = contribution;
+	if (COMPOUND_METHOD == COMPOUND_IFEMPTY)
+		if (*voxel == 0) *voxel = contribution;
+	if (COMPOUND_METHOD == COMPOUND_OVERWRITE)
+		*voxel = contribution;
+	if (COMPOUND_METHOD == COMPOUND_ALPHABLEND)
+		if (*voxel != 0) *voxel = (1-ALPHA)*(*voxel) + ALPHA*contribution;	else *voxel = contribution;
+}
+
 __kernel void adv_fill_voxels(__global float4 * intersections, 
-															__global unsigned char * volume,
+															__global unsigned char * brick_pool,
 															float volume_spacing, 
 															int volume_w, 
 															int volume_h, 
@@ -300,12 +390,20 @@ __kernel void adv_fill_voxels(__global float4 * intersections,
 															__global unsigned char * mask,
 															__global unsigned char * bscans_queue,
 															__global float * bscan_timetags_queue,
-															int intersection_counter) {
+															int intersection_counter,
+															__global int * brick_table,
+															int queue_head) {
 
 	int i = get_global_id(0);
 
 	if (i >= intersection_counter) return;
 
+	// The voxels are stored in the bricks allocated for this frame by mark_bricks
+	int bricks_w = (volume_w + BRICK_SIZE - 1)/BRICK_SIZE;
+	int bricks_h = (volume_h + BRICK_SIZE - 1)/BRICK_SIZE;
+	int last_brick = -1;
+	__global unsigned char * brick = NULL;
+
 	float4 intrs0 = intersections[i*2 + 0]/volume_spacing;
 	float4 intrs1 = intersections[i*2 + 1]/volume_spacing;
 
@@ -321,7 +419,16 @@ __kernel void adv_fill_voxels(__global float4 * intersections,
 		for (int y = y0; y <= y1; y++) {
 			for (int x = x0; x <= x1; x++) {
 				float4 voxel_coord = {x*volume_spacing,y*volume_spacing,z*volume_spacing,0};
-				if (inrange(x, 0, volume_w) && inrange(y, 0, volume_h) && inrange(z, 0, volume_n)) {
+				if (x >= 0 && x < volume_w && y >= 0 && y < volume_h && z >= 0 && z < volume_n) {
+					int b = brick_idx(x,y,z);
+					if (b != last_brick) {
+						int slot = brick_table[b];
+						brick = (slot >= 0) ? brick_pool + (size_t)slot*BRICK_VOXELS : NULL;
+						last_brick = b;
+					}
+					if (brick == NULL) continue;
+					__global unsigned char * voxel = brick + brick_offset(x,y,z);
+
 					float contribution = 0;
 					if (PT_OR_DW) { // DW
 						float dists[BSCAN_WINDOW];
@@ -329,7 +436,7 @@ __kernel void adv_fill_voxels(__global float4 * intersections,
 						bool valid = true;
 						float G = 0;
 						for (int n = 0; n < BSCAN_WINDOW; n++) {
-							int q_idx = n;
+							int q_idx = ring_idx(n);
 
 							float4 normal = { bscan_plane_equation_queue[q_idx].x, bscan_plane_equation_queue[q_idx].y, bscan_plane_equation_queue[q_idx].z, 0 };
 
@@ -344,7 +451,7 @@ __kernel void adv_fill_voxels(__global float4 * intersections,
 
 							bool valid0 = false;
 
-							if (inrange(xa0, 0, bscan_w) && inrange(ya0, 0, bscan_h) && inrange(xa0 + 1, 0, bscan_w) && inrange(ya0 + 1, 0, bscan_h)) {
+							if (inrange(xa0, 0, bscan_w) && inrange(ya0, 0, bscan_h) && xa0 + 1 < bscan_w && ya0 + 1 < bscan_h) {
 								if (mask[xa0 + ya0*bscan_w] != 0 && mask[xa0 + 1 + (ya0 + 1)*bscan_w] != 0 && mask[xa0 + 1 + ya0*bscan_w] != 0 && mask[xa0 + (ya0 + 1)*bscan_w] != 0) {
 									bilinears[n] = bscans_queue_a(q_idx, xa0, ya0)*(1 - xa)*(1 - ya) + bscans_queue_a(q_idx, xa0 + 1, ya0)*xa*(1 - ya) + bscans_queue_a(q_idx, xa0, ya0 + 1)*(1 - xa)*ya + bscans_queue_a(q_idx, xa0 + 1, ya0 + 1)*xa*ya;
 									valid0 = true;
@@ -370,7 +477,7 @@ __kernel void adv_fill_voxels(__global float4 * intersections,
 						float dists[4];
 						bool valid = true;
 						for (int n = 0; n < 4; n++) {
-							int q_idx = BSCAN_WINDOW/2-2+n;
+							int q_idx = ring_idx(BSCAN_WINDOW/2-2+n);
 
 							float4 normal = {bscan_plane_equation_queue[q_idx].x, bscan_plane_equation_queue[q_idx].y, bscan_plane_equation_queue[q_idx].z, 0};
 
@@ -386,7 +493,7 @@ __kernel void adv_fill_voxels(__global float4 * intersections,
 							bool valid0 = false;
 							float bilinear0;
 
-							if (inrange(xa0, 0, bscan_w) && inrange(ya0, 0, bscan_h) && inrange(xa0+1, 0, bscan_w) && inrange(ya0+1, 0, bscan_h))
+							if (inrange(xa0, 0, bscan_w) && inrange(ya0, 0, bscan_h) && xa0+1 < bscan_w && ya0+1 < bscan_h)
 								if (mask[xa0 + ya0*bscan_w] != 0 && mask[xa0+1 + (ya0+1)*bscan_w] != 0 && mask[xa0+1 + ya0*bscan_w] != 0 && mask[xa0 + (ya0+1)*bscan_w] != 0)
 									valid0 = true;
 
@@ -396,7 +503,7 @@ __kernel void adv_fill_voxels(__global float4 * intersections,
 						}
 						if (!valid) continue;
 						float G = dists[1] + dists[2];
-						float t = dists[2]/G*bscan_timetags_queue[BSCAN_WINDOW/2-1] + dists[1]/G*bscan_timetags_queue[BSCAN_WINDOW/2];
+						float t = dists[2]/G*bscan_timetags_queue[ring_idx(BSCAN_WINDOW/2-1)] + dists[1]/G*bscan_timetags_queue[ring_idx(BSCAN_WINDOW/2)];
 
 						// Cubic interpolate 4 bscan plane equations, corner0s and x- and y-vectors:
 						float4 v_plane_eq = {0,0,0,0};
@@ -404,10 +511,10 @@ __kernel void adv_fill_voxels(__global float4 * intersections,
 						float4 v_x_vector = {0,0,0,0};
 						float4 v_y_vector = {0,0,0,0};
 						for (int k = 0; k < 4; k++) {
-							int q_idx = BSCAN_WINDOW/2-2+k;
+							int q_idx = ring_idx(BSCAN_WINDOW/2-2+k);
 							float phi = 0;
 							float a = -1/2.0f;
-							float abs_t = fabs((t-bscan_timetags_queue[q_idx]))/(bscan_timetags_queue[1]-bscan_timetags_queue[0]);
+							float abs_t = fabs((t-bscan_timetags_queue[q_idx]))/(bscan_timetags_queue[ring_idx(1)]-bscan_timetags_queue[ring_idx(0)]);
 							if (inrange(abs_t, 0, 1))
 								phi = (a+2)*abs_t*abs_t*abs_t - (a+3)*abs_t*abs_t + 1;
 							else if (inrange(abs_t, 1, 2))
@@ -430,7 +537,7 @@ __kernel void adv_fill_voxels(__global float4 * intersections,
 						// Distance weight 4 bilinears:
 						float F = 0;
 						for (int n = 0; n < 4; n++) {
-							int q_idx = BSCAN_WINDOW/2-2+n;
+							int q_idx = ring_idx(BSCAN_WINDOW/2-2+n);
 							float bilinear0 = bscans_queue_a(q_idx,xa0,ya0)*(1-xa)*(1-ya) + bscans_queue_a(q_idx,xa0+1,ya0)*xa*(1-ya) + bscans_queue_a(q_idx,xa0,ya0+1)*(1-xa)*ya + bscans_queue_a(q_idx,xa0+1,ya0+1)*xa*ya;
 							F += 1/dists[n];
 							contribution += bilinear0/dists[n];
@@ -438,16 +545,7 @@ __kernel void adv_fill_voxels(__global float4 * intersections,
 						contribution /= F;
 					}
 
-					if (COMPOUND_METHOD == COMPOUND_AVG)
-						if (volume_a(x,y,z) != 0) volume_a(x,y,z) = (volume_a(x,y,z) + contribution)/2;	else volume_a(x,y,z) = contribution;
-					if (COMPOUND_METHOD == COMPOUND_MAX)
-						if (contribution > volume_a(x,y,z)) volume_a(x,y,z) = contribution;
-					if (COMPOUND_METHOD == COMPOUND_IFEMPTY)
-						if (volume_a(x,y,z) == 0) volume_a(x,y,z) = contribution;
-					if (COMPOUND_METHOD == COMPOUND_OVERWRITE)
-						volume_a(x,y,z) = contribution;
-					if (COMPOUND_METHOD == COMPOUND_ALPHABLEND)
-						if (volume_a(x, y, z) != 0) volume_a(x, y, z) = (1-ALPHA)*volume_a(x, y, z) + ALPHA*contribution;	else volume_a(x, y, z) = contribution;
+					compound_voxel(voxel, contribution);
 				}
 			}
 		}
@@ -460,7 +558,8 @@ __kernel void trace_intersections(__global float4 * intersections,
 																	int volume_n, 
 																	float volume_spacing, 
 																	__global float4 * bscan_plane_equation_queue,
-																	int axis) {
+																	int axis,
+																	int queue_head) {
 
 	float4 Rd = {axis == 0, axis == 1, axis == 2, 0};
 
@@ -489,9 +588,9 @@ __kernel void trace_intersections(__global float4 * intersections,
 
 	bool invalid = false;
 	for(int f = 0; f < 2; f++) {
-		int i = f==0 ? BSCAN_WINDOW/2-1 : BSCAN_WINDOW/2; // Fill voxels between two middle bscans
-		//int i = f==0 ? BSCAN_WINDOW/2-BSCAN_WINDOW/4-1 : BSCAN_WINDOW/2+BSCAN_WINDOW/4; // Alternatively fill voxels between BSCAN_WINDOW/2 middle bscans
-		//int i = f==0 ? 0 : BSCAN_WINDOW-1; // Alternatively fill voxels between first and last bscan
+		int i = ring_idx(f==0 ? BSCAN_WINDOW/2-1 : BSCAN_WINDOW/2); // Fill voxels between two middle bscans
+		//int i = ring_idx(f==0 ? BSCAN_WINDOW/2-BSCAN_WINDOW/4-1 : BSCAN_WINDOW/2+BSCAN_WINDOW/4); // Alternatively fill voxels between BSCAN_WINDOW/2 middle bscans
+		//int i = ring_idx(f==0 ? 0 : BSCAN_WINDOW-1); // Alternatively fill voxels between first and last bscan
 		float4 Pn = {bscan_plane_equation_queue[i].x, bscan_plane_equation_queue[i].y, bscan_plane_equation_queue[i].z, 0};
 		float4 R0 = {x*volume_spacing, y*volume_spacing, z*volume_spacing, 0};
 		float Vd = dot(Pn, Rd);
@@ -506,4 +605,242 @@ __kernel void trace_intersections(__global float4 * intersections,
 		float4 intersection = R0 + t*Rd;
 		intersections[n*2 + f] = intersection;
 	}
-}
\ No newline at end of file
+}
+__kernel void fill_brick_holes(__global unsigned char * brick_pool,
+															 __global int * brick_table,
+															 __global int * hole_bricks,
+															 int num_hole_bricks,
+															 __global unsigned char * hole_scratch,
+															 int volume_w,
+															 int volume_h,
+															 int volume_n,
+															 int radius) {
+	// Assumes no black ultrasound input data
+
+	int n = get_global_id(0);
+	if (n >= num_hole_bricks*BRICK_VOXELS) return;
+
+	int bricks_w = (volume_w + BRICK_SIZE - 1)/BRICK_SIZE;
+	int bricks_h = (volume_h + BRICK_SIZE - 1)/BRICK_SIZE;
+
+	int b = hole_bricks[n/BRICK_VOXELS];
+	int v = n%BRICK_VOXELS;
+	int x = (b%bricks_w)*BRICK_SIZE + v%BRICK_SIZE;
+	int y = ((b/bricks_w)%bricks_h)*BRICK_SIZE + (v/BRICK_SIZE)%BRICK_SIZE;
+	int z = (b/(bricks_w*bricks_h))*BRICK_SIZE + v/(BRICK_SIZE*BRICK_SIZE);
+
+	// Empty voxels get the mean of the non-empty ones around them, written aside so the result does not depend on the order
+	unsigned char value = brick_pool[(size_t)brick_table[b]*BRICK_VOXELS + v];
+	if (value == 0 && x < volume_w && y < volume_h && z < volume_n) {
+		int sum = 0;
+		int sum_counter = 0;
+		for (int k = max(z - radius, 0); k <= min(z + radius, volume_n - 1); k++) {
+			for (int j = max(y - radius, 0); j <= min(y + radius, volume_h - 1); j++) {
+				for (int i = max(x - radius, 0); i <= min(x + radius, volume_w - 1); i++) {
+					int slot = brick_table[brick_idx(i,j,k)];
+					if (slot < 0) continue;
+					unsigned char neighbour = brick_pool[(size_t)slot*BRICK_VOXELS + brick_offset(i,j,k)];
+					if (neighbour != 0) {
+						sum += neighbour;
+						sum_counter++;
+					}
+				}
+			}
+		}
+		if (sum_counter > 0)
+			value = sum/sum_counter;
+	}
+	hole_scratch[n] = value;
+}
+
+__kernel void commit_brick_holes(__global unsigned char * brick_pool,
+																 __global int * brick_table,
+																 __global int * hole_bricks,
+																 int num_hole_bricks,
+																 __global unsigned char * hole_scratch) {
+	int n = get_global_id(0);
+	if (n >= num_hole_bricks*BRICK_VOXELS) return;
+
+	brick_pool[(size_t)brick_table[hole_bricks[n/BRICK_VOXELS]]*BRICK_VOXELS + n%BRICK_VOXELS] = hole_scratch[n];
+}
+
+// Origin of the n-th ray, on the face of the volume opposite to the axis, as in trace_intersections
+float4 ray_origin(int n, int axis, int volume_w, int volume_h, float volume_spacing) {
+	int x = (axis != 0);
+	int y = (axis != 1);
+	int z = (axis != 2);
+
+	if (axis == 0) {
+		y = n%volume_h;
+		z = n/volume_h;
+	}
+	if (axis == 1) {
+		x = n%volume_w;
+		z = n/volume_w;
+	}
+	if (axis == 2) {
+		x = n%volume_w;
+		y = n/volume_w;
+	}
+
+	float4 R0 = {x*volume_spacing, y*volume_spacing, z*volume_spacing, 0};
+	return R0;
+}
+
+// Intersection of a ray along the axis with a bscan plane. false - if they are parallel
+bool ray_plane_intersection(float4 R0, int axis, float4 plane, float4 * intersection) {
+	float4 Rd = {axis == 0, axis == 1, axis == 2, 0};
+	float4 Pn = {plane.x, plane.y, plane.z, 0};
+	float Vd = dot(Pn, Rd);
+	if (Vd == 0)
+		return false;
+	*intersection = R0 + (-(dot(Pn, R0) + plane.w)/Vd)*Rd;
+	return true;
+}
+
+// Batched versions of mark_bricks and adv_fill_voxels (distance weighted). The bscans of the batch are stored
+// in order, window w of a launch is made of bscans first_window + w to first_window + w + BSCAN_WINDOW - 1.
+// Each work item processes the windows of its ray in order.
+__kernel void batch_mark_bricks(float volume_spacing,
+																int volume_w,
+																int volume_h,
+																int volume_n,
+																__global float4 * x_vector_queue,
+																__global float4 * y_vector_queue,
+																__global plane_pts * plane_points_queue,
+																__global float4 * bscan_plane_equation_queue,
+																float bscan_spacing_x,
+																float bscan_spacing_y,
+																int bscan_w,
+																int bscan_h,
+																int axis,
+																int first_window,
+																int num_windows,
+																__global unsigned char * touched_bricks) {
+
+	int iter_end[3] = {(axis != 0)*volume_w+(axis==0), (axis != 1)*volume_h+(axis==1), (axis != 2)*volume_n+(axis==2)};
+
+	int n = get_global_id(0);
+
+	if (n >= iter_end[0]*iter_end[1]*iter_end[2]) return;
+
+	float4 R0 = ray_origin(n, axis, volume_w, volume_h, volume_spacing);
+	for (int w = 0; w < num_windows; w++) {
+		int i0 = first_window + w + BSCAN_WINDOW/2-1; // Fill voxels between two middle bscans
+		float4 intrs0, intrs1;
+		if (!ray_plane_intersection(R0, axis, bscan_plane_equation_queue[i0], &intrs0) ||
+				!ray_plane_intersection(R0, axis, bscan_plane_equation_queue[i0 + 1], &intrs1))
+			continue;
+
+		mark_ray_bricks(intrs0, intrs1, volume_spacing, volume_w, volume_h, volume_n,
+										plane_points_queue[i0].corner0, x_vector_queue[i0], y_vector_queue[i0],
+										bscan_spacing_x, bscan_spacing_y, bscan_w, bscan_h, touched_bricks);
+	}
+}
+
+__kernel void batch_fill_voxels(__global unsigned char * brick_pool,
+																__global int * brick_table,
+																float volume_spacing,
+																int volume_w,
+																int volume_h,
+																int volume_n,
+																__global float4 * x_vector_queue,
+																__global float4 * y_vector_queue,
+																__global plane_pts * plane_points_queue,
+																__global float4 * bscan_plane_equation_queue,
+																float bscan_spacing_x,
+																float bscan_spacing_y,
+																int bscan_w,
+																int bscan_h,
+																__global unsigned char * mask,
+																__global unsigned char * bscans_queue,
+																int axis,
+																int first_window,
+																int num_windows) {
+
+	int iter_end[3] = {(axis != 0)*volume_w+(axis==0), (axis != 1)*volume_h+(axis==1), (axis != 2)*volume_n+(axis==2)};
+
+	int n = get_global_id(0);
+
+	if (n >= iter_end[0]*iter_end[1]*iter_end[2]) return;
+
+	int bricks_w = (volume_w + BRICK_SIZE - 1)/BRICK_SIZE;
+	int bricks_h = (volume_h + BRICK_SIZE - 1)/BRICK_SIZE;
+
+	float4 R0 = ray_origin(n, axis, volume_w, volume_h, volume_spacing);
+	for (int w = 0; w < num_windows; w++) {
+		int first = first_window + w;
+		float4 intrs0, intrs1;
+		if (!ray_plane_intersection(R0, axis, bscan_plane_equation_queue[first + BSCAN_WINDOW/2-1], &intrs0) ||
+				!ray_plane_intersection(R0, axis, bscan_plane_equation_queue[first + BSCAN_WINDOW/2], &intrs1))
+			continue;
+
+		intrs0 /= volume_spacing;
+		intrs1 /= volume_spacing;
+
+		int x0 = min(intrs0.x,intrs1.x);
+		int x1 = max(x0+1.0f, max(intrs0.x,intrs1.x));
+		int y0 = min(intrs0.y,intrs1.y);
+		int y1 = max(y0+1.0f, max(intrs0.y,intrs1.y));
+		int z0 = min(intrs0.z,intrs1.z);
+		int z1 = max(z0+1.0f, max(intrs0.z,intrs1.z));
+
+		// Only the part of the ray inside the volume
+		x0 = max(x0, 0); x1 = min(x1, volume_w - 1);
+		y0 = max(y0, 0); y1 = min(y1, volume_h - 1);
+		z0 = max(z0, 0); z1 = min(z1, volume_n - 1);
+
+		int last_brick = -1;
+		__global unsigned char * brick = NULL;
+		for (int z = z0; z <= z1; z++) {
+			for (int y = y0; y <= y1; y++) {
+				for (int x = x0; x <= x1; x++) {
+					int b = brick_idx(x,y,z);
+					if (b != last_brick) {
+						int slot = brick_table[b];
+						brick = (slot >= 0) ? brick_pool + (size_t)slot*BRICK_VOXELS : NULL;
+						last_brick = b;
+					}
+					if (brick == NULL) continue;
+
+					float4 voxel_coord = {x*volume_spacing,y*volume_spacing,z*volume_spacing,0};
+					bool valid = true;
+					float G = 0;
+					float contribution = 0;
+					for (int k = 0; k < BSCAN_WINDOW && valid; k++) {
+						int q_idx = first + k;
+
+						float4 normal = { bscan_plane_equation_queue[q_idx].x, bscan_plane_equation_queue[q_idx].y, bscan_plane_equation_queue[q_idx].z, 0 };
+
+						float dist0 = fabs(distance_pp(voxel_coord, bscan_plane_equation_queue[q_idx]));
+						float4 p0 = voxel_coord + -dist0*normal - plane_points_queue[q_idx].corner0;
+						float px0 = dot(p0, x_vector_queue[q_idx]) / bscan_spacing_x;
+						float py0 = dot(p0, y_vector_queue[q_idx]) / bscan_spacing_y;
+						float xa = px0 - floor(px0);
+						float ya = py0 - floor(py0);
+						int xa0 = (int)px0;
+						int ya0 = (int)py0;
+
+						valid = false;
+						if (inrange(xa0, 0, bscan_w) && inrange(ya0, 0, bscan_h) && xa0 + 1 < bscan_w && ya0 + 1 < bscan_h) {
+							if (mask[xa0 + ya0*bscan_w] != 0 && mask[xa0 + 1 + (ya0 + 1)*bscan_w] != 0 && mask[xa0 + 1 + ya0*bscan_w] != 0 && mask[xa0 + (ya0 + 1)*bscan_w] != 0) {
+								valid = true;
+								unsigned char bilinear = bscans_queue_a(q_idx, xa0, ya0)*(1 - xa)*(1 - ya) + bscans_queue_a(q_idx, xa0 + 1, ya0)*xa*(1 - ya) + bscans_queue_a(q_idx, xa0, ya0 + 1)*(1 - xa)*ya + bscans_queue_a(q_idx, xa0 + 1, ya0 + 1)*xa*ya;
+								if (dist0 != 0) {
+									G += 1 / dist0;
+									contribution += bilinear / dist0;
+								}
+							}
+						}
+					}
+
+					if (!valid) continue;
+					if (G != 0)
+						contribution /= G;
+
+					compound_voxel(brick + brick_offset(x,y,z), contribution);
+				}
+			}
+		}
+	}
+}
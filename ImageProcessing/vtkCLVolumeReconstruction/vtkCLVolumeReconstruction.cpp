@@ -37,6 +37,7 @@
 
 // VTK includes
 #include <vtkCommand.h>
+#include <vtkConditionVariable.h>
 #include <vtkImageData.h>
 #include <vtkInformation.h>
 #include <vtkInformationVector.h>
@@ -45,6 +46,7 @@
 #include <vtkObjectFactory.h>
 #include <vtkPointData.h>
 #include <vtkStreamingDemandDrivenPipeline.h>
+#include <vtkTimerLog.h>
 #include <vtkTransform.h>
 
 // STL includes
@@ -67,6 +69,34 @@ namespace
   {
     return make_float4(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x, 0);
   }
+
+  // Release an OpenCL object if it was created
+  inline void ReleaseCLObject(cl_mem& obj)
+  {
+    if (obj != nullptr)
+    {
+      clReleaseMemObject(obj);
+      obj = nullptr;
+    }
+  }
+
+  inline void ReleaseCLObject(cl_kernel& obj)
+  {
+    if (obj != nullptr)
+    {
+      clReleaseKernel(obj);
+      obj = nullptr;
+    }
+  }
+
+  inline void ReleaseCLObject(cl_command_queue& obj)
+  {
+    if (obj != nullptr)
+    {
+      clReleaseCommandQueue(obj);
+      obj = nullptr;
+    }
+  }
 }
 
 //----------------------------------------------------------------------------
@@ -77,7 +107,13 @@ vtkCLVolumeReconstruction::vtkCLVolumeReconstruction()
   , fill_holes(nullptr)
   , adv_fill_voxels(nullptr)
   , trace_intersections(nullptr)
+  , mark_bricks(nullptr)
+  , fill_brick_holes(nullptr)
+  , commit_brick_holes(nullptr)
+  , batch_mark_bricks(nullptr)
+  , batch_fill_voxels(nullptr)
   , reconstruction_cmd_queue(nullptr)
+  , upload_cmd_queue(nullptr)
   , device(nullptr)
   , context(nullptr)
   , program(nullptr)
@@ -94,9 +130,34 @@ vtkCLVolumeReconstruction::vtkCLVolumeReconstruction()
   , pose_data(nullptr)
   , timestamp(0.f)
   , device_index(0)
+  , backend(OPENCL_BACKEND)
+  , cpu_threads(0)
+  , device_failed(false)
   , program_src("")
+  , queue_head(0)
+  , mask_modified(false)
+  , bricks_w(0)
+  , bricks_h(0)
+  , bricks_d(0)
+  , touched_bricks_size(0)
+  , bytes_transferred_per_frame(0)
+  , incremental_readback(true)
+  , host_volume_stale(false)
+  , allocated_bricks(0)
+  , brick_pool_capacity(0)
+  , output_volume_allocated(false)
+  , hole_filling_radius(0)
+  , hole_filling_delay(10)
+  , max_hole_filling_bricks(16)
+  , hole_filling_frame(0)
+  , hole_filled_bricks(0)
+  , batch_capacity(0)
+  , mask(nullptr)
   , dev_intersections(nullptr)
-  , dev_volume(nullptr)
+  , dev_brick_pool(nullptr)
+  , dev_brick_table(nullptr)
+  , dev_hole_bricks(nullptr)
+  , dev_hole_scratch(nullptr)
   , dev_x_vector_queue(nullptr)
   , dev_y_vector_queue(nullptr)
   , dev_plane_points_queue(nullptr)
@@ -104,10 +165,34 @@ vtkCLVolumeReconstruction::vtkCLVolumeReconstruction()
   , dev_bscans_queue(nullptr)
   , dev_bscan_timetags_queue(nullptr)
   , dev_bscan_plane_equation_queue(nullptr)
+  , dev_touched_bricks(nullptr)
+  , dev_batch_bscans(nullptr)
+  , dev_batch_x_vectors(nullptr)
+  , dev_batch_y_vectors(nullptr)
+  , dev_batch_plane_points(nullptr)
+  , dev_batch_plane_equations(nullptr)
+  , num_upload_events(0)
+  , last_fill_event(nullptr)
+  , previous_fill_event(nullptr)
   , pos_timetags(nullptr)
   , pos_matrices(nullptr)
   , bscan_timetags(nullptr)
   , calibration_matrix(nullptr)
+  , frame_queue_read(0)
+  , frame_queue_write(0)
+  , frame_queue_size(8)
+  , frame_queue_policy(DROP_FRAMES)
+  , async_running(false)
+  , async_stop(false)
+  , compounding_thread_id(-1)
+  , published_version(0)
+  , publish_interval(0.1)
+  , last_publish_time(0.0)
+  , dropped_frames(0)
+  , compounded_frames(0)
+  , last_latency(0.0)
+  , total_latency(0.0)
+  , max_latency(0.0)
 {
   device_index = 0;
 
@@ -134,6 +219,11 @@ vtkCLVolumeReconstruction::vtkCLVolumeReconstruction()
   }
 
   input_data_mutex = vtkSmartPointer<vtkMutexLock>::New();
+  volume_mutex = vtkSmartPointer<vtkMutexLock>::New();
+  frame_queue_mutex = vtkSmartPointer<vtkMutexLock>::New();
+  publish_mutex = vtkSmartPointer<vtkMutexLock>::New();
+  frame_queue_condition = vtkSmartPointer<vtkConditionVariable>::New();
+  compounding_threader = vtkSmartPointer<vtkMultiThreader>::New();
 
 #ifdef VCLVR_DEBUG
   // Print device information
@@ -145,6 +235,7 @@ vtkCLVolumeReconstruction::vtkCLVolumeReconstruction()
 //----------------------------------------------------------------------------
 vtkCLVolumeReconstruction::~vtkCLVolumeReconstruction()
 {
+  StopAsyncReconstruction();
   ReleaseDevices();
 
   // Release host memory
@@ -174,6 +265,8 @@ void vtkCLVolumeReconstruction::PrintSelf(ostream& os, vtkIndent indent)
   os << indent << "bscan_spacing_y: " << this->bscan_spacing_y;
   os << indent << "timestamp: " << this->timestamp;
   os << indent << "device_index: " << this->device_index;
+  os << indent << "backend: " << (this->backend == CPU_BACKEND ? "CPU" : "OpenCL");
+  os << indent << "cpu_threads: " << this->cpu_threads;
   os << indent << "program_src: " << this->program_src;
   os << indent << "BSCAN_WINDOW: " << this->BSCAN_WINDOW;
   os << indent << "intersections_size: " << this->intersections_size;
@@ -186,6 +279,16 @@ void vtkCLVolumeReconstruction::PrintSelf(ostream& os, vtkIndent indent)
   os << indent << "global_work_size[1]: " << this->global_work_size[1];
   os << indent << "local_work_size[1]: " << this->local_work_size[1];
   os << indent << "mask: " << this->mask;
+  os << indent << "incremental_readback: " << this->incremental_readback;
+  os << indent << "bytes_transferred_per_frame: " << this->bytes_transferred_per_frame;
+  os << indent << "allocated_bricks: " << this->allocated_bricks;
+  os << indent << "brick_pool_capacity: " << this->brick_pool_capacity;
+  os << indent << "hole_filling_radius: " << this->hole_filling_radius;
+  os << indent << "hole_filling_delay: " << this->hole_filling_delay;
+  os << indent << "max_hole_filling_bricks: " << this->max_hole_filling_bricks;
+  os << indent << "frame_queue_size: " << this->frame_queue_size;
+  os << indent << "frame_queue_policy: " << this->frame_queue_policy;
+  os << indent << "async_running: " << this->async_running;
   this->image_data->PrintSelf(os, indent);
   this->pose_data->PrintSelf(os, indent);
   this->reconstructed_volume->PrintSelf(os, indent);
@@ -226,9 +329,25 @@ int vtkCLVolumeReconstruction::RequestData(vtkInformation* request, vtkInformati
   // Set input data
   input_data_mutex->Lock();
 
+  if (async_running)
+  {
+    // Hand the frame to the compounding thread and return the volume it last published, without
+    // waiting for the compounding. The pipeline clears the output before each update, so the
+    // shallow copy is made every time.
+    input_data_mutex->Unlock();
+    image_pose->GetMatrix(pose_data);
+    this->PushFrame(timestamp, input, pose_data);
+
+    this->GetPublishedVolume(output);
+    output->DataHasBeenGenerated();
+    output->Modified();
+    return 1;
+  }
+
   image_data->DeepCopy(input);
   image_pose->GetMatrix(pose_data);
   this->UpdateReconstruction();
+  this->UpdateOutputVolume();
 
   output->DeepCopy(reconstructed_volume);
   output->DataHasBeenGenerated();
@@ -248,27 +367,156 @@ void vtkCLVolumeReconstruction::SetDevice(int idx)
 //----------------------------------------------------------------------------
 void vtkCLVolumeReconstruction::ReleaseDevices()
 {
-  // Release device memory
-  clReleaseCommandQueue(reconstruction_cmd_queue);
-
-  clReleaseMemObject(dev_intersections);
-  clReleaseMemObject(dev_volume);
-  clReleaseMemObject(dev_x_vector_queue);
-  clReleaseMemObject(dev_y_vector_queue);
-  clReleaseMemObject(dev_plane_points_queue);
-  clReleaseMemObject(dev_mask);
-  clReleaseMemObject(dev_bscans_queue);
-  clReleaseMemObject(dev_bscan_plane_equation_queue);
-  clReleaseMemObject(dev_bscan_timetags_queue);
-  clReleaseProgram(program);
+  // Nothing was created on an OpenCL device
+  if (context == nullptr)
+  {
+    return;
+  }
+
+  // Release pending events
+  for (cl_uint i = 0; i < num_upload_events; i++)
+  {
+    clReleaseEvent(upload_events[i]);
+  }
+  num_upload_events = 0;
+  if (last_fill_event != nullptr)
+  {
+    clReleaseEvent(last_fill_event);
+    last_fill_event = nullptr;
+  }
+  if (previous_fill_event != nullptr)
+  {
+    clReleaseEvent(previous_fill_event);
+    previous_fill_event = nullptr;
+  }
+
+  // Release device memory. Any of it may be missing after a failed initialization or allocation
+  ReleaseCLObject(reconstruction_cmd_queue);
+  ReleaseCLObject(upload_cmd_queue);
+
+  ReleaseCLObject(dev_intersections);
+  ReleaseCLObject(dev_brick_pool);
+  ReleaseCLObject(dev_brick_table);
+  ReleaseCLObject(dev_hole_bricks);
+  ReleaseCLObject(dev_hole_scratch);
+  ReleaseCLObject(dev_x_vector_queue);
+  ReleaseCLObject(dev_y_vector_queue);
+  ReleaseCLObject(dev_plane_points_queue);
+  ReleaseCLObject(dev_mask);
+  ReleaseCLObject(dev_bscans_queue);
+  ReleaseCLObject(dev_bscan_plane_equation_queue);
+  ReleaseCLObject(dev_bscan_timetags_queue);
+  ReleaseCLObject(dev_touched_bricks);
+  ReleaseCLObject(dev_batch_bscans);
+  ReleaseCLObject(dev_batch_x_vectors);
+  ReleaseCLObject(dev_batch_y_vectors);
+  ReleaseCLObject(dev_batch_plane_points);
+  ReleaseCLObject(dev_batch_plane_equations);
+  batch_capacity = 0;
+
+  ReleaseCLObject(fill_volume);
+  ReleaseCLObject(round_off_translate);
+  ReleaseCLObject(transform);
+  ReleaseCLObject(fill_holes);
+  ReleaseCLObject(trace_intersections);
+  ReleaseCLObject(adv_fill_voxels);
+  ReleaseCLObject(mark_bricks);
+  ReleaseCLObject(fill_brick_holes);
+  ReleaseCLObject(commit_brick_holes);
+  ReleaseCLObject(batch_mark_bricks);
+  ReleaseCLObject(batch_fill_voxels);
+  if (program != nullptr)
+  {
+    clReleaseProgram(program);
+    program = nullptr;
+  }
   clReleaseContext(context);
+  context = nullptr;
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::FallBackToCPU()
+{
+  std::cerr << "[vtkCLVolumeReconstruction] OpenCL error, switching to the CPU backend" << std::endl;
+  int read_back = 0;
+
+  // The device pool holds the latest bricks, unless it is the one that failed. The pool may be
+  // smaller than the allocated bricks if growing it failed, the slots past it are still zero.
+  if (dev_brick_pool != nullptr && allocated_bricks > 0)
+  {
+    size_t pool_size = 0;
+    clGetMemObjectInfo(dev_brick_pool, CL_MEM_SIZE, sizeof(size_t), &pool_size, NULL);
+    size_t size = std::min(pool_size, (size_t)allocated_bricks * BRICK_VOXELS);
+    if (clFinish(reconstruction_cmd_queue) != CL_SUCCESS ||
+        clEnqueueReadBuffer(reconstruction_cmd_queue, dev_brick_pool, CL_TRUE, 0, size, &brick_pool[0], 0, 0, 0) != CL_SUCCESS)
+    {
+      std::cerr << "[vtkCLVolumeReconstruction] Could not read the bricks back, keeping the last ones read" << std::endl;
+    }
+    else
+    {
+      read_back = 1;
+    }
+  }
+  ReleaseDevices();
+
+  backend = CPU_BACKEND;
+  device_failed = false;
+  cpu_intersections.assign(2 * max_vol_dim * max_vol_dim, make_float4(0.0f));
+  hole_scratch.assign((size_t)max_hole_filling_bricks * BRICK_VOXELS, 0);
+
+  // The host pool is the volume from now on
+  for (int b = 0; b < touched_bricks_size; b++)
+  {
+    dirty_bricks[b] = (brick_table[b] >= 0);
+  }
+  host_volume_stale = false;
+  return read_back;
 }
 
 //----------------------------------------------------------------------------
 void vtkCLVolumeReconstruction::Initialize()
+{
+  if (backend == OPENCL_BACKEND && !InitializeOpenCL())
+  {
+    std::cerr << "[vtkCLVolumeReconstruction] No usable OpenCL device, using the CPU backend" << std::endl;
+    backend = CPU_BACKEND;
+  }
+
+  // Initialize Buffers
+  InitializeBuffers();
+
+  omp_init_lock(&cl_device_lock);
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::SetBackend(int val)
+{
+  this->backend = (val == CPU_BACKEND) ? CPU_BACKEND : OPENCL_BACKEND;
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::GetBackend() const
+{
+  return this->backend;
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::SetNumberOfCPUThreads(int val)
+{
+  this->cpu_threads = std::max(val, 0);
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::GetNumberOfCPUThreads() const
+{
+  return (this->cpu_threads > 0) ? this->cpu_threads : omp_get_max_threads();
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::InitializeOpenCL()
 {
   cl_int err;
-  cl_device_id devices[250];
+  cl_device_id devices[256];
 
 #ifdef KERNEL_DEBUG
   int platform_idx = 1; // 0 for NVIDIA and 1 for Intel CPU
@@ -277,21 +525,30 @@ void vtkCLVolumeReconstruction::Initialize()
 #endif
 
   // Get available platforms
-  cl_uint nPlatforms;
-  clGetPlatformIDs(0, NULL, &nPlatforms);
+  cl_uint nPlatforms = 0;
+  if (clGetPlatformIDs(0, NULL, &nPlatforms) != CL_SUCCESS || nPlatforms <= (cl_uint)platform_idx)
+  {
+    return 0;
+  }
 
   cl_platform_id* platformIDs = (cl_platform_id*)malloc(sizeof(cl_platform_id) * nPlatforms);
   clGetPlatformIDs(nPlatforms, platformIDs, NULL);
 
   cl_context_properties cps[3] = {CL_CONTEXT_PLATFORM, (cl_context_properties)platformIDs[platform_idx], 0};
 
+  cl_uint nDevices = 0;
 #ifdef KERNEL_DEBUG
   // Get handles to available CPU devices
-  clGetDeviceIDs(platformIDs[platform_idx], CL_DEVICE_TYPE_CPU, 256, devices, NULL);
+  err = clGetDeviceIDs(platformIDs[platform_idx], CL_DEVICE_TYPE_CPU, 256, devices, &nDevices);
 #else
   // Get handles to available GPU devices
-  clGetDeviceIDs(platformIDs[platform_idx], CL_DEVICE_TYPE_GPU, 256, devices, NULL);
+  err = clGetDeviceIDs(platformIDs[platform_idx], CL_DEVICE_TYPE_GPU, 256, devices, &nDevices);
 #endif
+  free(platformIDs);
+  if (err != CL_SUCCESS || nDevices <= (cl_uint)device_index)
+  {
+    return 0;
+  }
 
   device = devices[device_index];
 #ifdef VCLVR_DEBUG
@@ -301,14 +558,31 @@ void vtkCLVolumeReconstruction::Initialize()
 
   // Create CL context
   context = clCreateContext(cps, 1, &device, NULL, NULL, &err);
+  if (err != CL_SUCCESS)
+  {
+    std::cerr << "[vtkCLVolumeReconstruction] ERROR clCreateContext: " << err << std::endl;
+    context = nullptr;
+    return 0;
+  }
 
   // Create CommandQueue
   reconstruction_cmd_queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
   if (err != CL_SUCCESS)
   {
-    std::stringstream ss;
-    ss << "[vtkCLVolumeReconstruction] ERROR clCreateCommandQueue: " << err;
-    throw std::exception(ss.str().c_str());
+    std::cerr << "[vtkCLVolumeReconstruction] ERROR clCreateCommandQueue: " << err << std::endl;
+    reconstruction_cmd_queue = nullptr;
+    ReleaseDevices();
+    return 0;
+  }
+
+  // Separate queue for the frame uploads, so they can overlap with the compounding kernels
+  upload_cmd_queue = clCreateCommandQueue(context, device, 0, &err);
+  if (err != CL_SUCCESS)
+  {
+    std::cerr << "[vtkCLVolumeReconstruction] ERROR clCreateCommandQueue: " << err << std::endl;
+    upload_cmd_queue = nullptr;
+    ReleaseDevices();
+    return 0;
   }
 
   char* program_src_c = new char[program_src.length() + 1];
@@ -333,9 +607,9 @@ void vtkCLVolumeReconstruction::Initialize()
     clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(char) * 512 * 512, buffer, &len);
     buffer[len] = '\0';
 
-    std::stringstream ss;
-    ss << "[vtkCLVolumeReconstruction] ERROR: Failed to build program on device " << device << ". Error code: " << err << ". " << buffer;
-    throw std::exception(ss.str().c_str());
+    std::cerr << "[vtkCLVolumeReconstruction] ERROR: Failed to build program on device " << device << ". Error code: " << err << ". " << buffer << std::endl;
+    ReleaseDevices();
+    return 0;
   }
 
   // Now build kernels
@@ -345,11 +619,19 @@ void vtkCLVolumeReconstruction::Initialize()
   fill_holes = OpenCLKernelBuild(program, device, "fill_holes");
   trace_intersections = OpenCLKernelBuild(program, device, "trace_intersections");
   adv_fill_voxels = OpenCLKernelBuild(program, device, "adv_fill_voxels");
+  mark_bricks = OpenCLKernelBuild(program, device, "mark_bricks");
+  fill_brick_holes = OpenCLKernelBuild(program, device, "fill_brick_holes");
+  commit_brick_holes = OpenCLKernelBuild(program, device, "commit_brick_holes");
+  batch_mark_bricks = OpenCLKernelBuild(program, device, "batch_mark_bricks");
+  batch_fill_voxels = OpenCLKernelBuild(program, device, "batch_fill_voxels");
+  if (device_failed)
+  {
+    ReleaseDevices();
+    device_failed = false;
+    return 0;
+  }
 
-  // Initialize Buffers
-  InitializeBuffers();
-
-  omp_init_lock(&cl_device_lock);
+  return 1;
 }
 
 //----------------------------------------------------------------------------
@@ -495,6 +777,18 @@ void vtkCLVolumeReconstruction::SetReconstructionAxis(int val)
 	this->axis = val;
 }
 
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::SetMask(unsigned char* m)
+{
+  if (mask == nullptr || m == nullptr)
+  {
+    return;
+  }
+
+  memcpy(mask, m, sizeof(unsigned char) * bscan_w * bscan_h);
+  mask_modified = true;
+}
+
 //----------------------------------------------------------------------------
 void vtkCLVolumeReconstruction::SetInputImageData(double time, vtkImageData* data)
 {
@@ -524,9 +818,20 @@ void vtkCLVolumeReconstruction::SetImagePoseTransform(vtkTransform* t)
 //----------------------------------------------------------------------------
 void vtkCLVolumeReconstruction::ClearReconstruction()
 {
-	unsigned char *volume = (unsigned char*)reconstructed_volume->GetScalarPointer();
-	memset(volume, 0, sizeof(unsigned char)*volume_width*volume_height*volume_depth);
+	volume_mutex->Lock();
+
+	// Release the bricks on the host and the device
+	ClearBricks();
+
+	if (output_volume_allocated)
+	{
+		unsigned char *volume = (unsigned char*)reconstructed_volume->GetScalarPointer();
+		memset(volume, 0, sizeof(unsigned char)*volume_width*volume_height*volume_depth);
+	}
+	host_volume_stale = false;
+
 	this->reconstructed_volume->Modified();
+	volume_mutex->Unlock();
 }
 
 //----------------------------------------------------------------------------
@@ -569,29 +874,67 @@ void vtkCLVolumeReconstruction::StartReconstruction()
   global_work_size[0] = ((max_vol_dim * max_vol_dim) / 256 + 1) * 256;
   local_work_size[0] = 256;
 
-  // Initialize output volume to zero
-  unsigned char *volume = (unsigned char*)this->reconstructed_volume->GetScalarPointer();
-  memset(volume, 0, sizeof(unsigned char)*volume_width * volume_height * volume_depth);
-
-  // Set mask. Default is no mask (val 1 --> white). In mask Black is outside ROI while White is insite the ROI.
-  memset(mask, 1, sizeof(unsigned char)*bscan_w * bscan_h);
+  // The mask is sent with the first frame
+  mask_modified = true;
+  queue_head = 0;
 
   intersections_size = sizeof(cl_float4) * 2 * max_vol_dim * max_vol_dim;
   volume_size = volume_width * volume_height * volume_depth * sizeof(cl_uchar);
-  x_vector_queue_size = BSCAN_WINDOW * sizeof(cl_float4);
-  y_vector_queue_size = BSCAN_WINDOW * sizeof(cl_float4);
-  plane_points_queue_size = BSCAN_WINDOW * sizeof(plane_pts);
+  x_vector_queue_size = BSCAN_RING * sizeof(cl_float4);
+  y_vector_queue_size = BSCAN_RING * sizeof(cl_float4);
+  plane_points_queue_size = BSCAN_RING * sizeof(plane_pts);
   mask_size = bscan_w * bscan_h * sizeof(cl_uchar);
-  bscans_queue_size = BSCAN_WINDOW * bscan_w * bscan_h * sizeof(cl_uchar);
-  bscan_timetags_queue_size = BSCAN_WINDOW * sizeof(cl_float);
-  bscan_plane_equation_queue_size = BSCAN_WINDOW * sizeof(float4);
+  bscans_queue_size = BSCAN_RING * bscan_w * bscan_h * sizeof(cl_uchar);
+  bscan_timetags_queue_size = BSCAN_RING * sizeof(cl_float);
+  bscan_plane_equation_queue_size = BSCAN_RING * sizeof(float4);
+
+  // The volume is stored as bricks, allocated when mark_bricks first flags them
+  bricks_w = (volume_width + BRICK_SIZE - 1) / BRICK_SIZE;
+  bricks_h = (volume_height + BRICK_SIZE - 1) / BRICK_SIZE;
+  bricks_d = (volume_depth + BRICK_SIZE - 1) / BRICK_SIZE;
+  touched_bricks_size = bricks_w * bricks_h * bricks_d * sizeof(cl_uchar);
+  touched_bricks.assign(touched_bricks_size, 0);
+  untouched_bricks.assign(touched_bricks_size, 0);
+  dirty_bricks.assign(touched_bricks_size, 0);
+  brick_table.assign(touched_bricks_size, -1);
+  host_volume_stale = false;
+  bytes_transferred_per_frame = 0;
+
+  // Start small, the pool doubles as the sweeps cover more of the volume
+  allocated_bricks = 0;
+  brick_pool_capacity = std::min(touched_bricks_size, (int)INITIAL_BRICK_POOL);
+  brick_pool.assign((size_t)brick_pool_capacity * BRICK_VOXELS, 0);
+
+  // Bricks are hole filled once the sweep has left them
+  brick_last_touched.assign(touched_bricks_size, -1);
+  settled_bricks.clear();
+  hole_bricks.clear();
+  hole_filling_frame = 0;
+  hole_filled_bricks = 0;
+
+  // Initialize output volume to zero, if it was already asked for
+  if (output_volume_allocated)
+  {
+    unsigned char *volume = (unsigned char*)this->reconstructed_volume->GetScalarPointer();
+    memset(volume, 0, sizeof(unsigned char)*volume_width * volume_height * volume_depth);
+  }
 
-  dev_x_vector_queue_size = BSCAN_WINDOW * sizeof(float) * 4;
-  dev_y_vector_queue_size = BSCAN_WINDOW * sizeof(float) * 4;
-  dev_plane_points_queue_size = BSCAN_WINDOW * sizeof(float) * 4 * 3;
+  dev_x_vector_queue_size = BSCAN_RING * sizeof(float) * 4;
+  dev_y_vector_queue_size = BSCAN_RING * sizeof(float) * 4;
+  dev_plane_points_queue_size = BSCAN_RING * sizeof(float) * 4 * 3;
+
+  if (backend == CPU_BACKEND)
+  {
+    cpu_intersections.assign(2 * max_vol_dim * max_vol_dim, make_float4(0.0f));
+    hole_scratch.assign((size_t)max_hole_filling_bricks * BRICK_VOXELS, 0);
+    return;
+  }
 
   dev_intersections = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, intersections_size, NULL);
-  dev_volume = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, volume_size, volume);
+  dev_brick_pool = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, brick_pool.size(), &brick_pool[0]);
+  dev_brick_table = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, brick_table.size() * sizeof(cl_int), &brick_table[0]);
+  dev_hole_bricks = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, max_hole_filling_bricks * sizeof(cl_int), NULL);
+  dev_hole_scratch = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)max_hole_filling_bricks * BRICK_VOXELS, NULL);
   dev_x_vector_queue = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, dev_x_vector_queue_size, NULL);
   dev_y_vector_queue = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, dev_y_vector_queue_size, NULL);
   dev_plane_points_queue = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, dev_plane_points_queue_size, NULL);
@@ -599,260 +942,1179 @@ void vtkCLVolumeReconstruction::StartReconstruction()
   dev_bscans_queue = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, bscans_queue_size, NULL);
   dev_bscan_timetags_queue = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, bscan_timetags_queue_size, NULL);
   dev_bscan_plane_equation_queue = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, bscan_plane_equation_queue_size, NULL);
+  dev_touched_bricks = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, touched_bricks_size, &untouched_bricks[0]);
+  if (device_failed)
+  {
+    FallBackToCPU();
+  }
 }
 
 //----------------------------------------------------------------------------
 void vtkCLVolumeReconstruction::UpdateReconstruction()
+{
+  volume_mutex->Lock();
+  ReconstructFrame(NULL);
+  volume_mutex->Unlock();
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::ReconstructFrame(const frame_slot* frame)
 {
   // Retrieve US data and perform reconstruction
-  if (ShiftQueues())
-  {
-    // Multiply the position matrix with the calibration matrix
-    CalibratePosMatrix(pos_matrices_queue[BSCAN_WINDOW - 1], calibration_matrix);
+  int queues_full = ShiftQueues(frame);
 
-    InsertPlanePoints(pos_matrices_queue[BSCAN_WINDOW - 1]);
+  // Multiply the position matrix with the calibration matrix
+  CalibratePosMatrix(pos_matrices_queue[RingIndex(BSCAN_WINDOW - 1)], calibration_matrix);
 
-    // Fill BPlane equation
-    InsertPlaneEquation();
+  InsertPlanePoints(pos_matrices_queue[RingIndex(BSCAN_WINDOW - 1)]);
+
+  // Fill BPlane equation
+  InsertPlaneEquation();
 
-    // Fill Voxels
-    FillVoxels();
+  if (backend == OPENCL_BACKEND)
+  {
+    // Send the new frame to the device
+    UploadFrame();
+
+    int fill_enqueued = 0;
+    int holes_collected = 0;
+    if (queues_full && !device_failed)
+    {
+      // Fill Voxels
+      fill_enqueued = FillVoxels();
+
+      // Fill Holes in the bricks the sweep has left
+      if (!device_failed)
+      {
+        FillHoles();
+        holes_collected = 1;
+      }
+    }
+    if (!device_failed)
+    {
+      return;
+    }
 
-    // Fill Holes
-    // TODO
+    // The fill kernel runs once enqueued, the pool read back then has the frame and only the
+    // hole filling is left. Otherwise the frame is compounded again on the host.
+    int read_back = FallBackToCPU();
+    if (fill_enqueued && read_back)
+    {
+      FillHolesCPU(!holes_collected);
+      return;
+    }
+  }
 
-    // Update output volume. Copy GPU buffers to vtkImage buffer.
-    // Remove this if possible to save time.
-    //UpdateOutputVolume();
+  if (queues_full)
+  {
+    FillVoxelsCPU();
+    FillHolesCPU();
   }
 }
 
 //----------------------------------------------------------------------------
-void vtkCLVolumeReconstruction::GetOutputVolume(vtkImageData* v)
+int vtkCLVolumeReconstruction::ReconstructBatch(int num_frames, const double* timestamps, const unsigned char* bscans, const float* poses)
 {
-  v->DeepCopy(reconstructed_volume);
-  //memcpy((unsigned char*)v->GetScalarPointer(), volume, sizeof(unsigned char)*volume_width * volume_height * volume_depth);
-}
+  if (num_frames <= 0 || timestamps == NULL || bscans == NULL || poses == NULL)
+  {
+    return 0;
+  }
+  if (async_running || brick_table.empty())
+  {
+    std::cerr << "[vtkCLVolumeReconstruction] ReconstructBatch needs StartReconstruction and no compounding thread" << std::endl;
+    return 0;
+  }
 
-//--------------------------------------------------------------
-void vtkCLVolumeReconstruction::GetOrigin(double* ptr) const
-{
-  ptr[0] = (double)volume_origin[0];
-  ptr[1] = (double)volume_origin[1];
-  ptr[2] = (double)volume_origin[2];
-}
+  volume_mutex->Lock();
 
-//--------------------------------------------------------------
-void vtkCLVolumeReconstruction::GetSpacing(double spacing[3]) const
-{
-  spacing[0] = (double)volume_spacing;
-  spacing[1] = (double)volume_spacing;
-  spacing[2] = (double)volume_spacing;
-}
+  size_t bscan_size = bscan_w * bscan_h * sizeof(cl_uchar);
 
-//----------------------------------------------------------------------------
-std::string vtkCLVolumeReconstruction::FileToString(const std::string& filename, const std::string& preamble)
-{
-  std::ifstream inputFile = std::ifstream(filename, std::ios::in | std::ios::binary);
-  if (!inputFile.is_open())
+  // The newest BSCAN_WINDOW - 1 bscans of the queues start the window of the first frame of the batch
+  const int history = BSCAN_WINDOW - 1;
+  if (backend == OPENCL_BACKEND)
   {
-    return nullptr;
+    ReserveBatchBuffers(history + num_frames);
+    if (device_failed)
+    {
+      FallBackToCPU();
+    }
   }
 
-  std::string file_contents((std::istreambuf_iterator<char>(inputFile)), std::istreambuf_iterator<char>());
-  file_contents.insert(0, preamble);
-  inputFile.close();
+  if (backend == CPU_BACKEND)
+  {
+    // The CPU backend compounds frame by frame, there are no launches to amortize
+    for (int i = 0; i < num_frames; i++)
+    {
+      frame_slot frame;
+      frame.timestamp = timestamps[i];
+      frame.acquisition_time = 0.0;
+      memcpy(frame.pose, &poses[12 * i], sizeof(float) * 12);
+      frame.pixels = const_cast<unsigned char*>(&bscans[i * bscan_size]);
+      ReconstructFrame(&frame);
+    }
+    volume_mutex->Unlock();
+    return num_frames;
+  }
 
-  return file_contents;
-}
+  omp_set_lock(&cl_device_lock);
+  OpenCLCheckError(clFinish(upload_cmd_queue));
+  for (cl_uint i = 0; i < num_upload_events; i++)
+  {
+    clReleaseEvent(upload_events[i]);
+  }
+  num_upload_events = 0;
+  if (mask_modified)
+  {
+    OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_mask, CL_TRUE, 0, mask_size, mask, 0, 0, 0));
+    mask_modified = false;
+  }
 
-//----------------------------------------------------------------------------
-cl_kernel vtkCLVolumeReconstruction::OpenCLKernelBuild(cl_program program, cl_device_id device, char* kernel_name)
-{
-  cl_int err;
-  cl_kernel kernel = clCreateKernel(program, kernel_name, &err);
-  if (err != CL_SUCCESS)
+  // The window the batch starts from, to compound it again on the host if the device fails
+  ring_state batch_start;
+  SaveQueues(batch_start);
+  for (int f = 0; f < history; f++)
   {
-    size_t len;
-    char buffer[2048];
-    std::stringstream ss;
-    ss << "[vtkCLVolumeReconstruction] ERROR: Failed to build program executable: " << kernel_name << ". ";
+    int slot = RingIndex(f + 1);
+    batch_x_vectors[f] = x_vector_queue[slot];
+    batch_y_vectors[f] = y_vector_queue[slot];
+    batch_plane_points[f] = plane_points_queue[slot];
+    batch_plane_equations[f] = bscan_plane_equation_queue[slot];
+    OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_batch_bscans, CL_TRUE, f * bscan_size, bscan_size, bscans_queue[slot], 0, 0, 0));
+  }
 
-    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
+  // The bscans go straight from the caller's buffer to the device while the planes are computed
+  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_batch_bscans, CL_FALSE, history * bscan_size, num_frames * bscan_size, bscans, 0, 0, 0));
+  OpenCLCheckError(clFlush(reconstruction_cmd_queue));
+  omp_unset_lock(&cl_device_lock);
 
-    ss << buffer << std::endl;
-    throw std::exception(ss.str().c_str());
-  }
-  return kernel;
-}
+  int first_window = -1;
+  for (int i = 0; i < num_frames; i++)
+  {
+    frame_slot frame;
+    frame.timestamp = timestamps[i];
+    frame.acquisition_time = 0.0;
+    memcpy(frame.pose, &poses[12 * i], sizeof(float) * 12);
+    frame.pixels = const_cast<unsigned char*>(&bscans[i * bscan_size]);
+    int queues_full = ShiftQueues(&frame);
+
+    int slot = RingIndex(BSCAN_WINDOW - 1);
+    CalibratePosMatrix(pos_matrices_queue[slot], calibration_matrix);
+    InsertPlanePoints(pos_matrices_queue[slot]);
+    InsertPlaneEquation();
 
-//----------------------------------------------------------------------------
-void vtkCLVolumeReconstruction::InitializeBuffers()
-{
-  x_vector_queue = (float4*) malloc(BSCAN_WINDOW * sizeof(float4));
-  y_vector_queue = (float4*) malloc(BSCAN_WINDOW * sizeof(float4));
-  bscans_queue = new unsigned char* [BSCAN_WINDOW];
-  pos_matrices_queue = new float*[BSCAN_WINDOW];
+    batch_x_vectors[history + i] = x_vector_queue[slot];
+    batch_y_vectors[history + i] = y_vector_queue[slot];
+    batch_plane_points[history + i] = plane_points_queue[slot];
+    batch_plane_equations[history + i] = bscan_plane_equation_queue[slot];
+    if (queues_full && first_window < 0)
+    {
+      first_window = i;
+    }
+  }
 
-  for (int i = 0; i < BSCAN_WINDOW; i++)
+  // The fill kernel runs once enqueued, the device pool has the batch if it can still be read back
+  int fill_enqueued = 0;
+  int holes_collected = 0;
+  if (first_window >= 0 && !device_failed)
   {
-    pos_matrices_queue[i] = (float*)malloc(sizeof(float) * 12);
-    bscans_queue[i]     = (unsigned char*)malloc(bscan_w * bscan_h * sizeof(unsigned char));
+    fill_enqueued = FillVoxelsBatch(first_window, num_frames - first_window);
+
+    // Fill Holes in the bricks the sweep has left, the delay counts batches
+    if (!device_failed)
+    {
+      FillHoles();
+      holes_collected = 1;
+    }
   }
 
-  bscan_timetags_queue = (float*) malloc(BSCAN_WINDOW * sizeof(float));
-  pos_timetags_queue = (float*) malloc(BSCAN_WINDOW * sizeof(float));
-  bscan_plane_equation_queue = (float4*) malloc(BSCAN_WINDOW * sizeof(float4));
-  plane_points_queue = (plane_pts*) malloc(BSCAN_WINDOW * sizeof(plane_pts));
-  mask = (unsigned char*)malloc(sizeof(unsigned char) * bscan_w * bscan_h);
+  // The caller's bscans are not needed once the batch is done
+  omp_set_lock(&cl_device_lock);
+  OpenCLCheckError(clFinish(reconstruction_cmd_queue));
+  omp_unset_lock(&cl_device_lock);
 
-  image_data = vtkImageData::New();
-  image_data->SetExtent(0, this->bscan_w, 0, this->bscan_h, 0, 0);
-  image_data->AllocateScalars(VTK_UNSIGNED_CHAR, 1);
+  // Per-frame reconstruction continues from the queues
+  UploadQueues();
 
-  pose_data = vtkMatrix4x4::New();
+  if (device_failed)
+  {
+    // Only the hole filling is left if the pool read back has the batch, otherwise the caller's
+    // bscans are compounded again from the window the batch started from
+    int read_back = FallBackToCPU();
+    if (fill_enqueued && read_back)
+    {
+      FillHolesCPU(!holes_collected);
+    }
+    else
+    {
+      RestoreQueues(batch_start);
+      for (int i = 0; i < num_frames; i++)
+      {
+        frame_slot frame;
+        frame.timestamp = timestamps[i];
+        frame.acquisition_time = 0.0;
+        memcpy(frame.pose, &poses[12 * i], sizeof(float) * 12);
+        frame.pixels = const_cast<unsigned char*>(&bscans[i * bscan_size]);
+        ReconstructFrame(&frame);
+      }
+    }
+  }
 
-  reconstructed_volume = vtkSmartPointer< vtkImageData >::New();
-  reconstructed_volume->SetOrigin((double)volume_origin[0], (double)volume_origin[1], (double)volume_origin[2]);
-  reconstructed_volume->SetSpacing((double)volume_spacing, (double)volume_spacing, (double)volume_spacing);
-  reconstructed_volume->SetExtent(this->volume_extent[0], this->volume_extent[1],
-									 this->volume_extent[2], this->volume_extent[3],
-										this->volume_extent[4], this->volume_extent[5]); 
-  reconstructed_volume->AllocateScalars(VTK_UNSIGNED_CHAR, 1);
+  volume_mutex->Unlock();
+  return num_frames;
 }
 
 //----------------------------------------------------------------------------
-cl_mem vtkCLVolumeReconstruction::OpenCLCreateBuffer(cl_context context, cl_mem_flags flags, size_t size, void* host_data)
+void vtkCLVolumeReconstruction::SaveQueues(ring_state& state) const
 {
-  if (host_data != NULL)
+  size_t bscan_size = bscan_w * bscan_h * sizeof(unsigned char);
+
+  state.head = queue_head;
+  state.timestamps = timestamp_queue;
+  state.images = imageData_queue;
+  state.poses = poseData_queue;
+  state.bscans.resize(BSCAN_RING * bscan_size);
+  state.pos_matrices.resize(BSCAN_RING * 12);
+  for (int slot = 0; slot < BSCAN_RING; slot++)
   {
-    flags |= CL_MEM_COPY_HOST_PTR;
+    memcpy(&state.bscans[slot * bscan_size], bscans_queue[slot], bscan_size);
+    memcpy(&state.pos_matrices[slot * 12], pos_matrices_queue[slot], sizeof(float) * 12);
   }
+  state.bscan_timetags.assign(bscan_timetags_queue, bscan_timetags_queue + BSCAN_RING);
+  state.pos_timetags.assign(pos_timetags_queue, pos_timetags_queue + BSCAN_RING);
+  state.x_vectors.assign(x_vector_queue, x_vector_queue + BSCAN_RING);
+  state.y_vectors.assign(y_vector_queue, y_vector_queue + BSCAN_RING);
+  state.plane_equations.assign(bscan_plane_equation_queue, bscan_plane_equation_queue + BSCAN_RING);
+  state.plane_points.assign(plane_points_queue, plane_points_queue + BSCAN_RING);
+}
 
-  cl_int err;
-  cl_mem dev_mem = clCreateBuffer(context, flags, size, host_data, &err);
-  if (err != CL_SUCCESS)
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::RestoreQueues(const ring_state& state)
+{
+  size_t bscan_size = bscan_w * bscan_h * sizeof(unsigned char);
+
+  queue_head = state.head;
+  timestamp_queue = state.timestamps;
+  imageData_queue = state.images;
+  poseData_queue = state.poses;
+  for (int slot = 0; slot < BSCAN_RING; slot++)
   {
-    std::cout << "[vtkCLVolumeReconstruction] ERROR clCreateBuffer of size " << size << ":" << " " << err << std::endl;
-    exit(err);
+    memcpy(bscans_queue[slot], &state.bscans[slot * bscan_size], bscan_size);
+    memcpy(pos_matrices_queue[slot], &state.pos_matrices[slot * 12], sizeof(float) * 12);
   }
-#ifdef VCLVR_DEBUG
-  std::cout << "[vtkCLVolumeReconstruction] clCreateBuffer of " << size << " bytes(" << size / 1024.0f / 1024.0f << " MB)" << std::endl;
-#endif
-
-  return dev_mem;
+  std::copy(state.bscan_timetags.begin(), state.bscan_timetags.end(), bscan_timetags_queue);
+  std::copy(state.pos_timetags.begin(), state.pos_timetags.end(), pos_timetags_queue);
+  std::copy(state.x_vectors.begin(), state.x_vectors.end(), x_vector_queue);
+  std::copy(state.y_vectors.begin(), state.y_vectors.end(), y_vector_queue);
+  std::copy(state.plane_equations.begin(), state.plane_equations.end(), bscan_plane_equation_queue);
+  std::copy(state.plane_points.begin(), state.plane_points.end(), plane_points_queue);
 }
 
 //----------------------------------------------------------------------------
-void vtkCLVolumeReconstruction::OpenCLCheckError(int err, char* info)
+void vtkCLVolumeReconstruction::GetOutputVolume(vtkImageData* v)
 {
-  if (err != CL_SUCCESS)
+  volume_mutex->Lock();
+  UpdateOutputVolume();
+  if (device_failed)
   {
-    std::cout << "[vtkCLVolumeReconstruction] ERROR  " << info << ": " << err << std::endl;
-    exit(err);
+    FallBackToCPU();
+    UpdateOutputVolume();
   }
+  v->DeepCopy(reconstructed_volume);
+  volume_mutex->Unlock();
 }
 
 //----------------------------------------------------------------------------
-int vtkCLVolumeReconstruction::ShiftQueues()
+void vtkCLVolumeReconstruction::SetFrameQueueSize(int size)
 {
-  // Shift it to left
-  for (int i = 0; i < BSCAN_WINDOW - 1; i++)
+  if (!async_running)
   {
-    x_vector_queue[i] = x_vector_queue[i + 1];
-    y_vector_queue[i] = y_vector_queue[i + 1];
-    bscans_queue[i] = bscans_queue[i + 1];
-    pos_matrices_queue[i] = pos_matrices_queue[i + 1];
-    bscan_timetags_queue[i] = bscan_timetags_queue[i + 1];
-    pos_timetags_queue[i] = pos_timetags_queue[i + 1];
-    bscan_plane_equation_queue[i] = bscan_plane_equation_queue[i + 1];
-    plane_points_queue[i] = plane_points_queue[i + 1];
+    this->frame_queue_size = std::max(size, 1);
   }
+}
 
-  // Grab frame and insert it
-  GrabInputData();
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::SetFrameQueuePolicy(int policy)
+{
+  this->frame_queue_policy = (policy == BLOCK_ACQUISITION) ? BLOCK_ACQUISITION : DROP_FRAMES;
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::StartAsyncReconstruction()
+{
+  if (async_running)
+  {
+    return;
+  }
+
+  // Pre-allocate the frame slots
+  size_t bscan_size = bscan_w * bscan_h * sizeof(unsigned char);
+  frame_queue.resize(frame_queue_size);
+  frame_queue_pixels.assign(frame_queue_size * bscan_size, 0);
+  for (int i = 0; i < frame_queue_size; i++)
+  {
+    frame_queue[i].pixels = &frame_queue_pixels[i * bscan_size];
+  }
+  frame_queue_read = 0;
+  frame_queue_write = 0;
+
+  dropped_frames = 0;
+  compounded_frames = 0;
+  last_latency = 0.0;
+  total_latency = 0.0;
+  max_latency = 0.0;
+  last_publish_time = 0.0;
+
+  async_stop = false;
+  async_running = true;
+  compounding_thread_id = compounding_threader->SpawnThread((vtkThreadFunctionType) &CompoundingThread, (void*) this);
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::StopAsyncReconstruction()
+{
+  if (!async_running)
+  {
+    return;
+  }
+
+  frame_queue_mutex->Lock();
+  async_stop = true;
+  frame_queue_condition->Broadcast();
+  frame_queue_mutex->Unlock();
+
+  // Joins the thread once the queue is drained
+  compounding_threader->TerminateThread(compounding_thread_id);
+  compounding_thread_id = -1;
+  async_running = false;
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::PushFrame(double time, vtkImageData* image, vtkMatrix4x4* pose)
+{
+  if (!async_running || image == NULL || pose == NULL || image->GetScalarPointer() == NULL)
+  {
+    return 0;
+  }
+
+  unsigned int write = frame_queue_write.load(std::memory_order_relaxed);
+  unsigned int capacity = (unsigned int) frame_queue.size();
+  if (write - frame_queue_read.load(std::memory_order_acquire) >= capacity)
+  {
+    if (frame_queue_policy == DROP_FRAMES)
+    {
+      frame_queue_mutex->Lock();
+      dropped_frames++;
+      frame_queue_mutex->Unlock();
+      return 0;
+    }
+
+    // Back pressure: wait for the compounding thread to free a slot
+    frame_queue_mutex->Lock();
+    while (write - frame_queue_read.load(std::memory_order_acquire) >= capacity)
+    {
+      frame_queue_condition->Wait(frame_queue_mutex);
+    }
+    frame_queue_mutex->Unlock();
+  }
+
+  // Fill the slot, it is owned by this thread until the write index moves past it
+  frame_slot& slot = frame_queue[write % capacity];
+  slot.timestamp = time;
+  double* matrixPtr = pose->Element[0];
+  for (int i = 0; i < 12; i++)
+  {
+    slot.pose[i] = (float)matrixPtr[i];
+  }
+  memcpy(slot.pixels, image->GetScalarPointer(), sizeof(unsigned char) * bscan_w * bscan_h);
+  slot.acquisition_time = vtkTimerLog::GetUniversalTime();
+  frame_queue_write.store(write + 1, std::memory_order_release);
+
+  frame_queue_mutex->Lock();
+  frame_queue_condition->Broadcast();
+  frame_queue_mutex->Unlock();
+
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+void* vtkCLVolumeReconstruction::CompoundingThread(vtkMultiThreader::ThreadInfo* data)
+{
+  vtkCLVolumeReconstruction* self = (vtkCLVolumeReconstruction*)(data->UserData);
+  unsigned int capacity = (unsigned int) self->frame_queue.size();
+
+  while (true)
+  {
+    unsigned int read = self->frame_queue_read.load(std::memory_order_relaxed);
+    if (read == self->frame_queue_write.load(std::memory_order_acquire))
+    {
+      // Wait for a frame, leave once stopped and drained
+      self->frame_queue_mutex->Lock();
+      while (read == self->frame_queue_write.load(std::memory_order_acquire) && !self->async_stop)
+      {
+        self->frame_queue_condition->Wait(self->frame_queue_mutex);
+      }
+      bool done = (read == self->frame_queue_write.load(std::memory_order_acquire));
+      self->frame_queue_mutex->Unlock();
+      if (done)
+      {
+        break;
+      }
+      continue;
+    }
+
+    const frame_slot& slot = self->frame_queue[read % capacity];
+    self->volume_mutex->Lock();
+    self->ReconstructFrame(&slot);
+    double now = vtkTimerLog::GetUniversalTime();
+    double latency = now - slot.acquisition_time;
+
+    // The viewers get a copy at the publish interval, and the latest volume once the queue runs dry
+    bool idle = (read + 1 == self->frame_queue_write.load(std::memory_order_acquire));
+    if (self->publish_interval > 0.0 && (idle || now - self->last_publish_time >= self->publish_interval))
+    {
+      self->PublishVolume();
+      self->last_publish_time = now;
+    }
+    self->volume_mutex->Unlock();
+
+    // Release the slot to the producer
+    self->frame_queue_read.store(read + 1, std::memory_order_release);
+
+    self->frame_queue_mutex->Lock();
+    self->compounded_frames++;
+    self->last_latency = latency;
+    self->total_latency += latency;
+    self->max_latency = std::max(self->max_latency, latency);
+    self->frame_queue_condition->Broadcast();
+    self->frame_queue_mutex->Unlock();
+  }
+
+  return NULL;
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::PublishVolume()
+{
+  UpdateOutputVolume();
+  if (device_failed)
+  {
+    FallBackToCPU();
+    UpdateOutputVolume();
+  }
+  vtkSmartPointer<vtkImageData> snapshot = vtkSmartPointer<vtkImageData>::New();
+  snapshot->DeepCopy(reconstructed_volume);
+
+  publish_mutex->Lock();
+  published_volume = snapshot;
+  published_version++;
+  publish_mutex->Unlock();
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::SetPublishInterval(double val)
+{
+  this->publish_interval = std::max(val, 0.0);
+}
+
+//----------------------------------------------------------------------------
+double vtkCLVolumeReconstruction::GetPublishInterval() const
+{
+  return this->publish_interval;
+}
+
+//----------------------------------------------------------------------------
+unsigned long vtkCLVolumeReconstruction::GetPublishedVolume(vtkImageData* v, unsigned long known_version)
+{
+  publish_mutex->Lock();
+  unsigned long version = published_version;
+  if (published_volume != nullptr && version != known_version)
+  {
+    v->ShallowCopy(published_volume);
+  }
+  publish_mutex->Unlock();
+  return version;
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::GetNumberOfDroppedFrames() const
+{
+  frame_queue_mutex->Lock();
+  int val = dropped_frames;
+  frame_queue_mutex->Unlock();
+  return val;
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::GetNumberOfCompoundedFrames() const
+{
+  frame_queue_mutex->Lock();
+  int val = compounded_frames;
+  frame_queue_mutex->Unlock();
+  return val;
+}
+
+//----------------------------------------------------------------------------
+double vtkCLVolumeReconstruction::GetLastLatency() const
+{
+  frame_queue_mutex->Lock();
+  double val = last_latency;
+  frame_queue_mutex->Unlock();
+  return val;
+}
+
+//----------------------------------------------------------------------------
+double vtkCLVolumeReconstruction::GetMeanLatency() const
+{
+  frame_queue_mutex->Lock();
+  double val = (compounded_frames > 0) ? total_latency / compounded_frames : 0.0;
+  frame_queue_mutex->Unlock();
+  return val;
+}
+
+//----------------------------------------------------------------------------
+double vtkCLVolumeReconstruction::GetMaxLatency() const
+{
+  frame_queue_mutex->Lock();
+  double val = max_latency;
+  frame_queue_mutex->Unlock();
+  return val;
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::GetNumberOfAllocatedBricks() const
+{
+  return this->allocated_bricks;
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::GetNumberOfBricks() const
+{
+  return this->bricks_w * this->bricks_h * this->bricks_d;
+}
+
+//----------------------------------------------------------------------------
+size_t vtkCLVolumeReconstruction::GetBrickPoolSize() const
+{
+  return (size_t)this->brick_pool_capacity * BRICK_VOXELS;
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::SetHoleFillingRadius(int val)
+{
+  this->hole_filling_radius = std::min(std::max(val, 0), (int)BRICK_SIZE);
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::GetHoleFillingRadius() const
+{
+  return this->hole_filling_radius;
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::SetHoleFillingDelay(int val)
+{
+  this->hole_filling_delay = std::max(val, 1);
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::SetMaxHoleFillingBricks(int val)
+{
+  val = std::max(val, 1);
+
+  // The hole filling buffers are sized by StartReconstruction, grow them
+  // while no frame is being reconstructed if a reconstruction is running
+  volume_mutex->Lock();
+  if (val > this->max_hole_filling_bricks)
+  {
+    if (!hole_scratch.empty())
+    {
+      hole_scratch.assign((size_t)val * BRICK_VOXELS, 0);
+    }
+    if (dev_hole_bricks != nullptr)
+    {
+      clReleaseMemObject(dev_hole_bricks);
+      clReleaseMemObject(dev_hole_scratch);
+      dev_hole_bricks = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, val * sizeof(cl_int), NULL);
+      dev_hole_scratch = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)val * BRICK_VOXELS, NULL);
+    }
+  }
+  this->max_hole_filling_bricks = val;
+  volume_mutex->Unlock();
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::GetNumberOfHoleFilledBricks() const
+{
+  return this->hole_filled_bricks;
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::SetIncrementalReadback(bool val)
+{
+  this->incremental_readback = val;
+}
+
+//----------------------------------------------------------------------------
+bool vtkCLVolumeReconstruction::GetIncrementalReadback() const
+{
+  return this->incremental_readback;
+}
+
+//----------------------------------------------------------------------------
+size_t vtkCLVolumeReconstruction::GetBytesTransferredPerFrame() const
+{
+  return this->bytes_transferred_per_frame;
+}
+
+//--------------------------------------------------------------
+void vtkCLVolumeReconstruction::GetOrigin(double* ptr) const
+{
+  ptr[0] = (double)volume_origin[0];
+  ptr[1] = (double)volume_origin[1];
+  ptr[2] = (double)volume_origin[2];
+}
+
+//--------------------------------------------------------------
+void vtkCLVolumeReconstruction::GetSpacing(double spacing[3]) const
+{
+  spacing[0] = (double)volume_spacing;
+  spacing[1] = (double)volume_spacing;
+  spacing[2] = (double)volume_spacing;
+}
+
+//----------------------------------------------------------------------------
+std::string vtkCLVolumeReconstruction::FileToString(const std::string& filename, const std::string& preamble)
+{
+  std::ifstream inputFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+  if (!inputFile.is_open())
+  {
+    return nullptr;
+  }
+
+  std::string file_contents((std::istreambuf_iterator<char>(inputFile)), std::istreambuf_iterator<char>());
+  file_contents.insert(0, preamble);
+  inputFile.close();
+
+  return file_contents;
+}
+
+//----------------------------------------------------------------------------
+cl_kernel vtkCLVolumeReconstruction::OpenCLKernelBuild(cl_program program, cl_device_id device, char* kernel_name)
+{
+  cl_int err;
+  cl_kernel kernel = clCreateKernel(program, kernel_name, &err);
+  if (err != CL_SUCCESS)
+  {
+    size_t len;
+    char buffer[2048];
+    std::stringstream ss;
+    ss << "[vtkCLVolumeReconstruction] ERROR: Failed to build program executable: " << kernel_name << ". ";
+
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
+
+    ss << buffer;
+    std::cerr << ss.str() << std::endl;
+    device_failed = true;
+    return nullptr;
+  }
+  return kernel;
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::InitializeBuffers()
+{
+  x_vector_queue = (float4*) malloc(BSCAN_RING * sizeof(float4));
+  y_vector_queue = (float4*) malloc(BSCAN_RING * sizeof(float4));
+  bscans_queue = new unsigned char* [BSCAN_RING];
+  pos_matrices_queue = new float*[BSCAN_RING];
+
+  for (int i = 0; i < BSCAN_RING; i++)
+  {
+    pos_matrices_queue[i] = (float*)malloc(sizeof(float) * 12);
+    bscans_queue[i]     = (unsigned char*)malloc(bscan_w * bscan_h * sizeof(unsigned char));
+  }
+
+  bscan_timetags_queue = (float*) malloc(BSCAN_RING * sizeof(float));
+  pos_timetags_queue = (float*) malloc(BSCAN_RING * sizeof(float));
+  bscan_plane_equation_queue = (float4*) malloc(BSCAN_RING * sizeof(float4));
+  plane_points_queue = (plane_pts*) malloc(BSCAN_RING * sizeof(plane_pts));
+  mask = (unsigned char*)malloc(sizeof(unsigned char) * bscan_w * bscan_h);
+
+  // Set mask. Default is no mask (val 1 --> white). In mask Black is outside ROI while White is insite the ROI.
+  memset(mask, 1, sizeof(unsigned char)*bscan_w * bscan_h);
+
+  image_data = vtkImageData::New();
+  image_data->SetExtent(0, this->bscan_w, 0, this->bscan_h, 0, 0);
+  image_data->AllocateScalars(VTK_UNSIGNED_CHAR, 1);
+
+  pose_data = vtkMatrix4x4::New();
+
+  reconstructed_volume = vtkSmartPointer< vtkImageData >::New();
+  reconstructed_volume->SetOrigin((double)volume_origin[0], (double)volume_origin[1], (double)volume_origin[2]);
+  reconstructed_volume->SetSpacing((double)volume_spacing, (double)volume_spacing, (double)volume_spacing);
+  reconstructed_volume->SetExtent(this->volume_extent[0], this->volume_extent[1],
+									 this->volume_extent[2], this->volume_extent[3],
+										this->volume_extent[4], this->volume_extent[5]); 
+  // Allocated on the first UpdateOutputVolume, the reconstruction itself only needs the bricks
+  output_volume_allocated = false;
+}
+
+//----------------------------------------------------------------------------
+cl_mem vtkCLVolumeReconstruction::OpenCLCreateBuffer(cl_context context, cl_mem_flags flags, size_t size, void* host_data)
+{
+  if (host_data != NULL)
+  {
+    flags |= CL_MEM_COPY_HOST_PTR;
+  }
+
+  cl_int err;
+  cl_mem dev_mem = clCreateBuffer(context, flags, size, host_data, &err);
+  if (err != CL_SUCCESS)
+  {
+    std::cerr << "[vtkCLVolumeReconstruction] ERROR clCreateBuffer of size " << size << ":" << " " << err << std::endl;
+    device_failed = true;
+    return nullptr;
+  }
+#ifdef VCLVR_DEBUG
+  std::cout << "[vtkCLVolumeReconstruction] clCreateBuffer of " << size << " bytes(" << size / 1024.0f / 1024.0f << " MB)" << std::endl;
+#endif
+
+  return dev_mem;
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::OpenCLCheckError(int err, char* info)
+{
+  if (err != CL_SUCCESS)
+  {
+    std::cerr << "[vtkCLVolumeReconstruction] ERROR  " << info << ": " << err << std::endl;
+    device_failed = true;
+    return 0;
+  }
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::ShiftQueues(const frame_slot* frame)
+{
+  // Advance the head. The new frame goes into the spare slot, the oldest one becomes the spare.
+  queue_head = (queue_head + 1) % BSCAN_RING;
+
+  // Grab frame and insert it
+  if (frame != NULL)
+  {
+    InsertFrame((float)frame->timestamp, frame->pixels, frame->pose);
+  }
+  else
+  {
+    GrabInputData();
+  }
+
+  if (timestamp_queue.size() <= BSCAN_WINDOW)
+  {
+    // Queues are not full
+    return 0;
+  }
+  else
+  {
+    // Remove the elements from the top level data queues
+    timestamp_queue.pop();
+    imageData_queue.pop();
+    poseData_queue.pop();
+
+    return 1;
+  }
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::GrabInputData()
+{
+  // Get image data pointer.
+  unsigned char* imgDataPtr = (unsigned char*)image_data->GetScalarPointer();
+
+  if (imgDataPtr != NULL && pose_data != NULL)
+  {
+
+	  input_data_mutex->Lock();
+
+	  // Convert to a floating point array
+	  double* matrixPtr = pose_data->Element[0];
+	  float matrixPtr2[12];
+	  for (int i = 0; i < 12; i++)
+	  {
+		  matrixPtr2[i] = (float)matrixPtr[i];
+	  }
+
+	  InsertFrame(timestamp, imgDataPtr, matrixPtr2);
+
+	  input_data_mutex->Unlock();
+  }
+  else
+  {
+	  std::cerr << "[vtkCLVolumeReconstruction]: NULL inputs" << std::endl;
+  }
+
+  // TODO: Interpolate the pos matrix to the timetag of the bscan
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::InsertFrame(float time, const unsigned char* pixels, const float* matrix)
+{
+  timestamp_queue.push(time);
+  imageData_queue.push(image_data);
+  poseData_queue.push(pose_data);
+
+  // Copy data to buffers
+  int slot = RingIndex(BSCAN_WINDOW - 1);
+  bscan_timetags_queue[slot] = timestamp_queue.front();
+  pos_timetags_queue[slot] = timestamp_queue.front();
+  memcpy(pos_matrices_queue[slot], matrix, sizeof(float) * 12);
+  memcpy(bscans_queue[slot], pixels, sizeof(unsigned char)*bscan_h * bscan_w);
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::ReadTouchedBricks()
+{
+  // The brick flags were read back by FillVoxels
+  size_t bytes = touched_bricks_size;
+
+  // Read each run of touched bricks in consecutive pool slots with a single copy
+  omp_set_lock(&cl_device_lock);
+  int b = 0;
+  while (b < touched_bricks_size)
+  {
+    if (!touched_bricks[b] || brick_table[b] < 0)
+    {
+      b++;
+      continue;
+    }
+    int first_slot = brick_table[b];
+    int num_slots = 0;
+    while (b < touched_bricks_size && touched_bricks[b] && brick_table[b] == first_slot + num_slots)
+    {
+      dirty_bricks[b] = 1;
+      num_slots++;
+      b++;
+    }
+
+    size_t offset = (size_t)first_slot * BRICK_VOXELS;
+    size_t size = (size_t)num_slots * BRICK_VOXELS;
+    OpenCLCheckError(clEnqueueReadBuffer(reconstruction_cmd_queue, dev_brick_pool, CL_FALSE, offset, size, &brick_pool[offset], 0, 0, 0));
+    bytes += size;
+  }
+  OpenCLCheckError(clFinish(reconstruction_cmd_queue));
+  omp_unset_lock(&cl_device_lock);
+
+  bytes_transferred_per_frame = bytes;
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::UpdateOutputVolume()
+{
+  // Copy the bricks in use from the device
+  if (host_volume_stale && dev_brick_pool != nullptr && allocated_bricks > 0)
+  {
+    omp_set_lock(&cl_device_lock);
+    OpenCLCheckError(clEnqueueReadBuffer(reconstruction_cmd_queue, dev_brick_pool, CL_TRUE, 0, (size_t)allocated_bricks * BRICK_VOXELS, &brick_pool[0], 0, 0, 0));
+    omp_unset_lock(&cl_device_lock);
 
-  if (timestamp_queue.size() <= BSCAN_WINDOW)
+    for (int b = 0; b < touched_bricks_size; b++)
+    {
+      dirty_bricks[b] = (brick_table[b] >= 0);
+    }
+  }
+  host_volume_stale = false;
+
+  // The dense volume only exists once it is asked for
+  if (!output_volume_allocated)
   {
-    // Queues are not full
+    this->reconstructed_volume->AllocateScalars(VTK_UNSIGNED_CHAR, 1);
+    memset(this->reconstructed_volume->GetScalarPointer(), 0, sizeof(unsigned char) * volume_width * volume_height * volume_depth);
+    output_volume_allocated = true;
+  }
 
-    // Multiply the position matrix with the calibration matrix
-    CalibratePosMatrix(pos_matrices_queue[BSCAN_WINDOW - 1], calibration_matrix);
+  // Expand the bricks modified since the last call, the others are already in place
+  unsigned char* volume = (unsigned char*)this->reconstructed_volume->GetScalarPointer();
+  size_t slice_pitch = (size_t)volume_width * volume_height;
+  #pragma omp parallel for schedule(dynamic) num_threads(GetNumberOfCPUThreads())
+  for (int b = 0; b < touched_bricks_size; b++)
+  {
+    if (!dirty_bricks[b])
+    {
+      continue;
+    }
+    dirty_bricks[b] = 0;
+    if (brick_table[b] < 0)
+    {
+      continue;
+    }
 
-    InsertPlanePoints(pos_matrices_queue[BSCAN_WINDOW - 1]);
+    int x0 = (b % bricks_w) * BRICK_SIZE;
+    int y0 = ((b / bricks_w) % bricks_h) * BRICK_SIZE;
+    int z0 = (b / (bricks_w * bricks_h)) * BRICK_SIZE;
+    int w = std::min((int)BRICK_SIZE, volume_width - x0);
+    int h = std::min((int)BRICK_SIZE, volume_height - y0);
+    int d = std::min((int)BRICK_SIZE, volume_depth - z0);
+    const unsigned char* brick = &brick_pool[(size_t)brick_table[b] * BRICK_VOXELS];
+    for (int z = 0; z < d; z++)
+    {
+      for (int y = 0; y < h; y++)
+      {
+        memcpy(volume + x0 + (size_t)(y0 + y) * volume_width + (z0 + z) * slice_pitch,
+               brick + y * BRICK_SIZE + z * BRICK_SIZE * BRICK_SIZE, w);
+      }
+    }
+  }
 
-    // Fill BPlane Eq
-    InsertPlaneEquation();
+  this->reconstructed_volume->Modified();
+}
 
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::AllocateBricks()
+{
+  int needed = allocated_bricks;
+  for (int b = 0; b < touched_bricks_size; b++)
+  {
+    needed += (touched_bricks[b] && brick_table[b] < 0);
+  }
+  if (needed == allocated_bricks)
+  {
     return 0;
   }
-  else
+
+  GrowBrickPool(needed);
+  for (int b = 0; b < touched_bricks_size; b++)
   {
-    // Remove the elements from the top level data queues
-    timestamp_queue.pop();
-    imageData_queue.pop();
-    poseData_queue.pop();
+    if (touched_bricks[b] && brick_table[b] < 0)
+    {
+      brick_table[b] = allocated_bricks++;
+    }
+  }
 
-    return 1;
+  if (dev_brick_table != nullptr)
+  {
+    omp_set_lock(&cl_device_lock);
+    OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_brick_table, CL_TRUE, 0, brick_table.size() * sizeof(cl_int), &brick_table[0], 0, 0, 0));
+    omp_unset_lock(&cl_device_lock);
   }
+
+  return 1;
 }
 
 //----------------------------------------------------------------------------
-void vtkCLVolumeReconstruction::GrabInputData()
+void vtkCLVolumeReconstruction::GrowBrickPool(int needed)
 {
-  // Get image data pointer.
-  unsigned char* imgDataPtr = (unsigned char*)image_data->GetScalarPointer();
+  int capacity = brick_pool_capacity;
+  while (capacity < needed)
+  {
+    capacity = std::min(2 * capacity, touched_bricks_size);
+  }
+  if (capacity == brick_pool_capacity)
+  {
+    return;
+  }
 
-  if (imgDataPtr != NULL && pose_data != NULL)
+  // Slots past the allocated bricks are always zero
+  size_t used = (size_t)allocated_bricks * BRICK_VOXELS;
+  size_t size = (size_t)capacity * BRICK_VOXELS;
+  brick_pool.resize(size, 0);
+
+  if (dev_brick_pool != nullptr)
   {
+    // Move the bricks in use to the larger device pool and zero the rest
+    // On failure the old pool keeps the bricks for FallBackToCPU
+    cl_mem new_pool = OpenCLCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL);
+    if (new_pool != nullptr)
+    {
+      omp_set_lock(&cl_device_lock);
+      int moved = (used == 0) || OpenCLCheckError(clEnqueueCopyBuffer(reconstruction_cmd_queue, dev_brick_pool, new_pool, 0, 0, used, 0, 0, 0));
+      moved = moved && OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, new_pool, CL_TRUE, used, size - used, &brick_pool[used], 0, 0, 0));
+      omp_unset_lock(&cl_device_lock);
+      if (moved)
+      {
+        clReleaseMemObject(dev_brick_pool);
+        dev_brick_pool = new_pool;
+      }
+      else
+      {
+        clReleaseMemObject(new_pool);
+      }
+    }
+  }
 
-	  input_data_mutex->Lock();
+  vtkDebugMacro("Brick pool grown to " << capacity << " of " << touched_bricks_size << " bricks");
+  brick_pool_capacity = capacity;
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::ClearBricks()
+{
+  allocated_bricks = 0;
+  std::fill(brick_table.begin(), brick_table.end(), -1);
+  std::fill(brick_pool.begin(), brick_pool.end(), 0);
+  std::fill(dirty_bricks.begin(), dirty_bricks.end(), 0);
+  std::fill(brick_last_touched.begin(), brick_last_touched.end(), -1);
+  settled_bricks.clear();
+
+  if (dev_brick_pool != nullptr)
+  {
+    omp_set_lock(&cl_device_lock);
+    OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_brick_table, CL_TRUE, 0, brick_table.size() * sizeof(cl_int), &brick_table[0], 0, 0, 0));
+    OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_brick_pool, CL_TRUE, 0, brick_pool.size(), &brick_pool[0], 0, 0, 0));
+    omp_unset_lock(&cl_device_lock);
+  }
+}
 
-	  timestamp_queue.push(timestamp);
-	  imageData_queue.push(image_data);
-	  poseData_queue.push(pose_data);
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::CollectHoleBricks()
+{
+  hole_bricks.clear();
+  if (hole_filling_radius <= 0)
+  {
+    return 0;
+  }
 
-	  // Set this element to zero
-	  memset(pos_matrices_queue[BSCAN_WINDOW - 1], '\0', sizeof(float) * 12);
-	  memset(bscans_queue[BSCAN_WINDOW - 1], '\0', sizeof(unsigned char)*bscan_w * bscan_h);
+  // A brick settles once it has gone hole_filling_delay frames without being touched
+  hole_filling_frame++;
+  for (int b = 0; b < touched_bricks_size; b++)
+  {
+    if (touched_bricks[b])
+    {
+      brick_last_touched[b] = hole_filling_frame;
+    }
+    else if (brick_last_touched[b] >= 0 && hole_filling_frame - brick_last_touched[b] == hole_filling_delay)
+    {
+      settled_bricks.push_back(b);
+    }
+  }
 
-	  // Convert to a floating point array
-	  double* matrixPtr = pose_data->Element[0];
-	  float* matrixPtr2 = new float[12];
-	  matrixPtr2[0] = (float)matrixPtr[0];
-	  matrixPtr2[1] = (float)matrixPtr[1];
-	  matrixPtr2[2] = (float)matrixPtr[2];
-	  matrixPtr2[3] = (float)matrixPtr[3];
-	  matrixPtr2[4] = (float)matrixPtr[4];
-	  matrixPtr2[5] = (float)matrixPtr[5];
-	  matrixPtr2[6] = (float)matrixPtr[6];
-	  matrixPtr2[7] = (float)matrixPtr[7];
-	  matrixPtr2[8] = (float)matrixPtr[8];
-	  matrixPtr2[9] = (float)matrixPtr[9];
-	  matrixPtr2[10] = (float)matrixPtr[10];
-	  matrixPtr2[11] = (float)matrixPtr[11];
-
-	  // Copy data to buffers
-	  bscan_timetags_queue[BSCAN_WINDOW - 1] = timestamp_queue.front();
-	  pos_timetags_queue[BSCAN_WINDOW - 1] = timestamp_queue.front();
-	  memcpy(pos_matrices_queue[BSCAN_WINDOW - 1], matrixPtr2, sizeof(float) * 12);
-	  memcpy(bscans_queue[BSCAN_WINDOW - 1], imgDataPtr, sizeof(unsigned char)*bscan_h * bscan_w);
+  // Bounded work per frame, bricks touched again while queued are queued again when they settle
+  while (!settled_bricks.empty() && (int)hole_bricks.size() < max_hole_filling_bricks)
+  {
+    int b = settled_bricks.front();
+    settled_bricks.pop_front();
+    if (hole_filling_frame - brick_last_touched[b] >= hole_filling_delay && brick_table[b] >= 0)
+    {
+      hole_bricks.push_back(b);
+    }
+  }
 
-	  input_data_mutex->Unlock();
+  hole_filled_bricks += (int)hole_bricks.size();
+  return (int)hole_bricks.size();
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::FillHoles()
+{
+  int num_hole_bricks = CollectHoleBricks();
+  if (num_hole_bricks == 0)
+  {
+    return;
+  }
+
+  clSetKernelArg(fill_brick_holes, 0, sizeof(cl_mem), &dev_brick_pool);
+  clSetKernelArg(fill_brick_holes, 1, sizeof(cl_mem), &dev_brick_table);
+  clSetKernelArg(fill_brick_holes, 2, sizeof(cl_mem), &dev_hole_bricks);
+  clSetKernelArg(fill_brick_holes, 3, sizeof(cl_int), &num_hole_bricks);
+  clSetKernelArg(fill_brick_holes, 4, sizeof(cl_mem), &dev_hole_scratch);
+  clSetKernelArg(fill_brick_holes, 5, sizeof(cl_int), &volume_width);
+  clSetKernelArg(fill_brick_holes, 6, sizeof(cl_int), &volume_height);
+  clSetKernelArg(fill_brick_holes, 7, sizeof(cl_int), &volume_depth);
+  clSetKernelArg(fill_brick_holes, 8, sizeof(cl_int), &hole_filling_radius);
+
+  clSetKernelArg(commit_brick_holes, 0, sizeof(cl_mem), &dev_brick_pool);
+  clSetKernelArg(commit_brick_holes, 1, sizeof(cl_mem), &dev_brick_table);
+  clSetKernelArg(commit_brick_holes, 2, sizeof(cl_mem), &dev_hole_bricks);
+  clSetKernelArg(commit_brick_holes, 3, sizeof(cl_int), &num_hole_bricks);
+  clSetKernelArg(commit_brick_holes, 4, sizeof(cl_mem), &dev_hole_scratch);
+
+  size_t hole_work_size[1] = { (((size_t)num_hole_bricks * BRICK_VOXELS) / 256 + 1) * 256 };
+
+  omp_set_lock(&cl_device_lock);
+  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_hole_bricks, CL_TRUE, 0, num_hole_bricks * sizeof(cl_int), &hole_bricks[0], 0, 0, 0));
+  OpenCLCheckError(clEnqueueNDRangeKernel(reconstruction_cmd_queue, fill_brick_holes, 1, NULL, hole_work_size, local_work_size, 0, NULL, NULL));
+  OpenCLCheckError(clEnqueueNDRangeKernel(reconstruction_cmd_queue, commit_brick_holes, 1, NULL, hole_work_size, local_work_size, 0, NULL, NULL));
+
+  // Read the filled bricks back with the ones touched by the frame
+  if (incremental_readback && !host_volume_stale)
+  {
+    for (int i = 0; i < num_hole_bricks; i++)
+    {
+      size_t offset = (size_t)brick_table[hole_bricks[i]] * BRICK_VOXELS;
+      OpenCLCheckError(clEnqueueReadBuffer(reconstruction_cmd_queue, dev_brick_pool, CL_FALSE, offset, BRICK_VOXELS, &brick_pool[offset], 0, 0, 0));
+      dirty_bricks[hole_bricks[i]] = 1;
+    }
+    OpenCLCheckError(clFinish(reconstruction_cmd_queue));
+    bytes_transferred_per_frame += (size_t)num_hole_bricks * BRICK_VOXELS;
   }
   else
   {
-	  std::cerr << "[vtkCLVolumeReconstruction]: NULL inputs" << std::endl;
+    OpenCLCheckError(clFlush(reconstruction_cmd_queue));
   }
-
-  // TODO: Interpolate the pos matrix to the timetag of the bscan
+  omp_unset_lock(&cl_device_lock);
 }
 
 //----------------------------------------------------------------------------
-void vtkCLVolumeReconstruction::UpdateOutputVolume()
+void vtkCLVolumeReconstruction::FillHolesCPU(int collect)
 {
-  // Copy volume to outputVolume
-  //memcpy((unsigned char*)this->reconstructed_volume->GetScalarPointer(), volume, sizeof(unsigned char)*volume_width * volume_height * volume_depth);
+  int num_hole_bricks = collect ? CollectHoleBricks() : (int)hole_bricks.size();
+  if (num_hole_bricks == 0)
+  {
+    return;
+  }
+
+  const unsigned char* pool = &brick_pool[0];
+  const int* table = &brick_table[0];
+  int radius = hole_filling_radius;
+
+  // Same as fill_brick_holes
+  #pragma omp parallel for schedule(static) num_threads(GetNumberOfCPUThreads())
+  for (int n = 0; n < num_hole_bricks * BRICK_VOXELS; n++)
+  {
+    int b = hole_bricks[n / BRICK_VOXELS];
+    int v = n % BRICK_VOXELS;
+    int x = (b % bricks_w) * BRICK_SIZE + v % BRICK_SIZE;
+    int y = ((b / bricks_w) % bricks_h) * BRICK_SIZE + (v / BRICK_SIZE) % BRICK_SIZE;
+    int z = (b / (bricks_w * bricks_h)) * BRICK_SIZE + v / (BRICK_SIZE * BRICK_SIZE);
+
+    unsigned char value = pool[(size_t)table[b] * BRICK_VOXELS + v];
+    if (value == 0 && x < volume_width && y < volume_height && z < volume_depth)
+    {
+      int sum = 0;
+      int sum_counter = 0;
+      for (int k = std::max(z - radius, 0); k <= std::min(z + radius, volume_depth - 1); k++)
+      {
+        for (int j = std::max(y - radius, 0); j <= std::min(y + radius, volume_height - 1); j++)
+        {
+          for (int i = std::max(x - radius, 0); i <= std::min(x + radius, volume_width - 1); i++)
+          {
+            int slot = table[i / BRICK_SIZE + (j / BRICK_SIZE) * bricks_w + (k / BRICK_SIZE) * bricks_w * bricks_h];
+            if (slot < 0)
+            {
+              continue;
+            }
+            unsigned char neighbour = pool[(size_t)slot * BRICK_VOXELS + i % BRICK_SIZE + (j % BRICK_SIZE) * BRICK_SIZE + (k % BRICK_SIZE) * BRICK_SIZE * BRICK_SIZE];
+            if (neighbour != 0)
+            {
+              sum += neighbour;
+              sum_counter++;
+            }
+          }
+        }
+      }
+      if (sum_counter > 0)
+      {
+        value = (unsigned char)(sum / sum_counter);
+      }
+    }
+    hole_scratch[n] = value;
+  }
+
+  for (int i = 0; i < num_hole_bricks; i++)
+  {
+    memcpy(&brick_pool[(size_t)brick_table[hole_bricks[i]] * BRICK_VOXELS], &hole_scratch[(size_t)i * BRICK_VOXELS], BRICK_VOXELS);
+    dirty_bricks[hole_bricks[i]] = 1;
+  }
 }
 
 //----------------------------------------------------------------------------
@@ -903,12 +2165,13 @@ void vtkCLVolumeReconstruction::CalibratePosMatrix(float* pos_matrix, float* cal
 void vtkCLVolumeReconstruction::InsertPlanePoints(float* pos_matrix)
 {
   // Fill plane_points
-  plane_points_queue[BSCAN_WINDOW - 1].corner0 = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
-  plane_points_queue[BSCAN_WINDOW - 1].cornerx = make_float4(bscan_w * bscan_spacing_x, 0.0f, 0.0f, 0.0f);
-  plane_points_queue[BSCAN_WINDOW - 1].cornery = make_float4(0.0f, bscan_h * bscan_spacing_y, 0.0f, 0.0f);
+  int slot = RingIndex(BSCAN_WINDOW - 1);
+  plane_points_queue[slot].corner0 = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+  plane_points_queue[slot].cornerx = make_float4(bscan_w * bscan_spacing_x, 0.0f, 0.0f, 0.0f);
+  plane_points_queue[slot].cornery = make_float4(0.0f, bscan_h * bscan_spacing_y, 0.0f, 0.0f);
 
   // Transform plane_points
-  float4* foo = (float4*) &plane_points_queue[BSCAN_WINDOW - 1];
+  float4* foo = (float4*) &plane_points_queue[slot];
   float4 _volume_orig = {volume_origin[0], volume_origin[1], volume_origin[2]};
   float* sums = (float*) malloc(sizeof(float) * 3);
   for (int i = 0; i < 3; i++)
@@ -934,58 +2197,102 @@ void vtkCLVolumeReconstruction::InsertPlanePoints(float* pos_matrix)
 void vtkCLVolumeReconstruction::InsertPlaneEquation()
 {
   // Fill bscan_plane_equation
-  float4 a = plane_points_queue[BSCAN_WINDOW - 1].corner0;
-  float4 b = plane_points_queue[BSCAN_WINDOW - 1].cornerx;
-  float4 c = plane_points_queue[BSCAN_WINDOW - 1].cornery;
+  int slot = RingIndex(BSCAN_WINDOW - 1);
+  float4 a = plane_points_queue[slot].corner0;
+  float4 b = plane_points_queue[slot].cornerx;
+  float4 c = plane_points_queue[slot].cornery;
   float4 normal = normalize(cross(a - b, c - a));
 
-  bscan_plane_equation_queue[BSCAN_WINDOW - 1].x = normal.x;
-  bscan_plane_equation_queue[BSCAN_WINDOW - 1].y = normal.y;
-  bscan_plane_equation_queue[BSCAN_WINDOW - 1].z = normal.z;
-  bscan_plane_equation_queue[BSCAN_WINDOW - 1].w = -normal.x * a.x - normal.y * a.y - normal.z * a.z;
+  bscan_plane_equation_queue[slot].x = normal.x;
+  bscan_plane_equation_queue[slot].y = normal.y;
+  bscan_plane_equation_queue[slot].z = normal.z;
+  bscan_plane_equation_queue[slot].w = -normal.x * a.x - normal.y * a.y - normal.z * a.z;
 
-  x_vector_queue[BSCAN_WINDOW - 1] = normalize(plane_points_queue[BSCAN_WINDOW - 1].cornerx - plane_points_queue[BSCAN_WINDOW - 1].corner0);
-  y_vector_queue[BSCAN_WINDOW - 1] = normalize(plane_points_queue[BSCAN_WINDOW - 1].cornery - plane_points_queue[BSCAN_WINDOW - 1].corner0);
+  x_vector_queue[slot] = normalize(plane_points_queue[slot].cornerx - plane_points_queue[slot].corner0);
+  y_vector_queue[slot] = normalize(plane_points_queue[slot].cornery - plane_points_queue[slot].corner0);
 }
 
 //----------------------------------------------------------------------------
-void vtkCLVolumeReconstruction::FillVoxels()
+int vtkCLVolumeReconstruction::RingIndex(int n) const
 {
-  int intersection_counter = FindIntersections(this->axis);
-
-  omp_set_lock(&cl_device_lock);
-  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_x_vector_queue, CL_TRUE, 0, dev_x_vector_queue_size, x_vector_queue, 0, 0, 0));
-  omp_unset_lock(&cl_device_lock);
-
-  omp_set_lock(&cl_device_lock);
-  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_y_vector_queue, CL_TRUE, 0, dev_y_vector_queue_size, y_vector_queue, 0, 0, 0));
-  omp_unset_lock(&cl_device_lock);
+  return (queue_head + n) % BSCAN_RING;
+}
 
-  omp_set_lock(&cl_device_lock);
-  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_plane_points_queue, CL_TRUE, 0, dev_plane_points_queue_size, plane_points_queue, 0, 0, 0));
-  omp_unset_lock(&cl_device_lock);
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::UploadFrame()
+{
+  // The uploads of the previous frame are done before their events are reused
+  if (num_upload_events > 0)
+  {
+    OpenCLCheckError(clWaitForEvents(num_upload_events, upload_events));
+    for (cl_uint i = 0; i < num_upload_events; i++)
+    {
+      clReleaseEvent(upload_events[i]);
+    }
+    num_upload_events = 0;
+  }
 
   omp_set_lock(&cl_device_lock);
-  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_mask, CL_TRUE, 0, mask_size, mask, 0, 0, 0));
-  omp_unset_lock(&cl_device_lock);
 
-  unsigned char* temp = (unsigned char*) malloc(bscans_queue_size);
-  for (int i = 0; i < BSCAN_WINDOW; i++)
+  // The mask is read by every launch, so it is only replaced once the last one is done
+  if (mask_modified)
   {
-    memcpy(&temp[bscan_w * bscan_h * i], bscans_queue[i], sizeof(unsigned char) * bscan_w * bscan_h);
+    cl_uint num_wait = (last_fill_event != nullptr) ? 1 : 0;
+    OpenCLCheckError(clEnqueueWriteBuffer(upload_cmd_queue, dev_mask, CL_TRUE, 0, mask_size, mask, num_wait, num_wait ? &last_fill_event : NULL, NULL));
+    mask_modified = false;
   }
 
-  omp_set_lock(&cl_device_lock);
-  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_bscans_queue, CL_TRUE, 0, bscans_queue_size, temp, 0, 0, 0));
+  // The slot of the new frame was last read two launches ago, so this overlaps with the previous launch
+  int slot = RingIndex(BSCAN_WINDOW - 1);
+  size_t bscan_size = bscan_w * bscan_h * sizeof(cl_uchar);
+  cl_uint num_wait = (previous_fill_event != nullptr) ? 1 : 0;
+  cl_event* wait_list = num_wait ? &previous_fill_event : NULL;
+  OpenCLCheckError(clEnqueueWriteBuffer(upload_cmd_queue, dev_bscans_queue, CL_FALSE, slot * bscan_size, bscan_size, bscans_queue[slot], num_wait, wait_list, &upload_events[num_upload_events++]));
+  OpenCLCheckError(clEnqueueWriteBuffer(upload_cmd_queue, dev_x_vector_queue, CL_FALSE, slot * sizeof(cl_float4), sizeof(cl_float4), &x_vector_queue[slot], num_wait, wait_list, &upload_events[num_upload_events++]));
+  OpenCLCheckError(clEnqueueWriteBuffer(upload_cmd_queue, dev_y_vector_queue, CL_FALSE, slot * sizeof(cl_float4), sizeof(cl_float4), &y_vector_queue[slot], num_wait, wait_list, &upload_events[num_upload_events++]));
+  OpenCLCheckError(clEnqueueWriteBuffer(upload_cmd_queue, dev_plane_points_queue, CL_FALSE, slot * sizeof(plane_pts), sizeof(plane_pts), &plane_points_queue[slot], num_wait, wait_list, &upload_events[num_upload_events++]));
+  OpenCLCheckError(clEnqueueWriteBuffer(upload_cmd_queue, dev_bscan_plane_equation_queue, CL_FALSE, slot * sizeof(float4), sizeof(float4), &bscan_plane_equation_queue[slot], num_wait, wait_list, &upload_events[num_upload_events++]));
+  OpenCLCheckError(clEnqueueWriteBuffer(upload_cmd_queue, dev_bscan_timetags_queue, CL_FALSE, slot * sizeof(cl_float), sizeof(cl_float), &bscan_timetags_queue[slot], num_wait, wait_list, &upload_events[num_upload_events++]));
+  OpenCLCheckError(clFlush(upload_cmd_queue));
+
   omp_unset_lock(&cl_device_lock);
-  free(temp);
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::FillVoxels()
+{
+  int intersection_counter = FindIntersections(this->axis);
+
+  // Flag the bricks this frame can write to and give the new ones a slot in the pool
+  clSetKernelArg(mark_bricks, 0, sizeof(cl_mem), &dev_intersections);
+  clSetKernelArg(mark_bricks, 1, sizeof(cl_float), &volume_spacing);
+  clSetKernelArg(mark_bricks, 2, sizeof(cl_int), &volume_width);
+  clSetKernelArg(mark_bricks, 3, sizeof(cl_int), &volume_height);
+  clSetKernelArg(mark_bricks, 4, sizeof(cl_int), &volume_depth);
+  clSetKernelArg(mark_bricks, 5, sizeof(cl_mem), &dev_x_vector_queue);
+  clSetKernelArg(mark_bricks, 6, sizeof(cl_mem), &dev_y_vector_queue);
+  clSetKernelArg(mark_bricks, 7, sizeof(cl_mem), &dev_plane_points_queue);
+  clSetKernelArg(mark_bricks, 8, sizeof(cl_float), &bscan_spacing_x);
+  clSetKernelArg(mark_bricks, 9, sizeof(cl_float), &bscan_spacing_y);
+  clSetKernelArg(mark_bricks, 10, sizeof(cl_int), &bscan_w);
+  clSetKernelArg(mark_bricks, 11, sizeof(cl_int), &bscan_h);
+  clSetKernelArg(mark_bricks, 12, sizeof(cl_int), &intersection_counter);
+  clSetKernelArg(mark_bricks, 13, sizeof(cl_mem), &dev_touched_bricks);
+  clSetKernelArg(mark_bricks, 14, sizeof(cl_int), &queue_head);
 
   omp_set_lock(&cl_device_lock);
-  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_bscan_timetags_queue, CL_TRUE, 0, bscan_timetags_queue_size, bscan_timetags_queue, 0, 0, 0));
+  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_touched_bricks, CL_FALSE, 0, touched_bricks_size, &untouched_bricks[0], 0, 0, 0));
+  OpenCLCheckError(clEnqueueNDRangeKernel(reconstruction_cmd_queue, mark_bricks, 1, NULL, global_work_size, local_work_size, 0, NULL, NULL));
+  OpenCLCheckError(clEnqueueReadBuffer(reconstruction_cmd_queue, dev_touched_bricks, CL_TRUE, 0, touched_bricks_size, &touched_bricks[0], 0, 0, 0));
   omp_unset_lock(&cl_device_lock);
+  AllocateBricks();
+  if (device_failed)
+  {
+    return 0;
+  }
 
   clSetKernelArg(adv_fill_voxels, 0, sizeof(cl_mem), &dev_intersections);
-  clSetKernelArg(adv_fill_voxels, 1, sizeof(cl_mem), &dev_volume);
+  clSetKernelArg(adv_fill_voxels, 1, sizeof(cl_mem), &dev_brick_pool);
   clSetKernelArg(adv_fill_voxels, 2, sizeof(cl_float), &volume_spacing);
   clSetKernelArg(adv_fill_voxels, 3, sizeof(cl_int), &volume_width);
   clSetKernelArg(adv_fill_voxels, 4, sizeof(cl_int), &volume_height);
@@ -1002,25 +2309,166 @@ void vtkCLVolumeReconstruction::FillVoxels()
   clSetKernelArg(adv_fill_voxels, 15, sizeof(cl_mem), &dev_bscans_queue);
   clSetKernelArg(adv_fill_voxels, 16, sizeof(cl_mem), &dev_bscan_timetags_queue);
   clSetKernelArg(adv_fill_voxels, 17, sizeof(cl_int), &intersection_counter);
+  clSetKernelArg(adv_fill_voxels, 18, sizeof(cl_mem), &dev_brick_table);
+  clSetKernelArg(adv_fill_voxels, 19, sizeof(cl_int), &queue_head);
 
+  cl_event fill_event;
   omp_set_lock(&cl_device_lock);
-  OpenCLCheckError(clEnqueueNDRangeKernel(reconstruction_cmd_queue, adv_fill_voxels, 1, NULL, global_work_size, local_work_size, NULL, NULL, NULL));
+  int enqueued = OpenCLCheckError(clEnqueueNDRangeKernel(reconstruction_cmd_queue, adv_fill_voxels, 1, NULL, global_work_size, local_work_size, 0, NULL, &fill_event));
+  OpenCLCheckError(clFlush(reconstruction_cmd_queue));
   omp_unset_lock(&cl_device_lock);
+  if (!enqueued)
+  {
+    return 0;
+  }
+
+  // Keep the last two launches, the next uploads wait for them
+  if (previous_fill_event != nullptr)
+  {
+    clReleaseEvent(previous_fill_event);
+  }
+  previous_fill_event = last_fill_event;
+  last_fill_event = fill_event;
+
+  ReadBackBricks();
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::ReadBackBricks()
+{
+  // Readout the touched bricks of the device pool to the host pool
+  if (!incremental_readback)
+  {
+    host_volume_stale = true;
+    bytes_transferred_per_frame = touched_bricks_size;
+  }
+  else if (host_volume_stale)
+  {
+    UpdateOutputVolume();
+    bytes_transferred_per_frame = touched_bricks_size + (size_t)allocated_bricks * BRICK_VOXELS;
+  }
+  else
+  {
+    ReadTouchedBricks();
+  }
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::ReserveBatchBuffers(int num_bscans)
+{
+  batch_x_vectors.resize(num_bscans);
+  batch_y_vectors.resize(num_bscans);
+  batch_plane_points.resize(num_bscans);
+  batch_plane_equations.resize(num_bscans);
+  if (num_bscans <= batch_capacity)
+  {
+    return;
+  }
+
+  if (dev_batch_bscans != nullptr)
+  {
+    clReleaseMemObject(dev_batch_bscans);
+    clReleaseMemObject(dev_batch_x_vectors);
+    clReleaseMemObject(dev_batch_y_vectors);
+    clReleaseMemObject(dev_batch_plane_points);
+    clReleaseMemObject(dev_batch_plane_equations);
+  }
+  dev_batch_bscans = OpenCLCreateBuffer(context, CL_MEM_READ_ONLY, (size_t)num_bscans * bscan_w * bscan_h * sizeof(cl_uchar), NULL);
+  dev_batch_x_vectors = OpenCLCreateBuffer(context, CL_MEM_READ_ONLY, num_bscans * sizeof(cl_float4), NULL);
+  dev_batch_y_vectors = OpenCLCreateBuffer(context, CL_MEM_READ_ONLY, num_bscans * sizeof(cl_float4), NULL);
+  dev_batch_plane_points = OpenCLCreateBuffer(context, CL_MEM_READ_ONLY, num_bscans * sizeof(plane_pts), NULL);
+  dev_batch_plane_equations = OpenCLCreateBuffer(context, CL_MEM_READ_ONLY, num_bscans * sizeof(cl_float4), NULL);
+  batch_capacity = num_bscans;
+}
 
-  // Readout the device volume to local buffer
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::FillVoxelsBatch(int first_window, int num_windows)
+{
+  int num_bscans = (int)batch_x_vectors.size();
+
+  clSetKernelArg(batch_mark_bricks, 0, sizeof(cl_float), &volume_spacing);
+  clSetKernelArg(batch_mark_bricks, 1, sizeof(cl_int), &volume_width);
+  clSetKernelArg(batch_mark_bricks, 2, sizeof(cl_int), &volume_height);
+  clSetKernelArg(batch_mark_bricks, 3, sizeof(cl_int), &volume_depth);
+  clSetKernelArg(batch_mark_bricks, 4, sizeof(cl_mem), &dev_batch_x_vectors);
+  clSetKernelArg(batch_mark_bricks, 5, sizeof(cl_mem), &dev_batch_y_vectors);
+  clSetKernelArg(batch_mark_bricks, 6, sizeof(cl_mem), &dev_batch_plane_points);
+  clSetKernelArg(batch_mark_bricks, 7, sizeof(cl_mem), &dev_batch_plane_equations);
+  clSetKernelArg(batch_mark_bricks, 8, sizeof(cl_float), &bscan_spacing_x);
+  clSetKernelArg(batch_mark_bricks, 9, sizeof(cl_float), &bscan_spacing_y);
+  clSetKernelArg(batch_mark_bricks, 10, sizeof(cl_int), &bscan_w);
+  clSetKernelArg(batch_mark_bricks, 11, sizeof(cl_int), &bscan_h);
+  clSetKernelArg(batch_mark_bricks, 12, sizeof(cl_int), &axis);
+  clSetKernelArg(batch_mark_bricks, 13, sizeof(cl_int), &first_window);
+  clSetKernelArg(batch_mark_bricks, 14, sizeof(cl_int), &num_windows);
+  clSetKernelArg(batch_mark_bricks, 15, sizeof(cl_mem), &dev_touched_bricks);
+
+  // Flag the bricks of the whole batch and give the new ones a slot in the pool
   omp_set_lock(&cl_device_lock);
-  unsigned char* volume = (unsigned char*)this->reconstructed_volume->GetScalarPointer();
-  OpenCLCheckError(clEnqueueReadBuffer(reconstruction_cmd_queue, dev_volume, CL_TRUE, 0, volume_size, volume, 0, 0, 0));
+  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_batch_x_vectors, CL_FALSE, 0, num_bscans * sizeof(cl_float4), &batch_x_vectors[0], 0, 0, 0));
+  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_batch_y_vectors, CL_FALSE, 0, num_bscans * sizeof(cl_float4), &batch_y_vectors[0], 0, 0, 0));
+  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_batch_plane_points, CL_FALSE, 0, num_bscans * sizeof(plane_pts), &batch_plane_points[0], 0, 0, 0));
+  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_batch_plane_equations, CL_FALSE, 0, num_bscans * sizeof(cl_float4), &batch_plane_equations[0], 0, 0, 0));
+  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_touched_bricks, CL_FALSE, 0, touched_bricks_size, &untouched_bricks[0], 0, 0, 0));
+  OpenCLCheckError(clEnqueueNDRangeKernel(reconstruction_cmd_queue, batch_mark_bricks, 1, NULL, global_work_size, local_work_size, 0, NULL, NULL));
+  OpenCLCheckError(clEnqueueReadBuffer(reconstruction_cmd_queue, dev_touched_bricks, CL_TRUE, 0, touched_bricks_size, &touched_bricks[0], 0, 0, 0));
+  omp_unset_lock(&cl_device_lock);
+  AllocateBricks();
+
+  clSetKernelArg(batch_fill_voxels, 0, sizeof(cl_mem), &dev_brick_pool);
+  clSetKernelArg(batch_fill_voxels, 1, sizeof(cl_mem), &dev_brick_table);
+  clSetKernelArg(batch_fill_voxels, 2, sizeof(cl_float), &volume_spacing);
+  clSetKernelArg(batch_fill_voxels, 3, sizeof(cl_int), &volume_width);
+  clSetKernelArg(batch_fill_voxels, 4, sizeof(cl_int), &volume_height);
+  clSetKernelArg(batch_fill_voxels, 5, sizeof(cl_int), &volume_depth);
+  clSetKernelArg(batch_fill_voxels, 6, sizeof(cl_mem), &dev_batch_x_vectors);
+  clSetKernelArg(batch_fill_voxels, 7, sizeof(cl_mem), &dev_batch_y_vectors);
+  clSetKernelArg(batch_fill_voxels, 8, sizeof(cl_mem), &dev_batch_plane_points);
+  clSetKernelArg(batch_fill_voxels, 9, sizeof(cl_mem), &dev_batch_plane_equations);
+  clSetKernelArg(batch_fill_voxels, 10, sizeof(cl_float), &bscan_spacing_x);
+  clSetKernelArg(batch_fill_voxels, 11, sizeof(cl_float), &bscan_spacing_y);
+  clSetKernelArg(batch_fill_voxels, 12, sizeof(cl_int), &bscan_w);
+  clSetKernelArg(batch_fill_voxels, 13, sizeof(cl_int), &bscan_h);
+  clSetKernelArg(batch_fill_voxels, 14, sizeof(cl_mem), &dev_mask);
+  clSetKernelArg(batch_fill_voxels, 15, sizeof(cl_mem), &dev_batch_bscans);
+  clSetKernelArg(batch_fill_voxels, 16, sizeof(cl_int), &axis);
+  clSetKernelArg(batch_fill_voxels, 17, sizeof(cl_int), &first_window);
+  clSetKernelArg(batch_fill_voxels, 18, sizeof(cl_int), &num_windows);
+
+  // The bricks are only all allocated if nothing failed before the fill kernel
+  int marked = !device_failed;
+  omp_set_lock(&cl_device_lock);
+  int enqueued = OpenCLCheckError(clEnqueueNDRangeKernel(reconstruction_cmd_queue, batch_fill_voxels, 1, NULL, global_work_size, local_work_size, 0, NULL, NULL));
+  OpenCLCheckError(clFlush(reconstruction_cmd_queue));
   omp_unset_lock(&cl_device_lock);
+
+  ReadBackBricks();
+  return marked && enqueued;
 }
 
 //----------------------------------------------------------------------------
-int vtkCLVolumeReconstruction::FindIntersections(int axis)
+void vtkCLVolumeReconstruction::UploadQueues()
 {
+  size_t bscan_size = bscan_w * bscan_h * sizeof(cl_uchar);
+
   omp_set_lock(&cl_device_lock);
-  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_bscan_plane_equation_queue, CL_TRUE, 0, bscan_plane_equation_queue_size, bscan_plane_equation_queue, 0, 0, 0));
+  for (int slot = 0; slot < BSCAN_RING; slot++)
+  {
+    OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_bscans_queue, CL_FALSE, slot * bscan_size, bscan_size, bscans_queue[slot], 0, 0, 0));
+  }
+  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_x_vector_queue, CL_FALSE, 0, x_vector_queue_size, x_vector_queue, 0, 0, 0));
+  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_y_vector_queue, CL_FALSE, 0, y_vector_queue_size, y_vector_queue, 0, 0, 0));
+  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_plane_points_queue, CL_FALSE, 0, plane_points_queue_size, plane_points_queue, 0, 0, 0));
+  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_bscan_plane_equation_queue, CL_FALSE, 0, bscan_plane_equation_queue_size, bscan_plane_equation_queue, 0, 0, 0));
+  OpenCLCheckError(clEnqueueWriteBuffer(reconstruction_cmd_queue, dev_bscan_timetags_queue, CL_FALSE, 0, bscan_timetags_queue_size, bscan_timetags_queue, 0, 0, 0));
+  OpenCLCheckError(clFinish(reconstruction_cmd_queue));
   omp_unset_lock(&cl_device_lock);
+}
 
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::FindIntersections(int axis)
+{
   clSetKernelArg(trace_intersections, 0, sizeof(cl_mem), &dev_intersections);
   clSetKernelArg(trace_intersections, 1, sizeof(cl_int), &volume_width);
   clSetKernelArg(trace_intersections, 2, sizeof(cl_int), &volume_height);
@@ -1028,9 +2476,284 @@ int vtkCLVolumeReconstruction::FindIntersections(int axis)
   clSetKernelArg(trace_intersections, 4, sizeof(cl_float), &volume_spacing);
   clSetKernelArg(trace_intersections, 5, sizeof(cl_mem), &dev_bscan_plane_equation_queue);
   clSetKernelArg(trace_intersections, 6, sizeof(cl_int), &axis);
+  clSetKernelArg(trace_intersections, 7, sizeof(cl_int), &queue_head);
+
+  // Wait for the new frame to be on the device
   omp_set_lock(&cl_device_lock);
-  OpenCLCheckError(clEnqueueNDRangeKernel(reconstruction_cmd_queue, trace_intersections, 1, NULL, global_work_size, local_work_size, NULL, NULL, NULL));
+  OpenCLCheckError(clEnqueueNDRangeKernel(reconstruction_cmd_queue, trace_intersections, 1, NULL, global_work_size, local_work_size, num_upload_events, num_upload_events ? upload_events : NULL, NULL));
   omp_unset_lock(&cl_device_lock);
 
   return max_vol_dim * max_vol_dim;
-}
\ No newline at end of file
+}
+
+//----------------------------------------------------------------------------
+int vtkCLVolumeReconstruction::FindIntersectionsCPU(int axis)
+{
+  // Same as trace_intersections: one ray along the axis per voxel of the opposite face
+  float4 Rd = make_float4((float)(axis == 0), (float)(axis == 1), (float)(axis == 2), 0.0f);
+  int iter_end[3] = {(axis != 0)* volume_width + (axis == 0), (axis != 1)* volume_height + (axis == 1), (axis != 2)* volume_depth + (axis == 2)};
+  int num_rays = iter_end[0] * iter_end[1] * iter_end[2];
+
+  float4* intersections = &cpu_intersections[0];
+  float4* plane_equations = bscan_plane_equation_queue;
+  int planes[2] = { RingIndex(BSCAN_WINDOW / 2 - 1), RingIndex(BSCAN_WINDOW / 2) }; // Fill voxels between two middle bscans
+
+  #pragma omp parallel for schedule(static) num_threads(GetNumberOfCPUThreads())
+  for (int n = 0; n < num_rays; n++)
+  {
+    int x = (axis != 0);
+    int y = (axis != 1);
+    int z = (axis != 2);
+    if (axis == 0)
+    {
+      y = n % volume_height;
+      z = n / volume_height;
+    }
+    if (axis == 1)
+    {
+      x = n % volume_width;
+      z = n / volume_width;
+    }
+    if (axis == 2)
+    {
+      x = n % volume_width;
+      y = n / volume_width;
+    }
+
+    float4 R0 = make_float4(x * volume_spacing, y * volume_spacing, z * volume_spacing, 0.0f);
+    for (int f = 0; f < 2; f++)
+    {
+      float4 plane = plane_equations[planes[f]];
+      float4 Pn = make_float4(plane.x, plane.y, plane.z, 0.0f);
+      float Vd = dot(Pn, Rd);
+      if (Vd == 0)
+      {
+        continue;
+      }
+      float t = -(dot(Pn, R0) + plane.w) / Vd;
+      intersections[n * 2 + f] = R0 + t * Rd;
+    }
+  }
+
+  return num_rays;
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::MarkBricksCPU(int intersection_counter)
+{
+  const float4* intersections = &cpu_intersections[0];
+  unsigned char* bricks = &touched_bricks[0];
+  std::fill(touched_bricks.begin(), touched_bricks.end(), 0);
+
+  int q_idx = RingIndex(BSCAN_WINDOW / 2 - 1);
+  float4 corner0 = plane_points_queue[q_idx].corner0;
+  float4 x_vector = x_vector_queue[q_idx];
+  float4 y_vector = y_vector_queue[q_idx];
+
+  // Same as mark_bricks
+  #pragma omp parallel for schedule(static) num_threads(GetNumberOfCPUThreads())
+  for (int i = 0; i < intersection_counter; i++)
+  {
+    float4 intrs0 = intersections[i * 2 + 0];
+    float4 intrs1 = intersections[i * 2 + 1];
+
+    float margin = length(intrs1 - intrs0) + 2 * volume_spacing;
+    float px0 = dot(intrs0 - corner0, x_vector);
+    float py0 = dot(intrs0 - corner0, y_vector);
+    if (px0 < -margin - bscan_spacing_x || px0 > bscan_w * bscan_spacing_x + margin ||
+        py0 < -margin - bscan_spacing_y || py0 > bscan_h * bscan_spacing_y + margin)
+    {
+      continue;
+    }
+
+    intrs0 = intrs0 / volume_spacing;
+    intrs1 = intrs1 / volume_spacing;
+    int x0 = (int)clamp(std::min(intrs0.x, intrs1.x), 0.0f, volume_width - 1.0f);
+    int x1 = (int)clamp(std::max(intrs0.x, intrs1.x) + 1.0f, 0.0f, volume_width - 1.0f);
+    int y0 = (int)clamp(std::min(intrs0.y, intrs1.y), 0.0f, volume_height - 1.0f);
+    int y1 = (int)clamp(std::max(intrs0.y, intrs1.y) + 1.0f, 0.0f, volume_height - 1.0f);
+    int z0 = (int)clamp(std::min(intrs0.z, intrs1.z), 0.0f, volume_depth - 1.0f);
+    int z1 = (int)clamp(std::max(intrs0.z, intrs1.z) + 1.0f, 0.0f, volume_depth - 1.0f);
+
+    for (int z = z0 / BRICK_SIZE; z <= z1 / BRICK_SIZE; z++)
+    {
+      for (int y = y0 / BRICK_SIZE; y <= y1 / BRICK_SIZE; y++)
+      {
+        for (int x = x0 / BRICK_SIZE; x <= x1 / BRICK_SIZE; x++)
+        {
+          bricks[x + y * bricks_w + z * bricks_w * bricks_h] = 1;
+        }
+      }
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::RayExtent(float4 intrs0, float4 intrs1, int extent[6]) const
+{
+  intrs0 = intrs0 / volume_spacing;
+  intrs1 = intrs1 / volume_spacing;
+
+  int x0 = (int)std::min(intrs0.x, intrs1.x);
+  int x1 = (int)std::max(x0 + 1.0f, std::max(intrs0.x, intrs1.x));
+  int y0 = (int)std::min(intrs0.y, intrs1.y);
+  int y1 = (int)std::max(y0 + 1.0f, std::max(intrs0.y, intrs1.y));
+  int z0 = (int)std::min(intrs0.z, intrs1.z);
+  int z1 = (int)std::max(z0 + 1.0f, std::max(intrs0.z, intrs1.z));
+
+  // Only the part of the ray inside the volume
+  extent[0] = std::max(x0, 0);
+  extent[1] = std::min(x1, volume_width - 1);
+  extent[2] = std::max(y0, 0);
+  extent[3] = std::min(y1, volume_height - 1);
+  extent[4] = std::max(z0, 0);
+  extent[5] = std::min(z1, volume_depth - 1);
+}
+
+//----------------------------------------------------------------------------
+void vtkCLVolumeReconstruction::FillVoxelsCPU()
+{
+  int intersection_counter = FindIntersectionsCPU(this->axis);
+
+  // Allocate the bricks this frame can write to
+  MarkBricksCPU(intersection_counter);
+  AllocateBricks();
+
+  unsigned char* pool = &brick_pool[0];
+  const int* table = &brick_table[0];
+  const float4* intersections = &cpu_intersections[0];
+
+  int slots[BSCAN_WINDOW];
+  for (int n = 0; n < BSCAN_WINDOW; n++)
+  {
+    slots[n] = RingIndex(n);
+  }
+
+  // The voxel ranges of neighbouring rays overlap, and compounding a voxel reads it. Each thread
+  // takes whole slabs of slices and the rays crossing them in order, so every voxel is written
+  // by a single thread, in the same order as with one thread. A few slabs per thread, at most a
+  // brick thick.
+  int num_threads = GetNumberOfCPUThreads();
+  int slab_size = std::max(1, std::min((int)BRICK_SIZE, volume_depth / (4 * num_threads)));
+  int num_slabs = (volume_depth + slab_size - 1) / slab_size;
+  cpu_slab_rays.resize(num_slabs);
+  for (int s = 0; s < num_slabs; s++)
+  {
+    cpu_slab_rays[s].clear();
+  }
+  for (int i = 0; i < intersection_counter; i++)
+  {
+    int extent[6];
+    RayExtent(intersections[i * 2 + 0], intersections[i * 2 + 1], extent);
+    if (extent[0] > extent[1] || extent[2] > extent[3] || extent[4] > extent[5])
+    {
+      continue;
+    }
+    for (int s = extent[4] / slab_size; s <= extent[5] / slab_size; s++)
+    {
+      cpu_slab_rays[s].push_back(i);
+    }
+  }
+
+  // Same as adv_fill_voxels with distance weighting and averaging compounding
+  #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+  for (int s = 0; s < num_slabs; s++)
+  {
+    const std::vector<int>& rays = cpu_slab_rays[s];
+    for (size_t r = 0; r < rays.size(); r++)
+    {
+      int i = rays[r];
+      int extent[6];
+      RayExtent(intersections[i * 2 + 0], intersections[i * 2 + 1], extent);
+      int x0 = extent[0];
+      int x1 = extent[1];
+      int y0 = extent[2];
+      int y1 = extent[3];
+      int z0 = std::max(extent[4], s * slab_size);
+      int z1 = std::min(extent[5], s * slab_size + slab_size - 1);
+
+      int last_brick = -1;
+      unsigned char* brick = NULL;
+      for (int z = z0; z <= z1; z++)
+      {
+        for (int y = y0; y <= y1; y++)
+        {
+          for (int x = x0; x <= x1; x++)
+          {
+            int b = x / BRICK_SIZE + (y / BRICK_SIZE) * bricks_w + (z / BRICK_SIZE) * bricks_w * bricks_h;
+            if (b != last_brick)
+            {
+              brick = (table[b] >= 0) ? pool + (size_t)table[b] * BRICK_VOXELS : NULL;
+              last_brick = b;
+            }
+            if (brick == NULL)
+            {
+              continue;
+            }
+
+            float4 voxel_coord = make_float4(x * volume_spacing, y * volume_spacing, z * volume_spacing, 0.0f);
+            unsigned char bilinears[BSCAN_WINDOW];
+            bool valid = true;
+            float G = 0;
+            float contribution = 0;
+            for (int n = 0; n < BSCAN_WINDOW && valid; n++)
+            {
+              int q_idx = slots[n];
+              float4 plane = bscan_plane_equation_queue[q_idx];
+              float4 normal = make_float4(plane.x, plane.y, plane.z, 0.0f);
+
+              float dist0 = fabs(distance(voxel_coord, plane));
+              float4 p0 = voxel_coord + -dist0 * normal - plane_points_queue[q_idx].corner0;
+              float px0 = dot(p0, x_vector_queue[q_idx]) / bscan_spacing_x;
+              float py0 = dot(p0, y_vector_queue[q_idx]) / bscan_spacing_y;
+              float xa = px0 - floor(px0);
+              float ya = py0 - floor(py0);
+              int xa0 = (int)px0;
+              int ya0 = (int)py0;
+
+              if (!inrange(xa0, 0, bscan_w - 1) || !inrange(ya0, 0, bscan_h - 1))
+              {
+                valid = false;
+                break;
+              }
+              const unsigned char* m = &mask[xa0 + ya0 * bscan_w];
+              if (m[0] == 0 || m[1] == 0 || m[bscan_w] == 0 || m[bscan_w + 1] == 0)
+              {
+                valid = false;
+                break;
+              }
+              const unsigned char* b = &bscans_queue[q_idx][xa0 + ya0 * bscan_w];
+              bilinears[n] = (unsigned char)(b[0] * (1 - xa) * (1 - ya) + b[1] * xa * (1 - ya) + b[bscan_w] * (1 - xa) * ya + b[bscan_w + 1] * xa * ya);
+
+              if (dist0 == 0)
+              {
+                continue;
+              }
+              G += 1 / dist0;
+              contribution += bilinears[n] / dist0;
+            }
+
+            if (!valid)
+            {
+              continue;
+            }
+            if (G != 0)
+            {
+              contribution /= G;
+            }
+
+            unsigned char& voxel = brick[x % BRICK_SIZE + (y % BRICK_SIZE) * BRICK_SIZE + (z % BRICK_SIZE) * BRICK_SIZE * BRICK_SIZE];
+            voxel = (voxel != 0) ? (unsigned char)((voxel + contribution) / 2) : (unsigned char)contribution;
+          }
+        }
+      }
+    }
+  }
+
+  // The host pool is written directly, the marked bricks are expanded on the next UpdateOutputVolume
+  for (int b = 0; b < touched_bricks_size; b++)
+  {
+    dirty_bricks[b] |= touched_bricks[b];
+  }
+  bytes_transferred_per_frame = 0;
+}
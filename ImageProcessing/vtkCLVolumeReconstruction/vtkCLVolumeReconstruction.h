@@ -42,7 +42,10 @@
 // STL includes
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <deque>
 #include <queue>
+#include <vector>
 
 // OpenMP includes
 #include <omp.h>
@@ -53,8 +56,10 @@
 
 // VTK includes
 #include <vtkImageAlgorithm.h>
+#include <vtkMultiThreader.h>
 #include <vtkSmartPointer.h>
 
+class vtkConditionVariable;
 class vtkImageData;
 class vtkMatrix4x4;
 class vtkTransform;
@@ -77,9 +82,21 @@ public:
   vtkTypeMacro(vtkCLVolumeReconstruction, vtkAlgorithm);
   void PrintSelf(ostream& os, vtkIndent indent);
 
-  /* Initializes devices */
+  /* Compounding backends */
+  enum { OPENCL_BACKEND = 0, CPU_BACKEND = 1 };
+
+  /* Initializes devices. Falls back to the CPU backend if no OpenCL device can be used. */
   void Initialize();
 
+  /* Select the compounding backend. Set before Initialize. An OpenCL error while reconstructing
+     switches to the CPU backend, which carries on with the bricks read back from the device. */
+  void SetBackend(int);
+  int GetBackend() const;
+
+  /* Number of threads of the CPU backend, 0 uses all cores */
+  void SetNumberOfCPUThreads(int);
+  int GetNumberOfCPUThreads() const;
+
   /* Print device information */
   void PrintInfo();
 
@@ -107,6 +124,9 @@ public:
   /* Set Reconstruction axis. 0 - X axis, 1 - Y axis, 2 - Z axis */
   void SetReconstructionAxis(int);
 
+  /* Set the bscan mask (bscan width x height, 0 outside the ROI). Call after Initialize. Uploaded with the next frame. */
+  void SetMask(unsigned char*);
+
   /* Set input data */
   void SetInputImageData(double, vtkImageData*);
 
@@ -132,9 +152,76 @@ public:
   /* Starts realtime reconstruction */
   void UpdateReconstruction();
 
-  /* Get Output Volume */
+  /* Reconstruct a recorded sequence: bscans are stored one after the other (bscan width x height each) and
+     poses are the 12 first elements of each tracker matrix. The frames of a batch are compounded together,
+     many windows per kernel launch, so the caller should pass large batches (e.g. from a memory mapped file).
+     The batch kernels are distance weighted. If the device fails, the batch is compounded again on the CPU.
+     Not to be used with StartAsyncReconstruction. Returns the number of frames reconstructed. */
+  int ReconstructBatch(int, const double*, const unsigned char*, const float*);
+
+  /* Get Output Volume. Expands the bricks modified since the last call into the dense volume. */
   void GetOutputVolume(vtkImageData*);
 
+  /* The output volume is stored as BRICK_SIZE^3 bricks, allocated when first written to */
+  int GetNumberOfAllocatedBricks() const;
+  int GetNumberOfBricks() const;
+
+  /* Bytes held by the brick pool (on the device and mirrored on the host) */
+  size_t GetBrickPoolSize() const;
+
+  /* Hole filling radius in voxels. Empty voxels get the mean of the non-empty ones within it. 0 - disabled (default) */
+  void SetHoleFillingRadius(int);
+  int GetHoleFillingRadius() const;
+
+  /* Frames a brick must go without a new bscan before its holes are filled (default 10) */
+  void SetHoleFillingDelay(int);
+
+  /* Bricks hole filled per frame at most (default 16). Raising it while reconstructing grows the hole filling buffers. */
+  void SetMaxHoleFillingBricks(int);
+
+  /* Bricks hole filled since StartReconstruction */
+  int GetNumberOfHoleFilledBricks() const;
+
+  /* Frame queue policies for when the compounding thread falls behind */
+  enum { DROP_FRAMES = 0, BLOCK_ACQUISITION = 1 };
+
+  /* Compound frames from the frame queue on a dedicated thread. Call after StartReconstruction. Until
+     StopAsyncReconstruction, Update pushes the input as a frame and outputs the published volume. */
+  void StartAsyncReconstruction();
+
+  /* Compound the queued frames and stop the compounding thread */
+  void StopAsyncReconstruction();
+
+  /* Queue a frame for the compounding thread. Only one thread may push. 1 - queued, 0 - dropped */
+  int PushFrame(double, vtkImageData*, vtkMatrix4x4*);
+
+  /* Number of pre-allocated frame slots (default 8) and queue policy. Set before StartAsyncReconstruction. */
+  void SetFrameQueueSize(int);
+  void SetFrameQueuePolicy(int);
+
+  /* Interval in seconds (default 0.1) at which the compounding thread publishes a copy of the volume,
+     and whenever the queue runs dry. 0 - never. */
+  void SetPublishInterval(double);
+  double GetPublishInterval() const;
+
+  /* Shallow copy of the volume last published by the compounding thread, if it is newer than the given
+     version. Never waits for the compounding. Returns the version of the published volume, 0 - none yet. */
+  unsigned long GetPublishedVolume(vtkImageData*, unsigned long known_version = 0);
+
+  /* Pipeline metrics. Latency is the time from PushFrame to the frame being compounded, in seconds. */
+  int GetNumberOfDroppedFrames() const;
+  int GetNumberOfCompoundedFrames() const;
+  double GetLastLatency() const;
+  double GetMeanLatency() const;
+  double GetMaxLatency() const;
+
+  /* Copy back only the bricks touched by each frame (default), otherwise only on GetOutputVolume */
+  void SetIncrementalReadback(bool);
+  bool GetIncrementalReadback() const;
+
+  /* Bytes read back from the device by the last UpdateReconstruction */
+  size_t GetBytesTransferredPerFrame() const;
+
   /*Get volume origin */
   void GetOrigin(double*) const;
 
@@ -153,17 +240,24 @@ protected:
   /* Utility functions */
   std::string FileToString(const std::string& fileName, const std::string& header = "");
 
-  /* creates the OpenCL kernel given the device */
+  /* creates the OpenCL kernel given the device. NULL - on error */
   cl_kernel OpenCLKernelBuild(cl_program, cl_device_id, char*);
 
+  /* Creates the OpenCL context, queues and kernels. 0 - if there is no usable device */
+  int InitializeOpenCL();
+
   /* Initialize buffers */
   void InitializeBuffers();
 
-  /*  create CL buffers */
+  /*  create CL buffers. NULL - on error */
   cl_mem OpenCLCreateBuffer(cl_context, cl_mem_flags, size_t, void*);
 
-  /* */
-  void OpenCLCheckError(int, char* info = "");
+  /* 1 - if err is CL_SUCCESS  0 - otherwise. Errors are reported and set device_failed */
+  int OpenCLCheckError(int err, char* info = "");
+
+  /* Read the bricks back from the device if it still can, release it and switch to the CPU backend.
+     1 - if the bricks were read back  0 - otherwise */
+  int FallBackToCPU();
 
   /* Multiply calibration matrix into position matrix */
   void CalibratePosMatrix(float*, float*);
@@ -177,16 +271,83 @@ protected:
   /* */
   int FindIntersections(int axis);
 
-  /* */
-  void FillVoxels();
+  /* 1 - if the fill kernel was enqueued with all its bricks allocated  0 - otherwise */
+  int FillVoxels();
+
+  /* CPU versions of trace_intersections, mark_bricks and adv_fill_voxels (distance weighted) */
+  int FindIntersectionsCPU(int axis);
+  void MarkBricksCPU(int);
+  void FillVoxelsCPU();
 
-  /* Shifts data queues. 1 - if the queues are full  0- otherwise */
-  int ShiftQueues();
+  /* Voxels between the two intersections of a ray, clipped to the volume (xmin, xmax, ymin, ...) */
+  void RayExtent(float4, float4, int extent[6]) const;
+
+  /* Give a pool slot to every touched brick that has none. 1 - if bricks were allocated */
+  int AllocateBricks();
+
+  /* Grow the brick pool to hold at least the given number of bricks */
+  void GrowBrickPool(int);
+
+  /* Zero the brick pool and release all bricks */
+  void ClearBricks();
+
+  /* Queue the bricks the sweep has left and pick the next ones to hole fill. Returns their number. */
+  int CollectHoleBricks();
+
+  /* Hole fill the collected bricks. FillHolesCPU collects them first, unless told they were already
+     collected for a FillHoles that failed. */
+  void FillHoles();
+  void FillHolesCPU(int collect = 1);
+
+  typedef struct
+  {
+    double timestamp;
+    double acquisition_time;
+    float pose[12];
+    unsigned char* pixels;
+  } frame_slot;
+
+  /* Reconstructs the given frame, or the input data if NULL */
+  void ReconstructFrame(const frame_slot*);
+
+  /* Copy the volume into a new published snapshot. Called with volume_mutex held. */
+  void PublishVolume();
+
+  /* Advances the head of the ring queues. 1 - if the queues are full  0- otherwise */
+  int ShiftQueues(const frame_slot*);
+
+  /* Ring buffer slot of the n-th oldest bscan in the window */
+  int RingIndex(int n) const;
+
+  /* Non-blocking upload of the newest bscan and its pose into the device ring buffers */
+  void UploadFrame();
 
   /* Wait for input data */
   void GrabInputData();
 
-  /* Update output volume */
+  /* Copy a frame into the newest slot of the queues */
+  void InsertFrame(float, const unsigned char*, const float*);
+
+  /* Body of the compounding thread */
+  static void* CompoundingThread(vtkMultiThreader::ThreadInfo*);
+
+  /* Read back the bricks touched by the last frame */
+  void ReadTouchedBricks();
+
+  /* Read back the touched bricks, or mark the host copy stale if the readback is not incremental */
+  void ReadBackBricks();
+
+  /* Grow the device batch buffers to hold the given number of bscans */
+  void ReserveBatchBuffers(int);
+
+  /* Compound the windows of the uploaded batch with batch_mark_bricks and batch_fill_voxels.
+     1 - if the fill kernel was enqueued with all its bricks allocated  0 - otherwise */
+  int FillVoxelsBatch(int, int);
+
+  /* Write the host ring queues to the device after a batch */
+  void UploadQueues();
+
+  /* Update output volume. Reads back the device brick pool if the host copy is stale, then expands the dirty bricks. */
   void UpdateOutputVolume();
 
   /* Print the content of a matrix */
@@ -200,6 +361,26 @@ protected:
     float4 cornery;
   } plane_pts;
 
+  typedef struct
+  {
+    int head;
+    std::queue<float> timestamps;
+    std::queue<vtkImageData*> images;
+    std::queue<vtkMatrix4x4*> poses;
+    std::vector<unsigned char> bscans;
+    std::vector<float> pos_matrices;
+    std::vector<float> bscan_timetags;
+    std::vector<float> pos_timetags;
+    std::vector<float4> x_vectors;
+    std::vector<float4> y_vectors;
+    std::vector<float4> plane_equations;
+    std::vector<plane_pts> plane_points;
+  } ring_state;
+
+  /* Copy the ring queues and their head, so a batch can be replayed from the same window */
+  void SaveQueues(ring_state&) const;
+  void RestoreQueues(const ring_state&);
+
   /* CL Kernels */
   cl_kernel transform;
   cl_kernel round_off_translate;
@@ -207,7 +388,13 @@ protected:
   cl_kernel fill_holes;
   cl_kernel adv_fill_voxels;
   cl_kernel trace_intersections;
+  cl_kernel mark_bricks;
+  cl_kernel fill_brick_holes;
+  cl_kernel commit_brick_holes;
+  cl_kernel batch_mark_bricks;
+  cl_kernel batch_fill_voxels;
   cl_command_queue reconstruction_cmd_queue;
+  cl_command_queue upload_cmd_queue;
 
   /* CL Device */
   cl_device_id device;
@@ -257,11 +444,23 @@ protected:
   /* Use this device idx */
   int device_index;
 
+  /* Compounding backend and number of CPU threads */
+  int backend;
+  int cpu_threads;
+
+  /* Set by a failed OpenCL call, the reconstruction falls back to the CPU backend */
+  bool device_failed;
+
   /* Path to the CL Program source */
   std::string program_src;
 
   /* Private Constants */
   static const int BSCAN_WINDOW = 4; // must be >= 4 if PT
+  static const int BSCAN_RING = BSCAN_WINDOW + 1; // one spare slot, written while the previous frame is compounded
+  static const int BRICK_SIZE = 32; // must match kernels.cl
+  static const int BRICK_VOXELS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+  static const int INITIAL_BRICK_POOL = 64; // bricks allocated by StartReconstruction (2 MB)
+  static const int MAX_UPLOAD_EVENTS = 6; // bscan, x and y vectors, plane points, plane equation, timetag
 
   // Host variables
   int                         intersections_size;
@@ -276,6 +475,22 @@ protected:
   int                         bscan_plane_equation_queue_size;
   size_t                      global_work_size[1];
   size_t                      local_work_size[1];
+  int                         queue_head;
+  bool                        mask_modified;
+  int                         bricks_w, bricks_h, bricks_d;
+  int                         touched_bricks_size;
+  size_t                      bytes_transferred_per_frame;
+  bool                        incremental_readback;
+  bool                        host_volume_stale;
+  int                         allocated_bricks;
+  int                         brick_pool_capacity;
+  bool                        output_volume_allocated;
+  int                         hole_filling_radius;
+  int                         hole_filling_delay;
+  int                         max_hole_filling_bricks;
+  int                         hole_filling_frame;
+  int                         hole_filled_bricks;
+  int                         batch_capacity;
 
   // Host buffers
   float4*                     x_vector_queue;
@@ -287,6 +502,21 @@ protected:
   float4*                     bscan_plane_equation_queue;
   plane_pts*                  plane_points_queue;
   unsigned char*              mask;
+  std::vector<unsigned char>  touched_bricks;
+  std::vector<unsigned char>  untouched_bricks;
+  std::vector<unsigned char>  dirty_bricks;
+  std::vector<int>            brick_table;
+  std::vector<unsigned char>  brick_pool;
+  std::vector<int>            brick_last_touched;
+  std::deque<int>             settled_bricks;
+  std::vector<int>            hole_bricks;
+  std::vector<unsigned char>  hole_scratch;
+  std::vector<float4>         cpu_intersections;
+  std::vector<std::vector<int> > cpu_slab_rays;
+  std::vector<float4>         batch_x_vectors;
+  std::vector<float4>         batch_y_vectors;
+  std::vector<plane_pts>      batch_plane_points;
+  std::vector<float4>         batch_plane_equations;
   std::queue<float>           timestamp_queue;
   std::queue<vtkImageData*>   imageData_queue;
   std::queue<vtkMatrix4x4*>   poseData_queue;
@@ -298,7 +528,10 @@ protected:
 
   // Devices buffers
   cl_mem                      dev_intersections;
-  cl_mem                      dev_volume;
+  cl_mem                      dev_brick_pool;
+  cl_mem                      dev_brick_table;
+  cl_mem                      dev_hole_bricks;
+  cl_mem                      dev_hole_scratch;
   cl_mem                      dev_x_vector_queue;
   cl_mem                      dev_y_vector_queue;
   cl_mem                      dev_plane_points_queue;
@@ -306,6 +539,18 @@ protected:
   cl_mem                      dev_bscans_queue;
   cl_mem                      dev_bscan_timetags_queue;
   cl_mem                      dev_bscan_plane_equation_queue;
+  cl_mem                      dev_touched_bricks;
+  cl_mem                      dev_batch_bscans;
+  cl_mem                      dev_batch_x_vectors;
+  cl_mem                      dev_batch_y_vectors;
+  cl_mem                      dev_batch_plane_points;
+  cl_mem                      dev_batch_plane_equations;
+
+  // Events ordering the uploads against the compounding kernels
+  cl_event                    upload_events[MAX_UPLOAD_EVENTS];
+  cl_uint                     num_upload_events;
+  cl_event                    last_fill_event;
+  cl_event                    previous_fill_event;
 
   // cal_matrix is the 1x16 us calibration matrix
   float*                      pos_timetags;
@@ -317,6 +562,35 @@ protected:
   vtkSmartPointer<vtkTransform> image_pose;
   vtkSmartPointer<vtkImageData> reconstructed_volume;
   vtkSmartPointer<vtkMutexLock> input_data_mutex;
+
+  // Asynchronous compounding: single-producer/single-consumer queue of frame slots
+  std::vector<frame_slot>       frame_queue;
+  std::vector<unsigned char>    frame_queue_pixels;
+  std::atomic<unsigned int>     frame_queue_read;
+  std::atomic<unsigned int>     frame_queue_write;
+  int                           frame_queue_size;
+  int                           frame_queue_policy;
+  bool                          async_running;
+  bool                          async_stop;
+  int                           compounding_thread_id;
+  vtkSmartPointer<vtkMultiThreader> compounding_threader;
+  vtkSmartPointer<vtkMutexLock> frame_queue_mutex;
+  vtkSmartPointer<vtkConditionVariable> frame_queue_condition;
+  vtkSmartPointer<vtkMutexLock> volume_mutex;
+
+  // Snapshots of the volume for the viewers, a new image each time so the ones handed out stay untouched
+  vtkSmartPointer<vtkMutexLock> publish_mutex;
+  vtkSmartPointer<vtkImageData> published_volume;
+  unsigned long                 published_version;
+  double                        publish_interval;
+  double                        last_publish_time;
+
+  // Metrics, guarded by frame_queue_mutex
+  int                           dropped_frames;
+  int                           compounded_frames;
+  double                        last_latency;
+  double                        total_latency;
+  double                        max_latency;
 };
 
 #endif //_vtkCLVolumeReconstruction_h_
\ No newline at end of file
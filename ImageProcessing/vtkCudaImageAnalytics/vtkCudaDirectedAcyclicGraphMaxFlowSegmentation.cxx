@@ -60,6 +60,15 @@ vtkCudaDirectedAcyclicGraphMaxFlowSegmentation::vtkCudaDirectedAcyclicGraphMaxFl
   //set algorithm mathematical parameters to defaults
   this->MaxGPUUsage = 0.90;
   this->ReportRate = 100;
+  this->UseCPUWorker = 0;
+  this->CPUWorkerMemory = 0;
+  this->NumberOfCPUWorkerThreads = 0;
+  this->SchedulingTraceFileName = 0;
+  this->SimulatedVolumeSize = 0;
+  this->NumberOfMemoryTransfers = 0;
+  this->NumberOfKernelRuns = 0;
+  this->SimulatedTime = 0.0;
+  this->SimulatedIdleTime = 0.0;
 
   //give default GPU selection
   this->GPUsUsed.insert(0);
@@ -74,6 +83,7 @@ vtkCudaDirectedAcyclicGraphMaxFlowSegmentation::~vtkCudaDirectedAcyclicGraphMaxF
   this->GPUsUsed.clear();
   this->MaxGPUUsageNonDefault.clear();
   delete this->Scheduler;
+  this->SetSchedulingTraceFileName(0);
 }
 
 //----------------------------------------------------------------------------
@@ -113,6 +123,24 @@ void vtkCudaDirectedAcyclicGraphMaxFlowSegmentation::SetDevice(int GPU)
   this->AddDevice(GPU);
 }
 
+//----------------------------------------------------------------------------
+void vtkCudaDirectedAcyclicGraphMaxFlowSegmentation::AddSimulatedDevice(int numBuffers, double bandwidth, double kernelRate)
+{
+  vtkCudaMaxFlowSimulatedDevice device;
+  device.NumBuffers = numBuffers;
+  device.Bandwidth = bandwidth;
+  device.KernelRate = kernelRate;
+  this->SimulatedDevices.push_back(device);
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+void vtkCudaDirectedAcyclicGraphMaxFlowSegmentation::ClearSimulatedDevices()
+{
+  this->SimulatedDevices.clear();
+  this->Modified();
+}
+
 //----------------------------------------------------------------------------
 void vtkCudaDirectedAcyclicGraphMaxFlowSegmentation::SetMaxGPUUsage(double usage, int device)
 {
@@ -158,6 +186,18 @@ int vtkCudaDirectedAcyclicGraphMaxFlowSegmentation::InitializeAlgorithm()
   Scheduler->VZ = this->VZ;
   Scheduler->CC = this->CC;
   Scheduler->StepSize = this->StepSize;
+  Scheduler->WarmStart = (this->ContinueSolution != 0);
+  if (Scheduler->SetTraceFile(this->SchedulingTraceFileName))
+  {
+    vtkWarningMacro("Could not open scheduling trace file " << this->SchedulingTraceFileName << ".");
+  }
+  //simulated workers do not compute, so their buffers would corrupt a real segmentation
+  if (!this->SimulatedDevices.empty() && (!this->GPUsUsed.empty() || this->UseCPUWorker))
+  {
+    vtkErrorMacro("Simulated devices cannot be mixed with GPUs or the CPU worker, clear the devices to use and the CPU worker to simulate.");
+    return -1;
+  }
+
   if (this->Debug)
   {
     vtkDebugMacro("Building workers.");
@@ -173,14 +213,33 @@ int vtkCudaDirectedAcyclicGraphMaxFlowSegmentation::InitializeAlgorithm()
     {
       vtkErrorMacro("Could not allocate sufficient GPU buffers.");
       Scheduler->Clear();
-      while (CPUBuffersAcquired.size() > 0)
-      {
-        float* tempBuffer = CPUBuffersAcquired.front();
-        delete[] tempBuffer;
-        CPUBuffersAcquired.pop_front();
-      }
+      this->ReleaseBuffers();
+    }
+  }
+  if (this->UseCPUWorker)
+  {
+    if (this->Scheduler->CreateCPUWorker(this->CPUWorkerMemory, this->NumberOfCPUWorkerThreads))
+    {
+      vtkErrorMacro("Could not allocate sufficient CPU worker buffers, the pool must hold at least 8 volume buffers.");
+      Scheduler->Clear();
+      this->ReleaseBuffers();
     }
   }
+  for (size_t i = 0; i < this->SimulatedDevices.size(); i++)
+  {
+    vtkIdType simulatedVolumeSize = this->SimulatedVolumeSize ? this->SimulatedVolumeSize : (vtkIdType) this->VolumeSize;
+    if (this->Scheduler->CreateSimulatedWorker(-2 - (int) i, this->SimulatedDevices[i], simulatedVolumeSize))
+    {
+      vtkErrorMacro("Simulated device " << i << " holds too few buffers.");
+      Scheduler->Clear();
+      this->ReleaseBuffers();
+    }
+  }
+  if (this->Scheduler->Workers.empty())
+  {
+    vtkErrorMacro("No GPU, CPU or simulated workers available to run the algorithm.");
+    return -1;
+  }
 
   //if verbose, print progress
   if (this->Debug)
@@ -249,6 +308,10 @@ int vtkCudaDirectedAcyclicGraphMaxFlowSegmentation::RunAlgorithm()
   {
     vtkDebugMacro("Running tasks");
   }
+  if (Scheduler->Workers.empty())
+  {
+    return -1;
+  }
   int NumTasksDone = 0;
   while (Scheduler->CanRunAlgorithmIteration())
   {
@@ -263,13 +326,23 @@ int vtkCudaDirectedAcyclicGraphMaxFlowSegmentation::RunAlgorithm()
       vtkDebugMacro("Finished " << NumTasksDone << " with " << Scheduler->NumMemCpies << " memory transfers.");
     }
   }
-  Scheduler->ReturnLeaves();
+  if (this->KeepFullSolution)
+  {
+    Scheduler->ReturnAll();
+  }
+  else
+  {
+    Scheduler->ReturnLeaves();
+  }
 
   if (this->Debug)
   {
     vtkDebugMacro("Finished all " << NumTasksDone << " tasks with a total of " << Scheduler->NumMemCpies << " memory transfers.");
   }
   assert(Scheduler->BlockedTasks.size() == 0);
+  this->NumberOfMemoryTransfers = Scheduler->NumMemCpies;
+  this->NumberOfKernelRuns = Scheduler->NumKernelRuns;
+  Scheduler->GetSimulatedTimes(&this->SimulatedTime, &this->SimulatedIdleTime);
 
   Scheduler->Clear();
 
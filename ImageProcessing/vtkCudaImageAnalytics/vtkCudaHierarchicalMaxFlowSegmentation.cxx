@@ -543,6 +543,12 @@ int vtkCudaHierarchicalMaxFlowSegmentation::InitializeAlgorithm()
   }
   NumMemCpies = 0;
 
+  //a warm start or a coarser level continues from the solution kept on the CPU, which is loaded on demand
+  if (this->ContinueSolution)
+  {
+    return 1;
+  }
+
   //initialize solution
   //initalize all spatial flows and divergences to zero
   for (int i = 0; i < NumBranches; i++)
@@ -688,12 +694,25 @@ int vtkCudaHierarchicalMaxFlowSegmentation::RunAlgorithm()
     vtkDebugMacro("Finished all iterations with a total of " << NumMemCpies << " memory transfers.");
   }
 
-  //Copy back any uncopied leaf label buffers (others don't matter anymore)
-  for (int i = 0; i < NumLeaves; i++)
+  //Copy back any uncopied leaf label buffers (others only matter when warm starting or between levels)
+  if (this->KeepFullSolution)
   {
-    if (CPU2GPUMap.find(leafLabelBuffers[i]) != CPU2GPUMap.end())
+    for (std::map<float*, float*>::iterator it = CPU2GPUMap.begin(); it != CPU2GPUMap.end(); it++)
     {
-      ReturnBufferGPU2CPU(leafLabelBuffers[i], CPU2GPUMap[leafLabelBuffers[i]]);
+      if (it->first)
+      {
+        ReturnBufferGPU2CPU(it->first, it->second);
+      }
+    }
+  }
+  else
+  {
+    for (int i = 0; i < NumLeaves; i++)
+    {
+      if (CPU2GPUMap.find(leafLabelBuffers[i]) != CPU2GPUMap.end())
+      {
+        ReturnBufferGPU2CPU(leafLabelBuffers[i], CPU2GPUMap[leafLabelBuffers[i]]);
+      }
     }
   }
   if (this->Debug)
@@ -49,6 +49,12 @@ protected:
   virtual int InitializeAlgorithm();
   virtual int RunAlgorithm();
 
+  //the GPU solver keeps float flows
+  virtual int SupportsCompactFlowStorage()
+  {
+    return 0;
+  }
+
   double  MaxGPUUsage;
   void PropogateLabels(vtkIdType currNode);
   void SolveMaxFlow(vtkIdType currNode, int* timeStep);
@@ -54,6 +54,15 @@ vtkCudaHierarchicalMaxFlowSegmentation2::vtkCudaHierarchicalMaxFlowSegmentation2
   //set algorithm mathematical parameters to defaults
   this->MaxGPUUsage = 0.90;
   this->ReportRate = 100;
+  this->UseCPUWorker = 0;
+  this->CPUWorkerMemory = 0;
+  this->NumberOfCPUWorkerThreads = 0;
+  this->SchedulingTraceFileName = 0;
+  this->SimulatedVolumeSize = 0;
+  this->NumberOfMemoryTransfers = 0;
+  this->NumberOfKernelRuns = 0;
+  this->SimulatedTime = 0.0;
+  this->SimulatedIdleTime = 0.0;
 
   //give default GPU selection
   this->GPUsUsed.insert(0);
@@ -68,6 +77,7 @@ vtkCudaHierarchicalMaxFlowSegmentation2::~vtkCudaHierarchicalMaxFlowSegmentation
   this->GPUsUsed.clear();
   this->MaxGPUUsageNonDefault.clear();
   delete this->Scheduler;
+  this->SetSchedulingTraceFileName(0);
 }
 
 
@@ -101,6 +111,24 @@ void vtkCudaHierarchicalMaxFlowSegmentation2::ClearDevices()
   this->GPUsUsed.clear();
 }
 
+//----------------------------------------------------------------------------
+void vtkCudaHierarchicalMaxFlowSegmentation2::AddSimulatedDevice(int numBuffers, double bandwidth, double kernelRate)
+{
+  vtkCudaMaxFlowSimulatedDevice device;
+  device.NumBuffers = numBuffers;
+  device.Bandwidth = bandwidth;
+  device.KernelRate = kernelRate;
+  this->SimulatedDevices.push_back(device);
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+void vtkCudaHierarchicalMaxFlowSegmentation2::ClearSimulatedDevices()
+{
+  this->SimulatedDevices.clear();
+  this->Modified();
+}
+
 //----------------------------------------------------------------------------
 void vtkCudaHierarchicalMaxFlowSegmentation2::SetMaxGPUUsage(double usage, int device)
 {
@@ -147,6 +175,18 @@ int vtkCudaHierarchicalMaxFlowSegmentation2::InitializeAlgorithm()
   this->Scheduler->VZ = this->VZ;
   this->Scheduler->CC = this->CC;
   this->Scheduler->StepSize = this->StepSize;
+  this->Scheduler->WarmStart = (this->ContinueSolution != 0);
+  if (this->Scheduler->SetTraceFile(this->SchedulingTraceFileName))
+  {
+    vtkWarningMacro("Could not open scheduling trace file " << this->SchedulingTraceFileName << ".");
+  }
+
+  //simulated workers do not compute, so their buffers would corrupt a real segmentation
+  if (!this->SimulatedDevices.empty() && (!this->GPUsUsed.empty() || this->UseCPUWorker))
+  {
+    vtkErrorMacro("Simulated devices cannot be mixed with GPUs or the CPU worker, clear the devices to use and the CPU worker to simulate.");
+    return -1;
+  }
 
   if (this->Debug)
   {
@@ -164,14 +204,33 @@ int vtkCudaHierarchicalMaxFlowSegmentation2::InitializeAlgorithm()
     {
       vtkErrorMacro("Could not allocate sufficient GPU buffers.");
       Scheduler->Clear();
-      while (CPUBuffersAcquired.size() > 0)
-      {
-        float* tempBuffer = CPUBuffersAcquired.front();
-        delete[] tempBuffer;
-        CPUBuffersAcquired.pop_front();
-      }
+      this->ReleaseBuffers();
+    }
+  }
+  if (this->UseCPUWorker)
+  {
+    if (this->Scheduler->CreateCPUWorker(this->CPUWorkerMemory, this->NumberOfCPUWorkerThreads))
+    {
+      vtkErrorMacro("Could not allocate sufficient CPU worker buffers, the pool must hold at least 8 volume buffers.");
+      Scheduler->Clear();
+      this->ReleaseBuffers();
     }
   }
+  for (size_t i = 0; i < this->SimulatedDevices.size(); i++)
+  {
+    vtkIdType simulatedVolumeSize = this->SimulatedVolumeSize ? this->SimulatedVolumeSize : (vtkIdType) this->VolumeSize;
+    if (this->Scheduler->CreateSimulatedWorker(-2 - (int) i, this->SimulatedDevices[i], simulatedVolumeSize))
+    {
+      vtkErrorMacro("Simulated device " << i << " holds too few buffers.");
+      Scheduler->Clear();
+      this->ReleaseBuffers();
+    }
+  }
+  if (this->Scheduler->Workers.empty())
+  {
+    vtkErrorMacro("No GPU, CPU or simulated workers available to run the algorithm.");
+    return -1;
+  }
 
   //if verbose, print progress
   if (this->Debug)
@@ -238,6 +297,10 @@ int vtkCudaHierarchicalMaxFlowSegmentation2::RunAlgorithm()
   {
     vtkDebugMacro("Running tasks");
   }
+  if (Scheduler->Workers.empty())
+  {
+    return -1;
+  }
   int NumTasksDone = 0;
   while (Scheduler->CanRunAlgorithmIteration())
   {
@@ -252,13 +315,23 @@ int vtkCudaHierarchicalMaxFlowSegmentation2::RunAlgorithm()
       vtkDebugMacro("Finished " << NumTasksDone << " with " << Scheduler->NumMemCpies << " memory transfers.");
     }
   }
-  Scheduler->ReturnLeaves();
+  if (this->KeepFullSolution)
+  {
+    Scheduler->ReturnAll();
+  }
+  else
+  {
+    Scheduler->ReturnLeaves();
+  }
 
   if (this->Debug)
   {
     vtkDebugMacro("Finished all " << NumTasksDone << " tasks with a total of " << Scheduler->NumMemCpies << " memory transfers.");
   }
   assert(Scheduler->BlockedTasks.size() == 0);
+  this->NumberOfMemoryTransfers = Scheduler->NumMemCpies;
+  this->NumberOfKernelRuns = Scheduler->NumKernelRuns;
+  Scheduler->GetSimulatedTimes(&this->SimulatedTime, &this->SimulatedIdleTime);
 
   Scheduler->Clear();
 
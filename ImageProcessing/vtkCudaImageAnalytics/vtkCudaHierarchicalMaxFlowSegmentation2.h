@@ -36,9 +36,13 @@ DEALINGS IN THE SOFTWARE.
 
 #include "vtkCudaImageAnalyticsExport.h"
 
+#include "vtkCudaMaxFlowSegmentationSimulatedWorker.h"
+
 #include "vtkHierarchicalMaxFlowSegmentation.h"
+#include <limits.h>
 #include <map>
 #include <set>
+#include <vector>
 
 class CudaObject;
 class vtkCudaMaxFlowSegmentationScheduler;
@@ -53,7 +57,8 @@ public:
 
   // Description:
   // Insert, remove, and verify a given GPU into the set of GPUs usable by the algorithm. This
-  // set defaults to {GPU0} and must be non-empty when the update is invoked.
+  // set defaults to {GPU0} and must be non-empty when the update is invoked, unless the CPU
+  // worker is used.
   void AddDevice(int GPU);
   void RemoveDevice(int GPU);
   bool HasDevice(int GPU);
@@ -81,6 +86,50 @@ public:
   double GetMaxGPUUsage(int device);
   void ClearMaxGPUUsage();
 
+  // Description:
+  // Get and Set whether a CPU worker runs tasks alongside the GPUs. It keeps a pool of at most
+  // CPUWorkerMemory bytes of buffers (0, the default, for enough to hold every buffer) which the
+  // scheduler treats as device memory, and runs the kernels on NumberOfCPUWorkerThreads threads
+  // (0, the default, for the VTK default). With the set of GPUs cleared, the algorithm runs on
+  // the CPU alone. (Default is off.)
+  vtkSetClampMacro(UseCPUWorker,int,0,1);
+  vtkGetMacro(UseCPUWorker,int);
+  vtkBooleanMacro(UseCPUWorker,int);
+  vtkSetClampMacro(CPUWorkerMemory,vtkIdType,0,VTK_ID_MAX);
+  vtkGetMacro(CPUWorkerMemory,vtkIdType);
+  vtkSetClampMacro(NumberOfCPUWorkerThreads,int,0,INT_MAX);
+  vtkGetMacro(NumberOfCPUWorkerThreads,int);
+
+  // Description:
+  // Add and Clear simulated devices, which model a GPU holding numBuffers buffers, transferring
+  // bandwidth bytes per second and running each kernel at kernelRate voxels per second, without
+  // running anything. They cannot be mixed with GPUs or the CPU worker: with those cleared, an
+  // update gives the transfers, kernel launches and timings the modelled devices would see, but
+  // no segmentation.
+  void AddSimulatedDevice(int numBuffers, double bandwidth, double kernelRate);
+  void ClearSimulatedDevices();
+
+  // Description:
+  // Get and Set the number of voxels the simulated devices model in each buffer, so that a small
+  // input can stand in for a large volume. (Default is 0, for the size of the input.)
+  vtkSetClampMacro(SimulatedVolumeSize,vtkIdType,0,VTK_ID_MAX);
+  vtkGetMacro(SimulatedVolumeSize,vtkIdType);
+
+  // Description:
+  // Get the number of memory transfers and kernel launches made by the last update and, with
+  // simulated devices, its simulated running time and the time the devices spent idle (in seconds).
+  vtkGetMacro(NumberOfMemoryTransfers,int);
+  vtkGetMacro(NumberOfKernelRuns,int);
+  vtkGetMacro(SimulatedTime,double);
+  vtkGetMacro(SimulatedIdleTime,double);
+
+  // Description:
+  // Get and Set a file to which the scheduler writes one line per task it runs, giving the
+  // task, the worker chosen, its weight and the memory transfers and kernel runs it cost, in
+  // order to compare scheduling policies. (Default is none.)
+  vtkSetStringMacro(SchedulingTraceFileName);
+  vtkGetStringMacro(SchedulingTraceFileName);
+
   // Description:
   // Get and Set how often the algorithm should report if in Debug mode. If set
   // to 0, the algorithm doesn't report task completions. Default is 100 tasks.
@@ -99,9 +148,27 @@ protected:
   std::map<int, double>  MaxGPUUsageNonDefault;
   int            ReportRate;
 
+  int            UseCPUWorker;
+  vtkIdType      CPUWorkerMemory;
+  int            NumberOfCPUWorkerThreads;
+  char*          SchedulingTraceFileName;
+
+  std::vector<vtkCudaMaxFlowSimulatedDevice> SimulatedDevices;
+  vtkIdType      SimulatedVolumeSize;
+  int            NumberOfMemoryTransfers;
+  int            NumberOfKernelRuns;
+  double         SimulatedTime;
+  double         SimulatedIdleTime;
+
   virtual int InitializeAlgorithm();
   virtual int RunAlgorithm();
 
+  //the GPU solver keeps float flows
+  virtual int SupportsCompactFlowStorage()
+  {
+    return 0;
+  }
+
   void FigureOutBufferPriorities(vtkIdType currNode);
   void PropogateLabels(vtkIdType currNode);
   void SolveMaxFlow(vtkIdType currNode, int* timeStep);
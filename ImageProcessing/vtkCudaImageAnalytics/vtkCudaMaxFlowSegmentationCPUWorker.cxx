@@ -0,0 +1,544 @@
+/*=========================================================================
+
+Robarts Visualization Toolkit
+
+Copyright (c) 2016 Virtual Augmentation and Simulation for Surgery and Therapy, Robarts Research Institute
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files (the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+
+=========================================================================*/
+
+/** @file vtkCudaMaxFlowSegmentationCPUWorker.cxx
+ *
+ *  @brief Implementation file with class that runs the GHMF tasks on the CPU, standing in for a GPU.
+ *
+ *  @note This is not a front-end class. Header details are in vtkCudaMaxFlowSegmentationCPUWorker.h
+ *
+ */
+
+#include "vtkConditionVariable.h"
+#include "vtkCudaMaxFlowSegmentationCPUWorker.h"
+#include "vtkCudaMaxFlowSegmentationScheduler.h"
+#include "vtkCudaMaxFlowSegmentationTask.h"
+#include "vtkMaxFlowSegmentationUtilities.h"
+#include "vtkMultiThreader.h"
+#include "vtkMutexLock.h"
+#include <math.h>
+#include <string.h>
+
+//-----------------------------------------------------------------
+// Reusable barrier which releases the threads once all of them have entered.
+class vtkCudaMaxFlowSegmentationCPUWorkerBarrier
+{
+public:
+  vtkCudaMaxFlowSegmentationCPUWorkerBarrier(int numThreads)
+  {
+    this->NumThreads = numThreads;
+    this->NumEntered = 0;
+    this->Generation = 0;
+    this->Lock = vtkMutexLock::New();
+    this->Condition = vtkConditionVariable::New();
+  }
+  ~vtkCudaMaxFlowSegmentationCPUWorkerBarrier()
+  {
+    this->Condition->Delete();
+    this->Lock->Delete();
+  }
+  void Enter()
+  {
+    this->Lock->Lock();
+    int generation = this->Generation;
+    this->NumEntered++;
+    if( this->NumEntered == this->NumThreads )
+    {
+      this->NumEntered = 0;
+      this->Generation++;
+      this->Condition->Broadcast();
+    }
+    else
+    {
+      while( generation == this->Generation )
+      {
+        this->Condition->Wait(this->Lock);
+      }
+    }
+    this->Lock->Unlock();
+  }
+
+private:
+  int NumThreads;
+  int NumEntered;
+  int Generation;
+  vtkMutexLock* Lock;
+  vtkConditionVariable* Condition;
+};
+
+//-----------------------------------------------------------------
+// CPU versions of the kernels in CUDA_hierarchicalmaxflow.cu, restricted to the voxels [start,end).
+// Neighbours outside of the volume are not read, rather than read from the padding as on the GPU.
+namespace
+{
+  void ZeroOutBuffer(float* buffer, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      buffer[idx] = 0.0f;
+    }
+  }
+
+  void SetBufferToValue(float* buffer, float value, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      buffer[idx] = value;
+    }
+  }
+
+  void MultiplyAndStoreBuffer(float* inBuffer, float* outBuffer, float number, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      outBuffer[idx] = inBuffer[idx] * number;
+    }
+  }
+
+  void FindSinkPotentialAndStore(float* workingBuffer, float* incBuffer, float* divBuffer, float* labelBuffer, float iCC, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      workingBuffer[idx] = workingBuffer[idx] + incBuffer[idx] - divBuffer[idx] + labelBuffer[idx] * iCC;
+    }
+  }
+
+  void FindSourcePotentialAndStore(float* workingBuffer, float* sinkBuffer, float* divBuffer, float* labelBuffer, float iCC, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      workingBuffer[idx] = workingBuffer[idx] + sinkBuffer[idx] + divBuffer[idx] - labelBuffer[idx] * iCC;
+    }
+  }
+
+  void FindLeafSinkPotential(float* sinkBuffer, float* incBuffer, float* divBuffer, float* labelBuffer, float iCC, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      sinkBuffer[idx] = incBuffer[idx] - divBuffer[idx] + labelBuffer[idx] * iCC;
+    }
+  }
+
+  void ApplyCapacity(float* sinkBuffer, float* capBuffer, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      float value = sinkBuffer[idx];
+      value = (value < 0.0f) ? 0.0f: value;
+      value = (value > capBuffer[idx]) ? capBuffer[idx]: value;
+      sinkBuffer[idx] = value;
+    }
+  }
+
+  void UpdateLabel(float* sinkBuffer, float* incBuffer, float* divBuffer, float* labelBuffer, float CC, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      float value = labelBuffer[idx] + CC*(incBuffer[idx] - divBuffer[idx] - sinkBuffer[idx]);
+      value = (value < 0.0f) ? 0.0f : value;
+      value = (value > 1.0f) ? 1.0f : value;
+      labelBuffer[idx] = value;
+    }
+  }
+
+  void CalcGradStep(float* sinkBuffer, float* incBuffer, float* divBuffer, float* labelBuffer, float stepSize, float iCC, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      divBuffer[idx] = stepSize*(sinkBuffer[idx] + divBuffer[idx] - incBuffer[idx] - labelBuffer[idx] * iCC);
+    }
+  }
+
+  void DescentSpatialFlow(float* allowed, float* flowX, float* flowY, float* flowZ, int VX, int VY, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      int x = idx % VX;
+      int y = (idx / VX) % VY;
+      int z = idx / (VX*VY);
+      float currAllowed = allowed[idx];
+      flowX[idx] = x ? flowX[idx] - (currAllowed - allowed[idx-1]) : 0.0f;
+      flowY[idx] = y ? flowY[idx] - (currAllowed - allowed[idx-VX]) : 0.0f;
+      flowZ[idx] = z ? flowZ[idx] - (currAllowed - allowed[idx-VX*VY]) : 0.0f;
+    }
+  }
+
+  void ComputeFlowMag(float* amount, float* flowX, float* flowY, float* flowZ, float* smooth, float alpha, int VX, int VY, int size, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      int x = idx % VX;
+      int y = (idx / VX) % VY;
+      float FlowMag = flowX[idx]*flowX[idx] + ((x != VX-1) ? flowX[idx+1]*flowX[idx+1] : 0.0f);
+      FlowMag += flowY[idx]*flowY[idx] + ((y != VY-1) ? flowY[idx+VX]*flowY[idx+VX] : 0.0f);
+      FlowMag += flowZ[idx]*flowZ[idx] + ((idx+VX*VY < size) ? flowZ[idx+VX*VY]*flowZ[idx+VX*VY] : 0.0f);
+      FlowMag = sqrtf( 0.5f * FlowMag );
+      float smoothness = smooth ? alpha * smooth[idx] : alpha;
+      amount[idx] = (FlowMag > smoothness) ? smoothness / FlowMag : 1.0f;
+    }
+  }
+
+  void Project(float* div, float* flowX, float* flowY, float* flowZ, int VX, int VY, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      int x = idx % VX;
+      int y = (idx / VX) % VY;
+      int z = idx / (VX*VY);
+      float currAllowed = div[idx];
+      flowX[idx] = x ? flowX[idx] * 0.5f * (currAllowed + div[idx-1]) : 0.0f;
+      flowY[idx] = y ? flowY[idx] * 0.5f * (currAllowed + div[idx-VX]) : 0.0f;
+      flowZ[idx] = z ? flowZ[idx] * 0.5f * (currAllowed + div[idx-VX*VY]) : 0.0f;
+    }
+  }
+
+  void Divergence(float* div, float* flowX, float* flowY, float* flowZ, int VX, int VY, int size, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      int x = idx % VX;
+      int y = (idx / VX) % VY;
+      float divergence = flowX[idx]+flowY[idx]+flowZ[idx];
+      divergence -= (x != VX-1) ? flowX[idx+1] : 0.0f;
+      divergence -= (y != VY-1) ? flowY[idx+VX] : 0.0f;
+      divergence -= (idx < size-VX*VY) ? flowZ[idx+VX*VY] : 0.0f;
+      div[idx] = divergence;
+    }
+  }
+
+  void CopyBuffer(float* dst, float* src, int start, int end)
+  {
+    if( dst == src )
+    {
+      return;
+    }
+    for(int idx = start; idx < end; idx++)
+    {
+      dst[idx] = src[idx];
+    }
+  }
+
+  void MinBuffers(float* b1, float* b2, int start, int end)
+  {
+    if( b1 == b2 )
+    {
+      return;
+    }
+    for(int idx = start; idx < end; idx++)
+    {
+      b1[idx] = (b1[idx] < b2[idx]) ? b1[idx] : b2[idx];
+    }
+  }
+
+  void Lbl(float* lbl, float* flo, float* cap, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      lbl[idx] = (flo[idx] == cap[idx]) ? 1.0f : 0.0f;
+    }
+  }
+
+  void SumScaledBuffers(float* dst, float* src, float scale, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      dst[idx] = dst[idx] + scale * src[idx];
+    }
+  }
+
+  void SumBuffers(float* dst, float* src, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      dst[idx] = dst[idx] + src[idx];
+    }
+  }
+
+  void DivideBuffers(float* dst, float* src, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      dst[idx] = dst[idx] / src[idx];
+    }
+  }
+
+  void TranslateBuffer(float* buffer, float shift, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      buffer[idx] = buffer[idx] + shift;
+    }
+  }
+
+  void ResetSinkBuffer(float* sink, float* source, float* div, float* label, float ik, float iCC, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      sink[idx] = (1.0f-ik)*sink[idx] + ik*(source[idx] - div[idx] + label[idx] * iCC);
+    }
+  }
+
+  void PushUpSourceFlows(float* psink, float* sink, float* source, float* div, float* label, float w, float iCC, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      psink[idx] = psink[idx] + w*(sink[idx] - source[idx] + div[idx] - label[idx] * iCC);
+    }
+  }
+
+  void Copy2Buffers(float* fIn, float* fOut1, float* fOut2, int start, int end)
+  {
+    for(int idx = start; idx < end; idx++)
+    {
+      fOut1[idx] = fIn[idx];
+      fOut2[idx] = fIn[idx];
+    }
+  }
+
+  struct vtkCudaMaxFlowSegmentationCPUWorkerThreadStruct
+  {
+    vtkCudaMaxFlowSegmentationCPUWorker* Worker;
+    vtkCudaMaxFlowSegmentationTask* Task;
+    vtkCudaMaxFlowSegmentationCPUWorkerBarrier* Barrier;
+    int VolumeSize;
+  };
+
+  VTK_THREAD_RETURN_TYPE vtkCudaMaxFlowSegmentationCPUWorkerThreadedExecute(void* arg)
+  {
+    int threadId = static_cast<vtkMultiThreader::ThreadInfo*>(arg)->ThreadID;
+    int threadCount = static_cast<vtkMultiThreader::ThreadInfo*>(arg)->NumberOfThreads;
+    vtkCudaMaxFlowSegmentationCPUWorkerThreadStruct* str = static_cast<vtkCudaMaxFlowSegmentationCPUWorkerThreadStruct*>
+        (static_cast<vtkMultiThreader::ThreadInfo*>(arg)->UserData);
+
+    //contiguous share of the voxels for this thread
+    int start = (int)(((vtkIdType) str->VolumeSize * threadId) / threadCount);
+    int end = (int)(((vtkIdType) str->VolumeSize * (threadId + 1)) / threadCount);
+    str->Worker->RunKernelsOnRange(str->Task, start, end, str->Barrier);
+    return VTK_THREAD_RETURN_VALUE;
+  }
+}
+
+//-----------------------------------------------------------------
+vtkCudaMaxFlowSegmentationCPUWorker::vtkCudaMaxFlowSegmentationCPUWorker(vtkIdType memory, int numThreads, vtkCudaMaxFlowSegmentationScheduler* p)
+  : vtkCudaMaxFlowSegmentationWorker(-1, p)
+{
+  this->Threader = vtkMultiThreader::New();
+  if( numThreads > 0 )
+  {
+    this->Threader->SetNumberOfThreads(numThreads);
+  }
+
+  //size the pool, keeping each buffer aligned
+  size_t stride = alignedBufferStride(Parent->VolumeSize);
+  int BuffersWanted = Parent->TotalNumberOfBuffers;
+  if( memory > 0 && (vtkIdType)(memory / (sizeof(float) * stride)) < (vtkIdType) BuffersWanted )
+  {
+    BuffersWanted = (int)(memory / (sizeof(float) * stride));
+  }
+  this->BufferPool = (BuffersWanted > 0) ? allocateAlignedBuffer(stride * BuffersWanted) : 0;
+  if( !this->BufferPool )
+  {
+    //no buffers, either the memory holds less than one or the allocation failed
+    //CreateCPUWorker reports it as a creation failure
+    NumBuffers = 0;
+    return;
+  }
+
+  //load the buffers into the list of unused buffers
+  for( int i = 0; i < BuffersWanted; i++ )
+  {
+    UnusedGPUBuffers.push_back(this->BufferPool + stride * i);
+  }
+  NumBuffers = BuffersWanted;
+}
+
+//-----------------------------------------------------------------
+vtkCudaMaxFlowSegmentationCPUWorker::~vtkCudaMaxFlowSegmentationCPUWorker()
+{
+  ReturnLeafLabels();
+  if( this->BufferPool )
+  {
+    freeAlignedBuffer(this->BufferPool);
+  }
+  this->Threader->Delete();
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationCPUWorker::ReserveDevice()
+{
+  //the kernels and copies are finished when they return, nothing to reserve
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationCPUWorker::SyncDevice()
+{
+  //the kernels and copies are finished when they return, nothing to wait for
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationCPUWorker::CopyBufferToHost(float* GPUBuffer, float* CPUBuffer)
+{
+  memcpy(CPUBuffer, GPUBuffer, sizeof(float) * Parent->VolumeSize);
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationCPUWorker::CopyBufferToDevice(float* GPUBuffer, float* CPUBuffer)
+{
+  memcpy(GPUBuffer, CPUBuffer, sizeof(float) * Parent->VolumeSize);
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationCPUWorker::RunKernels(vtkCudaMaxFlowSegmentationTask* task)
+{
+  //no more threads than SingleMethodExecute will start, or the barrier never opens
+  int numThreads = this->Threader->GetNumberOfThreads();
+  int maxThreads = vtkMultiThreader::GetGlobalMaximumNumberOfThreads();
+  if( maxThreads > 0 && numThreads > maxThreads )
+  {
+    numThreads = maxThreads;
+    this->Threader->SetNumberOfThreads(numThreads);
+  }
+  vtkCudaMaxFlowSegmentationCPUWorkerBarrier barrier(numThreads);
+  vtkCudaMaxFlowSegmentationCPUWorkerThreadStruct str;
+  str.Worker = this;
+  str.Task = task;
+  str.Barrier = &barrier;
+  str.VolumeSize = Parent->VolumeSize;
+  this->Threader->SetSingleMethod(vtkCudaMaxFlowSegmentationCPUWorkerThreadedExecute, &str);
+  this->Threader->SingleMethodExecute();
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationCPUWorker::RunKernelsOnRange(vtkCudaMaxFlowSegmentationTask* task, int start, int end, vtkCudaMaxFlowSegmentationCPUWorkerBarrier* barrier)
+{
+  std::vector<float*> b;
+  for(std::vector<float*>::iterator it = task->RequiredCPUBuffers.begin(); it != task->RequiredCPUBuffers.end(); it++)
+  {
+    b.push_back(CPU2GPUMap.find(*it)->second);
+  }
+  int VX = Parent->VX;
+  int VY = Parent->VY;
+  int size = Parent->VolumeSize;
+  float iCC = 1.0f / Parent->CC;
+
+  switch(task->Type)
+  {
+  case(vtkCudaMaxFlowSegmentationTask::ClearWorkingBufferTask):      //0 - Working
+    if( !task->isRoot )
+    {
+      ZeroOutBuffer(b[0], start, end);
+    }
+    else
+    {
+      SetBufferToValue(b[0], iCC, start, end);
+    }
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::UpdateSpatialFlowsTask):      //0 - Sink,    1 - Inc,  2 - Div,  3 - Label,  4 - FlowX,  5 - FlowY,  6 - FlowZ,  7 - Smoothness
+    CalcGradStep(b[0], b[1], b[2], b[3], Parent->StepSize, iCC, start, end);
+    barrier->Enter();
+    DescentSpatialFlow(b[2], b[4], b[5], b[6], VX, VY, start, end);
+    barrier->Enter();
+    ComputeFlowMag(b[2], b[4], b[5], b[6], b[7], task->constant1, VX, VY, size, start, end);
+    barrier->Enter();
+    Project(b[2], b[4], b[5], b[6], VX, VY, start, end);
+    barrier->Enter();
+    Divergence(b[2], b[4], b[5], b[6], VX, VY, size, start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::ApplySinkPotentialLeafTask):    //0 - Sink,    1 - Inc,  2 - Div,  3 - Label,  4 - Data
+    FindLeafSinkPotential(b[0], b[1], b[2], b[3], iCC, start, end);
+    ApplyCapacity(b[0], b[4], start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::ApplySinkPotentialBranchTask):    //0 - Working,  1 - Inc,  2 - Div,  3 - Label
+    FindSinkPotentialAndStore(b[0], b[1], b[2], b[3], iCC, start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::ApplySourcePotentialTask):      //0 - Working,  1 - Sink,  2 - Div,  3 - Label
+    FindSourcePotentialAndStore(b[0], b[1], b[2], b[3], iCC, start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::DivideOutWorkingBufferTask):    //0 - Working,  1 - Sink
+    MultiplyAndStoreBuffer(b[0], b[1], 1.0f / task->constant1, start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::UpdateLabelsTask):          //0 - Sink,    1 - Inc,  2 - Div,  3 - Label
+    UpdateLabel(b[0], b[1], b[2], b[3], Parent->CC, start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::ClearBufferInitially):        //0 - Any
+  case(vtkCudaMaxFlowSegmentationTask::ClearSourceBuffer):        //0 - Inc
+    ZeroOutBuffer(b[0], start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::InitializeLeafFlows):        //0 - Sink,    1 - Data
+    CopyBuffer(b[0], b[1], start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::MinimizeLeafFlows):        //0 - Sink1,  1 - Sink2
+    MinBuffers(b[0], b[1], start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::PropogateLeafFlows):        //0 - SinkMin,  1 - SinkElse
+    CopyBuffer(b[1], b[0], start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::InitializeLeafLabels):        //0 - Sink,    1 - Data,  2 - Label
+    Lbl(b[2], b[0], b[1], start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::AccumulateLabels):          //0 - Accum,  1 - Label
+    SumBuffers(b[0], b[1], start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::CorrectLabels):          //0 - Factor,  1 - Label
+    DivideBuffers(b[1], b[0], start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::AccumulateLabelsWeighted):      //0 - Accum,  1 - Label
+    SumScaledBuffers(b[0], b[1], task->constant1, start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::ResetSinkFlowRoot):        //0 - Sink
+    TranslateBuffer(b[0], task->constant1, start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::ResetSinkFlowBranch):        //0 - Sink,    1 - Inc,  2 - Div,  3 - Label
+    ResetSinkBuffer(b[0], b[1], b[2], b[3], task->constant1, iCC, start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::PushUpSourceFlows):        //0 - PSink,  1 - Sink,  2 - Inc,  3 - Div,  4 - Label
+    PushUpSourceFlows(b[0], b[1], b[2], b[3], b[4], task->constant1, iCC, start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::PushDownSinkFlows):        //0 - Sink,    1 - CInc
+    SumScaledBuffers(b[1], b[0], task->constant1, start, end);
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::PropogateLeafFlowsInc):      //0 - FlowIn,  1 - FlowO,  2 - FlowO
+    Copy2Buffers(b[0], b[1], b[2], start, end);
+    break;
+
+  default:
+    break;
+  }
+}
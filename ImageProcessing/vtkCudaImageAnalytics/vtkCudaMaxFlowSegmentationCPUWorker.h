@@ -0,0 +1,70 @@
+/*=========================================================================
+
+Robarts Visualization Toolkit
+
+Copyright (c) 2016 Virtual Augmentation and Simulation for Surgery and Therapy, Robarts Research Institute
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files (the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+
+=========================================================================*/
+
+/** @file vtkCudaMaxFlowSegmentationCPUWorker.h
+ *
+ *  @brief Header file with class that runs the GHMF tasks on the CPU, standing in for a GPU.
+ *
+ *  @note The worker keeps a bounded pool of buffers which plays the part of device memory, so
+ *      the scheduler moves buffers in and out of it exactly as it does for a GPU. The task kernels
+ *      are CPU versions of the CUDA kernels, split over the voxels of the volume on a number of
+ *      threads. This lets the scheduler run on hosts without a GPU, or with CPU cores helping GPUs
+ *      on the same hierarchy.
+ *
+ *  @note This is not a front-end class.
+ *
+ */
+
+#ifndef __VTKCUDAMAXFLOWSEGMENTATIONCPUWORKER_H__
+#define __VTKCUDAMAXFLOWSEGMENTATIONCPUWORKER_H__
+
+#include "vtkCudaImageAnalyticsExport.h"
+
+#include "vtkCudaMaxFlowSegmentationWorker.h"
+#include "vtkType.h"
+
+class vtkCudaMaxFlowSegmentationCPUWorkerBarrier;
+class vtkMultiThreader;
+
+class vtkCudaImageAnalyticsExport vtkCudaMaxFlowSegmentationCPUWorker : public vtkCudaMaxFlowSegmentationWorker
+{
+public:
+  //memory is the size of the buffer pool in bytes (0 for enough to hold every buffer) and
+  //numThreads the number of threads running the kernels (0 for the VTK default)
+  vtkCudaMaxFlowSegmentationCPUWorker(vtkIdType memory, int numThreads, vtkCudaMaxFlowSegmentationScheduler* p);
+  ~vtkCudaMaxFlowSegmentationCPUWorker();
+
+  virtual void ReserveDevice();
+  virtual void SyncDevice();
+  virtual void CopyBufferToHost(float* GPUBuffer, float* CPUBuffer);
+  virtual void CopyBufferToDevice(float* GPUBuffer, float* CPUBuffer);
+  virtual void RunKernels(vtkCudaMaxFlowSegmentationTask* task);
+
+  //run the kernels of a task over the voxels [start,end), entering the barrier between
+  //kernels which read neighbouring voxels
+  void RunKernelsOnRange(vtkCudaMaxFlowSegmentationTask* task, int start, int end, vtkCudaMaxFlowSegmentationCPUWorkerBarrier* barrier);
+
+protected:
+  float* BufferPool;
+  vtkMultiThreader* Threader;
+};
+
+#endif
@@ -0,0 +1,237 @@
+/*=========================================================================
+
+Robarts Visualization Toolkit
+
+Copyright (c) 2016 Virtual Augmentation and Simulation for Surgery and Therapy, Robarts Research Institute
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files (the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+
+=========================================================================*/
+
+/** @file vtkCudaMaxFlowSegmentationGPUWorker.cxx
+ *
+ *  @brief Implementation file with class that runs the GHMF tasks on an individual GPU.
+ *
+ *  @author John Stuart Haberl Baxter (Dr. Peters' Lab (VASST) at Robarts Research Institute)
+ *
+ *  @note August 27th 2013 - Documentation first compiled.
+ *
+ *  @note This is not a front-end class. Header details are in vtkCudaMaxFlowSegmentationGPUWorker.h
+ *
+ */
+
+#include "CUDA_hierarchicalmaxflow.h"
+#include "CudaObject.h"
+#include "vtkCudaMaxFlowSegmentationGPUWorker.h"
+#include "vtkCudaMaxFlowSegmentationScheduler.h"
+#include "vtkCudaMaxFlowSegmentationTask.h"
+
+//-----------------------------------------------------------------
+vtkCudaMaxFlowSegmentationGPUWorker::vtkCudaMaxFlowSegmentationGPUWorker(int g, double usage, vtkCudaMaxFlowSegmentationScheduler* p)
+  : vtkCudaMaxFlowSegmentationWorker(g, p)
+  , CudaObject(g)
+{
+  //Get GPU buffers
+  int BuffersAcquired = 0;
+  double PercentAcquired = 0.0;
+  while (true)
+  {
+    //try acquiring some new buffers
+    float* NewAcquiredBuffers = 0;
+    int NewNumberAcquired = 0;
+    int Pad = Parent->VX * Parent->VY;
+    double NewPercentAcquired = 0;
+    CUDA_GetGPUBuffers(Parent->TotalNumberOfBuffers - BuffersAcquired, usage - PercentAcquired, &NewAcquiredBuffers,
+                       Pad, Parent->VolumeSize, &NewNumberAcquired, &NewPercentAcquired);
+    BuffersAcquired += NewNumberAcquired;
+    PercentAcquired += NewPercentAcquired;
+
+    //if no new buffers were acquired, exit the loop
+    if (NewNumberAcquired == 0)
+    {
+      break;
+    }
+
+    //else, load the new buffers into the list of unused buffers
+    AllGPUBufferBlocks.push_back(NewAcquiredBuffers);
+    NewAcquiredBuffers += Pad;
+    for (int i = 0; i < NewNumberAcquired; i++)
+    {
+      UnusedGPUBuffers.push_back(NewAcquiredBuffers);
+      NewAcquiredBuffers += Parent->VolumeSize;
+    }
+  }
+  NumBuffers = BuffersAcquired;
+}
+
+//-----------------------------------------------------------------
+vtkCudaMaxFlowSegmentationGPUWorker::~vtkCudaMaxFlowSegmentationGPUWorker()
+{
+  this->CallSyncThreads();
+
+  //Return all GPU buffers
+  ReturnLeafLabels();
+  while (AllGPUBufferBlocks.size() > 0)
+  {
+    CUDA_ReturnGPUBuffers(AllGPUBufferBlocks.front());
+    AllGPUBufferBlocks.pop_front();
+  }
+  AllGPUBufferBlocks.clear();
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationGPUWorker::ReserveDevice()
+{
+  this->ReserveGPU();
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationGPUWorker::SyncDevice()
+{
+  this->CallSyncThreads();
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationGPUWorker::CopyBufferToHost(float* GPUBuffer, float* CPUBuffer)
+{
+  CUDA_CopyBufferToCPU(GPUBuffer, CPUBuffer, Parent->VolumeSize, GetStream());
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationGPUWorker::CopyBufferToDevice(float* GPUBuffer, float* CPUBuffer)
+{
+  CUDA_CopyBufferToGPU(GPUBuffer, CPUBuffer, Parent->VolumeSize, GetStream());
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationGPUWorker::RunKernels(vtkCudaMaxFlowSegmentationTask* task)
+{
+  float smoothnessConstant = task->constant1;
+  switch(task->Type)
+  {
+  case(vtkCudaMaxFlowSegmentationTask::ClearWorkingBufferTask):      //0 - Working
+    if( !task->isRoot )
+    {
+      CUDA_zeroOutBuffer(CPU2GPUMap[task->RequiredCPUBuffers[0]], Parent->VolumeSize, GetStream());
+    }
+    else
+    {
+      CUDA_SetBufferToValue(CPU2GPUMap[task->RequiredCPUBuffers[0]], 1.0f/Parent->CC, Parent->VolumeSize, GetStream());
+    }
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::UpdateSpatialFlowsTask):      //0 - Sink,    1 - Inc,  2 - Div,  3 - Label,  4 - FlowX,  5 - FlowY,  6 - FlowZ,  7 - Smoothness
+    CUDA_flowGradientStep(CPU2GPUMap[task->RequiredCPUBuffers[0]], CPU2GPUMap[task->RequiredCPUBuffers[1]],
+                          CPU2GPUMap[task->RequiredCPUBuffers[2]], CPU2GPUMap[task->RequiredCPUBuffers[3]], Parent->StepSize, Parent->CC,
+                          Parent->VolumeSize, GetStream() );
+    CUDA_applyStep(CPU2GPUMap[task->RequiredCPUBuffers[2]], CPU2GPUMap[task->RequiredCPUBuffers[4]],
+                   CPU2GPUMap[task->RequiredCPUBuffers[5]], CPU2GPUMap[task->RequiredCPUBuffers[6]], Parent->VX, Parent->VY, Parent->VZ, Parent->VolumeSize, GetStream() );
+    CUDA_computeFlowMag(CPU2GPUMap[task->RequiredCPUBuffers[2]], CPU2GPUMap[task->RequiredCPUBuffers[4]],
+                        CPU2GPUMap[task->RequiredCPUBuffers[5]], CPU2GPUMap[task->RequiredCPUBuffers[6]],
+                        CPU2GPUMap[task->RequiredCPUBuffers[7]], smoothnessConstant, Parent->VX, Parent->VY, Parent->VZ, Parent->VolumeSize, GetStream() );
+    CUDA_projectOntoSet(CPU2GPUMap[task->RequiredCPUBuffers[2]], CPU2GPUMap[task->RequiredCPUBuffers[4]],
+                        CPU2GPUMap[task->RequiredCPUBuffers[5]], CPU2GPUMap[task->RequiredCPUBuffers[6]], Parent->VX, Parent->VY, Parent->VZ, Parent->VolumeSize, GetStream() );
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::ApplySinkPotentialLeafTask):    //0 - Sink,    1 - Inc,  2 - Div,  3 - Label,  4 - Data
+    CUDA_updateLeafSinkFlow(CPU2GPUMap[task->RequiredCPUBuffers[0]],CPU2GPUMap[task->RequiredCPUBuffers[1]],
+                            CPU2GPUMap[task->RequiredCPUBuffers[2]],CPU2GPUMap[task->RequiredCPUBuffers[3]],Parent->CC, Parent->VolumeSize, GetStream());
+    CUDA_constrainLeafSinkFlow(CPU2GPUMap[task->RequiredCPUBuffers[0]],CPU2GPUMap[task->RequiredCPUBuffers[4]], Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::ApplySinkPotentialBranchTask):    //0 - Working,  1 - Inc,  2 - Div,  3 - Label
+    CUDA_storeSinkFlowInBuffer(CPU2GPUMap[task->RequiredCPUBuffers[0]],CPU2GPUMap[task->RequiredCPUBuffers[1]],
+                               CPU2GPUMap[task->RequiredCPUBuffers[2]],CPU2GPUMap[task->RequiredCPUBuffers[3]], Parent->CC, Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::ApplySourcePotentialTask):      //0 - Working,  1 - Sink,  2 - Div,  3 - Label
+    CUDA_storeSourceFlowInBuffer(CPU2GPUMap[task->RequiredCPUBuffers[0]],CPU2GPUMap[task->RequiredCPUBuffers[1]],
+                                 CPU2GPUMap[task->RequiredCPUBuffers[2]],CPU2GPUMap[task->RequiredCPUBuffers[3]], Parent->CC, Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::DivideOutWorkingBufferTask):    //0 - Working,  1 - Sink
+    CUDA_divideAndStoreBuffer(CPU2GPUMap[task->RequiredCPUBuffers[0]],CPU2GPUMap[task->RequiredCPUBuffers[1]],
+                              task->constant1,  Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::UpdateLabelsTask):          //0 - Sink,    1 - Inc,  2 - Div,  3 - Label
+    CUDA_updateLabel(CPU2GPUMap[task->RequiredCPUBuffers[0]],CPU2GPUMap[task->RequiredCPUBuffers[1]], CPU2GPUMap[task->RequiredCPUBuffers[2]],
+                     CPU2GPUMap[task->RequiredCPUBuffers[3]], Parent->CC, Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::ClearBufferInitially):        //0 - Any
+    CUDA_zeroOutBuffer(CPU2GPUMap[task->RequiredCPUBuffers[0]], Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::InitializeLeafFlows):        //0 - Sink,    1 - Data
+    CUDA_CopyBuffer(CPU2GPUMap[task->RequiredCPUBuffers[0]], CPU2GPUMap[task->RequiredCPUBuffers[1]], Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::MinimizeLeafFlows):        //0 - Sink1,  1 - Sink2
+    CUDA_MinBuffer(CPU2GPUMap[task->RequiredCPUBuffers[0]], CPU2GPUMap[task->RequiredCPUBuffers[1]], Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::PropogateLeafFlows):        //0 - SinkMin,  1 - SinkElse
+    CUDA_CopyBuffer(CPU2GPUMap[task->RequiredCPUBuffers[1]], CPU2GPUMap[task->RequiredCPUBuffers[0]], Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::InitializeLeafLabels):        //0 - Sink,    1 - Data,  2 - Label
+    CUDA_LblBuffer(CPU2GPUMap[task->RequiredCPUBuffers[2]], CPU2GPUMap[task->RequiredCPUBuffers[0]], CPU2GPUMap[task->RequiredCPUBuffers[1]],
+                   Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::AccumulateLabels):          //0 - Accum,  1 - Label
+    CUDA_SumBuffer(CPU2GPUMap[task->RequiredCPUBuffers[0]], CPU2GPUMap[task->RequiredCPUBuffers[1]], Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::CorrectLabels):          //0 - Factor,  1 - Label
+    CUDA_DivBuffer(CPU2GPUMap[task->RequiredCPUBuffers[1]], CPU2GPUMap[task->RequiredCPUBuffers[0]], Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::AccumulateLabelsWeighted):      //0 - Accum,  1 - Label
+    CUDA_SumScaledBuffer(CPU2GPUMap[task->RequiredCPUBuffers[0]], CPU2GPUMap[task->RequiredCPUBuffers[1]], task->constant1, Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::ResetSinkFlowRoot):        //0 - Sink
+    CUDA_ShiftBuffer(CPU2GPUMap[task->RequiredCPUBuffers[0]], task->constant1, Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::ResetSinkFlowBranch):        //0 - Sink,    1 - Inc,  2 - Div,  3 - Label
+    CUDA_ResetSinkBuffer(CPU2GPUMap[task->RequiredCPUBuffers[0]], CPU2GPUMap[task->RequiredCPUBuffers[1]], CPU2GPUMap[task->RequiredCPUBuffers[2]],
+                         CPU2GPUMap[task->RequiredCPUBuffers[3]], task->constant1, 1.0/Parent->CC, Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::PushUpSourceFlows):        //0 - PSink,  1 - Sink,  2 - Inc,  3 - Div,  4 - Label
+    CUDA_PushUpSourceFlows(CPU2GPUMap[task->RequiredCPUBuffers[0]],CPU2GPUMap[task->RequiredCPUBuffers[1]],
+                           CPU2GPUMap[task->RequiredCPUBuffers[2]], CPU2GPUMap[task->RequiredCPUBuffers[3]],
+                           CPU2GPUMap[task->RequiredCPUBuffers[4]], task->constant1, 1.0/Parent->CC,Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::ClearSourceBuffer):        //0 - Inc
+    CUDA_zeroOutBuffer(CPU2GPUMap[task->RequiredCPUBuffers[0]], Parent->VolumeSize, GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::PushDownSinkFlows):        //0 - Sink,    1 - CInc
+    CUDA_SumScaledBuffer(CPU2GPUMap[task->RequiredCPUBuffers[1]],CPU2GPUMap[task->RequiredCPUBuffers[0]],task->constant1,Parent->VolumeSize,GetStream());
+    break;
+
+  case(vtkCudaMaxFlowSegmentationTask::PropogateLeafFlowsInc):      //0 - FlowIn,  1 - FlowO,  2 - FlowO
+    CUDA_Copy2Buffers(CPU2GPUMap[task->RequiredCPUBuffers[0]],CPU2GPUMap[task->RequiredCPUBuffers[1]],
+                      CPU2GPUMap[task->RequiredCPUBuffers[2]],Parent->VolumeSize,GetStream());
+    break;
+
+  default:
+    break;
+  }
+}
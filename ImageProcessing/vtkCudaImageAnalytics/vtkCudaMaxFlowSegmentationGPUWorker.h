@@ -0,0 +1,61 @@
+/*=========================================================================
+
+Robarts Visualization Toolkit
+
+Copyright (c) 2016 Virtual Augmentation and Simulation for Surgery and Therapy, Robarts Research Institute
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files (the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+
+=========================================================================*/
+
+/** @file vtkCudaMaxFlowSegmentationGPUWorker.h
+ *
+ *  @brief Header file with class that runs the GHMF tasks on an individual GPU.
+ *
+ *  @author John Stuart Haberl Baxter (Dr. Peters' Lab (VASST) at Robarts Research Institute)
+ *
+ *  @note August 27th 2013 - Documentation first compiled.
+ *
+ *  @note This is not a front-end class.
+ *
+ */
+
+#ifndef __VTKCUDAMAXFLOWSEGMENTATIONGPUWORKER_H__
+#define __VTKCUDAMAXFLOWSEGMENTATIONGPUWORKER_H__
+
+#include "vtkCudaImageAnalyticsExport.h"
+
+#include "CudaObject.h"
+#include "vtkCudaMaxFlowSegmentationWorker.h"
+
+class vtkCudaImageAnalyticsExport vtkCudaMaxFlowSegmentationGPUWorker : public vtkCudaMaxFlowSegmentationWorker, public CudaObject
+{
+public:
+  vtkCudaMaxFlowSegmentationGPUWorker(int g, double usage, vtkCudaMaxFlowSegmentationScheduler* p);
+  ~vtkCudaMaxFlowSegmentationGPUWorker();
+
+  virtual void ReserveDevice();
+  virtual void SyncDevice();
+  virtual void CopyBufferToHost(float* GPUBuffer, float* CPUBuffer);
+  virtual void CopyBufferToDevice(float* GPUBuffer, float* CPUBuffer);
+  virtual void RunKernels(vtkCudaMaxFlowSegmentationTask* task);
+
+  virtual void Reinitialize(bool withData = false) {};
+  virtual void Deinitialize(bool withData = false) {};
+
+protected:
+  std::list<float*> AllGPUBufferBlocks;
+};
+
+#endif
@@ -19,12 +19,24 @@ DEALINGS IN THE SOFTWARE.
 
 =========================================================================*/
 
+#include "vtkCudaMaxFlowSegmentationCPUWorker.h"
+#include "vtkCudaMaxFlowSegmentationGPUWorker.h"
 #include "vtkCudaMaxFlowSegmentationScheduler.h"
+#include "vtkCudaMaxFlowSegmentationSimulatedWorker.h"
 #include "vtkCudaMaxFlowSegmentationTask.h"
-#include "vtkCudaMaxFlowSegmentationWorker.h"
+#include <fstream>
+#include <limits.h>
+#include <vector>
+
+//----------------------------------------------------------------------------
+bool vtkCudaMaxFlowSegmentationWorkerCompare::operator()(const vtkCudaMaxFlowSegmentationWorker* a, const vtkCudaMaxFlowSegmentationWorker* b) const
+{
+  return a->GPU < b->GPU;
+}
 
 //----------------------------------------------------------------------------
 vtkCudaMaxFlowSegmentationScheduler::vtkCudaMaxFlowSegmentationScheduler()
+  : Trace(0)
 {
   Clear();
 }
@@ -42,8 +54,15 @@ void vtkCudaMaxFlowSegmentationScheduler::Clear()
   NumTasksGoingToHappen = 0;
   NumMemCpies = 0;
   NumKernelRuns = 0;
+  NumTasksCreated = 0;
+  NumDecisions = 0;
+  WarmStart = false;
+  SetTraceFile(0);
 
   //clear old lists
+  this->UnConflictedTasks.clear();
+  this->ConflictedTasks.clear();
+  this->BufferUsers.clear();
   this->CurrentTasks.clear();
   this->BlockedTasks.clear();
   this->CPUInUse.clear();
@@ -61,17 +80,30 @@ void vtkCudaMaxFlowSegmentationScheduler::Clear()
 
   //cleat tasks
   FinishedTasks.clear();
-  for (std::set<vtkCudaMaxFlowSegmentationWorker*>::iterator workerIterator = Workers.begin(); workerIterator != Workers.end(); workerIterator++)
+  for (vtkCudaMaxFlowSegmentationWorkerSet::iterator workerIterator = Workers.begin(); workerIterator != Workers.end(); workerIterator++)
   {
     delete *workerIterator;
   }
   Workers.clear();
+  BufferReadyTime.clear();
 }
 
 //----------------------------------------------------------------------------
 int vtkCudaMaxFlowSegmentationScheduler::CreateWorker(int GPU, double usage)
 {
-  vtkCudaMaxFlowSegmentationWorker* newWorker = new vtkCudaMaxFlowSegmentationWorker(GPU, usage, this);
+  vtkCudaMaxFlowSegmentationWorker* newWorker = new vtkCudaMaxFlowSegmentationGPUWorker(GPU, usage, this);
+  this->Workers.insert(newWorker);
+  if (newWorker->NumBuffers < 8)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+int vtkCudaMaxFlowSegmentationScheduler::CreateCPUWorker(vtkIdType memory, int numThreads)
+{
+  vtkCudaMaxFlowSegmentationWorker* newWorker = new vtkCudaMaxFlowSegmentationCPUWorker(memory, numThreads, this);
   this->Workers.insert(newWorker);
   if (newWorker->NumBuffers < 8)
   {
@@ -80,18 +112,64 @@ int vtkCudaMaxFlowSegmentationScheduler::CreateWorker(int GPU, double usage)
   return 0;
 }
 
+//----------------------------------------------------------------------------
+int vtkCudaMaxFlowSegmentationScheduler::CreateSimulatedWorker(int id, const vtkCudaMaxFlowSimulatedDevice& device, vtkIdType volumeSize)
+{
+  vtkCudaMaxFlowSegmentationWorker* newWorker = new vtkCudaMaxFlowSegmentationSimulatedWorker(id, device, volumeSize, this);
+  this->Workers.insert(newWorker);
+  if (newWorker->NumBuffers < 8)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationScheduler::GetSimulatedTimes(double* totalTime, double* idleTime)
+{
+  //the run takes as long as the slowest simulated worker, the others idling at the end
+  *totalTime = 0.0;
+  *idleTime = 0.0;
+  for (vtkCudaMaxFlowSegmentationWorkerSet::iterator workerIterator = Workers.begin(); workerIterator != Workers.end(); workerIterator++)
+  {
+    vtkCudaMaxFlowSegmentationSimulatedWorker* worker = dynamic_cast<vtkCudaMaxFlowSegmentationSimulatedWorker*>(*workerIterator);
+    if (worker && worker->Clock > *totalTime)
+    {
+      *totalTime = worker->Clock;
+    }
+  }
+  for (vtkCudaMaxFlowSegmentationWorkerSet::iterator workerIterator = Workers.begin(); workerIterator != Workers.end(); workerIterator++)
+  {
+    vtkCudaMaxFlowSegmentationSimulatedWorker* worker = dynamic_cast<vtkCudaMaxFlowSegmentationSimulatedWorker*>(*workerIterator);
+    if (worker)
+    {
+      *idleTime += worker->IdleTime + (*totalTime - worker->Clock);
+    }
+  }
+}
+
 //----------------------------------------------------------------------------
 void vtkCudaMaxFlowSegmentationScheduler::ReturnLeaves()
 {
   SyncWorkers();
-  for (std::set<vtkCudaMaxFlowSegmentationWorker*>::iterator workerIterator = Workers.begin(); workerIterator != Workers.end(); workerIterator++)
+  for (vtkCudaMaxFlowSegmentationWorkerSet::iterator workerIterator = Workers.begin(); workerIterator != Workers.end(); workerIterator++)
   {
     (*workerIterator)->ReturnLeafLabels();
   }
 }
 
 //----------------------------------------------------------------------------
-void vtkCudaMaxFlowSegmentationScheduler::ReturnBufferGPU2CPU(vtkCudaMaxFlowSegmentationWorker* caller, float* CPUBuffer, float* GPUBuffer, cudaStream_t* stream)
+void vtkCudaMaxFlowSegmentationScheduler::ReturnAll()
+{
+  SyncWorkers();
+  for (vtkCudaMaxFlowSegmentationWorkerSet::iterator workerIterator = Workers.begin(); workerIterator != Workers.end(); workerIterator++)
+  {
+    (*workerIterator)->ReturnAllBuffers();
+  }
+}
+
+//----------------------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationScheduler::ReturnBufferGPU2CPU(vtkCudaMaxFlowSegmentationWorker* caller, float* CPUBuffer, float* GPUBuffer)
 {
   if (!CPUBuffer)
   {
@@ -106,140 +184,208 @@ void vtkCudaMaxFlowSegmentationScheduler::ReturnBufferGPU2CPU(vtkCudaMaxFlowSegm
     return;
   }
   Overwritten[CPUBuffer] = 0;
-  caller->ReserveGPU();
+  caller->ReserveDevice();
   LastBufferUse[CPUBuffer] = caller;
   if (NoCopyBack.find(CPUBuffer) != NoCopyBack.end())
   {
     return;
   }
-  CUDA_CopyBufferToCPU(GPUBuffer, CPUBuffer, VolumeSize, stream);
+  caller->CopyBufferToHost(GPUBuffer, CPUBuffer);
   NumMemCpies++;
 }
 
 //----------------------------------------------------------------------------
-void vtkCudaMaxFlowSegmentationScheduler::MoveBufferCPU2GPU(vtkCudaMaxFlowSegmentationWorker* caller, float* CPUBuffer, float* GPUBuffer, cudaStream_t* stream)
+void vtkCudaMaxFlowSegmentationScheduler::MoveBufferCPU2GPU(vtkCudaMaxFlowSegmentationWorker* caller, float* CPUBuffer, float* GPUBuffer)
 {
   if (!CPUBuffer)
   {
     return;
   }
-  caller->ReserveGPU();
+  caller->ReserveDevice();
   if (LastBufferUse[CPUBuffer])
   {
-    LastBufferUse[CPUBuffer]->CallSyncThreads();
+    LastBufferUse[CPUBuffer]->SyncDevice();
   }
   LastBufferUse[CPUBuffer] = 0;
   if (NoCopyBack.find(CPUBuffer) != NoCopyBack.end())
   {
     return;
   }
-  CUDA_CopyBufferToGPU(GPUBuffer, CPUBuffer, VolumeSize, stream);
+  caller->CopyBufferToDevice(GPUBuffer, CPUBuffer);
   NumMemCpies++;
 }
 
 //----------------------------------------------------------------------------
 void vtkCudaMaxFlowSegmentationScheduler::SyncWorkers()
 {
-  for (std::set<vtkCudaMaxFlowSegmentationWorker*>::iterator workerIt = Workers.begin(); workerIt != Workers.end(); workerIt++)
+  for (vtkCudaMaxFlowSegmentationWorkerSet::iterator workerIt = Workers.begin(); workerIt != Workers.end(); workerIt++)
+  {
+    (*workerIt)->SyncDevice();
+  }
+}
+
+//----------------------------------------------------------------------------
+int vtkCudaMaxFlowSegmentationScheduler::SetTraceFile(const char* filename)
+{
+  delete this->Trace;
+  this->Trace = 0;
+  if (!filename || !*filename)
+  {
+    return 0;
+  }
+
+  std::ofstream* trace = new std::ofstream(filename);
+  if (!trace->is_open())
+  {
+    delete trace;
+    return -1;
+  }
+  *trace << "Decision\tTask\tType\tWorker\tWeight\tConflicted\tMemCpies\tKernelRuns\tNumMemCpies\tNumKernelRuns" << std::endl;
+  this->Trace = trace;
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationScheduler::UpdateTaskCost(vtkCudaMaxFlowSegmentationTask* task)
+{
+  //take the task out of whichever queue it is in
+  if (task->Queued == 1)
+  {
+    UnConflictedTasks.erase(std::pair<int, int>(task->QueuedCost, task->Id));
+  }
+  else if (task->Queued == 2)
+  {
+    ConflictedTasks.erase(std::pair<int, int>(task->QueuedCost, task->Id));
+  }
+  task->Queued = 0;
+  if (!task->CanDo() || CurrentTasks.find(task) == CurrentTasks.end())
+  {
+    return;
+  }
+
+  //conflicted tasks are keyed by the exact cost of resolving the conflict
+  int conflictWeight = task->Conflicted(&(task->CostWorker));
+  if (conflictWeight)
+  {
+    task->Queued = 2;
+    task->QueuedCost = conflictWeight;
+    ConflictedTasks[std::pair<int, int>(task->QueuedCost, task->Id)] = task;
+    return;
+  }
+
+  //the others by the number of buffers to bring in, a lower bound on their weight since
+  //bringing a buffer into a full worker also costs an eviction
+  int numMissing = (int) task->RequiredCPUBuffers.size();
+  if (task->CostWorker)
+  {
+    numMissing = 0;
+    for (std::vector<float*>::iterator it = task->RequiredCPUBuffers.begin(); it != task->RequiredCPUBuffers.end(); it++)
+    {
+      if (task->CostWorker->CPU2GPUMap.find(*it) == task->CostWorker->CPU2GPUMap.end())
+      {
+        numMissing++;
+      }
+    }
+  }
+  task->Queued = 1;
+  task->QueuedCost = numMissing;
+  UnConflictedTasks[std::pair<int, int>(task->QueuedCost, task->Id)] = task;
+}
+
+//----------------------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationScheduler::UpdateTaskCosts(float* CPUBuffer)
+{
+  std::map<float*, std::vector<vtkCudaMaxFlowSegmentationTask*> >::iterator users = BufferUsers.find(CPUBuffer);
+  if (users == BufferUsers.end())
+  {
+    return;
+  }
+  for (std::vector<vtkCudaMaxFlowSegmentationTask*>::iterator it = users->second.begin(); it != users->second.end(); it++)
   {
-    (*workerIt)->CallSyncThreads();
+    UpdateTaskCost(*it);
   }
 }
 
 //----------------------------------------------------------------------------
 bool vtkCudaMaxFlowSegmentationScheduler::CanRunAlgorithmIteration()
 {
-  return (this->CurrentTasks.size() > 0) ;
+  return (this->UnConflictedTasks.size() > 0 || this->ConflictedTasks.size() > 0);
 }
 
 //----------------------------------------------------------------------------
 int vtkCudaMaxFlowSegmentationScheduler::RunAlgorithmIteration()
 {
-  int MinWeight = INT_MAX;
+  //the cheapest conflicted task, whose key is its exact weight
   int MinUnConflictWeight = INT_MAX;
-  std::vector<vtkCudaMaxFlowSegmentationTask*> MinTasks;
-  std::vector<vtkCudaMaxFlowSegmentationTask*> MinUnConflictTasks;
-  std::vector<vtkCudaMaxFlowSegmentationWorker*> MinWorkers;
-  std::vector<vtkCudaMaxFlowSegmentationWorker*> MinUnConflictWorkers;
-  for (std::set<vtkCudaMaxFlowSegmentationTask*>::iterator taskIt = CurrentTasks.begin(); MinWeight > 0 && taskIt != CurrentTasks.end(); taskIt++)
+  vtkCudaMaxFlowSegmentationTask* MinUnConflictTask = 0;
+  if (ConflictedTasks.size() > 0)
   {
-    if (!(*taskIt)->CanDo())
-    {
-      continue;
-    }
+    MinUnConflictWeight = ConflictedTasks.begin()->first.first;
+    MinUnConflictTask = ConflictedTasks.begin()->second;
+  }
 
-    //find if the task is conflicted and put in appropriate contest
-    vtkCudaMaxFlowSegmentationWorker* possibleWorker = 0;
-    int conflictWeight = (*taskIt)->Conflicted(&possibleWorker);
-    if (conflictWeight)
+  //weigh the unconflicted tasks in order of their lower bound until none can beat the best
+  //one found, ties going to the oldest task
+  int MinWeight = INT_MAX;
+  vtkCudaMaxFlowSegmentationTask* MinTask = 0;
+  vtkCudaMaxFlowSegmentationWorker* MinWorker = 0;
+  for (vtkCudaMaxFlowSegmentationTaskQueue::iterator taskIt = UnConflictedTasks.begin(); taskIt != UnConflictedTasks.end(); taskIt++)
+  {
+    if (MinTask && (taskIt->first.first > MinWeight || (taskIt->first.first == MinWeight && taskIt->first.second > MinTask->Id)))
     {
-      if (conflictWeight < MinUnConflictWeight)
-      {
-        MinUnConflictWeight = conflictWeight;
-        MinUnConflictTasks.clear();
-        MinUnConflictTasks.push_back(*taskIt);
-        MinUnConflictWorkers.clear();
-        MinUnConflictWorkers.push_back(possibleWorker);
-      }
-      else if (conflictWeight == MinUnConflictWeight)
-      {
-        MinUnConflictTasks.push_back(*taskIt);
-        MinUnConflictWorkers.push_back(possibleWorker);
-      }
-      continue;
+      break;
     }
 
-    if (possibleWorker)   //only one worker can do this task
+    vtkCudaMaxFlowSegmentationTask* task = taskIt->second;
+    if (task->CostWorker)   //only one worker can do this task
     {
-      int weight = (*taskIt)->CalcWeight(possibleWorker);
-      if (weight < MinWeight)
+      int weight = task->CalcWeight(task->CostWorker);
+      if (weight < MinWeight || (weight == MinWeight && task->Id < MinTask->Id))
       {
         MinWeight = weight;
-        MinTasks.clear();
-        MinTasks.push_back(*taskIt);
-        MinWorkers.clear();
-        MinWorkers.push_back(possibleWorker);
-      }
-      else if (weight == MinWeight)
-      {
-        MinTasks.push_back(*taskIt);
-        MinWorkers.push_back(possibleWorker);
+        MinTask = task;
+        MinWorker = task->CostWorker;
       }
     }
     else   //all workers have a chance, find the emptiest one
     {
-      for (std::set<vtkCudaMaxFlowSegmentationWorker*>::iterator workerIt = Workers.begin(); workerIt != Workers.end(); workerIt++)
+      for (vtkCudaMaxFlowSegmentationWorkerSet::iterator workerIt = Workers.begin(); workerIt != Workers.end(); workerIt++)
       {
-        int weight = (*taskIt)->CalcWeight(*workerIt);
-        if (weight < MinWeight)
+        int weight = task->CalcWeight(*workerIt);
+        if (weight < MinWeight || (weight == MinWeight && task->Id < MinTask->Id))
         {
           MinWeight = weight;
-          MinTasks.clear();
-          MinTasks.push_back(*taskIt);
-          MinWorkers.clear();
-          MinWorkers.push_back(*workerIt);
-        }
-        else if (weight == MinWeight)
-        {
-          MinTasks.push_back(*taskIt);
-          MinWorkers.push_back(*workerIt);
+          MinTask = task;
+          MinWorker = *workerIt;
         }
       }
     }
   }
 
   //figure out if it is cheaper to run a conflicted or non-conflicted task
-  if (MinUnConflictWeight >= MinWeight)
+  bool conflicted = (MinUnConflictWeight < MinWeight);
+  vtkCudaMaxFlowSegmentationTask* task = conflicted ? MinUnConflictTask : MinTask;
+  vtkCudaMaxFlowSegmentationWorker* worker = conflicted ? MinUnConflictTask->CostWorker : MinWorker;
+  if (!task || !worker)
+  {
+    return -1;
+  }
+  int memCpies = NumMemCpies;
+  int kernelRuns = NumKernelRuns;
+  if (conflicted)
   {
-    int taskIdx = rand() % MinTasks.size();
-    MinTasks[taskIdx]->Perform(MinWorkers[taskIdx]);
+    task->UnConflict(worker);
   }
-  else
+  task->Perform(worker);
+
+  if (this->Trace)
   {
-    int taskIdx = rand() % MinUnConflictTasks.size();
-    MinUnConflictTasks[taskIdx]->UnConflict(MinUnConflictWorkers[taskIdx]);
-    MinUnConflictTasks[taskIdx]->Perform(MinUnConflictWorkers[taskIdx]);
+    *this->Trace << NumDecisions << "\t" << task->Id << "\t" << task->Type << "\t" << worker->GPU << "\t"
+                 << (conflicted ? MinUnConflictWeight : MinWeight) << "\t" << (conflicted ? 1 : 0) << "\t"
+                 << NumMemCpies - memCpies << "\t" << NumKernelRuns - kernelRuns << "\t"
+                 << NumMemCpies << "\t" << NumKernelRuns << "\n";
   }
+  NumDecisions++;
 
   return 0;
-}
\ No newline at end of file
+}
@@ -37,12 +37,26 @@ DEALINGS IN THE SOFTWARE.
 
 #include "vtkCudaImageAnalyticsExport.h"
 
-#include "CUDA_hierarchicalmaxflow.h"
+#include "vtkType.h"
+#include <iosfwd>
 #include <map>
 #include <set>
+#include <utility>
+#include <vector>
 
 class vtkCudaMaxFlowSegmentationTask;
 class vtkCudaMaxFlowSegmentationWorker;
+struct vtkCudaMaxFlowSimulatedDevice;
+
+//order the workers by device rather than by address so that scheduling is reproducible
+struct vtkCudaMaxFlowSegmentationWorkerCompare
+{
+  bool operator()(const vtkCudaMaxFlowSegmentationWorker* a, const vtkCudaMaxFlowSegmentationWorker* b) const;
+};
+typedef std::set<vtkCudaMaxFlowSegmentationWorker*, vtkCudaMaxFlowSegmentationWorkerCompare> vtkCudaMaxFlowSegmentationWorkerSet;
+
+//runnable tasks keyed by (cost, task id), cheapest and then oldest first
+typedef std::map<std::pair<int, int>, vtkCudaMaxFlowSegmentationTask*> vtkCudaMaxFlowSegmentationTaskQueue;
 
 class vtkCudaImageAnalyticsExport vtkCudaMaxFlowSegmentationScheduler
 {
@@ -54,21 +68,35 @@ private:
   friend class vtkCudaDirectedAcyclicGraphMaxFlowSegmentation;
   friend class vtkCudaMaxFlowSegmentationTask;
   friend class vtkCudaMaxFlowSegmentationWorker;
+  friend class vtkCudaMaxFlowSegmentationGPUWorker;
+  friend class vtkCudaMaxFlowSegmentationCPUWorker;
+  friend class vtkCudaMaxFlowSegmentationSimulatedWorker;
 
   void Clear();
   int RunAlgorithmIteration();
   bool CanRunAlgorithmIteration();
 
   int CreateWorker(int GPU, double MaxUsage);
+  int CreateCPUWorker(vtkIdType MaxMemory, int NumThreads);
+  int CreateSimulatedWorker(int id, const vtkCudaMaxFlowSimulatedDevice& device, vtkIdType volumeSize);
+  void GetSimulatedTimes(double* totalTime, double* idleTime);
   void SyncWorkers();
   void ReturnLeaves();
+  void ReturnAll();
+
+  //log every scheduling decision to the given file (none if null or empty)
+  int SetTraceFile(const char* filename);
+
+  //keep the task queues up to date as tasks become runnable and buffers move
+  void UpdateTaskCost(vtkCudaMaxFlowSegmentationTask* task);
+  void UpdateTaskCosts(float* CPUBuffer);
 
   //Mappings for CPU-GPU buffer sharing
-  void ReturnBufferGPU2CPU(vtkCudaMaxFlowSegmentationWorker* caller, float* CPUBuffer, float* GPUBuffer, cudaStream_t* stream);
-  void MoveBufferCPU2GPU(vtkCudaMaxFlowSegmentationWorker* caller, float* CPUBuffer, float* GPUBuffer, cudaStream_t* stream);
+  void ReturnBufferGPU2CPU(vtkCudaMaxFlowSegmentationWorker* caller, float* CPUBuffer, float* GPUBuffer);
+  void MoveBufferCPU2GPU(vtkCudaMaxFlowSegmentationWorker* caller, float* CPUBuffer, float* GPUBuffer);
 
 private:
-  std::set<vtkCudaMaxFlowSegmentationWorker*>         Workers;
+  vtkCudaMaxFlowSegmentationWorkerSet                 Workers;
 
   std::map<float*, vtkCudaMaxFlowSegmentationWorker*> LastBufferUse;
   std::map<float*, int>                               Overwritten;
@@ -83,6 +111,13 @@ private:
   std::set<vtkCudaMaxFlowSegmentationTask*>           CurrentTasks;
   std::set<vtkCudaMaxFlowSegmentationTask*>           BlockedTasks;
   std::set<vtkCudaMaxFlowSegmentationTask*>           FinishedTasks;
+  int                                                 NumTasksCreated;
+
+  //Runnable tasks, the unconflicted ones keyed by the number of buffers they have to bring
+  //onto their worker and the conflicted ones by the cost of returning buffers from the others
+  vtkCudaMaxFlowSegmentationTaskQueue                 UnConflictedTasks;
+  vtkCudaMaxFlowSegmentationTaskQueue                 ConflictedTasks;
+  std::map<float*, std::vector<vtkCudaMaxFlowSegmentationTask*> > BufferUsers;
 
   std::set<float*>                                    ReadOnly;
   std::set<float*>                                    NoCopyBack;
@@ -90,6 +125,14 @@ private:
   int                                                 NumMemCpies;
   int                                                 NumKernelRuns;
   int                                                 NumTasksGoingToHappen;
+  int                                                 NumDecisions;
+  std::ostream*                                       Trace;
+
+  //time at which each buffer was last copied back to the CPU by a simulated worker
+  std::map<float*, double>                            BufferReadyTime;
+
+  //skip the initialization tasks, continuing from the buffers on the CPU
+  bool                                                WarmStart;
 
   int                                                 VolumeSize;
   int                                                 VX;
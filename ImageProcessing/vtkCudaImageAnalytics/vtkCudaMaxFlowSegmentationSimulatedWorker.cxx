@@ -0,0 +1,105 @@
+/*=========================================================================
+
+Robarts Visualization Toolkit
+
+Copyright (c) 2016 Virtual Augmentation and Simulation for Surgery and Therapy, Robarts Research Institute
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files (the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+
+=========================================================================*/
+
+/** @file vtkCudaMaxFlowSegmentationSimulatedWorker.cxx
+ *
+ *  @brief Implementation file with class that models a GPU running the GHMF tasks without running them.
+ *
+ *  @note This is not a front-end class. Header details are in vtkCudaMaxFlowSegmentationSimulatedWorker.h
+ *
+ */
+
+#include "vtkCudaMaxFlowSegmentationScheduler.h"
+#include "vtkCudaMaxFlowSegmentationSimulatedWorker.h"
+#include "vtkCudaMaxFlowSegmentationTask.h"
+
+//-----------------------------------------------------------------
+vtkCudaMaxFlowSegmentationSimulatedWorker::vtkCudaMaxFlowSegmentationSimulatedWorker(int id, const vtkCudaMaxFlowSimulatedDevice& device, vtkIdType volumeSize, vtkCudaMaxFlowSegmentationScheduler* p)
+  : vtkCudaMaxFlowSegmentationWorker(id, p)
+  , Device(device)
+{
+  this->Clock = 0.0;
+  this->IdleTime = 0.0;
+  this->TransferTime = (device.Bandwidth > 0.0) ? (double) sizeof(float) * (double) volumeSize / device.Bandwidth : 0.0;
+  this->KernelTime = (device.KernelRate > 0.0) ? (double) volumeSize / device.KernelRate : 0.0;
+
+  //the buffers are never touched, so their addresses only have to be distinct
+  this->BufferTokens = (device.NumBuffers > 0) ? new float[device.NumBuffers] : 0;
+  for( int i = 0; i < device.NumBuffers; i++ )
+  {
+    UnusedGPUBuffers.push_back(this->BufferTokens + i);
+  }
+  NumBuffers = device.NumBuffers;
+}
+
+//-----------------------------------------------------------------
+vtkCudaMaxFlowSegmentationSimulatedWorker::~vtkCudaMaxFlowSegmentationSimulatedWorker()
+{
+  ReturnLeafLabels();
+  delete[] this->BufferTokens;
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationSimulatedWorker::ReserveDevice()
+{
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationSimulatedWorker::SyncDevice()
+{
+  //waiting is modelled by the buffer ready times
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationSimulatedWorker::CopyBufferToHost(float* GPUBuffer, float* CPUBuffer)
+{
+  this->Clock += this->TransferTime;
+  Parent->BufferReadyTime[CPUBuffer] = this->Clock;
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationSimulatedWorker::CopyBufferToDevice(float* GPUBuffer, float* CPUBuffer)
+{
+  //wait for the last writer of the buffer to have copied it back
+  std::map<float*, double>::iterator ready = Parent->BufferReadyTime.find(CPUBuffer);
+  if( ready != Parent->BufferReadyTime.end() && ready->second > this->Clock )
+  {
+    this->IdleTime += ready->second - this->Clock;
+    this->Clock = ready->second;
+  }
+  this->Clock += this->TransferTime;
+}
+
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationSimulatedWorker::RunKernels(vtkCudaMaxFlowSegmentationTask* task)
+{
+  //same launch counts as are recorded in NumKernelRuns
+  int numKernels = 1;
+  if( task->Type == vtkCudaMaxFlowSegmentationTask::UpdateSpatialFlowsTask )
+  {
+    numKernels = 4;
+  }
+  else if( task->Type == vtkCudaMaxFlowSegmentationTask::ApplySinkPotentialLeafTask )
+  {
+    numKernels = 2;
+  }
+  this->Clock += numKernels * this->KernelTime;
+}
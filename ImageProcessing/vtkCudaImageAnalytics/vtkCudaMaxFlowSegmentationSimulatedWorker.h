@@ -0,0 +1,80 @@
+/*=========================================================================
+
+Robarts Visualization Toolkit
+
+Copyright (c) 2016 Virtual Augmentation and Simulation for Surgery and Therapy, Robarts Research Institute
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files (the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+
+=========================================================================*/
+
+/** @file vtkCudaMaxFlowSegmentationSimulatedWorker.h
+ *
+ *  @brief Header file with class that models a GPU running the GHMF tasks without running them.
+ *
+ *  @note The worker holds a given number of buffers and only keeps time: transfers take the
+ *      buffer size over the bandwidth, kernels the volume size over the kernel rate, and a
+ *      buffer cannot be brought onto a device before the worker which last wrote it has copied
+ *      it back. Running the scheduler against these workers gives the transfers, kernel launches
+ *      and idle time a set of GPUs would see, without needing one.
+ *
+ *  @note This is not a front-end class.
+ *
+ */
+
+#ifndef __VTKCUDAMAXFLOWSEGMENTATIONSIMULATEDWORKER_H__
+#define __VTKCUDAMAXFLOWSEGMENTATIONSIMULATEDWORKER_H__
+
+#include "vtkCudaImageAnalyticsExport.h"
+
+#include "vtkCudaMaxFlowSegmentationWorker.h"
+#include "vtkType.h"
+
+//description of a simulated device: its capacity in buffers, its transfer rate in bytes per
+//second and the rate at which a kernel processes voxels in voxels per second
+struct vtkCudaMaxFlowSimulatedDevice
+{
+  int NumBuffers;
+  double Bandwidth;
+  double KernelRate;
+};
+
+class vtkCudaImageAnalyticsExport vtkCudaMaxFlowSegmentationSimulatedWorker : public vtkCudaMaxFlowSegmentationWorker
+{
+public:
+  //volumeSize is the number of voxels in each modelled buffer
+  vtkCudaMaxFlowSegmentationSimulatedWorker(int id, const vtkCudaMaxFlowSimulatedDevice& device, vtkIdType volumeSize, vtkCudaMaxFlowSegmentationScheduler* p);
+  ~vtkCudaMaxFlowSegmentationSimulatedWorker();
+
+  virtual void ReserveDevice();
+  virtual void SyncDevice();
+  virtual void CopyBufferToHost(float* GPUBuffer, float* CPUBuffer);
+  virtual void CopyBufferToDevice(float* GPUBuffer, float* CPUBuffer);
+  virtual void RunKernels(vtkCudaMaxFlowSegmentationTask* task);
+
+  //simulated time at which the worker finishes its last operation, and the time it has
+  //spent waiting on buffers from other workers
+  double Clock;
+  double IdleTime;
+
+protected:
+  vtkCudaMaxFlowSimulatedDevice Device;
+  double TransferTime;
+  double KernelTime;
+
+  //addresses standing in for the device buffers
+  float* BufferTokens;
+};
+
+#endif
@@ -24,14 +24,12 @@
  *
  */
 
-#include "CUDA_hierarchicalmaxflow.h"
-#include "CudaObject.h"
-#include "vtkCudaDeviceManager.h"
 #include "vtkCudaMaxFlowSegmentationScheduler.h"
 #include "vtkCudaMaxFlowSegmentationTask.h"
 #include "vtkCudaMaxFlowSegmentationWorker.h"
 #include <assert.h>
 #include <float.h>
+#include <iostream>
 #include <limits.h>
 #include <math.h>
 #include <set>
@@ -50,6 +48,10 @@ vtkCudaMaxFlowSegmentationTask::vtkCudaMaxFlowSegmentationTask( vtkIdType n1, vt
 {
   NumToDeath = numToDeath;
   NumTimesCalled = 0;
+  Id = Parent->NumTasksCreated++;
+  Queued = 0;
+  QueuedCost = 0;
+  CostWorker = 0;
 
   if( NumToDeath <= 0 )
   {
@@ -61,6 +63,7 @@ vtkCudaMaxFlowSegmentationTask::vtkCudaMaxFlowSegmentationTask( vtkIdType n1, vt
   if(Active >= 0)
   {
     Parent->CurrentTasks.insert(this);
+    Parent->UpdateTaskCost(this);
   }
   else
   {
@@ -103,11 +106,13 @@ void vtkCudaMaxFlowSegmentationTask::Signal()
     if( Type == ClearWorkingBufferTask )
     {
       Parent->NoCopyBack.insert( RequiredCPUBuffers[0] );
+      Parent->UpdateTaskCosts( RequiredCPUBuffers[0] );
     }
     //else if( Type == DivideOutWorkingBufferTask )
     //Parent->NoCopyBack.insert( RequiredCPUBuffers[1] );
     //else if( Type == ApplySinkPotentialLeafTask )
     //Parent->NoCopyBack.insert( RequiredCPUBuffers[0] );
+    Parent->UpdateTaskCost(this);
   }
 }
 
@@ -141,12 +146,15 @@ void vtkCudaMaxFlowSegmentationTask::FinishedSignal()
 void vtkCudaMaxFlowSegmentationTask::DecrementActivity()
 {
   Active--;
+  Parent->UpdateTaskCost(this);
 }
 
 //----------------------------------------------------------------------------
 void vtkCudaMaxFlowSegmentationTask::AddBuffer(float* b)
 {
   RequiredCPUBuffers.push_back(b);
+  Parent->BufferUsers[b].push_back(this);
+  Parent->UpdateTaskCost(this);
 }
 
 //----------------------------------------------------------------------------
@@ -158,7 +166,7 @@ int vtkCudaMaxFlowSegmentationTask::Conflicted(vtkCudaMaxFlowSegmentationWorker*
   int retVal = 0;
   int maxBuffersGot = 0;
   vtkCudaMaxFlowSegmentationWorker* maxGPU = 0;
-  for(std::set<vtkCudaMaxFlowSegmentationWorker*>::iterator wit = Parent->Workers.begin(); wit != Parent->Workers.end(); wit++)
+  for(vtkCudaMaxFlowSegmentationWorkerSet::iterator wit = Parent->Workers.begin(); wit != Parent->Workers.end(); wit++)
   {
     int buffersGot = 0;
     for(std::vector<float*>::iterator it = RequiredCPUBuffers.begin(); it != RequiredCPUBuffers.end(); it++)
@@ -176,7 +184,7 @@ int vtkCudaMaxFlowSegmentationTask::Conflicted(vtkCudaMaxFlowSegmentationWorker*
   }
 
   //return everything that is not on that GPU
-  for(std::set<vtkCudaMaxFlowSegmentationWorker*>::iterator wit = Parent->Workers.begin(); wit != Parent->Workers.end(); wit++)
+  for(vtkCudaMaxFlowSegmentationWorkerSet::iterator wit = Parent->Workers.begin(); wit != Parent->Workers.end(); wit++)
   {
     if( *wit == maxGPU )
     {
@@ -208,7 +216,7 @@ int vtkCudaMaxFlowSegmentationTask::Conflicted(vtkCudaMaxFlowSegmentationWorker*
 void vtkCudaMaxFlowSegmentationTask::UnConflict(vtkCudaMaxFlowSegmentationWorker* maxGPU)
 {
   //return everything that is not on that GPU
-  for(std::set<vtkCudaMaxFlowSegmentationWorker*>::iterator wit = Parent->Workers.begin(); wit != Parent->Workers.end(); wit++)
+  for(vtkCudaMaxFlowSegmentationWorkerSet::iterator wit = Parent->Workers.begin(); wit != Parent->Workers.end(); wit++)
   {
     if( *wit == maxGPU )
     {
@@ -225,10 +233,10 @@ void vtkCudaMaxFlowSegmentationTask::UnConflict(vtkCudaMaxFlowSegmentationWorker
     }
     if( flag )
     {
-      (*wit)->CallSyncThreads();
+      (*wit)->SyncDevice();
     }
   }
-  maxGPU->CallSyncThreads();
+  maxGPU->SyncDevice();
 }
 
 //----------------------------------------------------------------------------
@@ -263,7 +271,14 @@ void vtkCudaMaxFlowSegmentationTask::Perform(vtkCudaMaxFlowSegmentationWorker* w
   {
     return;
   }
-  w->ReserveGPU();
+
+  //when warm starting, the initialization tasks only pass on their signals
+  if( Parent->WarmStart && Type >= ClearBufferInitially )
+  {
+    this->FinishPerform();
+    return;
+  }
+  w->ReserveDevice();
 
   //load anything that will be overwritten onto the no copy back list
   switch(Type)
@@ -305,188 +320,100 @@ void vtkCudaMaxFlowSegmentationTask::Perform(vtkCudaMaxFlowSegmentationWorker* w
 
   assert(w->CPU2GPUMap.size() == w->GPU2CPUMap.size());
 
-  //run the kernels
-  float smoothnessConstant = this->constant1;
+  //run the kernels on the worker's device
+  w->RunKernels(this);
+
+  //record what has been overwritten
   switch(Type)
   {
   case(ClearWorkingBufferTask):      //0 - Working
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "ClearWorkingBufferTask" << std::endl;
-    if( !isRoot )
-    {
-      CUDA_zeroOutBuffer(w->CPU2GPUMap[RequiredCPUBuffers[0]], Parent->VolumeSize, w->GetStream());
-    }
-    else
-    {
-      CUDA_SetBufferToValue(w->CPU2GPUMap[RequiredCPUBuffers[0]], 1.0f/Parent->CC, Parent->VolumeSize, w->GetStream());
-    }
     Parent->Overwritten[RequiredCPUBuffers[0]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(UpdateSpatialFlowsTask):      //0 - Sink,    1 - Inc,  2 - Div,  3 - Label,  4 - FlowX,  5 - FlowY,  6 - FlowZ,  7 - Smoothness
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "UpdateSpatialFlowsTask" << std::endl;
-    CUDA_flowGradientStep(w->CPU2GPUMap[RequiredCPUBuffers[0]], w->CPU2GPUMap[RequiredCPUBuffers[1]],
-                          w->CPU2GPUMap[RequiredCPUBuffers[2]], w->CPU2GPUMap[RequiredCPUBuffers[3]], Parent->StepSize, Parent->CC,
-                          Parent->VolumeSize, w->GetStream() );
-    CUDA_applyStep(w->CPU2GPUMap[RequiredCPUBuffers[2]], w->CPU2GPUMap[RequiredCPUBuffers[4]],
-                   w->CPU2GPUMap[RequiredCPUBuffers[5]], w->CPU2GPUMap[RequiredCPUBuffers[6]], Parent->VX, Parent->VY, Parent->VZ, Parent->VolumeSize, w->GetStream() );
-    CUDA_computeFlowMag(w->CPU2GPUMap[RequiredCPUBuffers[2]], w->CPU2GPUMap[RequiredCPUBuffers[4]],
-                        w->CPU2GPUMap[RequiredCPUBuffers[5]], w->CPU2GPUMap[RequiredCPUBuffers[6]],
-                        w->CPU2GPUMap[RequiredCPUBuffers[7]], smoothnessConstant, Parent->VX, Parent->VY, Parent->VZ, Parent->VolumeSize, w->GetStream() );
-    CUDA_projectOntoSet(w->CPU2GPUMap[RequiredCPUBuffers[2]], w->CPU2GPUMap[RequiredCPUBuffers[4]],
-                        w->CPU2GPUMap[RequiredCPUBuffers[5]], w->CPU2GPUMap[RequiredCPUBuffers[6]], Parent->VX, Parent->VY, Parent->VZ, Parent->VolumeSize, w->GetStream() );
     Parent->Overwritten[RequiredCPUBuffers[2]] = 1;
     Parent->Overwritten[RequiredCPUBuffers[4]] = 1;
     Parent->Overwritten[RequiredCPUBuffers[5]] = 1;
     Parent->Overwritten[RequiredCPUBuffers[6]] = 1;
     Parent->NumKernelRuns += 4;
     break;
-
   case(ApplySinkPotentialLeafTask):    //0 - Sink,    1 - Inc,  2 - Div,  3 - Label,  4 - Data
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "ApplySinkPotentialLeafTask " << w->CPU2GPUMap[RequiredCPUBuffers[0]] << std::endl;
-    CUDA_updateLeafSinkFlow(w->CPU2GPUMap[RequiredCPUBuffers[0]],w->CPU2GPUMap[RequiredCPUBuffers[1]],
-                            w->CPU2GPUMap[RequiredCPUBuffers[2]],w->CPU2GPUMap[RequiredCPUBuffers[3]],Parent->CC, Parent->VolumeSize, w->GetStream());
-    CUDA_constrainLeafSinkFlow(w->CPU2GPUMap[RequiredCPUBuffers[0]],w->CPU2GPUMap[RequiredCPUBuffers[4]], Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[0]] = 1;
     Parent->NumKernelRuns += 2;
     break;
-
   case(ApplySinkPotentialBranchTask):    //0 - Working,  1 - Inc,  2 - Div,  3 - Label
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "ApplySinkPotentialBranchTask" << std::endl;
-    CUDA_storeSinkFlowInBuffer(w->CPU2GPUMap[RequiredCPUBuffers[0]],w->CPU2GPUMap[RequiredCPUBuffers[1]],
-                               w->CPU2GPUMap[RequiredCPUBuffers[2]],w->CPU2GPUMap[RequiredCPUBuffers[3]], Parent->CC, Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[0]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(ApplySourcePotentialTask):      //0 - Working,  1 - Sink,  2 - Div,  3 - Label
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "ApplySourcePotentialTask" << std::endl;
-    CUDA_storeSourceFlowInBuffer(w->CPU2GPUMap[RequiredCPUBuffers[0]],w->CPU2GPUMap[RequiredCPUBuffers[1]],
-                                 w->CPU2GPUMap[RequiredCPUBuffers[2]],w->CPU2GPUMap[RequiredCPUBuffers[3]], Parent->CC, Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[0]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(DivideOutWorkingBufferTask):    //0 - Working,  1 - Sink
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "DivideOutWorkingBufferTask" << std::endl;
-    CUDA_divideAndStoreBuffer(w->CPU2GPUMap[RequiredCPUBuffers[0]],w->CPU2GPUMap[RequiredCPUBuffers[1]],
-                              constant1,  Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[1]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(UpdateLabelsTask):          //0 - Sink,    1 - Inc,  2 - Div,  3 - Label
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "UpdateLabelsTask" << std::endl;
-    CUDA_updateLabel(w->CPU2GPUMap[RequiredCPUBuffers[0]],w->CPU2GPUMap[RequiredCPUBuffers[1]], w->CPU2GPUMap[RequiredCPUBuffers[2]],
-                     w->CPU2GPUMap[RequiredCPUBuffers[3]], Parent->CC, Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[3]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(ClearBufferInitially):        //0 - Any
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "ClearBufferInitially" << std::endl;
-    CUDA_zeroOutBuffer(w->CPU2GPUMap[RequiredCPUBuffers[0]], Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[0]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(InitializeLeafFlows):        //0 - Sink,    1 - Data
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "InitializeLeafFlows" << std::endl;
-    CUDA_CopyBuffer(w->CPU2GPUMap[RequiredCPUBuffers[0]], w->CPU2GPUMap[RequiredCPUBuffers[1]], Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[0]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(MinimizeLeafFlows):        //0 - Sink1,  1 - Sink2
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "MinimizeLeafFlows" << std::endl;
-    CUDA_MinBuffer(w->CPU2GPUMap[RequiredCPUBuffers[0]], w->CPU2GPUMap[RequiredCPUBuffers[1]], Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[0]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(PropogateLeafFlows):        //0 - SinkMin,  1 - SinkElse
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "PropogateLeafFlows" << std::endl;
-    CUDA_CopyBuffer(w->CPU2GPUMap[RequiredCPUBuffers[1]], w->CPU2GPUMap[RequiredCPUBuffers[0]], Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[1]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(InitializeLeafLabels):        //0 - Sink,    1 - Data,  2 - Label
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "InitializeLeafLabels" << std::endl;
-    CUDA_LblBuffer(w->CPU2GPUMap[RequiredCPUBuffers[2]], w->CPU2GPUMap[RequiredCPUBuffers[0]], w->CPU2GPUMap[RequiredCPUBuffers[1]],
-                   Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[2]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(AccumulateLabels):          //0 - Accum,  1 - Label
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "AccumulateLabels" << std::endl;
-    CUDA_SumBuffer(w->CPU2GPUMap[RequiredCPUBuffers[0]], w->CPU2GPUMap[RequiredCPUBuffers[1]], Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[0]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(CorrectLabels):          //0 - Factor,  1 - Label
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "CorrectLabels" << std::endl;
-    CUDA_DivBuffer(w->CPU2GPUMap[RequiredCPUBuffers[1]], w->CPU2GPUMap[RequiredCPUBuffers[0]], Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[1]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(AccumulateLabelsWeighted):      //0 - Accum,  1 - Label
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "AccumulateLabelsWeighted" << "\t" << constant1 << std::endl;
-    CUDA_SumScaledBuffer(w->CPU2GPUMap[RequiredCPUBuffers[0]], w->CPU2GPUMap[RequiredCPUBuffers[1]], constant1, Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[0]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(ResetSinkFlowRoot):        //0 - Sink
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "ResetSinkFlowRoot" << "\t" << constant1 << std::endl;
-    CUDA_ShiftBuffer(w->CPU2GPUMap[RequiredCPUBuffers[0]], constant1, Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[0]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(ResetSinkFlowBranch):        //0 - Sink,    1 - Inc,  2 - Div,  3 - Label
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "ResetSinkFlowBranch" << "\t" << constant1 << std::endl;
-    CUDA_ResetSinkBuffer(w->CPU2GPUMap[RequiredCPUBuffers[0]], w->CPU2GPUMap[RequiredCPUBuffers[1]], w->CPU2GPUMap[RequiredCPUBuffers[2]],
-                         w->CPU2GPUMap[RequiredCPUBuffers[3]], constant1, 1.0/Parent->CC, Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[0]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(PushUpSourceFlows):        //0 - PSink,  1 - Sink,  2 - Inc,  3 - Div,  4 - Label
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "PushUpSourceFlows" << "\t" << constant1 << std::endl;
-    CUDA_PushUpSourceFlows(w->CPU2GPUMap[RequiredCPUBuffers[0]],w->CPU2GPUMap[RequiredCPUBuffers[1]],
-                           w->CPU2GPUMap[RequiredCPUBuffers[2]], w->CPU2GPUMap[RequiredCPUBuffers[3]],
-                           w->CPU2GPUMap[RequiredCPUBuffers[4]], constant1, 1.0/Parent->CC,Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[0]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(ClearSourceBuffer):        //0 - Inc
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "ClearSourceBuffer " << w->CPU2GPUMap[RequiredCPUBuffers[0]] << std::endl;
-    CUDA_zeroOutBuffer(w->CPU2GPUMap[RequiredCPUBuffers[0]], Parent->VolumeSize, w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[0]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(PushDownSinkFlows):        //0 - Sink,    1 - CInc
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "PushDownSinkFlows " << w->CPU2GPUMap[RequiredCPUBuffers[0]] << " to " << w->CPU2GPUMap[RequiredCPUBuffers[1]] << "\t" << constant1 << std::endl;
-    CUDA_SumScaledBuffer(w->CPU2GPUMap[RequiredCPUBuffers[1]],w->CPU2GPUMap[RequiredCPUBuffers[0]],constant1,Parent->VolumeSize,w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[1]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   case(PropogateLeafFlowsInc):      //0 - FlowIn,  1 - FlowO,  2 - FlowO
-    //std::cout << Node1 << "\t" << Node2 << "\t" << "PropogateLeafFlowsInc" << std::endl;
-    CUDA_Copy2Buffers(w->CPU2GPUMap[RequiredCPUBuffers[0]],w->CPU2GPUMap[RequiredCPUBuffers[1]],
-                      w->CPU2GPUMap[RequiredCPUBuffers[2]],Parent->VolumeSize,w->GetStream());
     Parent->Overwritten[RequiredCPUBuffers[1]] = 1;
     Parent->Overwritten[RequiredCPUBuffers[2]] = 1;
     Parent->NumKernelRuns += 1;
     break;
-
   default:
     break;
   }
@@ -514,6 +441,18 @@ void vtkCudaMaxFlowSegmentationTask::Perform(vtkCudaMaxFlowSegmentationWorker* w
     break;
   }
 
+  //the no-copy-back list changes the cost of resolving conflicts on these buffers
+  for(std::vector<float*>::iterator it = RequiredCPUBuffers.begin(); it != RequiredCPUBuffers.end(); it++)
+  {
+    Parent->UpdateTaskCosts(*it);
+  }
+
+  this->FinishPerform();
+}
+
+//----------------------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationTask::FinishPerform()
+{
   //send off appropriate finishing signals and return to original state
   this->FinishedSignal();
   Active -= FinishDecreaseInActive;
@@ -530,4 +469,5 @@ void vtkCudaMaxFlowSegmentationTask::Perform(vtkCudaMaxFlowSegmentationWorker* w
     Parent->CurrentTasks.erase( this );
     Parent->FinishedTasks.insert( this );
   }
+  Parent->UpdateTaskCost(this);
 }
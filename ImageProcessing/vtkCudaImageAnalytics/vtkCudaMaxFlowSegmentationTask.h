@@ -109,8 +109,13 @@ public:
 
 private:
   friend class vtkCudaMaxFlowSegmentationWorker;
+  friend class vtkCudaMaxFlowSegmentationGPUWorker;
+  friend class vtkCudaMaxFlowSegmentationCPUWorker;
   friend class vtkCudaMaxFlowSegmentationScheduler;
 
+  //signal the dependent tasks and retire or block this one after it has been performed
+  void FinishPerform();
+
   int Active;
   int FinishDecreaseInActive;
   int NumTimesCalled;
@@ -118,6 +123,13 @@ private:
   bool isRoot;
   vtkCudaMaxFlowSegmentationScheduler* const Parent;
 
+  //creation order, which breaks ties between equally cheap tasks, and the scheduler's
+  //cached cost (queue 0 for none, 1 for unconflicted, 2 for conflicted)
+  int Id;
+  int Queued;
+  int QueuedCost;
+  vtkCudaMaxFlowSegmentationWorker* CostWorker;
+
   float constant1;
   float constant2;
 
@@ -19,20 +19,19 @@ DEALINGS IN THE SOFTWARE.
 
 =========================================================================*/
 
-/** @file vtkCudaHierarchicalMaxFlowSegmentation2Worker.cxx
+/** @file vtkCudaMaxFlowSegmentationWorker.cxx
  *
- *  @brief Implementation file with class that runs each individual GPU for GHMF.
+ *  @brief Implementation file with the device independent part of the workers for GHMF, managing
+ *      the pool of device buffers.
  *
  *  @author John Stuart Haberl Baxter (Dr. Peters' Lab (VASST) at Robarts Research Institute)
  *
  *  @note August 27th 2013 - Documentation first compiled.
  *
- *  @note This is not a front-end class. Header details are in vtkCudaMaxFlowSegmentation.h
+ *  @note This is not a front-end class. Header details are in vtkCudaMaxFlowSegmentationWorker.h
  *
  */
 
-#include "CUDA_hierarchicalmaxflow.h"
-#include "CudaObject.h"
 #include "vtkCudaMaxFlowSegmentationScheduler.h"
 #include "vtkCudaMaxFlowSegmentationWorker.h"
 #include <assert.h>
@@ -41,70 +40,28 @@ DEALINGS IN THE SOFTWARE.
 #include <math.h>
 
 //-----------------------------------------------------------------
-vtkCudaMaxFlowSegmentationWorker::vtkCudaMaxFlowSegmentationWorker(int g, double usage, vtkCudaMaxFlowSegmentationScheduler* p)
+vtkCudaMaxFlowSegmentationWorker::vtkCudaMaxFlowSegmentationWorker(int g, vtkCudaMaxFlowSegmentationScheduler* p)
   : Parent(p)
   , GPU(g)
-  , CudaObject(g)
 {
-  //Get GPU buffers
-  int BuffersAcquired = 0;
-  double PercentAcquired = 0.0;
+  NumBuffers = 0;
   UnusedGPUBuffers.clear();
   CPU2GPUMap.clear();
   GPU2CPUMap.clear();
   CPU2GPUMap.insert(std::pair<float*, float*>((float*)0, (float*)0));
   GPU2CPUMap.insert(std::pair<float*, float*>((float*)0, (float*)0));
-  while (true)
-  {
-    //try acquiring some new buffers
-    float* NewAcquiredBuffers = 0;
-    int NewNumberAcquired = 0;
-    int Pad = Parent->VX * Parent->VY;
-    double NewPercentAcquired = 0;
-    CUDA_GetGPUBuffers(Parent->TotalNumberOfBuffers - BuffersAcquired, usage - PercentAcquired, &NewAcquiredBuffers,
-                       Pad, Parent->VolumeSize, &NewNumberAcquired, &NewPercentAcquired);
-    BuffersAcquired += NewNumberAcquired;
-    PercentAcquired += NewPercentAcquired;
-
-    //if no new buffers were acquired, exit the loop
-    if (NewNumberAcquired == 0)
-    {
-      break;
-    }
-
-    //else, load the new buffers into the list of unused buffers
-    AllGPUBufferBlocks.push_back(NewAcquiredBuffers);
-    NewAcquiredBuffers += Pad;
-    for (int i = 0; i < NewNumberAcquired; i++)
-    {
-      UnusedGPUBuffers.push_back(NewAcquiredBuffers);
-      NewAcquiredBuffers += Parent->VolumeSize;
-    }
-  }
-  NumBuffers = BuffersAcquired;
 }
 
 //-----------------------------------------------------------------
 vtkCudaMaxFlowSegmentationWorker::~vtkCudaMaxFlowSegmentationWorker()
 {
-  this->CallSyncThreads();
-
-  //Return all GPU buffers
-  ReturnLeafLabels();
-  while (AllGPUBufferBlocks.size() > 0)
-  {
-    CUDA_ReturnGPUBuffers(AllGPUBufferBlocks.front());
-    AllGPUBufferBlocks.pop_front();
-  }
-
-  //take down stack structure
+  //take down stack structure (the device buffers are returned by the subclasses)
   TakeDownPriorityStacks();
 
   //clear remaining mappings
   CPU2GPUMap.clear();
   GPU2CPUMap.clear();
   UnusedGPUBuffers.clear();
-  AllGPUBufferBlocks.clear();
   CPUInUse.clear();
 }
 
@@ -115,12 +72,23 @@ void vtkCudaMaxFlowSegmentationWorker::ReturnLeafLabels()
   for (int i = 0; i < Parent->NumLeaves; i++)
     if (CPU2GPUMap.find(Parent->LeafLabelBuffers[i]) != CPU2GPUMap.end())
     {
-      Parent->ReturnBufferGPU2CPU(this, Parent->LeafLabelBuffers[i], CPU2GPUMap[Parent->LeafLabelBuffers[i]], GetStream());
+      Parent->ReturnBufferGPU2CPU(this, Parent->LeafLabelBuffers[i], CPU2GPUMap[Parent->LeafLabelBuffers[i]]);
       GPU2CPUMap.erase(GPU2CPUMap.find(CPU2GPUMap[Parent->LeafLabelBuffers[i]]));
       CPU2GPUMap.erase(CPU2GPUMap.find(Parent->LeafLabelBuffers[i]));
+      Parent->UpdateTaskCosts(Parent->LeafLabelBuffers[i]);
     }
 }
 
+//-----------------------------------------------------------------
+void vtkCudaMaxFlowSegmentationWorker::ReturnAllBuffers()
+{
+  //Copy back every modified buffer so the whole solution is on the CPU (used for warm starts)
+  for (std::map<float*, float*>::iterator it = CPU2GPUMap.begin(); it != CPU2GPUMap.end(); it++)
+  {
+    Parent->ReturnBufferGPU2CPU(this, it->first, it->second);
+  }
+}
+
 //-----------------------------------------------------------------
 void vtkCudaMaxFlowSegmentationWorker::ReturnBuffer(float* CPUBuffer)
 {
@@ -130,11 +98,12 @@ void vtkCudaMaxFlowSegmentationWorker::ReturnBuffer(float* CPUBuffer)
   }
   if (CPU2GPUMap.find(CPUBuffer) != CPU2GPUMap.end())
   {
-    Parent->ReturnBufferGPU2CPU(this, CPUBuffer, CPU2GPUMap[CPUBuffer], GetStream());
+    Parent->ReturnBufferGPU2CPU(this, CPUBuffer, CPU2GPUMap[CPUBuffer]);
     UnusedGPUBuffers.push_front(CPU2GPUMap[CPUBuffer]);
     GPU2CPUMap.erase(GPU2CPUMap.find(CPU2GPUMap[CPUBuffer]));
     CPU2GPUMap.erase(CPU2GPUMap.find(CPUBuffer));
     RemoveFromStack(CPUBuffer);
+    Parent->UpdateTaskCosts(CPUBuffer);
   }
 }
 
@@ -160,7 +129,8 @@ void vtkCudaMaxFlowSegmentationWorker::UpdateBuffersInUse()
       UnusedGPUBuffers.pop_front();
       CPU2GPUMap.insert(std::pair<float*, float*>(*iterator, NewGPUBuffer));
       GPU2CPUMap.insert(std::pair<float*, float*>(NewGPUBuffer, *iterator));
-      Parent->MoveBufferCPU2GPU(this, *iterator, NewGPUBuffer, GetStream());
+      Parent->MoveBufferCPU2GPU(this, *iterator, NewGPUBuffer);
+      Parent->UpdateTaskCosts(*iterator);
 
       //update the priority stacks
       AddToStack(*iterator);
@@ -184,7 +154,9 @@ void vtkCudaMaxFlowSegmentationWorker::UpdateBuffersInUse()
       GPU2CPUMap.erase(GPU2CPUMap.find(NewGPUBuffer));
       CPU2GPUMap.insert(std::pair<float*, float*>(*iterator, NewGPUBuffer));
       GPU2CPUMap.insert(std::pair<float*, float*>(NewGPUBuffer, *iterator));
-      Parent->MoveBufferCPU2GPU(this, *iterator, NewGPUBuffer, GetStream());
+      Parent->MoveBufferCPU2GPU(this, *iterator, NewGPUBuffer);
+      Parent->UpdateTaskCosts(*iterator2);
+      Parent->UpdateTaskCosts(*iterator);
 
       //update the priority stacks
       RemoveFromStack(*iterator2);
@@ -221,8 +193,10 @@ void vtkCudaMaxFlowSegmentationWorker::UpdateBuffersInUse()
         GPU2CPUMap.erase(GPU2CPUMap.find(NewGPUBuffer));
         CPU2GPUMap.insert(std::pair<float*, float*>(*iterator, NewGPUBuffer));
         GPU2CPUMap.insert(std::pair<float*, float*>(NewGPUBuffer, *iterator));
-        Parent->ReturnBufferGPU2CPU(this, *subIterator, NewGPUBuffer, GetStream());
-        Parent->MoveBufferCPU2GPU(this, *iterator, NewGPUBuffer, GetStream());
+        Parent->ReturnBufferGPU2CPU(this, *subIterator, NewGPUBuffer);
+        Parent->MoveBufferCPU2GPU(this, *iterator, NewGPUBuffer);
+        Parent->UpdateTaskCosts(*subIterator);
+        Parent->UpdateTaskCosts(*iterator);
 
         //update the priority stack and leave immediately since our iterators
         //no longer have a valid contract (changed container)
@@ -21,7 +21,9 @@ DEALINGS IN THE SOFTWARE.
 
 /** @file vtkCudaMaxFlowSegmentationWorker.h
  *
- *  @brief Implementation file with class that runs each individual GPU for GHMF.
+ *  @brief Header file with the base class for the devices which run the GHMF/DAGMF tasks. It keeps
+ *      the pool of device buffers and the CPU-device buffer mappings, while the device specific
+ *      parts (copies, synchronization and the task kernels) are left to the GPU and CPU workers.
  *
  *  @author John Stuart Haberl Baxter (Dr. Peters' Lab (VASST) at Robarts Research Institute)
  *
@@ -36,14 +38,15 @@ DEALINGS IN THE SOFTWARE.
 
 #include "vtkCudaImageAnalyticsExport.h"
 
-#include "CudaObject.h"
 #include <list>
+#include <map>
 #include <set>
 #include <vector>
 
 class vtkCudaMaxFlowSegmentationScheduler;
+class vtkCudaMaxFlowSegmentationTask;
 
-class vtkCudaImageAnalyticsExport vtkCudaMaxFlowSegmentationWorker : public CudaObject
+class vtkCudaImageAnalyticsExport vtkCudaMaxFlowSegmentationWorker
 {
 public:
   void UpdateBuffersInUse();
@@ -53,10 +56,15 @@ public:
   void TakeDownPriorityStacks();
   int LowestBufferShift(unsigned int n);
   void ReturnLeafLabels();
+  void ReturnAllBuffers();
   void ReturnBuffer(float* CPUBuffer);
 
-  virtual void Reinitialize(bool withData = false) {};
-  virtual void Deinitialize(bool withData = false) {};
+  //device specific parts, the "GPU" buffers being the buffers of the worker's pool
+  virtual void ReserveDevice() = 0;
+  virtual void SyncDevice() = 0;
+  virtual void CopyBufferToHost(float* GPUBuffer, float* CPUBuffer) = 0;
+  virtual void CopyBufferToDevice(float* GPUBuffer, float* CPUBuffer) = 0;
+  virtual void RunKernels(vtkCudaMaxFlowSegmentationTask* task) = 0;
 
 public:
   vtkCudaMaxFlowSegmentationScheduler* const Parent;
@@ -66,10 +74,9 @@ public:
   std::map<float*, float*> GPU2CPUMap;
   std::set<float*> CPUInUse;
   std::list<float*> UnusedGPUBuffers;
-  std::list<float*> AllGPUBufferBlocks;
   std::vector< std::list< float* > > PriorityStacks;
-  vtkCudaMaxFlowSegmentationWorker(int g, double usage, vtkCudaMaxFlowSegmentationScheduler* p);
-  ~vtkCudaMaxFlowSegmentationWorker();
+  vtkCudaMaxFlowSegmentationWorker(int g, vtkCudaMaxFlowSegmentationScheduler* p);
+  virtual ~vtkCudaMaxFlowSegmentationWorker();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1184 @@
+/*=========================================================================
+
+  Program:   Robarts Visualization Toolkit
+  Module:    vtkImageJointHistogram.cxx
+
+  Copyright (c) 1993-2002 Ken Martin, Will Schroeder, Bill Lorensen
+  All rights reserved.
+  See Copyright.txt or http://www.kitware.com/Copyright.htm for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notice for more information.
+
+=========================================================================*/
+#include "vtkImageJointHistogram.h"
+
+#include "vtkMath.h"
+#include "vtkMatrix4x4.h"
+#include "vtkMinimalStandardRandomSequence.h"
+#include "vtkMultiThreader.h"
+#include "vtkObjectFactory.h"
+
+#include <algorithm>
+#include <string.h>
+
+vtkStandardNewMacro(vtkImageJointHistogram);
+
+//----------------------------------------------------------------------------
+// Bin of an intensity, value / width rounded down (half = 0) or to the
+// nearest bin (half = 0.5). The product with the inverse width may round
+// across a bin boundary, so the bin is stepped to where the exact quotient
+// falls. Returns -1 for negative values when rounding down, and clamps to
+// the last bin.
+static inline int vtkImageJointHistogramBin(double value, double width, double inverse,
+                                            double half, int numBins)
+{
+  double scaled = value * inverse + half;
+  if (scaled <= 0.0)
+  {
+    return (value < 0.0 && half == 0.0) ? -1 : 0;
+  }
+  if (scaled >= numBins)
+  {
+    return numBins - 1;
+  }
+  int bin = (int) scaled;
+  double lower = (bin - half) * width;
+  if (value < lower)
+  {
+    bin--;
+  }
+  else if (value >= lower + width)
+  {
+    bin++;
+  }
+  return (bin < numBins) ? bin : numBins - 1;
+}
+
+// Bin number held by a partial volume image, clamped to the histogram
+static inline int vtkImageJointHistogramClamp(int bin, int numBins)
+{
+  return (bin < 0) ? 0 : ((bin < numBins) ? bin : numBins - 1);
+}
+
+//----------------------------------------------------------------------------
+struct vtkImageJointHistogramThreadStruct
+{
+  void *SourcePtr;
+  const unsigned char *TargetBins8; // bins of image 2, one of them is set
+  const unsigned short *TargetBins16;
+  void *MaskPtr;
+  vtkIdType *SourceInc;
+  vtkIdType *MaskInc;
+  vtkIdType Step[3]; // to the neighbours of the source voxel, 0 on axes without interpolation
+  bool Interpolate;
+  double Weights[8];
+  bool Transformed; // image 1 sampled through Matrix instead of translated
+  double Matrix[3][4]; // structured coordinates of image 2 to those of image 1
+  int SourceExtent[6];
+  int ExtentStart[3];
+  int ScalarType;
+  int RowLength;
+  int RowsPerSlice;
+  int NumberOfRows;
+  const vtkIdType *Samples; // voxels of the extent to visit, all of them if NULL
+  vtkIdType NumberOfSamples;
+
+  int Binning;
+  int BinNumber[2];
+  double Width[2];
+  double Inverse[2];
+  double Half;
+  const int *Table[2];
+  int TableOffset;
+
+  long *HistS[VTK_MAX_THREADS];
+  long *HistST[VTK_MAX_THREADS];
+  double *WeightedHistST[VTK_MAX_THREADS];
+  double Count[VTK_MAX_THREADS];
+  int Negative[VTK_MAX_THREADS];
+};
+
+//----------------------------------------------------------------------------
+template <class T>
+static inline int vtkImageJointHistogramLookup(vtkImageJointHistogramThreadStruct *str, int image, T value)
+{
+  if (str->Table[image])
+  {
+    return str->Table[image][(int) value + str->TableOffset];
+  }
+  return vtkImageJointHistogramBin((double) value, str->Width[image], str->Inverse[image],
+                                   str->Half, str->BinNumber[image]);
+}
+
+//----------------------------------------------------------------------------
+// Bin image 2 over the extent into bins, and count the voxels of each bin
+template <class T, class B>
+static int vtkImageJointHistogramBinTarget(const T *inPtr, const T *maskPtr, vtkIdType *inc,
+                                           vtkIdType *maskInc, int extent[6], int binning,
+                                           double width, int numBins, B *bins, long *histT,
+                                           double &count)
+{
+  double inverse = 1.0 / width;
+  double half = (binning == VTK_JOINT_HISTOGRAM_ROUND) ? 0.5 : 0.0;
+  vtkIdType numVoxels = 0;
+  int negative = 0;
+
+  for (int idZ = extent[4]; idZ <= extent[5]; idZ++)
+  {
+    for (int idY = extent[2]; idY <= extent[3]; idY++)
+    {
+      const T *in2Ptr = inPtr + (idZ - extent[4]) * inc[2] + (idY - extent[2]) * inc[1];
+      const T *mPtr = maskPtr ? maskPtr + (idZ - extent[4]) * maskInc[2] + (idY - extent[2]) * maskInc[1] : 0;
+      for (int idX = extent[0]; idX <= extent[1]; idX++, in2Ptr += inc[0], bins++)
+      {
+        int b;
+        if (binning == VTK_JOINT_HISTOGRAM_PARTIAL_VOLUME)
+        {
+          b = vtkImageJointHistogramClamp((int) *in2Ptr, numBins);
+        }
+        else
+        {
+          b = vtkImageJointHistogramBin((double) *in2Ptr, width, inverse, half, numBins);
+        }
+        if (b < 0)
+        {
+          negative = 1;
+          b = 0;
+        }
+        *bins = (B) b;
+        if (mPtr)
+        {
+          bool inside = (*mPtr != 0);
+          mPtr += maskInc[0];
+          if (!inside)
+          {
+            continue;
+          }
+        }
+        numVoxels++;
+        histT[b]++;
+      }
+    }
+  }
+
+  count = (double) numVoxels;
+  return negative;
+}
+
+//----------------------------------------------------------------------------
+// Count the sampled voxels of image 2 in each bin
+template <class T, class B>
+static void vtkImageJointHistogramCountSamples(const B *bins, const T *maskPtr, vtkIdType *maskInc,
+                                               int extent[6], const vtkIdType *samples,
+                                               vtkIdType numSamples, long *histT, double &count)
+{
+  vtkIdType rowLength = extent[1] - extent[0] + 1;
+  vtkIdType rowsPerSlice = extent[3] - extent[2] + 1;
+  vtkIdType numVoxels = 0;
+
+  for (vtkIdType i = 0; i < numSamples; i++)
+  {
+    vtkIdType sample = samples[i];
+    if (maskPtr)
+    {
+      vtkIdType idX = sample % rowLength;
+      vtkIdType idY = (sample / rowLength) % rowsPerSlice;
+      vtkIdType idZ = (sample / rowLength) / rowsPerSlice;
+      if (!maskPtr[idZ * maskInc[2] + idY * maskInc[1] + idX * maskInc[0]])
+      {
+        continue;
+      }
+    }
+    numVoxels++;
+    histT[bins[sample]]++;
+  }
+
+  count = (double) numVoxels;
+}
+
+//----------------------------------------------------------------------------
+template <class T, class B>
+static void vtkImageJointHistogramRows(vtkImageJointHistogramThreadStruct *str, T *, const B *targetBins,
+                                       int threadId, int firstRow, int lastRow)
+{
+  long *histS = str->HistS[threadId];
+  long *histST = str->HistST[threadId];
+  double *weightedST = str->WeightedHistST[threadId];
+  int numS = str->BinNumber[0];
+  vtkIdType s0 = str->SourceInc[0];
+  vtkIdType m0 = str->MaskPtr ? str->MaskInc[0] : 0;
+  vtkIdType x1 = str->Step[0], y1 = str->Step[1], z1 = str->Step[2];
+  int rowLength = str->RowLength;
+  bool partialVolume = (str->Binning == VTK_JOINT_HISTOGRAM_PARTIAL_VOLUME);
+  bool interpolate = str->Interpolate;
+  double F[8];
+  memcpy(F, str->Weights, sizeof(F));
+  vtkIdType count = 0;
+  int negative = 0;
+  int a, b;
+
+  for (int row = firstRow; row < lastRow; row++)
+  {
+    int idY = row % str->RowsPerSlice;
+    int idZ = row / str->RowsPerSlice;
+    const T *in1Ptr = (const T *) str->SourcePtr + idZ * str->SourceInc[2] + idY * str->SourceInc[1];
+    const B *binPtr = targetBins + (vtkIdType) row * rowLength;
+    const T *maskPtr = str->MaskPtr ?
+                       (const T *) str->MaskPtr + idZ * str->MaskInc[2] + idY * str->MaskInc[1] : 0;
+
+    // Partial volume: the weights go to the bins of the neighbours
+    if (partialVolume)
+    {
+      for (int idX = 0; idX < rowLength; idX++, in1Ptr += s0, binPtr++, maskPtr += m0)
+      {
+        if (maskPtr && !*maskPtr)
+        {
+          continue;
+        }
+        count++;
+        b = *binPtr * numS;
+        if (!interpolate)
+        {
+          weightedST[b + vtkImageJointHistogramClamp((int) *in1Ptr, numS)] += 1.0;
+          continue;
+        }
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[0], numS)]            += F[0];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[x1], numS)]           += F[1];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[y1], numS)]           += F[2];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[x1 + y1], numS)]      += F[3];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[z1], numS)]           += F[4];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[x1 + z1], numS)]      += F[5];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[y1 + z1], numS)]      += F[6];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[x1 + y1 + z1], numS)] += F[7];
+      }
+      continue;
+    }
+
+    for (int idX = 0; idX < rowLength; idX++, in1Ptr += s0, binPtr++, maskPtr += m0)
+    {
+      if (maskPtr && !*maskPtr)
+      {
+        continue;
+      }
+      count++;
+
+      if (interpolate)
+      {
+        double Vxyz = (in1Ptr[0]       * F[0] + in1Ptr[x1]           * F[1] +
+                       in1Ptr[y1]      * F[2] + in1Ptr[x1 + y1]      * F[3] +
+                       in1Ptr[z1]      * F[4] + in1Ptr[x1 + z1]      * F[5] +
+                       in1Ptr[y1 + z1] * F[6] + in1Ptr[x1 + y1 + z1] * F[7]);
+        a = vtkImageJointHistogramBin(Vxyz, str->Width[0], str->Inverse[0], str->Half, numS);
+      }
+      else
+      {
+        a = vtkImageJointHistogramLookup(str, 0, *in1Ptr);
+      }
+      b = *binPtr;
+
+      // only rounding down reports negative values, which go to bin 0
+      if (a < 0)
+      {
+        negative = 1;
+        a = 0;
+      }
+      histS[a]++;
+      histST[b * numS + a]++;
+    }
+  }
+
+  str->Count[threadId] = (double) count;
+  str->Negative[threadId] = negative;
+}
+
+//----------------------------------------------------------------------------
+// The voxel of image 1 below a transformed point (offset from SourcePtr), its
+// trilinear weights, and the steps to its neighbours, which are not needed
+// at the upper faces of the extent
+static inline vtkIdType vtkImageJointHistogramSourceVoxel(const vtkImageJointHistogramThreadStruct *str,
+                                                          const double point[3], double F[8],
+                                                          vtkIdType step[3])
+{
+  const vtkIdType *inc = str->SourceInc;
+  const int *inExt = str->SourceExtent;
+  vtkIdType offset = 0;
+  double f[3];
+  for (int i = 0; i < 3; i++)
+  {
+    int index = vtkMath::Floor(point[i]);
+    f[i] = point[i] - index;
+    if (index < inExt[2 * i])
+    {
+      index = inExt[2 * i];
+      f[i] = 0.0;
+    }
+    if (index >= inExt[2 * i + 1])
+    {
+      index = inExt[2 * i + 1];
+      f[i] = 0.0;
+    }
+    step[i] = (index < inExt[2 * i + 1]) ? inc[i] : 0;
+    offset += (index - inExt[2 * i]) * inc[i];
+  }
+  F[0] = (1.0 - f[0]) * (1.0 - f[1]) * (1.0 - f[2]);
+  F[1] =        f[0]  * (1.0 - f[1]) * (1.0 - f[2]);
+  F[2] = (1.0 - f[0]) *        f[1]  * (1.0 - f[2]);
+  F[3] =        f[0]  *        f[1]  * (1.0 - f[2]);
+  F[4] = (1.0 - f[0]) * (1.0 - f[1]) *        f[2];
+  F[5] =        f[0]  * (1.0 - f[1]) *        f[2];
+  F[6] = (1.0 - f[0]) *        f[1]  *        f[2];
+  F[7] =        f[0]  *        f[1]  *        f[2];
+  return offset;
+}
+
+//----------------------------------------------------------------------------
+// The row starts are transformed, and the points along a row stepped by
+// the first column of the matrix. SourcePtr is the first voxel of image 1.
+template <class T, class B>
+static void vtkImageJointHistogramTransformedRows(vtkImageJointHistogramThreadStruct *str, T *,
+                                                  const B *targetBins, int threadId,
+                                                  int firstRow, int lastRow)
+{
+  long *histS = str->HistS[threadId];
+  long *histST = str->HistST[threadId];
+  double *weightedST = str->WeightedHistST[threadId];
+  int numS = str->BinNumber[0];
+  vtkIdType m0 = str->MaskPtr ? str->MaskInc[0] : 0;
+  int rowLength = str->RowLength;
+  bool partialVolume = (str->Binning == VTK_JOINT_HISTOGRAM_PARTIAL_VOLUME);
+  double step[3] = { str->Matrix[0][0], str->Matrix[1][0], str->Matrix[2][0] };
+  vtkIdType count = 0;
+  int negative = 0;
+  int a, b;
+
+  for (int row = firstRow; row < lastRow; row++)
+  {
+    int idY = row % str->RowsPerSlice;
+    int idZ = row / str->RowsPerSlice;
+    double x = str->ExtentStart[0];
+    double y = str->ExtentStart[1] + idY;
+    double z = str->ExtentStart[2] + idZ;
+    double point[3];
+    for (int i = 0; i < 3; i++)
+    {
+      point[i] = str->Matrix[i][0] * x + str->Matrix[i][1] * y + str->Matrix[i][2] * z + str->Matrix[i][3];
+    }
+    const B *binPtr = targetBins + (vtkIdType) row * rowLength;
+    const T *maskPtr = str->MaskPtr ?
+                       (const T *) str->MaskPtr + idZ * str->MaskInc[2] + idY * str->MaskInc[1] : 0;
+
+    for (int idX = 0; idX < rowLength; idX++, binPtr++, maskPtr += m0,
+         point[0] += step[0], point[1] += step[1], point[2] += step[2])
+    {
+      if (maskPtr && !*maskPtr)
+      {
+        continue;
+      }
+      count++;
+
+      double F[8];
+      vtkIdType x1[3];
+      const T *in1Ptr = (const T *) str->SourcePtr + vtkImageJointHistogramSourceVoxel(str, point, F, x1);
+      vtkIdType X = x1[0], Y = x1[1], Z = x1[2];
+
+      if (partialVolume)
+      {
+        b = *binPtr * numS;
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[0], numS)]         += F[0];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[X], numS)]         += F[1];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[Y], numS)]         += F[2];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[X + Y], numS)]     += F[3];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[Z], numS)]         += F[4];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[X + Z], numS)]     += F[5];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[Y + Z], numS)]     += F[6];
+        weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[X + Y + Z], numS)] += F[7];
+        continue;
+      }
+
+      double Vxyz = (in1Ptr[0]     * F[0] + in1Ptr[X]         * F[1] +
+                     in1Ptr[Y]     * F[2] + in1Ptr[X + Y]     * F[3] +
+                     in1Ptr[Z]     * F[4] + in1Ptr[X + Z]     * F[5] +
+                     in1Ptr[Y + Z] * F[6] + in1Ptr[X + Y + Z] * F[7]);
+      a = vtkImageJointHistogramBin(Vxyz, str->Width[0], str->Inverse[0], str->Half, numS);
+      b = *binPtr;
+      if (a < 0)
+      {
+        negative = 1;
+        a = 0;
+      }
+      histS[a]++;
+      histST[b * numS + a]++;
+    }
+  }
+
+  str->Count[threadId] = (double) count;
+  str->Negative[threadId] = negative;
+}
+
+//----------------------------------------------------------------------------
+// Only the sampled voxels, each located from its index in the extent
+template <class T, class B>
+static void vtkImageJointHistogramSamples(vtkImageJointHistogramThreadStruct *str, T *,
+                                          const B *targetBins, int threadId,
+                                          vtkIdType firstSample, vtkIdType lastSample)
+{
+  long *histS = str->HistS[threadId];
+  long *histST = str->HistST[threadId];
+  double *weightedST = str->WeightedHistST[threadId];
+  int numS = str->BinNumber[0];
+  const vtkIdType *inc = str->SourceInc;
+  vtkIdType rowLength = str->RowLength;
+  bool partialVolume = (str->Binning == VTK_JOINT_HISTOGRAM_PARTIAL_VOLUME);
+  bool interpolate = str->Interpolate;
+  vtkIdType count = 0;
+  int negative = 0;
+  int a, b;
+
+  for (vtkIdType i = firstSample; i < lastSample; i++)
+  {
+    vtkIdType sample = str->Samples[i];
+    int idX = (int) (sample % rowLength);
+    int idY = (int) ((sample / rowLength) % str->RowsPerSlice);
+    int idZ = (int) ((sample / rowLength) / str->RowsPerSlice);
+    if (str->MaskPtr &&
+        !((const T *) str->MaskPtr)[idZ * str->MaskInc[2] + idY * str->MaskInc[1] + idX * str->MaskInc[0]])
+    {
+      continue;
+    }
+    count++;
+
+    const T *in1Ptr;
+    double F[8];
+    vtkIdType x1[3];
+    if (str->Transformed)
+    {
+      double x = str->ExtentStart[0] + idX;
+      double y = str->ExtentStart[1] + idY;
+      double z = str->ExtentStart[2] + idZ;
+      double point[3];
+      for (int j = 0; j < 3; j++)
+      {
+        point[j] = str->Matrix[j][0] * x + str->Matrix[j][1] * y + str->Matrix[j][2] * z + str->Matrix[j][3];
+      }
+      in1Ptr = (const T *) str->SourcePtr + vtkImageJointHistogramSourceVoxel(str, point, F, x1);
+    }
+    else
+    {
+      in1Ptr = (const T *) str->SourcePtr + idZ * inc[2] + idY * inc[1] + idX * inc[0];
+      memcpy(F, str->Weights, sizeof(F));
+      memcpy(x1, str->Step, sizeof(x1));
+    }
+    vtkIdType X = x1[0], Y = x1[1], Z = x1[2];
+
+    if (partialVolume)
+    {
+      b = targetBins[sample] * numS;
+      if (!interpolate)
+      {
+        weightedST[b + vtkImageJointHistogramClamp((int) *in1Ptr, numS)] += 1.0;
+        continue;
+      }
+      weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[0], numS)]         += F[0];
+      weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[X], numS)]         += F[1];
+      weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[Y], numS)]         += F[2];
+      weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[X + Y], numS)]     += F[3];
+      weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[Z], numS)]         += F[4];
+      weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[X + Z], numS)]     += F[5];
+      weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[Y + Z], numS)]     += F[6];
+      weightedST[b + vtkImageJointHistogramClamp((int) in1Ptr[X + Y + Z], numS)] += F[7];
+      continue;
+    }
+
+    if (interpolate)
+    {
+      double Vxyz = (in1Ptr[0]     * F[0] + in1Ptr[X]         * F[1] +
+                     in1Ptr[Y]     * F[2] + in1Ptr[X + Y]     * F[3] +
+                     in1Ptr[Z]     * F[4] + in1Ptr[X + Z]     * F[5] +
+                     in1Ptr[Y + Z] * F[6] + in1Ptr[X + Y + Z] * F[7]);
+      a = vtkImageJointHistogramBin(Vxyz, str->Width[0], str->Inverse[0], str->Half, numS);
+    }
+    else
+    {
+      a = vtkImageJointHistogramLookup(str, 0, *in1Ptr);
+    }
+    b = targetBins[sample];
+    if (a < 0)
+    {
+      negative = 1;
+      a = 0;
+    }
+    histS[a]++;
+    histST[b * numS + a]++;
+  }
+
+  str->Count[threadId] = (double) count;
+  str->Negative[threadId] = negative;
+}
+
+//----------------------------------------------------------------------------
+// Rows of the extent, or samples if there are any, from first to last
+template <class T, class B>
+static void vtkImageJointHistogramExecuteRange(vtkImageJointHistogramThreadStruct *str, T *dummy,
+                                               const B *targetBins, int threadId,
+                                               vtkIdType first, vtkIdType last)
+{
+  if (str->Samples)
+  {
+    vtkImageJointHistogramSamples(str, dummy, targetBins, threadId, first, last);
+  }
+  else if (str->Transformed)
+  {
+    vtkImageJointHistogramTransformedRows(str, dummy, targetBins, threadId, (int) first, (int) last);
+  }
+  else
+  {
+    vtkImageJointHistogramRows(str, dummy, targetBins, threadId, (int) first, (int) last);
+  }
+}
+
+//----------------------------------------------------------------------------
+static VTK_THREAD_RETURN_TYPE vtkImageJointHistogramThreadedExecute(void *arg)
+{
+  int threadId = static_cast<vtkMultiThreader::ThreadInfo *>(arg)->ThreadID;
+  int threadCount = static_cast<vtkMultiThreader::ThreadInfo *>(arg)->NumberOfThreads;
+  vtkImageJointHistogramThreadStruct *str = static_cast<vtkImageJointHistogramThreadStruct *>
+      (static_cast<vtkMultiThreader::ThreadInfo *>(arg)->UserData);
+
+  // every thread clears its own histograms
+  size_t numBins = (size_t) str->BinNumber[0] * str->BinNumber[1];
+  if (str->Binning == VTK_JOINT_HISTOGRAM_PARTIAL_VOLUME)
+  {
+    memset(str->WeightedHistST[threadId], 0, numBins * sizeof(double));
+  }
+  else
+  {
+    memset(str->HistS[threadId], 0, str->BinNumber[0] * sizeof(long));
+    memset(str->HistST[threadId], 0, numBins * sizeof(long));
+  }
+
+  vtkIdType units = str->Samples ? str->NumberOfSamples : (vtkIdType) str->NumberOfRows;
+  vtkIdType first = units * threadId / threadCount;
+  vtkIdType last = units * (threadId + 1) / threadCount;
+  if (str->TargetBins8)
+  {
+    switch (str->ScalarType)
+    {
+      vtkTemplateMacro(vtkImageJointHistogramExecuteRange(str, (VTK_TT *) 0, str->TargetBins8,
+                                                          threadId, first, last));
+    }
+  }
+  else
+  {
+    switch (str->ScalarType)
+    {
+      vtkTemplateMacro(vtkImageJointHistogramExecuteRange(str, (VTK_TT *) 0, str->TargetBins16,
+                                                          threadId, first, last));
+    }
+  }
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//----------------------------------------------------------------------------
+vtkImageJointHistogram::vtkImageJointHistogram()
+{
+  this->BinNumber[0] = 0;
+  this->BinNumber[1] = 0;
+  this->BinWidth[0] = 1.0;
+  this->BinWidth[1] = 1.0;
+  this->Binning = VTK_JOINT_HISTOGRAM_FLOOR;
+  this->Count = 0.0;
+  this->BinTableScalarType = -1;
+  this->TargetImage = 0;
+  this->TargetMask = 0;
+  memset(this->TargetExtent, 0, sizeof(this->TargetExtent));
+  this->TargetNegative = 0;
+  this->TargetCount = 0.0;
+  this->TargetBinWidth = 0.0;
+  this->TargetBinNumber = 0;
+  this->TargetBinning = -1;
+  this->SamplingFraction = 1.0;
+  this->SamplesFraction = -1.0;
+  memset(this->SamplesExtent, 0, sizeof(this->SamplesExtent));
+
+  this->Threader = vtkMultiThreader::New();
+  this->NumberOfThreads = this->Threader->GetNumberOfThreads();
+}
+
+//----------------------------------------------------------------------------
+vtkImageJointHistogram::~vtkImageJointHistogram()
+{
+  this->Threader->Delete();
+}
+
+//----------------------------------------------------------------------------
+void vtkImageJointHistogram::SetBinNumber(int numS, int numT)
+{
+  if (numS < 1 || numT < 1)
+  {
+    vtkErrorMacro("SetBinNumber: There must be at least one bin.");
+    return;
+  }
+  this->BinNumber[0] = numS;
+  this->BinNumber[1] = numT;
+  this->HistS.assign(numS, 0);
+  this->HistT.assign(numT, 0);
+  this->HistST.assign((size_t) numS * numT, 0);
+  this->WeightedHistS.clear();
+  this->WeightedHistST.clear();
+  this->ThreadHistS.clear();
+  this->ThreadHistST.clear();
+  this->ThreadWeightedHistST.clear();
+  this->TargetBins8.clear();
+  this->TargetBins16.clear();
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+long *vtkImageJointHistogram::GetHistS()
+{
+  return this->HistS.empty() ? 0 : &(this->HistS[0]);
+}
+
+//----------------------------------------------------------------------------
+long *vtkImageJointHistogram::GetHistT()
+{
+  return this->HistT.empty() ? 0 : &(this->HistT[0]);
+}
+
+//----------------------------------------------------------------------------
+long *vtkImageJointHistogram::GetHistST()
+{
+  return this->HistST.empty() ? 0 : &(this->HistST[0]);
+}
+
+//----------------------------------------------------------------------------
+double *vtkImageJointHistogram::GetWeightedHistS()
+{
+  if (this->WeightedHistS.size() != (size_t) this->BinNumber[0])
+  {
+    this->WeightedHistS.assign(this->BinNumber[0], 0.0);
+  }
+  return this->WeightedHistS.empty() ? 0 : &(this->WeightedHistS[0]);
+}
+
+//----------------------------------------------------------------------------
+double *vtkImageJointHistogram::GetWeightedHistST()
+{
+  size_t numBins = (size_t) this->BinNumber[0] * this->BinNumber[1];
+  if (this->WeightedHistST.size() != numBins)
+  {
+    this->WeightedHistST.assign(numBins, 0.0);
+  }
+  return this->WeightedHistST.empty() ? 0 : &(this->WeightedHistST[0]);
+}
+
+//----------------------------------------------------------------------------
+void vtkImageJointHistogram::UpdateBinTables(int scalarType)
+{
+  // only 8 and 16 bit intensities are worth a table
+  int minimum = 0;
+  int size = 0;
+  switch (scalarType)
+  {
+  case VTK_CHAR:
+    minimum = VTK_CHAR_MIN;
+    size = 256;
+    break;
+  case VTK_SIGNED_CHAR:
+    minimum = VTK_SIGNED_CHAR_MIN;
+    size = 256;
+    break;
+  case VTK_UNSIGNED_CHAR:
+    size = 256;
+    break;
+  case VTK_SHORT:
+    minimum = VTK_SHORT_MIN;
+    size = 65536;
+    break;
+  case VTK_UNSIGNED_SHORT:
+    size = 65536;
+    break;
+  }
+  if (this->Binning == VTK_JOINT_HISTOGRAM_PARTIAL_VOLUME)
+  {
+    size = 0;
+  }
+  if (size == 0)
+  {
+    this->BinTable[0].clear();
+    this->BinTable[1].clear();
+    this->BinTableScalarType = -1;
+    return;
+  }
+
+  // rebuild only if the scalar type or the binning changed
+  if (this->BinTableScalarType == scalarType && this->BinTableBinning == this->Binning &&
+      this->BinTableWidth[0] == this->BinWidth[0] && this->BinTableWidth[1] == this->BinWidth[1] &&
+      this->BinTableNumber[0] == this->BinNumber[0] && this->BinTableNumber[1] == this->BinNumber[1])
+  {
+    return;
+  }
+  double half = (this->Binning == VTK_JOINT_HISTOGRAM_ROUND) ? 0.5 : 0.0;
+  for (int i = 0; i < 2; i++)
+  {
+    this->BinTable[i].resize(size);
+    for (int v = 0; v < size; v++)
+    {
+      this->BinTable[i][v] = vtkImageJointHistogramBin(minimum + v, this->BinWidth[i], 1.0 / this->BinWidth[i],
+                                                       half, this->BinNumber[i]);
+    }
+    this->BinTableWidth[i] = this->BinWidth[i];
+    this->BinTableNumber[i] = this->BinNumber[i];
+  }
+  this->BinTableScalarType = scalarType;
+  this->BinTableBinning = this->Binning;
+}
+
+//----------------------------------------------------------------------------
+int vtkImageJointHistogram::TargetBinsValid(vtkImageData *target, vtkImageData *mask, int extent[6])
+{
+  if (this->TargetBins8.empty() && this->TargetBins16.empty())
+  {
+    return 0;
+  }
+  if (target != this->TargetImage || mask != this->TargetMask ||
+      memcmp(extent, this->TargetExtent, sizeof(this->TargetExtent)) != 0)
+  {
+    return 0;
+  }
+  if (this->TargetBinWidth != this->BinWidth[1] || this->TargetBinNumber != this->BinNumber[1] ||
+      this->TargetBinning != this->Binning)
+  {
+    return 0;
+  }
+  return (this->TargetTime > target->GetMTime() && (!mask || this->TargetTime > mask->GetMTime()));
+}
+
+//----------------------------------------------------------------------------
+void vtkImageJointHistogram::UpdateSamples(int extent[6])
+{
+  this->Samples.clear();
+  this->SamplesFraction = this->SamplingFraction;
+  memcpy(this->SamplesExtent, extent, sizeof(this->SamplesExtent));
+  if (this->SamplingFraction >= 1.0)
+  {
+    return;
+  }
+
+  // One voxel from each of numSamples equal runs of the extent, so that they
+  // are spread over all of it and sorted. The same seed gives the same voxels
+  // for the same extent and fraction.
+  vtkIdType numVoxels = (vtkIdType) (extent[1] - extent[0] + 1) * (extent[3] - extent[2] + 1) *
+                        (extent[5] - extent[4] + 1);
+  vtkIdType numSamples = (vtkIdType) (this->SamplingFraction * numVoxels + 0.5);
+  if (numSamples < 1)
+  {
+    numSamples = 1;
+  }
+  vtkMinimalStandardRandomSequence *random = vtkMinimalStandardRandomSequence::New();
+  random->SetSeed(1);
+  this->Samples.resize(numSamples);
+  for (vtkIdType i = 0; i < numSamples; i++)
+  {
+    vtkIdType first = numVoxels * i / numSamples;
+    vtkIdType last = numVoxels * (i + 1) / numSamples;
+    vtkIdType sample = first + (vtkIdType) (random->GetValue() * (last - first));
+    this->Samples[i] = (sample < last) ? sample : last - 1;
+    random->Next();
+  }
+  random->Delete();
+}
+
+//----------------------------------------------------------------------------
+int vtkImageJointHistogram::ComputeTarget(vtkImageData *target, vtkImageData *mask, int extent[6])
+{
+  if (this->HistT.empty())
+  {
+    vtkErrorMacro("ComputeTarget: SetBinNumber must be called first.");
+    return 0;
+  }
+  int binsValid = this->TargetBinsValid(target, mask, extent);
+  int samplesValid = (this->SamplesFraction == this->SamplingFraction &&
+                      memcmp(extent, this->SamplesExtent, sizeof(this->SamplesExtent)) == 0);
+  if (binsValid && samplesValid)
+  {
+    return this->TargetNegative ? -1 : 1;
+  }
+  if (this->BinNumber[1] > 65536)
+  {
+    vtkErrorMacro("ComputeTarget: Image 2 cannot have more than 65536 bins.");
+    return 0;
+  }
+  if (!samplesValid)
+  {
+    this->UpdateSamples(extent);
+  }
+  void *maskPtr = mask ? mask->GetScalarPointer(extent[0], extent[2], extent[4]) : 0;
+  vtkIdType *maskInc = mask ? mask->GetIncrements() : 0;
+  long *histT = &(this->HistT[0]);
+
+  // Bin all of image 2, which also counts all of it
+  if (!binsValid || this->Samples.empty())
+  {
+    if (!this->BinTarget(target, mask, extent))
+    {
+      return 0;
+    }
+  }
+
+  // or only the samples, whose bins are looked up
+  if (!this->Samples.empty())
+  {
+    std::fill(this->HistT.begin(), this->HistT.end(), 0);
+    switch (target->GetScalarType())
+    {
+      vtkTemplateMacro(
+        if (!this->TargetBins8.empty())
+        {
+          vtkImageJointHistogramCountSamples(&(this->TargetBins8[0]), (VTK_TT *) maskPtr, maskInc, extent,
+                                             &(this->Samples[0]), (vtkIdType) this->Samples.size(),
+                                             histT, this->TargetCount);
+        }
+        else
+        {
+          vtkImageJointHistogramCountSamples(&(this->TargetBins16[0]), (VTK_TT *) maskPtr, maskInc, extent,
+                                             &(this->Samples[0]), (vtkIdType) this->Samples.size(),
+                                             histT, this->TargetCount);
+        });
+    }
+  }
+  return this->TargetNegative ? -1 : 1;
+}
+
+//----------------------------------------------------------------------------
+int vtkImageJointHistogram::BinTarget(vtkImageData *target, vtkImageData *mask, int extent[6])
+{
+  size_t numVoxels = (size_t) (extent[1] - extent[0] + 1) * (extent[3] - extent[2] + 1) *
+                     (extent[5] - extent[4] + 1);
+  void *inPtr = target->GetScalarPointer(extent[0], extent[2], extent[4]);
+  void *maskPtr = mask ? mask->GetScalarPointer(extent[0], extent[2], extent[4]) : 0;
+  vtkIdType *inc = target->GetIncrements();
+  vtkIdType *maskInc = mask ? mask->GetIncrements() : 0;
+  std::fill(this->HistT.begin(), this->HistT.end(), 0);
+  long *histT = &(this->HistT[0]);
+
+  this->TargetNegative = 0;
+  if (this->BinNumber[1] <= 256)
+  {
+    this->TargetBins16.clear();
+    this->TargetBins8.resize(numVoxels);
+    unsigned char *bins = &(this->TargetBins8[0]);
+    switch (target->GetScalarType())
+    {
+      vtkTemplateMacro(this->TargetNegative = vtkImageJointHistogramBinTarget(
+                         (VTK_TT *) inPtr, (VTK_TT *) maskPtr, inc, maskInc, extent, this->Binning,
+                         this->BinWidth[1], this->BinNumber[1], bins, histT, this->TargetCount));
+    default:
+      vtkErrorMacro("ComputeTarget: Unknown ScalarType");
+      return 0;
+    }
+  }
+  else
+  {
+    this->TargetBins8.clear();
+    this->TargetBins16.resize(numVoxels);
+    unsigned short *bins = &(this->TargetBins16[0]);
+    switch (target->GetScalarType())
+    {
+      vtkTemplateMacro(this->TargetNegative = vtkImageJointHistogramBinTarget(
+                         (VTK_TT *) inPtr, (VTK_TT *) maskPtr, inc, maskInc, extent, this->Binning,
+                         this->BinWidth[1], this->BinNumber[1], bins, histT, this->TargetCount));
+    default:
+      vtkErrorMacro("ComputeTarget: Unknown ScalarType");
+      return 0;
+    }
+  }
+
+  this->TargetImage = target;
+  this->TargetMask = mask;
+  memcpy(this->TargetExtent, extent, sizeof(this->TargetExtent));
+  this->TargetBinWidth = this->BinWidth[1];
+  this->TargetBinNumber = this->BinNumber[1];
+  this->TargetBinning = this->Binning;
+  this->TargetTime.Modified();
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+int vtkImageJointHistogram::Compute(vtkImageData *source, vtkImageData *target, vtkImageData *mask,
+                                    int extent[6], int loc000[3], int loc111[3], double weights[8])
+{
+  if (this->HistST.empty())
+  {
+    vtkErrorMacro("Compute: SetBinNumber must be called first.");
+    return 0;
+  }
+
+  // Check if translation takes us out of image 1.
+  int *inExt = source->GetExtent();
+  if ( (extent[0] + loc000[0] < inExt[0]) ||
+       (extent[2] + loc000[1] < inExt[2]) ||
+       (extent[4] + loc000[2] < inExt[4]) ||
+       (extent[1] + loc111[0] > inExt[1]) ||
+       (extent[3] + loc111[1] > inExt[3]) ||
+       (extent[5] + loc111[2] > inExt[5]) )
+  {
+    return 0;
+  }
+
+  // image 2 is only binned again if it, or its binning, changed
+  if (this->ComputeTarget(target, mask, extent) == 0)
+  {
+    return 0;
+  }
+
+  vtkImageJointHistogramThreadStruct str;
+  int start[3] = { extent[0] + loc000[0], extent[2] + loc000[1], extent[4] + loc000[2] };
+  str.SourcePtr = source->GetScalarPointer(start);
+  str.TargetBins8 = this->TargetBins8.empty() ? 0 : &(this->TargetBins8[0]);
+  str.TargetBins16 = this->TargetBins16.empty() ? 0 : &(this->TargetBins16[0]);
+  str.MaskPtr = mask ? mask->GetScalarPointer(extent[0], extent[2], extent[4]) : 0;
+  str.SourceInc = source->GetIncrements();
+  str.MaskInc = mask ? mask->GetIncrements() : 0;
+  str.Interpolate = false;
+  for (int i = 0; i < 3; i++)
+  {
+    str.Step[i] = (loc111[i] != loc000[i]) ? str.SourceInc[i] : 0;
+    str.Interpolate = str.Interpolate || loc000[i] != 0 || loc111[i] != 0;
+  }
+  memcpy(str.Weights, weights, sizeof(str.Weights));
+  str.Transformed = false;
+  str.ScalarType = source->GetScalarType();
+  str.TableOffset = -(int) source->GetScalarTypeMin();
+  str.RowLength = extent[1] - extent[0] + 1;
+  str.RowsPerSlice = extent[3] - extent[2] + 1;
+  str.NumberOfRows = str.RowsPerSlice * (extent[5] - extent[4] + 1);
+  str.Samples = this->Samples.empty() ? 0 : &(this->Samples[0]);
+  str.NumberOfSamples = (vtkIdType) this->Samples.size();
+
+  return this->Execute(&str);
+}
+
+//----------------------------------------------------------------------------
+int vtkImageJointHistogram::ComputeTransformed(vtkImageData *source, vtkImageData *target,
+                                               vtkImageData *mask, int extent[6],
+                                               vtkMatrix4x4 *matrix)
+{
+  if (this->HistST.empty())
+  {
+    vtkErrorMacro("ComputeTransformed: SetBinNumber must be called first.");
+    return 0;
+  }
+
+  // The matrix in structured coordinates, from those of image 2 to those of image 1
+  vtkImageJointHistogramThreadStruct str;
+  double originS[3], spacingS[3], originT[3], spacingT[3];
+  source->GetOrigin(originS);
+  source->GetSpacing(spacingS);
+  target->GetOrigin(originT);
+  target->GetSpacing(spacingT);
+  for (int i = 0; i < 3; i++)
+  {
+    str.Matrix[i][3] = matrix->GetElement(i, 3) - originS[i];
+    for (int j = 0; j < 3; j++)
+    {
+      str.Matrix[i][j] = matrix->GetElement(i, j) * spacingT[j] / spacingS[i];
+      str.Matrix[i][3] += matrix->GetElement(i, j) * originT[j];
+    }
+    str.Matrix[i][3] /= spacingS[i];
+  }
+
+  // Check if the transformation takes a corner of the extent out of
+  // image 1, the other voxels are then inside as well.
+  int *inExt = source->GetExtent();
+  for (int corner = 0; corner < 8; corner++)
+  {
+    double x = extent[(corner & 1) ? 1 : 0];
+    double y = extent[(corner & 2) ? 3 : 2];
+    double z = extent[(corner & 4) ? 5 : 4];
+    for (int i = 0; i < 3; i++)
+    {
+      double point = str.Matrix[i][0] * x + str.Matrix[i][1] * y + str.Matrix[i][2] * z + str.Matrix[i][3];
+      if (point < inExt[2 * i] || point > inExt[2 * i + 1])
+      {
+        return 0;
+      }
+    }
+  }
+
+  // image 2 is only binned again if it, or its binning, changed
+  if (this->ComputeTarget(target, mask, extent) == 0)
+  {
+    return 0;
+  }
+
+  str.SourcePtr = source->GetScalarPointer(inExt[0], inExt[2], inExt[4]);
+  str.TargetBins8 = this->TargetBins8.empty() ? 0 : &(this->TargetBins8[0]);
+  str.TargetBins16 = this->TargetBins16.empty() ? 0 : &(this->TargetBins16[0]);
+  str.MaskPtr = mask ? mask->GetScalarPointer(extent[0], extent[2], extent[4]) : 0;
+  str.SourceInc = source->GetIncrements();
+  str.MaskInc = mask ? mask->GetIncrements() : 0;
+  str.Interpolate = true;
+  str.Transformed = true;
+  for (int i = 0; i < 3; i++)
+  {
+    str.Step[i] = 0;
+    str.SourceExtent[2 * i] = inExt[2 * i];
+    str.SourceExtent[2 * i + 1] = inExt[2 * i + 1];
+    str.ExtentStart[i] = extent[2 * i];
+  }
+  str.ScalarType = source->GetScalarType();
+  str.TableOffset = -(int) source->GetScalarTypeMin();
+  str.RowLength = extent[1] - extent[0] + 1;
+  str.RowsPerSlice = extent[3] - extent[2] + 1;
+  str.NumberOfRows = str.RowsPerSlice * (extent[5] - extent[4] + 1);
+  str.Samples = this->Samples.empty() ? 0 : &(this->Samples[0]);
+  str.NumberOfSamples = (vtkIdType) this->Samples.size();
+
+  return this->Execute(&str);
+}
+
+//----------------------------------------------------------------------------
+int vtkImageJointHistogram::Execute(vtkImageJointHistogramThreadStruct *strPtr)
+{
+  vtkImageJointHistogramThreadStruct &str = *strPtr;
+  str.Binning = this->Binning;
+  str.Half = (this->Binning == VTK_JOINT_HISTOGRAM_ROUND) ? 0.5 : 0.0;
+  this->UpdateBinTables(str.ScalarType);
+  for (int i = 0; i < 2; i++)
+  {
+    str.BinNumber[i] = this->BinNumber[i];
+    str.Width[i] = this->BinWidth[i];
+    str.Inverse[i] = 1.0 / this->BinWidth[i];
+    str.Table[i] = this->BinTable[i].empty() ? 0 : &(this->BinTable[i][0]);
+  }
+
+  // each thread fills a histogram of its own, only worth it if the
+  // threads have more voxels to go through than bins to clear and merge
+  size_t numBins = (size_t) this->BinNumber[0] * this->BinNumber[1];
+  double numVoxels = str.Samples ? (double) str.NumberOfSamples : (double) str.NumberOfRows * str.RowLength;
+  // no more than SingleMethodExecute will start, or the merge would read
+  // the counts and histograms of threads that never ran
+  int numThreads = this->NumberOfThreads;
+  int maxThreads = vtkMultiThreader::GetGlobalMaximumNumberOfThreads();
+  if (maxThreads > 0 && numThreads > maxThreads)
+  {
+    numThreads = maxThreads;
+  }
+  if (!str.Samples && numThreads > str.NumberOfRows)
+  {
+    numThreads = str.NumberOfRows;
+  }
+  if (numThreads > numVoxels / numBins)
+  {
+    numThreads = (int) (numVoxels / numBins);
+  }
+  if (numThreads < 1)
+  {
+    numThreads = 1;
+  }
+
+  bool partialVolume = (this->Binning == VTK_JOINT_HISTOGRAM_PARTIAL_VOLUME);
+  int numS = this->BinNumber[0];
+  if (partialVolume)
+  {
+    this->GetWeightedHistST();
+    this->ThreadWeightedHistST.resize(numThreads - 1);
+  }
+  else
+  {
+    this->ThreadHistS.resize((size_t) (numThreads - 1) * numS);
+    this->ThreadHistST.resize(numThreads - 1);
+  }
+  for (int i = 0; i < numThreads; i++)
+  {
+    str.HistS[i] = 0;
+    str.HistST[i] = 0;
+    str.WeightedHistST[i] = 0;
+    if (partialVolume)
+    {
+      std::vector<double> &hist = i ? this->ThreadWeightedHistST[i - 1] : this->WeightedHistST;
+      hist.resize(numBins);
+      str.WeightedHistST[i] = &(hist[0]);
+    }
+    else
+    {
+      std::vector<long> &hist = i ? this->ThreadHistST[i - 1] : this->HistST;
+      hist.resize(numBins);
+      str.HistST[i] = &(hist[0]);
+      str.HistS[i] = i ? &(this->ThreadHistS[(size_t) (i - 1) * numS]) : &(this->HistS[0]);
+    }
+  }
+
+  this->Threader->SetNumberOfThreads(numThreads);
+  this->Threader->SetSingleMethod(vtkImageJointHistogramThreadedExecute, strPtr);
+  this->Threader->SingleMethodExecute();
+
+  // merge the threads' histograms into the first ones
+  this->Count = 0.0;
+  int negative = this->TargetNegative;
+  for (int i = 0; i < numThreads; i++)
+  {
+    this->Count += str.Count[i];
+    negative |= str.Negative[i];
+  }
+  for (int i = 1; i < numThreads; i++)
+  {
+    if (partialVolume)
+    {
+      const double *in = str.WeightedHistST[i];
+      double *out = str.WeightedHistST[0];
+      for (size_t j = 0; j < numBins; j++)
+      {
+        out[j] += in[j];
+      }
+    }
+    else
+    {
+      for (int s = 0; s < numS; s++)
+      {
+        str.HistS[0][s] += str.HistS[i][s];
+      }
+      const long *in = str.HistST[i];
+      long *out = str.HistST[0];
+      for (size_t j = 0; j < numBins; j++)
+      {
+        out[j] += in[j];
+      }
+    }
+  }
+
+  // the weights spread over the neighbours only add up per target bin,
+  // the weighted source histogram is the marginal of the joint one
+  if (partialVolume)
+  {
+    double *histS = this->GetWeightedHistS();
+    memset(histS, 0, numS * sizeof(double));
+    for (int t = 0; t < this->BinNumber[1]; t++)
+    {
+      const double *rowST = str.WeightedHistST[0] + (size_t) t * numS;
+      for (int s = 0; s < numS; s++)
+      {
+        histS[s] += rowST[s];
+      }
+    }
+  }
+
+  return negative ? -1 : 1;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageJointHistogram::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os,indent);
+
+  os << indent << "BinNumber: ( " << this->BinNumber[0] << ", " << this->BinNumber[1] << " )\n";
+  os << indent << "BinWidth: ( "  << this->BinWidth[0]  << ", " << this->BinWidth[1]  << " )\n";
+  os << indent << "Binning: "        << this->Binning         << "\n";
+  os << indent << "NumberOfThreads: " << this->NumberOfThreads << "\n";
+  os << indent << "Count: "          << this->Count           << "\n";
+  os << indent << "TargetCount: "    << this->TargetCount     << "\n";
+  os << indent << "SamplingFraction: " << this->SamplingFraction << "\n";
+}
@@ -0,0 +1,208 @@
+/*=========================================================================
+
+  Program:   Robarts Visualization Toolkit
+  Module:    vtkImageJointHistogram.h
+
+  Copyright (c) 1993-2002 Ken Martin, Will Schroeder, Bill Lorensen
+  All rights reserved.
+  See Copyright.txt or http://www.kitware.com/Copyright.htm for details.
+
+     This software is distributed WITHOUT ANY WARRANTY; without even
+     the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+     PURPOSE.  See the above copyright notice for more information.
+
+=========================================================================*/
+// .NAME vtkImageJointHistogram - Joint intensity histogram of 2 images
+// .SECTION Description
+// vtkImageJointHistogram fills the source (image 1), and joint histograms
+// the vtkImage*Manipulator similarity metrics are computed from. Image 1
+// can be translated with respect to image 2, and is then trilinearly
+// interpolated with the weights of the manipulator. The rows of the extent
+// are split between threads, each filling its own joint histogram, which
+// are summed at the end. Intensities of 8 and 16 bit images are binned through a
+// lookup table, others with a multiplication by the inverse bin width.
+// Image 2 does not move during a registration, so it is binned once by
+// ComputeTarget() into an 8 or 16 bit image of bin numbers that every
+// Compute() reads instead of its intensities. With ComputeTransformed(),
+// image 1 is resampled through an affine matrix within the same loop.
+// .SECTION See Also
+// vtkImageMIManipulator vtkImageSMIPVIManipulator
+
+#ifndef __vtkImageJointHistogram_h
+#define __vtkImageJointHistogram_h
+
+#include "vtkRobartsRegistrationExport.h"
+
+#include "vtkObject.h"
+#include "vtkImageData.h"
+
+#include <vector>
+
+class vtkMatrix4x4;
+class vtkMultiThreader;
+struct vtkImageJointHistogramThreadStruct;
+
+// binning of the intensities
+#define VTK_JOINT_HISTOGRAM_FLOOR 0
+#define VTK_JOINT_HISTOGRAM_ROUND 1
+#define VTK_JOINT_HISTOGRAM_PARTIAL_VOLUME 2
+
+class vtkRobartsRegistrationExport vtkImageJointHistogram : public vtkObject
+{
+public:
+  static vtkImageJointHistogram *New();
+  vtkTypeMacro(vtkImageJointHistogram,vtkObject);
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // Numbers of bins of image 1 (source) and image 2 (target), setting
+  // them allocates the histograms.
+  virtual void SetBinNumber(int numS, int numT);
+  vtkGetVector2Macro(BinNumber,int);
+
+  // Description:
+  // Number of intensities per bin.
+  vtkSetVector2Macro(BinWidth,double);
+  vtkGetVector2Macro(BinWidth,double);
+
+  // Description:
+  // How intensities are binned: VTK_JOINT_HISTOGRAM_FLOOR divides by the
+  // bin width and rounds down (values below 0 are an error),
+  // VTK_JOINT_HISTOGRAM_ROUND rounds to the nearest bin, and with
+  // VTK_JOINT_HISTOGRAM_PARTIAL_VOLUME the images already hold bin numbers
+  // and the trilinear weights are spread over the bins of the 8 neighbours
+  // instead of interpolating the intensity (weighted histograms). Bins
+  // past either end of the histogram are clamped to it.
+  vtkSetClampMacro(Binning,int,VTK_JOINT_HISTOGRAM_FLOOR,VTK_JOINT_HISTOGRAM_PARTIAL_VOLUME);
+  vtkGetMacro(Binning,int);
+
+  // Description:
+  // Maximum number of threads. Fewer are used if the extent has fewer
+  // voxels than (threads x joint histogram bins), since every thread
+  // clears and merges a joint histogram of its own.
+  vtkSetClampMacro(NumberOfThreads,int,1,VTK_MAX_THREADS);
+  vtkGetMacro(NumberOfThreads,int);
+
+  // Description:
+  // Fraction of the voxels of the extent the histograms are filled from, 1
+  // (the default) for all of them. The voxels are drawn at random, one from
+  // each of as many equal runs of the extent, and kept until the extent or
+  // the fraction changes, so that every evaluation sees the same ones.
+  vtkSetClampMacro(SamplingFraction,double,0.0,1.0);
+  vtkGetMacro(SamplingFraction,double);
+
+  // Description:
+  // Bin image 2 over extent and fill its histogram, counting only the
+  // non-zero voxels of the mask if one is given. The bins are kept and
+  // reused by Compute() until the image, mask, extent or binning changes.
+  // Returns 0 if the histograms are not allocated, -1 if
+  // VTK_JOINT_HISTOGRAM_FLOOR found values below 0, 1 otherwise.
+  int ComputeTarget(vtkImageData *target, vtkImageData *mask, int extent[6]);
+
+  // Description:
+  // Histogram of image 2 filled by ComputeTarget(), the number of voxels
+  // it counted (only the sampled ones if SamplingFraction < 1), and image 2,
+  // NULL until ComputeTarget() is called.
+  long *GetHistT();
+  vtkGetMacro(TargetCount,double);
+  vtkImageData *GetTargetImage() { return this->TargetImage; }
+
+  // Description:
+  // Fill the histograms over extent, in which voxel (x,y,z) of image 2 is
+  // paired with (x,y,z) + loc000 of image 1 interpolated towards
+  // (x,y,z) + loc111 with weights (F000, F100, F010, F110, F001, F101,
+  // F011, F111), or with (x,y,z) itself if both are 0. If a mask (of the
+  // same scalar type) is given, only its non-zero voxels are counted.
+  // Image 2 is binned by ComputeTarget() first if its bins are out of date.
+  // Returns 0 without filling them if the translated extent leaves image
+  // 1, -1 if VTK_JOINT_HISTOGRAM_FLOOR found values below 0, 1 otherwise.
+  int Compute(vtkImageData *source, vtkImageData *target, vtkImageData *mask,
+              int extent[6], int loc000[3], int loc111[3], double weights[8]);
+
+  // Description:
+  // Fill the histograms over extent like Compute(), with voxel (x,y,z) of
+  // image 2 paired with image 1 at matrix * (x,y,z), the matrix mapping the
+  // world coordinates of image 2 to those of image 1. The samples of image
+  // 1 are interpolated while the histograms are filled, stepping along the
+  // rows of image 2, so no resliced image is needed. Returns 0 without
+  // filling them if any voxel of extent maps outside image 1.
+  int ComputeTransformed(vtkImageData *source, vtkImageData *target, vtkImageData *mask,
+                         int extent[6], vtkMatrix4x4 *matrix);
+
+  // Description:
+  // Histograms filled by Compute(), HistST[t * BinNumber[0] + s] counting
+  // the voxels of source bin s and target bin t. The weighted ones are
+  // filled instead with VTK_JOINT_HISTOGRAM_PARTIAL_VOLUME.
+  long *GetHistS();
+  long *GetHistST();
+  double *GetWeightedHistS();
+  double *GetWeightedHistST();
+
+  // Description:
+  // Number of voxels counted by the last Compute().
+  vtkGetMacro(Count,double);
+
+protected:
+  vtkImageJointHistogram();
+  ~vtkImageJointHistogram();
+
+  int BinNumber[2];
+  double BinWidth[2];
+  int Binning;
+  int NumberOfThreads;
+  double SamplingFraction;
+  double Count;
+
+  // Histograms, and those of the threads other than the first
+  std::vector<long> HistS;
+  std::vector<long> HistST;
+  std::vector<double> WeightedHistS;
+  std::vector<double> WeightedHistST;
+  std::vector<long> ThreadHistS;
+  std::vector< std::vector<long> > ThreadHistST;
+  std::vector< std::vector<double> > ThreadWeightedHistST;
+
+  // Bin of every value of 8 and 16 bit images, for images 1 and 2,
+  // rebuilt when the scalar type or the binning changes
+  std::vector<int> BinTable[2];
+  int BinTableScalarType;
+  double BinTableWidth[2];
+  int BinTableNumber[2];
+  int BinTableBinning;
+  void UpdateBinTables(int scalarType);
+
+  // Fill the histograms with the threads once str points to the images
+  int Execute(vtkImageJointHistogramThreadStruct *str);
+
+  // Bins of image 2 over TargetExtent, 8 bit if it has up to 256 bins,
+  // and what they were computed from
+  std::vector<long> HistT;
+  std::vector<unsigned char> TargetBins8;
+  std::vector<unsigned short> TargetBins16;
+  vtkImageData *TargetImage;
+  vtkImageData *TargetMask;
+  int TargetExtent[6];
+  int TargetNegative;
+  double TargetCount;
+  double TargetBinWidth;
+  int TargetBinNumber;
+  int TargetBinning;
+  vtkTimeStamp TargetTime;
+  int TargetBinsValid(vtkImageData *target, vtkImageData *mask, int extent[6]);
+  int BinTarget(vtkImageData *target, vtkImageData *mask, int extent[6]);
+
+  // Sorted indices of the sampled voxels in the extent, empty for all of
+  // them, and the extent and fraction they were drawn for
+  std::vector<vtkIdType> Samples;
+  int SamplesExtent[6];
+  double SamplesFraction;
+  void UpdateSamples(int extent[6]);
+
+  vtkMultiThreader *Threader;
+
+private:
+  vtkImageJointHistogram(const vtkImageJointHistogram&);  // Not implemented.
+  void operator=(const vtkImageJointHistogram&);  // Not implemented.
+};
+
+#endif
@@ -16,6 +16,10 @@
 
 =========================================================================*/
 #include "vtkImageMIManipulator.h"
+#include "vtkImageJointHistogram.h"
+#include "vtkLinearTransform.h"
+#include "vtkMatrix4x4.h"
+#include "vtkMatrixToLinearTransform.h"
 
 //--------------------------------------------------------------------------
 // The 'floor' function on x86 and mips is many times slower than these
@@ -88,14 +92,19 @@ vtkImageMIManipulator::vtkImageMIManipulator()
   this->BinWidth[1] = 1;
   this->BinNumber[0] = 4096;
   this->BinNumber[1] = 4096;
+  this->HistS = NULL;
+  this->HistT = NULL;
+  this->HistST = NULL;
+  this->Histogram = vtkImageJointHistogram::New();
+  this->Histogram->SetBinning(VTK_JOINT_HISTOGRAM_FLOOR);
+  this->Transform = NULL;
 }
 
 //----------------------------------------------------------------------------
 vtkImageMIManipulator::~vtkImageMIManipulator()
 {
-  delete this->HistS;
-  delete this->HistT;
-  delete this->HistST;
+  this->SetTransform(NULL);
+  this->Histogram->Delete();
 }
 
 //----------------------------------------------------------------------------
@@ -130,39 +139,46 @@ void vtkImageMIManipulator::SetBinNumber(int numS, int numT)
 {
   this->BinNumber[0] = numS;
   this->BinNumber[1] = numT;
-  this->HistS = new long[numS];
-  this->HistT = new long[numT];
-  this->HistST = new long[numS*numT];
+  this->Histogram->SetBinNumber(numS, numT);
+  this->HistS = this->Histogram->GetHistS();
+  this->HistST = this->Histogram->GetHistST();
+  this->HistT = this->Histogram->GetHistT();
 }
 
 //----------------------------------------------------------------------------
-template <class T>
-void vtkImageMIManipulatorEntropyT(vtkImageMIManipulator *self,
-                                   T  *inPtr, int inc2[2], double count)
+void vtkImageMIManipulator::SetNumberOfThreads(int numThreads)
 {
-  short b;
-  double temp, entropyT = 0;
+  this->Histogram->SetNumberOfThreads(numThreads);
+}
+
+//----------------------------------------------------------------------------
+int vtkImageMIManipulator::GetNumberOfThreads()
+{
+  return this->Histogram->GetNumberOfThreads();
+}
 
-  // Loop over data
-  for (int idZ = self->Extent[4]; idZ <= self->Extent[5]; idZ++)
+//----------------------------------------------------------------------------
+void vtkImageMIManipulator::SetSamplingFraction(double fraction)
+{
+  this->Histogram->SetSamplingFraction(fraction);
+
+  // Draw the samples and count image 2 over them again
+  if (this->Histogram->GetTargetImage())
   {
-    for (int idY = self->Extent[2]; idY <= self->Extent[3]; idY++)
-    {
-      for (int idX = self->Extent[0]; idX <= self->Extent[1]; idX++)
-      {
-        b = vtkResliceFloor(*inPtr/double(self->BinWidth[1]));
-        if (b < 0.0)
-        {
-          cout << "ERROR: Images have values < 0.0\n";
-          exit(0);
-        }
-        self->HistT[b]++;
-        inPtr++;
-      }
-      inPtr += inc2[0];
-    }
-    inPtr += inc2[1];
+    this->SetExtent(this->Extent);
   }
+}
+
+//----------------------------------------------------------------------------
+double vtkImageMIManipulator::GetSamplingFraction()
+{
+  return this->Histogram->GetSamplingFraction();
+}
+
+//----------------------------------------------------------------------------
+void vtkImageMIManipulatorEntropyT(vtkImageMIManipulator *self, double count)
+{
+  double temp, entropyT = 0;
 
   for (int i = 0; i < self->BinNumber[1]; i++)
   {
@@ -180,14 +196,11 @@ void vtkImageMIManipulatorEntropyT(vtkImageMIManipulator *self,
 //----------------------------------------------------------------------------
 void vtkImageMIManipulator::SetExtent(int ext[6])
 {
-  void *inPtr;
-
   this->inc2[0] = this->inc[1] - this->inc[0] * (ext[1] - ext[0] + 1);
   this->inc2[1] = this->inc[2] - this->inc[1] * (ext[3] - ext[2] + 1);
 
   this->inPtr[0] = this->inData[0]->GetScalarPointerForExtent(ext);
   this->inPtr[1] = this->inData[1]->GetScalarPointerForExtent(ext);
-  inPtr = this->inData[1]->GetScalarPointerForExtent(ext);
 
   this->count = (ext[1]-ext[0]+1) * (ext[3]-ext[2]+1) * (ext[5]-ext[4]+1);
   if (this->count == 0)
@@ -197,15 +210,19 @@ void vtkImageMIManipulator::SetExtent(int ext[6])
 
   memcpy(this->Extent, ext, sizeof(int)*6);
 
-  memset((void *)this->HistT, 0, this->BinNumber[1]*sizeof(long));
-  // Calculate the entropy of image 2
-  switch (this->inData[1]->GetScalarType())
+  // Bin image 2 once, it stays put while image 1 is moved
+  this->Histogram->SetBinWidth(this->BinWidth[0], this->BinWidth[1]);
+  if (this->Histogram->ComputeTarget(this->inData[1], NULL, ext) < 0)
   {
-    vtkTemplateMacro(vtkImageMIManipulatorEntropyT(this,
-                     (VTK_TT *)(inPtr), this->inc2, this->count));
-  default:
-    vtkErrorMacro( "Execute: Unknown ScalarType");
+    cout << "ERROR: Images have values < 0.0\n";
+    exit(0);
   }
+
+  // Only the sampled voxels are counted if SamplingFraction < 1
+  this->count = this->Histogram->GetTargetCount();
+
+  // Calculate the entropy of image 2
+  vtkImageMIManipulatorEntropyT(this, this->count);
 }
 
 //----------------------------------------------------------------------------
@@ -213,6 +230,8 @@ void vtkImageMIManipulator::SetTranslation(double tran[3])
 {
   double f[3];
 
+  this->SetTransform(NULL);
+
   // Interpolation is not required.
   if ( (tran[0] == 0.0) && (tran[1] == 0.0) && (tran[2] == 0.0) )
   {
@@ -249,138 +268,83 @@ void vtkImageMIManipulator::SetTranslation(double tran[3])
 }
 
 //----------------------------------------------------------------------------
-template <class T>
-void vtkImageMIManipulatorExecute(vtkImageMIManipulator *self,
-                                  T  *in1Ptr, T *in2Ptr,
-                                  vtkIdType inc[3], int inc2[2], int inExt[6],
-                                  int loc000[3], int loc111[3], double count)
+vtkCxxSetObjectMacro(vtkImageMIManipulator, Transform, vtkLinearTransform);
+
+//----------------------------------------------------------------------------
+void vtkImageMIManipulator::SetMatrix(vtkMatrix4x4 *matrix)
+{
+  vtkMatrixToLinearTransform *transform = vtkMatrixToLinearTransform::New();
+  transform->SetInput(matrix);
+  this->SetTransform(transform);
+  transform->Delete();
+}
+
+//----------------------------------------------------------------------------
+double vtkImageMIManipulator::GetResult()
 {
-  double V000, V100, V010, V110, V001, V101, V011, V111, Vxyz;
   double temp, entropyS = 0, entropyST = 0;
-  short a, b;
   int i, j;
 
-  // CASE 1: Check if translation takes us out of the input image, in
-  // which case set the result to indicate complete dissimilarity and stop.
-  if ( (self->Extent[0] + loc000[0] < inExt[0]) ||
-       (self->Extent[2] + loc000[1] < inExt[2]) ||
-       (self->Extent[4] + loc000[2] < inExt[4]) ||
-       (self->Extent[1] + loc111[0] > inExt[1]) ||
-       (self->Extent[3] + loc111[1] > inExt[3]) ||
-       (self->Extent[5] + loc111[2] > inExt[5]) )
+  // Check inputs.
+  if (this->inData[0] == NULL)
   {
-    self->Result = 0.0;
-    return;
+    vtkErrorMacro( "Input " << 0 << " must be specified.");
+    return 0;
   }
-
-  // CASE 2: Check if no interpolation is necessary.
-  if ( (loc000[0] == 0) && (loc111[0] == 0) &&
-       (loc000[1] == 0) && (loc111[1] == 0) &&
-       (loc000[2] == 0) && (loc111[2] == 0) )
+  if (this->inData[1] == NULL)
   {
-    for (int idZ = self->Extent[4]; idZ <= self->Extent[5]; idZ++)
-    {
-      for (int idY = self->Extent[2]; idY <= self->Extent[3]; idY++)
-      {
-        for (int idX = self->Extent[0]; idX <= self->Extent[1]; idX++)
-        {
-          a = vtkResliceFloor(*in1Ptr/double(self->BinWidth[0]));
-          b = vtkResliceFloor(*in2Ptr/double(self->BinWidth[1]));
-
-          if ((a < 0.0) || (b < 0.0))
-          {
-            cout << "ERROR: Images have values < 0.0\n";
-            exit(0);
-          }
-
-          self->HistS[a]++;
-          self->HistST[b * self->BinNumber[0] + a]++;
-
-          in1Ptr++;
-          in2Ptr++;
-        }
-        in1Ptr += inc2[0];
-        in2Ptr += inc2[0];
-      }
-      in1Ptr += inc2[1];
-      in2Ptr += inc2[1];
-    }
+    vtkErrorMacro( "Input " << 1 << " must be specified.");
+    return 0;
+  }
+  if ((this->inData[0]->GetScalarType() != this->inData[1]->GetScalarType()))
+  {
+    vtkErrorMacro( "Execute: Inputs must be of the same ScalarType");
+    return 0;
   }
 
-  // CASE 3: If the above two cases don't apply, do the full calculation.
+  this->Result = 0;
+
+  // Fill the histograms, image 1 translated or transformed with trilinear interpolation.
+  double F[8] = { this->F000, this->F100, this->F010, this->F110,
+                  this->F001, this->F101, this->F011, this->F111 };
+  this->Histogram->SetBinWidth(this->BinWidth[0], this->BinWidth[1]);
+  int filled;
+  if (this->Transform)
+  {
+    filled = this->Histogram->ComputeTransformed(this->inData[0], this->inData[1], NULL,
+                                                 this->Extent, this->Transform->GetMatrix());
+  }
   else
   {
-    in1Ptr += inc[2] * loc000[2] + inc[1] * loc000[1] + inc[0] * loc000[0];
+    filled = this->Histogram->Compute(this->inData[0], this->inData[1], NULL,
+                                      this->Extent, this->loc000, this->loc111, F);
+  }
 
-    for (int idZ = self->Extent[4]; idZ <= self->Extent[5]; idZ++)
-    {
-      for (int idY = self->Extent[2]; idY <= self->Extent[3]; idY++)
-      {
-        // Initiate previous data
-        V000 = *in1Ptr;
-        in1Ptr += inc[1];
-        V010 = *in1Ptr;
-        in1Ptr += inc[2];
-        V011 = *in1Ptr;
-        in1Ptr -= inc[1];
-        V001 = *in1Ptr;
-        in1Ptr -= inc[2];
-
-        for (int idX = self->Extent[0]; idX <= self->Extent[1]; idX++)
-        {
-          in1Ptr++;
-          V100 = *in1Ptr;
-          in1Ptr += inc[1];
-          V110 = *in1Ptr;
-          in1Ptr += inc[2];
-          V111 = *in1Ptr;
-          in1Ptr -= inc[1];
-          V101 = *in1Ptr;
-          in1Ptr -= inc[2];
-
-          Vxyz = (V000 * self->F000 + V100 * self->F100 +
-                  V010 * self->F010 + V110 * self->F110 +
-                  V001 * self->F001 + V101 * self->F101 +
-                  V011 * self->F011 + V111 * self->F111);
-
-          V000 = V100;
-          V010 = V110;
-          V001 = V101;
-          V011 = V111;
-
-          a = vtkResliceFloor(Vxyz/double(self->BinWidth[0]));
-          b = vtkResliceFloor(*in2Ptr/double(self->BinWidth[1]));
-
-          if ((a < 0.0) || (b < 0.0))
-          {
-            cout << "ERROR: Images have values < 0.0\n";
-            exit(0);
-          }
-
-          self->HistS[a]++;
-          self->HistST[b * self->BinNumber[0] + a]++;
-
-          in2Ptr++;
-        }
-        in1Ptr += inc2[0];
-        in2Ptr += inc2[0];
-      }
-      in1Ptr += inc2[1];
-      in2Ptr += inc2[1];
-    }
+  // Check if translation takes us out of the input image, in which
+  // case set the result to indicate complete dissimilarity and stop.
+  if (filled == 0)
+  {
+
+    this->Result = 0.0;
+    return this->Result;
+  }
+  if (filled < 0)
+  {
+    cout << "ERROR: Images have values < 0.0\n";
+    exit(0);
   }
 
   // Loop over S and ST histograms.
-  for (i = 0; i < self->BinNumber[0]; i++)
+  for (i = 0; i < this->BinNumber[0]; i++)
   {
-    temp = (double)self->HistS[i];
+    temp = (double)this->HistS[i];
     if (temp > 0.0)
     {
       entropyS += temp * log(temp);
     }
-    for (j = 0; j < self->BinNumber[1]; j++)
+    for (j = 0; j < this->BinNumber[1]; j++)
     {
-      temp = (double)self->HistST[j * self->BinNumber[0] + i];
+      temp = (double)this->HistST[j * this->BinNumber[0] + i];
       if (temp > 0.0)
       {
         entropyST += temp * log(temp);
@@ -389,48 +353,10 @@ void vtkImageMIManipulatorExecute(vtkImageMIManipulator *self,
   }
 
   // Calculate entropies and the MI
-  entropyS  = -entropyS /count + log(count);
-  entropyST = -entropyST/count + log(count);
-
-  self->Result = entropyS + self->entropyT - entropyST;
-
-}
-
-//----------------------------------------------------------------------------
-double vtkImageMIManipulator::GetResult()
-{
-  // Check inputs.
-  if (this->inData[0] == NULL)
-  {
-    vtkErrorMacro( "Input " << 0 << " must be specified.");
-    return 0;
-  }
-  if (this->inData[1] == NULL)
-  {
-    vtkErrorMacro( "Input " << 1 << " must be specified.");
-    return 0;
-  }
-  if ((this->inData[0]->GetScalarType() != this->inData[1]->GetScalarType()))
-  {
-    vtkErrorMacro( "Execute: Inputs must be of the same ScalarType");
-    return 0;
-  }
-
-  // Zero the histograms and result.
-  memset((void *)this->HistS, 0, this->BinNumber[0]*sizeof(long));
-  memset((void *)this->HistST, 0, this->BinNumber[0]*this->BinNumber[1]*sizeof(long));
-  this->Result = 0;
+  entropyS  = -entropyS /this->count + log(this->count);
+  entropyST = -entropyST/this->count + log(this->count);
 
-  // Calculate and return MI result.
-  switch (this->inData[0]->GetScalarType())
-  {
-    vtkTemplateMacro(vtkImageMIManipulatorExecute(this,
-                     (VTK_TT *)(this->inPtr[0]), (VTK_TT *)(this->inPtr[1]),
-                     this->inc, this->inc2, this->inExt,
-                     this->loc000, this->loc111, this->count));
-  default:
-    vtkErrorMacro( "Execute: Unknown ScalarType");
-  }
+  this->Result = entropyS + this->entropyT - entropyST;
 
   return this->Result;
 
@@ -33,6 +33,10 @@
 #include "vtkObjectFactory.h"
 #include "vtkImageData.h"
 
+class vtkImageJointHistogram;
+class vtkLinearTransform;
+class vtkMatrix4x4;
+
 class vtkRobartsRegistrationExport vtkImageNMIManipulator : public vtkObject
 {
 public:
@@ -56,6 +60,17 @@ public:
   vtkSetVector2Macro(BinWidth,int);
   int BinWidth[2];
 
+  // Description:
+  // Set/get the maximum number of threads filling the histograms.
+  virtual void SetNumberOfThreads(int numThreads);
+  virtual int GetNumberOfThreads();
+
+  // Description:
+  // Set/get the fraction of the voxels of the extent that are sampled,
+  // 1 (the default) for all of them.
+  virtual void SetSamplingFraction(double fraction);
+  virtual double GetSamplingFraction();
+
   // Description:
   // Set/get the extent to calculate the NMI over.
   virtual void SetExtent(int ext[6]);
@@ -65,6 +80,15 @@ public:
   // Set the translation of input 1 in 3D (mm)
   virtual void SetTranslation(double Translation[3]);
 
+  // Description:
+  // Set a rigid or affine transformation from the coordinates of image 2
+  // to those of image 1 (mm) to use instead of the translation. Image 1 is
+  // then resampled while the histograms are filled. SetTranslation()
+  // removes it, SetMatrix() sets a transformation following the matrix.
+  virtual void SetTransform(vtkLinearTransform *transform);
+  vtkGetObjectMacro(Transform,vtkLinearTransform);
+  virtual void SetMatrix(vtkMatrix4x4 *matrix);
+
   // Description:
   // Get the absolute difference
   double GetResult();
@@ -95,6 +119,9 @@ protected:
   vtkImageNMIManipulator();
   ~vtkImageNMIManipulator();
 
+  // Joint histogram of the inputs, filled by multiple threads
+  vtkImageJointHistogram *Histogram;
+
   // Globals used to speed up repeated execution:
 
   // Increments to go through the data (calculate on SetExtent)
@@ -109,6 +136,9 @@ protected:
   int loc000[3];
   int loc111[3];
 
+  // Transformation of image 1 used instead of the translation
+  vtkLinearTransform *Transform;
+
   // Number of voxels in Extent
   double count;
 
@@ -0,0 +1,436 @@
+/*=========================================================================
+
+Robarts Visualization Toolkit
+
+Copyright (c) 2016 Virtual Augmentation and Simulation for Surgery and Therapy, Robarts Research Institute
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files (the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+
+=========================================================================*/
+
+#include "vtkImagePyramidRegistration.h"
+
+#include "vtkImageData.h"
+#include "vtkImageECRManipulator.h"
+#include "vtkImageGaussianSmooth.h"
+#include "vtkImageMIManipulator.h"
+#include "vtkImageNMIManipulator.h"
+#include "vtkImageShrink3D.h"
+#include "vtkLinearTransform.h"
+#include "vtkObjectFactory.h"
+#include "vtkPowellMinimizer.h"
+#include "vtkTimerLog.h"
+#include "vtkTransform.h"
+
+//----------------------------------------------------------------------------
+// Names of the minimizer variables, the number of search steps of the level
+// from its start along tx, ty, tz, rx, ry and rz
+static const char* vtkImagePyramidRegistrationNames[6] = { "tx", "ty", "tz", "rx", "ry", "rz" };
+
+//----------------------------------------------------------------------------
+void vtkImagePyramidRegistrationFunction(void* arg)
+{
+  vtkImagePyramidRegistration* self = (vtkImagePyramidRegistration*)arg;
+
+  double parameters[6];
+  for (int i = 0; i < 6; i++)
+  {
+    parameters[i] = self->LevelStart[i] + self->LevelStep[i] *
+                    self->Minimizer->GetScalarVariableValue(vtkImagePyramidRegistrationNames[i]);
+  }
+  self->SetTransformParameters(self->LevelTransform, parameters);
+  double cost = self->EvaluateManipulator();
+  self->LevelEvaluations++;
+
+  // The minimizer does not leave its best point in the variables
+  if (cost < self->LevelBestCost)
+  {
+    self->LevelBestCost = cost;
+    for (int i = 0; i < 6; i++)
+    {
+      self->LevelBest[i] = parameters[i];
+    }
+  }
+  self->Minimizer->SetScalarResult(cost);
+}
+
+//----------------------------------------------------------------------------
+template <class M>
+static void vtkImagePyramidRegistrationSetUp(M* manipulator, int binWidth[2], int binNumber,
+                                             int numThreads, int extent[6], vtkTransform* transform)
+{
+  manipulator->SetBinWidth(binWidth[0], binWidth[1]);
+  manipulator->SetBinNumber(binNumber, binNumber);
+  if (numThreads > 0)
+  {
+    manipulator->SetNumberOfThreads(numThreads);
+  }
+  manipulator->SetExtent(extent);
+  manipulator->SetTransform(transform);
+}
+
+//----------------------------------------------------------------------------
+vtkStandardNewMacro(vtkImagePyramidRegistration);
+
+//----------------------------------------------------------------------------
+vtkCxxSetObjectMacro(vtkImagePyramidRegistration, SourceImage, vtkImageData);
+vtkCxxSetObjectMacro(vtkImagePyramidRegistration, TargetImage, vtkImageData);
+vtkCxxSetObjectMacro(vtkImagePyramidRegistration, InitialTransform, vtkLinearTransform);
+
+//----------------------------------------------------------------------------
+vtkImagePyramidRegistration::vtkImagePyramidRegistration()
+  : SourceImage(NULL)
+  , TargetImage(NULL)
+  , InitialTransform(NULL)
+  , Metric(VTK_PYRAMID_REGISTRATION_MI)
+  , NumberOfLevels(3)
+  , BinNumber(64)
+  , MinimumBinNumber(16)
+  , TranslationStep(1.0)
+  , RotationStep(1.0)
+  , Margin(0.1)
+  , Tolerance(0.001)
+  , NumberOfThreads(0)
+  , MIManipulator(NULL)
+  , NMIManipulator(NULL)
+  , ECRManipulator(NULL)
+  , LevelBestCost(0.0)
+  , LevelEvaluations(0)
+{
+  for (int i = 0; i < 6; i++)
+  {
+    this->Parameters[i] = 0.0;
+    this->LevelStart[i] = 0.0;
+    this->LevelStep[i] = 1.0;
+    this->LevelBest[i] = 0.0;
+  }
+  for (int i = 0; i < 3; i++)
+  {
+    this->Center[i] = 0.0;
+  }
+  this->Transform = vtkTransform::New();
+  this->LevelTransform = vtkTransform::New();
+
+  // Every level starts at 0 steps from its start and moves by 1 step at first
+  this->Minimizer = vtkPowellMinimizer::New();
+  this->Minimizer->SetFunction(&vtkImagePyramidRegistrationFunction, this);
+  for (int i = 0; i < 6; i++)
+  {
+    this->Minimizer->SetScalarVariableBracket(vtkImagePyramidRegistrationNames[i], 0.0, 1.0);
+  }
+}
+
+//----------------------------------------------------------------------------
+vtkImagePyramidRegistration::~vtkImagePyramidRegistration()
+{
+  this->ClearPyramids();
+  this->SetSourceImage(NULL);
+  this->SetTargetImage(NULL);
+  this->SetInitialTransform(NULL);
+  if (this->MIManipulator)
+  {
+    this->MIManipulator->Delete();
+  }
+  if (this->NMIManipulator)
+  {
+    this->NMIManipulator->Delete();
+  }
+  if (this->ECRManipulator)
+  {
+    this->ECRManipulator->Delete();
+  }
+  this->Minimizer->Delete();
+  this->LevelTransform->Delete();
+  this->Transform->Delete();
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePyramidRegistration::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+
+  os << indent << "SourceImage: " << this->SourceImage << "\n";
+  os << indent << "TargetImage: " << this->TargetImage << "\n";
+  os << indent << "InitialTransform: " << this->InitialTransform << "\n";
+  os << indent << "Metric: " << this->Metric << "\n";
+  os << indent << "NumberOfLevels: " << this->NumberOfLevels << "\n";
+  os << indent << "BinNumber: " << this->BinNumber << "\n";
+  os << indent << "MinimumBinNumber: " << this->MinimumBinNumber << "\n";
+  os << indent << "TranslationStep: " << this->TranslationStep << "\n";
+  os << indent << "RotationStep: " << this->RotationStep << "\n";
+  os << indent << "Margin: " << this->Margin << "\n";
+  os << indent << "Tolerance: " << this->Tolerance << "\n";
+  os << indent << "NumberOfThreads: " << this->NumberOfThreads << "\n";
+  os << indent << "Parameters: ( " << this->Parameters[0] << ", " << this->Parameters[1] << ", "
+     << this->Parameters[2] << ", " << this->Parameters[3] << ", " << this->Parameters[4] << ", "
+     << this->Parameters[5] << " )\n";
+  for (int level = (int)this->NumberOfEvaluations.size() - 1; level >= 0; level--)
+  {
+    os << indent << "Level " << level << ": " << this->NumberOfEvaluations[level] << " evaluations in "
+       << this->ElapsedTimes[level] << " s, metric " << this->MetricValues[level] << "\n";
+  }
+}
+
+//----------------------------------------------------------------------------
+int vtkImagePyramidRegistration::GetNumberOfEvaluations(int level)
+{
+  if (level < 0 || level >= (int)this->NumberOfEvaluations.size())
+  {
+    vtkErrorMacro("GetNumberOfEvaluations: no level " << level << " in the last Update.");
+    return 0;
+  }
+  return this->NumberOfEvaluations[level];
+}
+
+//----------------------------------------------------------------------------
+double vtkImagePyramidRegistration::GetElapsedTime(int level)
+{
+  if (level < 0 || level >= (int)this->ElapsedTimes.size())
+  {
+    vtkErrorMacro("GetElapsedTime: no level " << level << " in the last Update.");
+    return 0.0;
+  }
+  return this->ElapsedTimes[level];
+}
+
+//----------------------------------------------------------------------------
+double vtkImagePyramidRegistration::GetMetricValue(int level)
+{
+  if (level < 0 || level >= (int)this->MetricValues.size())
+  {
+    vtkErrorMacro("GetMetricValue: no level " << level << " in the last Update.");
+    return 0.0;
+  }
+  return this->MetricValues[level];
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePyramidRegistration::ClearPyramids()
+{
+  // index 0 holds the inputs, which are not ours
+  for (size_t level = 1; level < this->SourcePyramid.size(); level++)
+  {
+    this->SourcePyramid[level]->Delete();
+    this->TargetPyramid[level]->Delete();
+  }
+  this->SourcePyramid.clear();
+  this->TargetPyramid.clear();
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePyramidRegistration::BuildPyramids()
+{
+  this->ClearPyramids();
+
+  vtkImageData* inputs[2] = { this->SourceImage, this->TargetImage };
+  std::vector<vtkImageData*>* pyramids[2] = { &this->SourcePyramid, &this->TargetPyramid };
+  for (int i = 0; i < 2; i++)
+  {
+    pyramids[i]->push_back(inputs[i]);
+    for (int level = 1; level < this->NumberOfLevels; level++)
+    {
+      // a Gaussian of 1 voxel of the finer level, then every other voxel
+      vtkImageGaussianSmooth* smooth = vtkImageGaussianSmooth::New();
+      smooth->SetInputData(pyramids[i]->back());
+      smooth->SetDimensionality(3);
+      smooth->SetStandardDeviations(1.0, 1.0, 1.0);
+      smooth->SetRadiusFactors(2.0, 2.0, 2.0);
+      vtkImageShrink3D* shrink = vtkImageShrink3D::New();
+      shrink->SetInputConnection(smooth->GetOutputPort());
+      shrink->SetShrinkFactors(2, 2, 2);
+      shrink->AveragingOff();
+      shrink->Update();
+
+      vtkImageData* image = vtkImageData::New();
+      image->ShallowCopy(shrink->GetOutput());
+      pyramids[i]->push_back(image);
+      shrink->Delete();
+      smooth->Delete();
+    }
+  }
+
+  this->PyramidTime.Modified();
+}
+
+//----------------------------------------------------------------------------
+int vtkImagePyramidRegistration::SetUpManipulator(int level)
+{
+  vtkImageData* source = this->SourcePyramid[level];
+  vtkImageData* target = this->TargetPyramid[level];
+
+  int binNumber = this->BinNumber >> level;
+  if (binNumber < this->MinimumBinNumber)
+  {
+    binNumber = this->MinimumBinNumber;
+  }
+
+  // Widths that keep the largest value of either image in the last bin
+  int binWidth[2];
+  vtkImageData* images[2] = { source, target };
+  for (int i = 0; i < 2; i++)
+  {
+    double range[2];
+    images[i]->GetScalarRange(range);
+    if (range[0] < 0.0)
+    {
+      vtkErrorMacro("Update: Images have values < 0.0");
+      return 0;
+    }
+    binWidth[i] = (int)(range[1] / binNumber) + 1;
+  }
+
+  int extent[6];
+  target->GetExtent(extent);
+  for (int i = 0; i < 3; i++)
+  {
+    int margin = (int)(this->Margin * (extent[2 * i + 1] - extent[2 * i]) + 0.5);
+    extent[2 * i] += margin;
+    extent[2 * i + 1] -= margin;
+  }
+
+  switch (this->Metric)
+  {
+    case VTK_PYRAMID_REGISTRATION_MI:
+      if (!this->MIManipulator)
+      {
+        this->MIManipulator = vtkImageMIManipulator::New();
+      }
+      this->MIManipulator->SetInput1(source);
+      this->MIManipulator->SetInput2(target);
+      vtkImagePyramidRegistrationSetUp(this->MIManipulator, binWidth, binNumber, this->NumberOfThreads,
+                                       extent, this->LevelTransform);
+      break;
+    case VTK_PYRAMID_REGISTRATION_NMI:
+      if (!this->NMIManipulator)
+      {
+        this->NMIManipulator = vtkImageNMIManipulator::New();
+      }
+      this->NMIManipulator->SetInput1(source);
+      this->NMIManipulator->SetInput2(target);
+      vtkImagePyramidRegistrationSetUp(this->NMIManipulator, binWidth, binNumber, this->NumberOfThreads,
+                                       extent, this->LevelTransform);
+      break;
+    case VTK_PYRAMID_REGISTRATION_ECR:
+      if (!this->ECRManipulator)
+      {
+        this->ECRManipulator = vtkImageECRManipulator::New();
+      }
+      this->ECRManipulator->SetInput1Data(source);
+      this->ECRManipulator->SetInput2Data(target);
+      vtkImagePyramidRegistrationSetUp(this->ECRManipulator, binWidth, binNumber, this->NumberOfThreads,
+                                       extent, this->LevelTransform);
+      break;
+  }
+
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+// The cost the minimizer lowers: MI and NMI grow as the images align, ECR
+// falls
+double vtkImagePyramidRegistration::EvaluateManipulator()
+{
+  switch (this->Metric)
+  {
+    case VTK_PYRAMID_REGISTRATION_MI:
+      return -this->MIManipulator->GetResult();
+    case VTK_PYRAMID_REGISTRATION_NMI:
+      return -this->NMIManipulator->GetResult();
+    case VTK_PYRAMID_REGISTRATION_ECR:
+      return this->ECRManipulator->GetResult();
+  }
+  return 0.0;
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePyramidRegistration::SetTransformParameters(vtkTransform* transform, const double parameters[6])
+{
+  transform->Identity();
+  transform->PostMultiply();
+  transform->Translate(-this->Center[0], -this->Center[1], -this->Center[2]);
+  transform->RotateX(parameters[3]);
+  transform->RotateY(parameters[4]);
+  transform->RotateZ(parameters[5]);
+  transform->Translate(this->Center[0] + parameters[0], this->Center[1] + parameters[1],
+                       this->Center[2] + parameters[2]);
+  if (this->InitialTransform)
+  {
+    transform->Concatenate(this->InitialTransform->GetMatrix());
+  }
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePyramidRegistration::Update()
+{
+  if (!this->SourceImage || !this->TargetImage)
+  {
+    vtkErrorMacro("Update: Both images must be set.");
+    return;
+  }
+  if (this->SourceImage->GetScalarType() != this->TargetImage->GetScalarType())
+  {
+    vtkErrorMacro("Update: Images must be of the same ScalarType");
+    return;
+  }
+
+  // The pyramids are built once for as long as the images stay the same
+  if ((int)this->SourcePyramid.size() != this->NumberOfLevels ||
+      this->SourcePyramid[0] != this->SourceImage || this->TargetPyramid[0] != this->TargetImage ||
+      this->SourceImage->GetMTime() > this->PyramidTime || this->TargetImage->GetMTime() > this->PyramidTime)
+  {
+    this->BuildPyramids();
+  }
+  this->TargetImage->GetCenter(this->Center);
+
+  this->NumberOfEvaluations.assign(this->NumberOfLevels, 0);
+  this->ElapsedTimes.assign(this->NumberOfLevels, 0.0);
+  this->MetricValues.assign(this->NumberOfLevels, 0.0);
+  this->Minimizer->SetTolerance(this->Tolerance);
+  for (int i = 0; i < 6; i++)
+  {
+    this->Parameters[i] = 0.0;
+  }
+
+  // Coarse to fine, with the search steps growing with the voxels
+  for (int level = this->NumberOfLevels - 1; level >= 0; level--)
+  {
+    if (!this->SetUpManipulator(level))
+    {
+      return;
+    }
+    double factor = (double)(1 << level);
+    for (int i = 0; i < 6; i++)
+    {
+      this->LevelStart[i] = this->Parameters[i];
+      this->LevelBest[i] = this->Parameters[i];
+      this->LevelStep[i] = factor * ((i < 3) ? this->TranslationStep : this->RotationStep);
+    }
+    this->LevelBestCost = VTK_DOUBLE_MAX;
+    this->LevelEvaluations = 0;
+
+    double startTime = vtkTimerLog::GetUniversalTime();
+    this->Minimizer->Minimize();
+    this->ElapsedTimes[level] = vtkTimerLog::GetUniversalTime() - startTime;
+
+    this->NumberOfEvaluations[level] = this->LevelEvaluations;
+    this->MetricValues[level] = (this->Metric == VTK_PYRAMID_REGISTRATION_ECR) ? this->LevelBestCost
+                                                                               : -this->LevelBestCost;
+    for (int i = 0; i < 6; i++)
+    {
+      this->Parameters[i] = this->LevelBest[i];
+    }
+  }
+
+  this->SetTransformParameters(this->Transform, this->Parameters);
+}
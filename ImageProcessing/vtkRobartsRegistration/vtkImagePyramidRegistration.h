@@ -0,0 +1,207 @@
+/*=========================================================================
+
+Robarts Visualization Toolkit
+
+Copyright (c) 2016 Virtual Augmentation and Simulation for Surgery and Therapy, Robarts Research Institute
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files (the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+
+=========================================================================*/
+// .NAME vtkImagePyramidRegistration - Coarse-to-fine rigid registration of 2 images
+// .SECTION Description
+// vtkImagePyramidRegistration finds the rigid transformation from the
+// coordinates of the target image (image 2) to those of the source image
+// (image 1) that optimizes a histogram based similarity metric. Both images
+// are smoothed with a Gaussian and halved NumberOfLevels - 1 times, once,
+// and vtkPowellMinimizer is run from the coarsest level to the finest, each
+// level starting from the result of the previous one. At level l the
+// search steps are 2^l times TranslationStep and RotationStep, and the
+// histograms have BinNumber / 2^l bins (not fewer than MinimumBinNumber),
+// so most of the evaluations are made on the small images. A single
+// manipulator is reused for all the levels, with the transformation sampled
+// within its histogram loop. The number of evaluations, time and metric of
+// every level are kept for reporting.
+// .SECTION See Also
+// vtkPowellMinimizer vtkImageMIManipulator vtkImageJointHistogram
+
+#ifndef __vtkImagePyramidRegistration_h
+#define __vtkImagePyramidRegistration_h
+
+#include "vtkRobartsRegistrationExport.h"
+
+#include "vtkObject.h"
+
+#include <vector>
+
+class vtkImageData;
+class vtkImageECRManipulator;
+class vtkImageMIManipulator;
+class vtkImageNMIManipulator;
+class vtkLinearTransform;
+class vtkPowellMinimizer;
+class vtkTransform;
+
+// similarity metrics
+#define VTK_PYRAMID_REGISTRATION_MI 0
+#define VTK_PYRAMID_REGISTRATION_NMI 1
+#define VTK_PYRAMID_REGISTRATION_ECR 2
+
+class vtkRobartsRegistrationExport vtkImagePyramidRegistration : public vtkObject
+{
+public:
+  static vtkImagePyramidRegistration* New();
+  vtkTypeMacro(vtkImagePyramidRegistration, vtkObject);
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // Set/get the image that is moved (image 1) and the one that stays put
+  // (image 2). They must have the same scalar type and values >= 0.
+  virtual void SetSourceImage(vtkImageData* image);
+  vtkGetObjectMacro(SourceImage, vtkImageData);
+  virtual void SetTargetImage(vtkImageData* image);
+  vtkGetObjectMacro(TargetImage, vtkImageData);
+
+  // Description:
+  // Set/get a transformation from the coordinates of image 2 to those of
+  // image 1 that the rigid transformation is applied after, NULL for none.
+  virtual void SetInitialTransform(vtkLinearTransform* transform);
+  vtkGetObjectMacro(InitialTransform, vtkLinearTransform);
+
+  // Description:
+  // Set/get the similarity metric, VTK_PYRAMID_REGISTRATION_MI (default),
+  // VTK_PYRAMID_REGISTRATION_NMI or VTK_PYRAMID_REGISTRATION_ECR.
+  vtkSetClampMacro(Metric, int, VTK_PYRAMID_REGISTRATION_MI, VTK_PYRAMID_REGISTRATION_ECR);
+  vtkGetMacro(Metric, int);
+  void SetMetricToMI() { this->SetMetric(VTK_PYRAMID_REGISTRATION_MI); };
+  void SetMetricToNMI() { this->SetMetric(VTK_PYRAMID_REGISTRATION_NMI); };
+  void SetMetricToECR() { this->SetMetric(VTK_PYRAMID_REGISTRATION_ECR); };
+
+  // Description:
+  // Set/get the number of pyramid levels, 1 for the full resolution only.
+  vtkSetClampMacro(NumberOfLevels, int, 1, 8);
+  vtkGetMacro(NumberOfLevels, int);
+
+  // Description:
+  // Set/get the number of bins of both histograms at the finest level.
+  // Each coarser level halves it, down to MinimumBinNumber.
+  vtkSetClampMacro(BinNumber, int, 2, 4096);
+  vtkGetMacro(BinNumber, int);
+  vtkSetClampMacro(MinimumBinNumber, int, 2, 4096);
+  vtkGetMacro(MinimumBinNumber, int);
+
+  // Description:
+  // Set/get the initial search steps of the minimizer at the finest level,
+  // in mm and degrees. Each coarser level doubles them.
+  vtkSetMacro(TranslationStep, double);
+  vtkGetMacro(TranslationStep, double);
+  vtkSetMacro(RotationStep, double);
+  vtkGetMacro(RotationStep, double);
+
+  // Description:
+  // Set/get the fraction of image 2 left out on each side of every axis,
+  // so that its rotated and translated voxels stay within image 1.
+  vtkSetClampMacro(Margin, double, 0.0, 0.45);
+  vtkGetMacro(Margin, double);
+
+  // Description:
+  // Set/get the fractional tolerance of the minimizer on every level.
+  vtkSetMacro(Tolerance, double);
+  vtkGetMacro(Tolerance, double);
+
+  // Description:
+  // Set/get the number of threads of the manipulator, 0 for its default.
+  vtkSetClampMacro(NumberOfThreads, int, 0, VTK_MAX_THREADS);
+  vtkGetMacro(NumberOfThreads, int);
+
+  // Description:
+  // Build the pyramids if the images changed and register them.
+  virtual void Update();
+
+  // Description:
+  // Get the result, as the translation (mm) and the rotations about x, y
+  // and z (degrees, applied in that order about the centre of image 2),
+  // and as a transformation from the coordinates of image 2 to those of
+  // image 1 that includes InitialTransform.
+  vtkGetVector6Macro(Parameters, double);
+  vtkTransform* GetTransform() { return this->Transform; };
+
+  // Description:
+  // Get the number of metric evaluations, the time taken (s) and the metric
+  // reached on each level of the last Update(), level 0 being the finest.
+  int GetNumberOfEvaluations(int level);
+  double GetElapsedTime(int level);
+  double GetMetricValue(int level);
+
+protected:
+  vtkImagePyramidRegistration();
+  ~vtkImagePyramidRegistration();
+
+  vtkImageData* SourceImage;
+  vtkImageData* TargetImage;
+  vtkLinearTransform* InitialTransform;
+
+  int Metric;
+  int NumberOfLevels;
+  int BinNumber;
+  int MinimumBinNumber;
+  double TranslationStep;
+  double RotationStep;
+  double Margin;
+  double Tolerance;
+  int NumberOfThreads;
+
+  double Parameters[6];
+  vtkTransform* Transform;
+
+  // Centre of image 2 (mm), which the rotations are about
+  double Center[3];
+
+  // Smoothed and halved images, index 0 holding the inputs themselves,
+  // rebuilt when the inputs or the number of levels change
+  std::vector<vtkImageData*> SourcePyramid;
+  std::vector<vtkImageData*> TargetPyramid;
+  vtkTimeStamp PyramidTime;
+  void BuildPyramids();
+  void ClearPyramids();
+
+  // The manipulator of the metric, kept from one level and Update() to the next
+  vtkImageMIManipulator* MIManipulator;
+  vtkImageNMIManipulator* NMIManipulator;
+  vtkImageECRManipulator* ECRManipulator;
+  int SetUpManipulator(int level);
+  double EvaluateManipulator();
+
+  // State of the level being minimized: the parameters it starts from,
+  // its search steps, and the best evaluation so far
+  vtkPowellMinimizer* Minimizer;
+  vtkTransform* LevelTransform;
+  double LevelStart[6];
+  double LevelStep[6];
+  double LevelBest[6];
+  double LevelBestCost;
+  int LevelEvaluations;
+  void SetTransformParameters(vtkTransform* transform, const double parameters[6]);
+
+  std::vector<int> NumberOfEvaluations;
+  std::vector<double> ElapsedTimes;
+  std::vector<double> MetricValues;
+
+  friend void vtkImagePyramidRegistrationFunction(void* arg);
+
+private:
+  vtkImagePyramidRegistration(const vtkImagePyramidRegistration&);  // Not implemented.
+  void operator=(const vtkImagePyramidRegistration&);  // Not implemented.
+};
+
+#endif
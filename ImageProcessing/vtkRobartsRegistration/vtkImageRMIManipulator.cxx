@@ -16,6 +16,10 @@
 
 =========================================================================*/
 #include "vtkImageRMIManipulator.h"
+#include "vtkImageJointHistogram.h"
+#include "vtkLinearTransform.h"
+#include "vtkMatrix4x4.h"
+#include "vtkMatrixToLinearTransform.h"
 
 //--------------------------------------------------------------------------
 // The 'floor' function on x86 and mips is many times slower than these
@@ -82,14 +86,19 @@ vtkImageRMIManipulator::vtkImageRMIManipulator()
   this->MaxIntensities[0] = 4095;
   this->MaxIntensities[1] = 4095;
   this->qValue = 1.5;
+  this->HistS = NULL;
+  this->HistT = NULL;
+  this->HistST = NULL;
+  this->Histogram = vtkImageJointHistogram::New();
+  this->Histogram->SetBinning(VTK_JOINT_HISTOGRAM_ROUND);
+  this->Transform = NULL;
 }
 
 //----------------------------------------------------------------------------
 vtkImageRMIManipulator::~vtkImageRMIManipulator()
 {
-  delete this->HistS;
-  delete this->HistT;
-  delete this->HistST;
+  this->SetTransform(NULL);
+  this->Histogram->Delete();
 }
 
 //----------------------------------------------------------------------------
@@ -126,9 +135,40 @@ void vtkImageRMIManipulator::SetBinNumber(int numS, int numT)
   this->BinNumber[1] = numT;
   this->BinWidth[0] = (double)this->MaxIntensities[0] / ((double)this->BinNumber[0] - 1.0);
   this->BinWidth[1] = (double)this->MaxIntensities[1] / ((double)this->BinNumber[1] - 1.0);
-  this->HistS = new long[numS];
-  this->HistT = new long[numT];
-  this->HistST = new long[numS*numT];
+  this->Histogram->SetBinNumber(numS, numT);
+  this->HistS = this->Histogram->GetHistS();
+  this->HistST = this->Histogram->GetHistST();
+  this->HistT = this->Histogram->GetHistT();
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRMIManipulator::SetNumberOfThreads(int numThreads)
+{
+  this->Histogram->SetNumberOfThreads(numThreads);
+}
+
+//----------------------------------------------------------------------------
+int vtkImageRMIManipulator::GetNumberOfThreads()
+{
+  return this->Histogram->GetNumberOfThreads();
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRMIManipulator::SetSamplingFraction(double fraction)
+{
+  this->Histogram->SetSamplingFraction(fraction);
+
+  // Draw the samples and count image 2 over them again
+  if (this->Histogram->GetTargetImage())
+  {
+    this->SetExtent(this->Extent);
+  }
+}
+
+//----------------------------------------------------------------------------
+double vtkImageRMIManipulator::GetSamplingFraction()
+{
+  return this->Histogram->GetSamplingFraction();
 }
 
 //----------------------------------------------------------------------------
@@ -141,29 +181,10 @@ void vtkImageRMIManipulator::SetMaxIntensities(int maxS, int maxT)
 }
 
 //----------------------------------------------------------------------------
-template <class T>
-void vtkImageRMIManipulatorEntropyT(vtkImageRMIManipulator *self,
-             T  *inPtr, int inc2[2], double count)
+void vtkImageRMIManipulatorEntropyT(vtkImageRMIManipulator *self, double count)
 {
-  short b;
   double temp, entropyT = 0;
  
-  // Loop over data
-  for (int idZ = self->Extent[4]; idZ <= self->Extent[5]; idZ++)
-    {
-      for (int idY = self->Extent[2]; idY <= self->Extent[3]; idY++)
-  {
-    for (int idX = self->Extent[0]; idX <= self->Extent[1]; idX++)
-      {
-           b = vtkResliceRound(*inPtr/double(self->BinWidth[1]));
-           self->HistT[b]++;
-        inPtr++;
-      }
-    inPtr += inc2[0];
-  }
-      inPtr += inc2[1];
-    }
-
   for (int i = 0; i < self->BinNumber[1]; i++)
     {  
       temp = (double)self->HistT[i];
@@ -185,8 +206,6 @@ void vtkImageRMIManipulatorEntropyT(vtkImageRMIManipulator *self,
 //----------------------------------------------------------------------------
 void vtkImageRMIManipulator::SetExtent(int ext[6])
 {
-  void *inPtr;
-
   if ( this->qValue == 1.0 ) 
     {
       vtkErrorMacro( "qValue cannot be 1.0");
@@ -197,22 +216,21 @@ void vtkImageRMIManipulator::SetExtent(int ext[6])
 
   this->inPtr[0] = this->inData[0]->GetScalarPointerForExtent(ext);
   this->inPtr[1] = this->inData[1]->GetScalarPointerForExtent(ext);
-  inPtr = this->inData[1]->GetScalarPointerForExtent(ext);
 
   this->count = (ext[1]-ext[0]+1) * (ext[3]-ext[2]+1) * (ext[5]-ext[4]+1);
   if (this->count == 0) vtkErrorMacro( "GetResult: No data to work with.");
 
   memcpy(this->Extent, ext, sizeof(int)*6);
 
+  // Bin image 2 once, it stays put while image 1 is moved
+  this->Histogram->SetBinWidth(this->BinWidth[0], this->BinWidth[1]);
+  this->Histogram->ComputeTarget(this->inData[1], NULL, ext);
+
+  // Only the sampled voxels are counted if SamplingFraction < 1
+  this->count = this->Histogram->GetTargetCount();
+
   // Calculate the entropy of image 2
-  memset((void *)this->HistT, 0, this->BinNumber[1]*sizeof(long));
-  switch (this->inData[1]->GetScalarType())
-    {
-      vtkTemplateMacro(vtkImageRMIManipulatorEntropyT(this, 
-        (VTK_TT *)(inPtr), this->inc2, this->count));
-    default:
-      vtkErrorMacro( "Execute: Unknown ScalarType");
-    }
+  vtkImageRMIManipulatorEntropyT(this, this->count);
 
 }
 
@@ -221,6 +239,8 @@ void vtkImageRMIManipulator::SetTranslation(double tran[3])
 {
   double f[3];
 
+  this->SetTransform(NULL);
+
   // Interpolation is not required.
   if ( (tran[0] == 0.0) && (tran[1] == 0.0) && (tran[2] == 0.0) )
     {
@@ -254,131 +274,83 @@ void vtkImageRMIManipulator::SetTranslation(double tran[3])
 }
 
 //----------------------------------------------------------------------------
-template <class T>
-void vtkImageRMIManipulatorExecute(vtkImageRMIManipulator *self,
-           T  *in1Ptr, T *in2Ptr,
-           vtkIdType inc[3], int inc2[2], int inExt[6],
-           int loc000[3], int loc111[3], double count)
+vtkCxxSetObjectMacro(vtkImageRMIManipulator, Transform, vtkLinearTransform);
+
+//----------------------------------------------------------------------------
+void vtkImageRMIManipulator::SetMatrix(vtkMatrix4x4 *matrix)
+{
+  vtkMatrixToLinearTransform *transform = vtkMatrixToLinearTransform::New();
+  transform->SetInput(matrix);
+  this->SetTransform(transform);
+  transform->Delete();
+}
+
+//----------------------------------------------------------------------------
+double vtkImageRMIManipulator::GetResult()
 {
-  double V000, V100, V010, V110, V001, V101, V011, V111, Vxyz;
   double temp, entropyS = 0, entropyST = 0;
-  short a, b;
   int i, j;
- 
-  // CASE 1: Check if translation takes us out of the input image, in 
-  // which case set the result to indicate complete dissimilarity and stop.
-  if ( (self->Extent[0] + loc000[0] < inExt[0]) ||
-       (self->Extent[2] + loc000[1] < inExt[2]) ||
-       (self->Extent[4] + loc000[2] < inExt[4]) ||
-       (self->Extent[1] + loc111[0] > inExt[1]) ||
-       (self->Extent[3] + loc111[1] > inExt[3]) ||
-       (self->Extent[5] + loc111[2] > inExt[5]) )
+
+  // Check inputs.
+  if (this->inData[0] == NULL)
     {
-      self->Result = 0.5;
-      return;
+      vtkErrorMacro( "Input " << 0 << " must be specified.");
     }
-
-  // CASE 2: Check if no interpolation is necessary.
-  if ( (loc000[0] == 0) && (loc111[0] == 0) &&
-       (loc000[1] == 0) && (loc111[1] == 0) &&
-       (loc000[2] == 0) && (loc111[2] == 0) )
+  if (this->inData[1] == NULL)
     {
-      for (int idZ = self->Extent[4]; idZ <= self->Extent[5]; idZ++)
-  {
-    for (int idY = self->Extent[2]; idY <= self->Extent[3]; idY++)
-      {
-        for (int idX = self->Extent[0]; idX <= self->Extent[1]; idX++)
+      vtkErrorMacro( "Input " << 1 << " must be specified.");
+    }
+  if ((this->inData[0]->GetScalarType() != this->inData[1]->GetScalarType()))
     {
-      a = vtkResliceRound(*in1Ptr/double(self->BinWidth[0]));
-      b = vtkResliceRound(*in2Ptr/double(self->BinWidth[1]));
-      
-      self->HistS[a]++;
-      self->HistST[b * self->BinNumber[0] + a]++;
-
-      in1Ptr++;
-      in2Ptr++;
+      vtkErrorMacro( "Inputs must be of the same ScalarType");
     }
-        in1Ptr += inc2[0];
-        in2Ptr += inc2[0];
-      }
-    in1Ptr += inc2[1];
-    in2Ptr += inc2[1];
-  }
+  if ( this->qValue == 1.0 ) 
+    {
+      vtkErrorMacro( "qValue cannot be 1.0");
     }
 
-  // CASE 3: If the above two cases don't apply, do the full calculation.
+  this->Result = 0;
+
+  // Fill the histograms, image 1 translated or transformed with trilinear interpolation.
+  double F[8] = { this->F000, this->F100, this->F010, this->F110,
+                  this->F001, this->F101, this->F011, this->F111 };
+  this->Histogram->SetBinWidth(this->BinWidth[0], this->BinWidth[1]);
+  int filled;
+  if (this->Transform)
+  {
+    filled = this->Histogram->ComputeTransformed(this->inData[0], this->inData[1], NULL,
+                                                 this->Extent, this->Transform->GetMatrix());
+  }
   else
-    {
-      in1Ptr += inc[2] * loc000[2] + inc[1] * loc000[1] + inc[0] * loc000[0];
+  {
+    filled = this->Histogram->Compute(this->inData[0], this->inData[1], NULL,
+                                      this->Extent, this->loc000, this->loc111, F);
+  }
 
-      for (int idZ = self->Extent[4]; idZ <= self->Extent[5]; idZ++)
+  // Check if translation takes us out of the input image, in which
+  // case set the result to indicate complete dissimilarity and stop.
+  if (filled == 0)
   {
-    for (int idY = self->Extent[2]; idY <= self->Extent[3]; idY++)
-      {
-        // Initiate previous data
-        V000 = *in1Ptr;
-        in1Ptr += inc[1];
-        V010 = *in1Ptr;
-        in1Ptr += inc[2];
-        V011 = *in1Ptr;
-        in1Ptr -= inc[1];
-        V001 = *in1Ptr;
-        in1Ptr -= inc[2];
-        
-        for (int idX = self->Extent[0]; idX <= self->Extent[1]; idX++)
-    {
-      in1Ptr++;
-      V100 = *in1Ptr;
-      in1Ptr += inc[1];
-      V110 = *in1Ptr;
-      in1Ptr += inc[2];
-      V111 = *in1Ptr;
-      in1Ptr -= inc[1];
-      V101 = *in1Ptr;
-      in1Ptr -= inc[2];
-      
-      Vxyz = (V000 * self->F000 + V100 * self->F100 + 
-        V010 * self->F010 + V110 * self->F110 + 
-        V001 * self->F001 + V101 * self->F101 + 
-        V011 * self->F011 + V111 * self->F111);
-      
-      V000 = V100;
-      V010 = V110;
-      V001 = V101;
-      V011 = V111;
-      
-      a = vtkResliceRound(Vxyz/double(self->BinWidth[0]));
-      b = vtkResliceRound(*in2Ptr/double(self->BinWidth[1]));
-
-      self->HistS[a]++;
-      self->HistST[b * self->BinNumber[0] + a]++;
-      
-      in2Ptr++;
-    }
-        in1Ptr += inc2[0];
-        in2Ptr += inc2[0];
-      }
-    in1Ptr += inc2[1];
-    in2Ptr += inc2[1];
+    this->Result = 0.5;
+    return this->Result;
   }
-    }
 
   // Loop over S and ST histograms.
-  for (i = 0; i < self->BinNumber[0]; i++)
+  for (i = 0; i < this->BinNumber[0]; i++)
     {
-      temp = (double)self->HistS[i];
-      entropyS += pow(temp,self->qValue);
-      for (j = 0; j < self->BinNumber[1]; j++) 
+      temp = (double)this->HistS[i];
+      entropyS += pow(temp,this->qValue);
+      for (j = 0; j < this->BinNumber[1]; j++) 
    {
-     temp = (double)self->HistST[j * self->BinNumber[0] + i];
-     entropyST += pow(temp,self->qValue);
+     temp = (double)this->HistST[j * this->BinNumber[0] + i];
+     entropyST += pow(temp,this->qValue);
    }
     }
 
   // Calculate entropies and the RMI
   if ( entropyS > 0 )
     {
-      entropyS = 1.0 / (1.0 - self->qValue) * (log(entropyS) - log(pow(count,self->qValue)));
+      entropyS = 1.0 / (1.0 - this->qValue) * (log(entropyS) - log(pow(this->count,this->qValue)));
     }
   else
     {
@@ -388,7 +360,7 @@ void vtkImageRMIManipulatorExecute(vtkImageRMIManipulator *self,
 
   if ( entropyST > 0 )
     {
-      entropyST = 1.0 / (1.0-self->qValue) * (log(entropyST) - log(pow(count,self->qValue)));
+      entropyST = 1.0 / (1.0-this->qValue) * (log(entropyST) - log(pow(this->count,this->qValue)));
     }
   else
     {
@@ -396,46 +368,8 @@ void vtkImageRMIManipulatorExecute(vtkImageRMIManipulator *self,
       exit(0);
     }
  
-  self->Result = entropyS + self->entropyT - entropyST;
+  this->Result = entropyS + this->entropyT - entropyST;
 
-}
-
-//----------------------------------------------------------------------------
-double vtkImageRMIManipulator::GetResult()
-{
-  // Check inputs.
-  if (this->inData[0] == NULL)
-    {
-      vtkErrorMacro( "Input " << 0 << " must be specified.");
-    }
-  if (this->inData[1] == NULL)
-    {
-      vtkErrorMacro( "Input " << 1 << " must be specified.");
-    }
-  if ((this->inData[0]->GetScalarType() != this->inData[1]->GetScalarType()))
-    {
-      vtkErrorMacro( "Inputs must be of the same ScalarType");
-    }
-  if ( this->qValue == 1.0 ) 
-    {
-      vtkErrorMacro( "qValue cannot be 1.0");
-    }
-
-  // Zero the histograms and result.
-  memset((void *)this->HistS, 0, this->BinNumber[0]*sizeof(long));
-  memset((void *)this->HistST, 0, this->BinNumber[0]*this->BinNumber[1]*sizeof(long));
-  this->Result = 0;
-
-  // Calculate and return RMI result.
-  switch (this->inData[0]->GetScalarType())
-    {
-      vtkTemplateMacro(vtkImageRMIManipulatorExecute(this, 
-             (VTK_TT *)(this->inPtr[0]), (VTK_TT *)(this->inPtr[1]),
-      this->inc, this->inc2, this->inExt,
-      this->loc000, this->loc111, this->count));
-    default:
-      vtkErrorMacro( "Execute: Unknown ScalarType");
-    }
   return this->Result;
 
 }
@@ -34,6 +34,10 @@
 #include "vtkImageData.h"
 #include "math.h"
 
+class vtkImageJointHistogram;
+class vtkLinearTransform;
+class vtkMatrix4x4;
+
 class vtkRobartsRegistrationExport vtkImageRMIManipulator : public vtkObject
 {
 public:
@@ -61,6 +65,17 @@ public:
   vtkSetMacro(qValue, float);
   double qValue;
 
+  // Description:
+  // Set/get the maximum number of threads filling the histograms.
+  virtual void SetNumberOfThreads(int numThreads);
+  virtual int GetNumberOfThreads();
+
+  // Description:
+  // Set/get the fraction of the voxels of the extent that are sampled,
+  // 1 (the default) for all of them.
+  virtual void SetSamplingFraction(double fraction);
+  virtual double GetSamplingFraction();
+
   // Description:
   // Set/get the extent to calculate the RMI over.
   virtual void SetExtent(int ext[6]);
@@ -70,6 +85,15 @@ public:
   // Set the translation of input 1 in 3D (mm)
   virtual void SetTranslation(double Translation[3]);
 
+  // Description:
+  // Set a rigid or affine transformation from the coordinates of image 2
+  // to those of image 1 (mm) to use instead of the translation. Image 1 is
+  // then resampled while the histograms are filled. SetTranslation()
+  // removes it, SetMatrix() sets a transformation following the matrix.
+  virtual void SetTransform(vtkLinearTransform *transform);
+  vtkGetObjectMacro(Transform,vtkLinearTransform);
+  virtual void SetMatrix(vtkMatrix4x4 *matrix);
+
   // Description:
   // Get the absolute difference
   double GetResult();
@@ -100,6 +124,9 @@ protected:
   vtkImageRMIManipulator();
   ~vtkImageRMIManipulator();
 
+  // Joint histogram of the inputs, filled by multiple threads
+  vtkImageJointHistogram *Histogram;
+
   // Globals used to speed up repeated execution:
 
   // Increments to go through the data (calculate on SetExtent)
@@ -114,6 +141,9 @@ protected:
   int loc000[3];
   int loc111[3];
 
+  // Transformation of image 1 used instead of the translation
+  vtkLinearTransform *Transform;
+
   // Number of voxels in Extent
   double count;
 
@@ -16,6 +16,10 @@
 
 =========================================================================*/
 #include "vtkImageSMIPVIManipulator.h"
+#include "vtkImageJointHistogram.h"
+#include "vtkLinearTransform.h"
+#include "vtkMatrix4x4.h"
+#include "vtkMatrixToLinearTransform.h"
 
 //--------------------------------------------------------------------------
 // The 'floor' function on x86 and mips is many times slower than these
@@ -91,14 +95,20 @@ vtkImageSMIPVIManipulator::vtkImageSMIPVIManipulator()
   this->MaxIntensities[0] = 4095;
   this->MaxIntensities[1] = 4095;
   this->Metric = 0;
+  this->HistS = NULL;
+  this->HistT = NULL;
+  this->HistST = NULL;
+  this->Histogram = vtkImageJointHistogram::New();
+  this->Histogram->SetBinning(VTK_JOINT_HISTOGRAM_PARTIAL_VOLUME);
+  this->Transform = NULL;
 }
 
 //----------------------------------------------------------------------------
 vtkImageSMIPVIManipulator::~vtkImageSMIPVIManipulator()
 {
-  delete this->HistS;
-  delete this->HistT;
-  delete this->HistST;
+  delete [] this->HistT;
+  this->SetTransform(NULL);
+  this->Histogram->Delete();
 }
 
 //----------------------------------------------------------------------------
@@ -135,9 +145,11 @@ void vtkImageSMIPVIManipulator::SetBinNumber(int numS, int numT)
   this->BinNumber[1] = numT;
   this->BinWidth[0] = (double)this->MaxIntensities[0] / ((double)this->BinNumber[0] - 1.0);
   this->BinWidth[1] = (double)this->MaxIntensities[1] / ((double)this->BinNumber[1] - 1.0);
-  this->HistS = new double[numS];
+  this->Histogram->SetBinNumber(numS, numT);
+  this->HistS = this->Histogram->GetWeightedHistS();
+  this->HistST = this->Histogram->GetWeightedHistST();
+  delete [] this->HistT;
   this->HistT = new double[numT];
-  this->HistST = new double[numS*numT];
 
   vtkImageShiftScale* scale0 = vtkImageShiftScale::New();
   scale0->SetInputData(this->inData[0]);
@@ -155,6 +167,36 @@ void vtkImageSMIPVIManipulator::SetBinNumber(int numS, int numT)
   this->inDataScl[1] = scale1->GetOutput();
 }
 
+//----------------------------------------------------------------------------
+void vtkImageSMIPVIManipulator::SetNumberOfThreads(int numThreads)
+{
+  this->Histogram->SetNumberOfThreads(numThreads);
+}
+
+//----------------------------------------------------------------------------
+int vtkImageSMIPVIManipulator::GetNumberOfThreads()
+{
+  return this->Histogram->GetNumberOfThreads();
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSMIPVIManipulator::SetSamplingFraction(double fraction)
+{
+  this->Histogram->SetSamplingFraction(fraction);
+
+  // Draw the samples and count image 2 over them again
+  if (this->Histogram->GetTargetImage())
+  {
+    this->SetExtent(this->Extent);
+  }
+}
+
+//----------------------------------------------------------------------------
+double vtkImageSMIPVIManipulator::GetSamplingFraction()
+{
+  return this->Histogram->GetSamplingFraction();
+}
+
 //----------------------------------------------------------------------------
 void vtkImageSMIPVIManipulator::SetMaxIntensities(int maxS, int maxT)
 {
@@ -180,29 +222,10 @@ void vtkImageSMIPVIManipulator::SetMaxIntensities(int maxS, int maxT)
 }
 
 //----------------------------------------------------------------------------
-template <class T>
-void vtkImageSMIPVIManipulatorEntropyT(vtkImageSMIPVIManipulator *self,
-                                       T  *inPtr, int inc2[2], double count)
+void vtkImageSMIPVIManipulatorEntropyT(vtkImageSMIPVIManipulator *self, double count)
 {
-  short b;
   double temp, entropyT = 0;
 
-  // Loop over data
-  for (int idZ = self->Extent[4]; idZ <= self->Extent[5]; idZ++)
-  {
-    for (int idY = self->Extent[2]; idY <= self->Extent[3]; idY++)
-    {
-      for (int idX = self->Extent[0]; idX <= self->Extent[1]; idX++)
-      {
-        b = (short)*inPtr;
-        self->HistT[b]++;
-        inPtr++;
-      }
-      inPtr += inc2[0];
-    }
-    inPtr += inc2[1];
-  }
-
   for (int i = 0; i < self->BinNumber[1]; i++)
   {
     temp = self->HistT[i];
@@ -232,15 +255,20 @@ void vtkImageSMIPVIManipulator::SetExtent(int ext[6])
 
   memcpy(this->Extent, ext, sizeof(int)*6);
 
-  memset((void *)this->HistT, 0, this->BinNumber[1]*sizeof(double));
-  // Calculate the entropy of image 2
-  switch (this->inDataScl[1]->GetScalarType())
+  // Bin image 2 once, it stays put while image 1 is moved
+  this->Histogram->SetBinWidth(this->BinWidth[0], this->BinWidth[1]);
+  this->Histogram->ComputeTarget(this->inDataScl[1], NULL, ext);
+  long *histT = this->Histogram->GetHistT();
+  for (int i = 0; i < this->BinNumber[1]; i++)
   {
-    vtkTemplateMacro(vtkImageSMIPVIManipulatorEntropyT(this,
-                     (VTK_TT *)(this->inPtr[1]), this->inc2, this->count));
-  default:
-    vtkErrorMacro( "Execute: Unknown ScalarType");
+    this->HistT[i] = (double)histT[i];
   }
+
+  // Only the sampled voxels are counted if SamplingFraction < 1
+  this->count = this->Histogram->GetTargetCount();
+
+  // Calculate the entropy of image 2
+  vtkImageSMIPVIManipulatorEntropyT(this, this->count);
 }
 
 //----------------------------------------------------------------------------
@@ -248,6 +276,8 @@ void vtkImageSMIPVIManipulator::SetTranslation(double tran[3])
 {
   double f[3];
 
+  this->SetTransform(NULL);
+
   // Interpolation is not required.
   if ( (tran[0] == 0.0) && (tran[1] == 0.0) && (tran[2] == 0.0) )
   {
@@ -284,122 +314,73 @@ void vtkImageSMIPVIManipulator::SetTranslation(double tran[3])
 }
 
 //----------------------------------------------------------------------------
-template <class T>
-void vtkImageSMIPVIManipulatorExecute(vtkImageSMIPVIManipulator *self,
-                                      T  *in1Ptr, T *in2Ptr,
-                                      vtkIdType inc[3], int inc2[2], int inExt[6],
-                                      int loc000[3], int loc111[3], double count)
+vtkCxxSetObjectMacro(vtkImageSMIPVIManipulator, Transform, vtkLinearTransform);
+
+//----------------------------------------------------------------------------
+void vtkImageSMIPVIManipulator::SetMatrix(vtkMatrix4x4 *matrix)
+{
+  vtkMatrixToLinearTransform *transform = vtkMatrixToLinearTransform::New();
+  transform->SetInput(matrix);
+  this->SetTransform(transform);
+  transform->Delete();
+}
+
+//----------------------------------------------------------------------------
+double vtkImageSMIPVIManipulator::GetResult()
 {
-  short V000, V100, V010, V110, V001, V101, V011, V111;
   double temp1, temp2, entropyS = 0, entropyST = 0;
-  short a, b;
   int i, j;
 
-  // CASE 1: Check if translation takes us out of the input image, in
-  // which case set the result to indicate complete dissimilarity and stop.
-  if ( (self->Extent[0] + loc000[0] < inExt[0]) ||
-       (self->Extent[2] + loc000[1] < inExt[2]) ||
-       (self->Extent[4] + loc000[2] < inExt[4]) ||
-       (self->Extent[1] + loc111[0] > inExt[1]) ||
-       (self->Extent[3] + loc111[1] > inExt[3]) ||
-       (self->Extent[5] + loc111[2] > inExt[5]) )
+  // Check inputs.
+  if (this->inData[0] == NULL)
   {
-    self->Result = 0.5;
-    return;
+    vtkErrorMacro( "Input " << 0 << " must be specified.");
+    return 0;
   }
-
-  // CASE 2: Check if no interpolation is necessary.
-  if ( (loc000[0] == 0) && (loc111[0] == 0) &&
-       (loc000[1] == 0) && (loc111[1] == 0) &&
-       (loc000[2] == 0) && (loc111[2] == 0) )
+  if (this->inData[1] == NULL)
   {
-    for (int idZ = self->Extent[4]; idZ <= self->Extent[5]; idZ++)
-    {
-      for (int idY = self->Extent[2]; idY <= self->Extent[3]; idY++)
-      {
-        for (int idX = self->Extent[0]; idX <= self->Extent[1]; idX++)
-        {
-          a = (short)*in1Ptr;
-          b = (short)*in2Ptr;
-
-          self->HistS[a]++;
-          self->HistST[b * self->BinNumber[0] + a]++;
-
-          in1Ptr++;
-          in2Ptr++;
-        }
-        in1Ptr += inc2[0];
-        in2Ptr += inc2[0];
-      }
-      in1Ptr += inc2[1];
-      in2Ptr += inc2[1];
-    }
+    vtkErrorMacro( "Input " << 1 << " must be specified.");
+    return 0;
+  }
+  if ((this->inData[0]->GetScalarType() != this->inData[1]->GetScalarType()))
+  {
+    vtkErrorMacro( "Execute: Inputs must be of the same ScalarType");
+    return 0;
   }
 
-  // CASE 3: If the above two cases don't apply, do the full calculation.
+  this->Result = 0;
+
+  // Fill the histograms, image 1 translated or transformed with trilinear interpolation.
+  double F[8] = { this->F000, this->F100, this->F010, this->F110,
+                  this->F001, this->F101, this->F011, this->F111 };
+  this->Histogram->SetBinWidth(this->BinWidth[0], this->BinWidth[1]);
+  int filled;
+  if (this->Transform)
+  {
+    filled = this->Histogram->ComputeTransformed(this->inDataScl[0], this->inDataScl[1], NULL,
+                                                 this->Extent, this->Transform->GetMatrix());
+  }
   else
   {
-    in1Ptr += inc[2] * loc000[2] + inc[1] * loc000[1] + inc[0] * loc000[0];
+    filled = this->Histogram->Compute(this->inDataScl[0], this->inDataScl[1], NULL,
+                                      this->Extent, this->loc000, this->loc111, F);
+  }
 
-    for (int idZ = self->Extent[4]; idZ <= self->Extent[5]; idZ++)
-    {
-      for (int idY = self->Extent[2]; idY <= self->Extent[3]; idY++)
-      {
-        // Initiate previous data
-        V000 = (short)*in1Ptr;
-        in1Ptr += inc[1];
-        V010 = (short)*in1Ptr;
-        in1Ptr += inc[2];
-        V011 = (short)*in1Ptr;
-        in1Ptr -= inc[1];
-        V001 = (short)*in1Ptr;
-        in1Ptr -= inc[2];
-
-        for (int idX = self->Extent[0]; idX <= self->Extent[1]; idX++)
-        {
-          in1Ptr++;
-          V100 = (short)*in1Ptr;
-          in1Ptr += inc[1];
-          V110 = (short)*in1Ptr;
-          in1Ptr += inc[2];
-          V111 = (short)*in1Ptr;
-          in1Ptr -= inc[1];
-          V101 = (short)*in1Ptr;
-          in1Ptr -= inc[2];
-
-          b = (short)*in2Ptr * self->BinNumber[0];
-
-          self->HistST[b + V000] +=  self->F000;
-          self->HistST[b + V100] +=  self->F100;
-          self->HistST[b + V010] +=  self->F010;
-          self->HistST[b + V110] +=  self->F110;
-          self->HistST[b + V001] +=  self->F001;
-          self->HistST[b + V101] +=  self->F101;
-          self->HistST[b + V011] +=  self->F011;
-          self->HistST[b + V111] +=  self->F111;
-
-          V000 = V100;
-          V010 = V110;
-          V001 = V101;
-          V011 = V111;
-
-          in2Ptr++;
-        }
-        in1Ptr += inc2[0];
-        in2Ptr += inc2[0];
-      }
-      in1Ptr += inc2[1];
-      in2Ptr += inc2[1];
-    }
+  // Check if translation takes us out of the input image, in which
+  // case set the result to indicate complete dissimilarity and stop.
+  if (filled == 0)
+  {
+    this->Result = 0.5;
+    return this->Result;
   }
 
   // Loop over S and ST histograms.
-  for (i = 0; i < self->BinNumber[0]; i++)
+  for (i = 0; i < this->BinNumber[0]; i++)
   {
     temp2 = 0.0;
-    for (j = 0; j < self->BinNumber[1]; j++)
+    for (j = 0; j < this->BinNumber[1]; j++)
     {
-      temp1 = self->HistST[j * self->BinNumber[0] + i];
+      temp1 = this->HistST[j * this->BinNumber[0] + i];
       temp2 += temp1;
       if (temp1 > 0.0)
       {
@@ -413,38 +394,38 @@ void vtkImageSMIPVIManipulatorExecute(vtkImageSMIPVIManipulator *self,
   }
 
   // Calculate entropies and the SMIPVI result based on the Metric flag.
-  entropyS  = -entropyS /count + log(count);
-  entropyST = -entropyST/count + log(count);
+  entropyS  = -entropyS /this->count + log(this->count);
+  entropyST = -entropyST/this->count + log(this->count);
 
   // Normalized Mutual Information
-  if (self->Metric == 0)
+  if (this->Metric == 0)
   {
     if (entropyST == 0)
     {
-      self->Result = 1.0;
+      this->Result = 1.0;
     }
     else
     {
-      self->Result = (entropyS + self->entropyT)/entropyST/2.0;
+      this->Result = (entropyS + this->entropyT)/entropyST/2.0;
     }
   }
 
   // Mutual Information
-  else if (self->Metric == 1)
+  else if (this->Metric == 1)
   {
-    self->Result = entropyS + self->entropyT - entropyST;
+    this->Result = entropyS + this->entropyT - entropyST;
   }
 
   // Entropy Correlation Coefficient
-  else if (self->Metric == 2)
+  else if (this->Metric == 2)
   {
-    if (entropyS + self->entropyT == 0)
+    if (entropyS + this->entropyT == 0)
     {
-      self->Result = 0.0;
+      this->Result = 0.0;
     }
     else
     {
-      self->Result = sqrt ( 2.0 * (1.0 - entropyST / ( self->entropyT + entropyS ) ) );
+      this->Result = sqrt ( 2.0 * (1.0 - entropyST / ( this->entropyT + entropyS ) ) );
     }
   }
 
@@ -454,44 +435,9 @@ void vtkImageSMIPVIManipulatorExecute(vtkImageSMIPVIManipulator *self,
     cout << "ERROR: Wrong Metric chosen\n";
     exit(0);
   }
-}
 
-//----------------------------------------------------------------------------
-double vtkImageSMIPVIManipulator::GetResult()
-{
-  // Check inputs.
-  if (this->inData[0] == NULL)
-  {
-    vtkErrorMacro( "Input " << 0 << " must be specified.");
-    return 0;
-  }
-  if (this->inData[1] == NULL)
-  {
-    vtkErrorMacro( "Input " << 1 << " must be specified.");
-    return 0;
-  }
-  if ((this->inData[0]->GetScalarType() != this->inData[1]->GetScalarType()))
-  {
-    vtkErrorMacro( "Execute: Inputs must be of the same ScalarType");
-    return 0;
-  }
-
-  // Zero the histograms and result.
-  memset((void *)this->HistS, 0, this->BinNumber[0]*sizeof(double));
-  memset((void *)this->HistST, 0, this->BinNumber[0]*this->BinNumber[1]*sizeof(double));
-  this->Result = 0;
-
-  // Calculate and return SMIPVI result.
-  switch (this->inDataScl[0]->GetScalarType())
-  {
-    vtkTemplateMacro(vtkImageSMIPVIManipulatorExecute(this,
-                     (VTK_TT *)(this->inPtr[0]), (VTK_TT *)(this->inPtr[1]),
-                     this->inc, this->inc2, this->inExt,
-                     this->loc000, this->loc111, this->count));
-  default:
-    vtkErrorMacro( "Execute: Unknown ScalarType");
-  }
   return this->Result;
+
 }
 
 //----------------------------------------------------------------------------